@@ -0,0 +1,399 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "format.h"
+#include "blocks.h"
+#include "journal.h"
+#include "scan.h"
+#include "alloc_table.h"
+#include "writeback.h"
+
+// The alloc table is kept in memory in pages that are read on first access, so opening an image doesn't read all of
+// it. Once more pages than the budget are loaded, the least recently used clean page is dropped. Pages changed in
+// memory but not written yet, and pages written through the journal, stay until the next checkpoint has put them in
+// place, because the image doesn't hold them before; the budget may be exceeded until that happens.
+
+#define ALLOC_PAGE_ENTRIES 256
+#define ALLOC_PAGE_SIZE (ALLOC_PAGE_ENTRIES * ALLOC_TABLE_ENTRY_SIZE)
+
+typedef struct {
+    uint8_t *data;
+    // Free entries in the page, or -1 before it was first loaded
+    int32_t free;
+    bool referenced;
+    // Sequence number of the last journal transaction with entries of the page, 0 once they are all in place
+    uint64_t logged_seq;
+    // Entries changed in memory that haven't been written
+    uint16_t dirty_count;
+    uint32_t dirty[ALLOC_PAGE_ENTRIES / 32];
+} alloc_page_t;
+
+struct alloc_table {
+    alloc_page_t *pages;
+    uint32_t page_count;
+    uint32_t resident;
+    uint32_t budget;
+    // Clock hand for eviction
+    uint32_t hand;
+    // Free entries in the pages counted so far
+    uint32_t free_count;
+    uint32_t uncounted_pages;
+    // Set while several threads read the table
+    bool shared;
+    pthread_mutex_t lock;
+};
+
+static inline bool alloc_page_entry_free(const uint8_t *data, uint32_t index) {
+    return data[index * ALLOC_TABLE_ENTRY_SIZE] == 0 && data[index * ALLOC_TABLE_ENTRY_SIZE + 1] == 0;
+}
+
+uint32_t alloc_page_entries(mfs_t *mfs, uint32_t index) {
+    uint32_t rest = mfs->block_count - index * ALLOC_PAGE_ENTRIES;
+    return rest < ALLOC_PAGE_ENTRIES ? rest : ALLOC_PAGE_ENTRIES;
+}
+
+int alloc_table_open(mfs_t *mfs, unsigned int budget_kb) {
+    alloc_table_t *table = malloc(sizeof(*table));
+    if(table == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    table->page_count = ((uint32_t) mfs->block_count + ALLOC_PAGE_ENTRIES - 1) / ALLOC_PAGE_ENTRIES;
+    table->pages = calloc(table->page_count ? table->page_count : 1, sizeof(*table->pages));
+    if(table->pages == NULL) {
+        perror("Memory allocation failed");
+        free(table);
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < table->page_count; i++) {
+        table->pages[i].free = -1;
+    }
+
+    table->resident = 0;
+    table->budget = (uint32_t) ((budget_kb * 1024u + ALLOC_PAGE_SIZE - 1) / ALLOC_PAGE_SIZE);
+    table->hand = 0;
+    table->free_count = 0;
+    table->uncounted_pages = table->page_count;
+    table->shared = false;
+    pthread_mutex_init(&table->lock, NULL);
+
+    mfs->alloc_table = table;
+
+    return 0;
+}
+
+void alloc_table_free(mfs_t *mfs) {
+    alloc_table_t *table = mfs->alloc_table;
+    if(table == NULL) {
+        return;
+    }
+
+    for(uint32_t i = 0; i < table->page_count; i++) {
+        free(table->pages[i].data);
+    }
+    pthread_mutex_destroy(&table->lock);
+    free(table->pages);
+    free(table);
+    mfs->alloc_table = NULL;
+}
+
+// Drops all pages, after the table has moved or changed its size. Nothing may be waiting to be written.
+int alloc_table_reset(mfs_t *mfs) {
+    alloc_table_t *table = mfs->alloc_table;
+    unsigned int budget_kb = table->budget * ALLOC_PAGE_SIZE / 1024u;
+
+    alloc_table_free(mfs);
+
+    return alloc_table_open(mfs, budget_kb);
+}
+
+// Takes the buffer of a page that can be dropped, or returns NULL if every loaded page has to stay
+uint8_t *alloc_table_evict(alloc_table_t *table) {
+    // Two turns of the clock clear every referenced bit on the way
+    for(uint32_t n = 0; n < 2 * table->page_count; n++) {
+        alloc_page_t *page = &table->pages[table->hand];
+        table->hand = (table->hand + 1) % table->page_count;
+
+        if(page->data == NULL || page->dirty_count > 0 || page->logged_seq != 0) {
+            continue;
+        }
+        if(page->referenced) {
+            page->referenced = false;
+            continue;
+        }
+
+        uint8_t *data = page->data;
+        page->data = NULL;
+        return data;
+    }
+
+    return NULL;
+}
+
+// Returns the entries of a page, reading it from the image if it isn't loaded
+uint8_t *alloc_table_page(mfs_t *mfs, uint32_t index) {
+    alloc_table_t *table = mfs->alloc_table;
+    alloc_page_t *page = &table->pages[index];
+
+    if(page->data != NULL) {
+        page->referenced = true;
+        return page->data;
+    }
+
+    uint8_t *data = NULL;
+    if(table->resident >= table->budget) {
+        data = alloc_table_evict(table);
+    }
+    if(data == NULL) {
+        data = malloc(sizeof(*data) * ALLOC_PAGE_SIZE);
+        if(data == NULL) {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+        table->resident++;
+    }
+
+    // The alloc table is always in the main image file, also when the blocks are striped
+    uint32_t entries = alloc_page_entries(mfs, index);
+    size_t len = (size_t) entries * ALLOC_TABLE_ENTRY_SIZE;
+    size_t offset = mfs->alloc_table_base + (size_t) index * ALLOC_PAGE_SIZE;
+    if(mfs->writeback && writeback_overlaps(mfs, offset, len)) {
+        // Dropped after its last changes were handed to the writeback buffer
+        if(writeback_read(mfs, offset, data, len)) {
+            free(data);
+            table->resident--;
+            return NULL;
+        }
+    } else {
+        fseek(mfs->f, offset, SEEK_SET);
+        if(fread(data, sizeof(*data), len, mfs->f) != len) {
+            if(ferror(mfs->f)) {
+                perror("File read error");
+            } else {
+                fprintf(stderr, "File to short\n");
+            }
+            free(data);
+            table->resident--;
+            return NULL;
+        }
+    }
+
+    if(page->free < 0) {
+        page->free = (int32_t) scan_alloc_count_free(data, 0, entries);
+        table->free_count += (uint32_t) page->free;
+        table->uncounted_pages--;
+    }
+
+    page->data = data;
+    page->referenced = true;
+
+    return data;
+}
+
+int alloc_table_get(mfs_t *mfs, uint16_t block_number, uint16_t *next_out, uint16_t *previous_out) {
+    alloc_table_t *table = mfs->alloc_table;
+
+    if(table->shared) {
+        pthread_mutex_lock(&table->lock);
+    }
+
+    int ret = -1;
+    uint8_t *data = alloc_table_page(mfs, block_number / ALLOC_PAGE_ENTRIES);
+    if(data != NULL) {
+        size_t offset = (size_t) (block_number % ALLOC_PAGE_ENTRIES) * ALLOC_TABLE_ENTRY_SIZE;
+        *next_out = read16(data, offset);
+        *previous_out = read16(data, offset + 2);
+        ret = 0;
+    }
+
+    if(table->shared) {
+        pthread_mutex_unlock(&table->lock);
+    }
+
+    return ret;
+}
+
+// Changes an entry in memory only. It stays loaded until alloc_table_store() has written it.
+int alloc_table_set(mfs_t *mfs, uint16_t block_number, uint16_t next, uint16_t previous) {
+    alloc_table_t *table = mfs->alloc_table;
+    uint32_t index = block_number / ALLOC_PAGE_ENTRIES;
+    uint32_t entry = block_number % ALLOC_PAGE_ENTRIES;
+
+    uint8_t *data = alloc_table_page(mfs, index);
+    if(data == NULL) {
+        return -1;
+    }
+
+    alloc_page_t *page = &table->pages[index];
+
+    // Only the next field tells used blocks from free ones
+    bool was_free = alloc_page_entry_free(data, entry);
+    if(was_free && next != BLOCK_UNUSED) {
+        page->free--;
+        table->free_count--;
+    } else if(!was_free && next == BLOCK_UNUSED) {
+        page->free++;
+        table->free_count++;
+    }
+
+    write16(data, entry * ALLOC_TABLE_ENTRY_SIZE, next);
+    write16(data, entry * ALLOC_TABLE_ENTRY_SIZE + 2, previous);
+
+    if(!(page->dirty[entry / 32] & 1u << entry % 32)) {
+        page->dirty[entry / 32] |= 1u << entry % 32;
+        page->dirty_count++;
+    }
+
+    return 0;
+}
+
+// Writes entries first to last from memory, in as few metadata writes as the journal accepts
+int alloc_table_store(mfs_t *mfs, uint16_t first, uint16_t last) {
+    alloc_table_t *table = mfs->alloc_table;
+    size_t limit = mfs->journal ? journal_write_limit(mfs) : UINT16_MAX;
+    limit -= limit % ALLOC_TABLE_ENTRY_SIZE;
+
+    uint32_t block_number = first;
+    while(block_number <= last) {
+        uint32_t index = block_number / ALLOC_PAGE_ENTRIES;
+        uint32_t entry = block_number % ALLOC_PAGE_ENTRIES;
+        uint32_t count = (index + 1) * ALLOC_PAGE_ENTRIES - block_number;
+        if(count > (uint32_t) last + 1 - block_number) {
+            count = (uint32_t) last + 1 - block_number;
+        }
+        if(count > limit / ALLOC_TABLE_ENTRY_SIZE) {
+            count = (uint32_t) (limit / ALLOC_TABLE_ENTRY_SIZE);
+        }
+
+        uint8_t *data = alloc_table_page(mfs, index);
+        if(data == NULL) {
+            return -1;
+        }
+
+        size_t offset = (size_t) block_number * ALLOC_TABLE_ENTRY_SIZE;
+        if(write_metadata(mfs, mfs->alloc_table_base + offset, data + entry * ALLOC_TABLE_ENTRY_SIZE, (uint16_t) (count * ALLOC_TABLE_ENTRY_SIZE))) {
+            return -1;
+        }
+
+        alloc_page_t *page = &table->pages[index];
+        if(mfs->journal) {
+            page->logged_seq = journal_seq(mfs);
+        }
+        for(uint32_t i = entry; i < entry + count && page->dirty_count > 0; i++) {
+            if(page->dirty[i / 32] & 1u << i % 32) {
+                page->dirty[i / 32] &= ~(1u << i % 32);
+                page->dirty_count--;
+            }
+        }
+
+        block_number += count;
+    }
+
+    return 0;
+}
+
+// Called by the journal checkpoint once every transaction before seq is in place. The checkpoint writes the entries
+// as they were logged, so pages only logged by those transactions may be dropped again.
+void alloc_table_checkpoint(mfs_t *mfs, uint64_t seq) {
+    alloc_table_t *table = mfs->alloc_table;
+
+    for(uint32_t i = 0; i < table->page_count; i++) {
+        alloc_page_t *page = &table->pages[i];
+        if(page->logged_seq != 0 && page->logged_seq < seq) {
+            page->logged_seq = 0;
+        }
+    }
+}
+
+// Returns the first entry in [start, end) that begins a run of at least length free entries, or end if there is none.
+// Pages known to have no free entries aren't read.
+uint32_t alloc_table_find_free(mfs_t *mfs, uint32_t start, uint32_t end, uint32_t length) {
+    alloc_table_t *table = mfs->alloc_table;
+    uint32_t run_start = start;
+    uint32_t run = 0;
+    uint32_t i = start;
+
+    while(i < end) {
+        uint32_t index = i / ALLOC_PAGE_ENTRIES;
+        uint32_t page_start = index * ALLOC_PAGE_ENTRIES;
+        uint32_t page_end = page_start + ALLOC_PAGE_ENTRIES < end ? page_start + ALLOC_PAGE_ENTRIES : end;
+
+        if(table->pages[index].free == 0) {
+            run = 0;
+            i = page_end;
+            continue;
+        }
+
+        uint8_t *data = alloc_table_page(mfs, index);
+        if(data == NULL) {
+            return end;
+        }
+
+        // A run from the previous page continues with the free entries at the start of this one
+        while(run > 0 && i < page_end && alloc_page_entry_free(data, i - page_start)) {
+            run++;
+            i++;
+            if(run >= length) {
+                return run_start;
+            }
+        }
+        if(run > 0 && i == page_end) {
+            continue;
+        }
+
+        uint32_t found = page_start + scan_alloc_find_free(data, i - page_start, page_end - page_start, length);
+        if(found < page_end) {
+            return found;
+        }
+
+        // A run at the end of the page may go on in the next one
+        run = 0;
+        while(run + 1 < length && page_end - run > i && alloc_page_entry_free(data, page_end - run - 1 - page_start)) {
+            run++;
+        }
+        run_start = page_end - run;
+        i = page_end;
+    }
+
+    return end;
+}
+
+// Counts the free blocks, reading the pages that haven't been counted yet. Returns 0 if that fails.
+uint32_t alloc_table_free_count(mfs_t *mfs) {
+    alloc_table_t *table = mfs->alloc_table;
+
+    for(uint32_t i = 0; i < table->page_count && table->uncounted_pages > 0; i++) {
+        if(table->pages[i].free < 0 && alloc_table_page(mfs, i) == NULL) {
+            return 0;
+        }
+    }
+
+    return table->free_count;
+}
+
+// Copies the first count entries into buf
+int alloc_table_copy(mfs_t *mfs, uint8_t *buf, uint32_t count) {
+    for(uint32_t i = 0; i * ALLOC_PAGE_ENTRIES < count; i++) {
+        uint8_t *data = alloc_table_page(mfs, i);
+        if(data == NULL) {
+            return -1;
+        }
+        uint32_t entries = count - i * ALLOC_PAGE_ENTRIES < ALLOC_PAGE_ENTRIES ? count - i * ALLOC_PAGE_ENTRIES : ALLOC_PAGE_ENTRIES;
+        memcpy(buf + (size_t) i * ALLOC_PAGE_SIZE, data, (size_t) entries * ALLOC_TABLE_ENTRY_SIZE);
+    }
+
+    return 0;
+}
+
+// While shared, entries may be read from several threads at once. Nothing may change the table meanwhile.
+void alloc_table_share(mfs_t *mfs, bool shared) {
+    mfs->alloc_table->shared = shared;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mfs.h"
+
+int alloc_table_open(mfs_t *mfs, unsigned int budget_kb);
+void alloc_table_free(mfs_t *mfs);
+int alloc_table_reset(mfs_t *mfs);
+
+int alloc_table_get(mfs_t *mfs, uint16_t block_number, uint16_t *next_out, uint16_t *previous_out);
+int alloc_table_set(mfs_t *mfs, uint16_t block_number, uint16_t next, uint16_t previous);
+int alloc_table_store(mfs_t *mfs, uint16_t first, uint16_t last);
+void alloc_table_checkpoint(mfs_t *mfs, uint64_t seq);
+
+uint32_t alloc_table_find_free(mfs_t *mfs, uint32_t start, uint32_t end, uint32_t length);
+uint32_t alloc_table_free_count(mfs_t *mfs);
+int alloc_table_copy(mfs_t *mfs, uint8_t *buf, uint32_t count);
+
+void alloc_table_share(mfs_t *mfs, bool shared);
@@ -0,0 +1,308 @@
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "util.h"
+#include "format.h"
+#include "blocks.h"
+#include "compress.h"
+#include "dircache.h"
+#include "journal.h"
+#include "alloc_table.h"
+#include "batch.h"
+#include "trace.h"
+
+// Creates many entries in one directory at once. The directory is resolved and scanned once, with the new names in a
+// hash set to find duplicates, all blocks are taken in one pass over the alloc table and the new entries are written
+// behind the last one in as few writes as possible.
+
+uint32_t batch_hash(const char *name) {
+    // FNV-1a over the name, which is at most PATH_SEG_MAX bytes
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < PATH_SEG_MAX && name[i] != '\0'; i++) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Slots hold the index of a name plus one, 0 is empty. Returns the slot of the name or of the empty slot it belongs in.
+size_t batch_slot(const uint32_t *set, size_t slots, const char **names, const char *name) {
+    size_t slot = batch_hash(name) & (slots - 1);
+    while(set[slot] != 0 && strncmp(names[set[slot] - 1], name, PATH_SEG_MAX) != 0) {
+        slot = (slot + 1) & (slots - 1);
+    }
+    return slot;
+}
+
+// Writes a range of directory entries, split into pieces the journal accepts
+int batch_write_entries(mfs_t *mfs, size_t offset, const uint8_t *buf, size_t len) {
+    size_t limit = mfs->journal ? journal_write_limit(mfs) : UINT16_MAX;
+    limit -= limit % DIR_ENTRY_SIZE;
+
+    while(len > 0) {
+        size_t n = len < limit ? len : limit;
+        if(write_metadata(mfs, offset, buf, (uint16_t) n)) {
+            return -1;
+        }
+        offset += n;
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int batch_check_names(unsigned int count, const char **names, const uint16_t *types, uint32_t *set, size_t slots) {
+    for(unsigned int i = 0; i < count; i++) {
+        size_t len = strlen(names[i]);
+        if(len == 0 || strchr(names[i], '/')) {
+            fprintf(stderr, "Invalid name: %s\n", names[i]);
+            return -1;
+        }
+        if(len + 1 > PATH_SEG_MAX) {
+            fprintf(stderr, "File name too long: %s\n", names[i]);
+            return -1;
+        }
+        if(types[i] != MFS_TYPE_FILE && types[i] != MFS_TYPE_DIRECTORY) {
+            fprintf(stderr, "Invalid type for %s\n", names[i]);
+            return -1;
+        }
+
+        size_t slot = batch_slot(set, slots, names, names[i]);
+        if(set[slot] != 0) {
+            fprintf(stderr, "%s is given twice\n", names[i]);
+            return -1;
+        }
+        set[slot] = i + 1;
+    }
+
+    return 0;
+}
+
+int create_many(mfs_t *mfs, const char *path, unsigned int count, const char **names, const uint16_t *types) {
+    uint16_t dir_block_number = 0;
+    if(mfs_block_for_directory_path(mfs, path, &dir_block_number)) {
+        fprintf(stderr, "Directory %s not found\n", path);
+        return -1;
+    }
+
+    if(count == 0) {
+        return 0;
+    }
+
+    // The entries are written in bulk behind the cache's back
+    dircache_forget(mfs, dir_block_number);
+
+    size_t slots = 16;
+    while(slots < 2 * (size_t) count) {
+        slots *= 2;
+    }
+    uint32_t *set = calloc(slots, sizeof(*set));
+    if(set == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    if(batch_check_names(count, names, types, set, slots)) {
+        free(set);
+        return -1;
+    }
+
+    // One pass over the directory checks every existing name and ends at the end slot
+    directory_iterator_t it;
+    if(open_directory_iterator(&it, mfs, dir_block_number)) {
+        fprintf(stderr, "Failed to iterate directory\n");
+        free(set);
+        return -1;
+    }
+
+    while(next_directory_entry(&it)) {
+        if(set[batch_slot(set, slots, names, it.entry.name)] != 0) {
+            fprintf(stderr, "%.*s already exists\n", PATH_SEG_MAX, it.entry.name);
+            close_directory_iterator(&it);
+            free(set);
+            return -1;
+        }
+    }
+
+    free(set);
+
+    uint16_t tail_block_number = it.block_number;
+    uint16_t tail_addr = it.reached_eof ? mfs->block_size : it.entry_addr;
+    close_directory_iterator(&it);
+    size_t tail_len = mfs->block_size - tail_addr;
+    size_t tail_slots = tail_len / DIR_ENTRY_SIZE;
+    size_t block_slots = mfs->block_size / DIR_ENTRY_SIZE;
+    size_t dir_blocks = count > tail_slots ? (count - tail_slots + block_slots - 1) / block_slots : 0;
+
+    // The rest of the last directory block and the new directory blocks, entries followed by zeros
+    size_t entries_len = tail_len + dir_blocks * mfs->block_size;
+    uint8_t *entries = calloc(entries_len, sizeof(*entries));
+    if(entries == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    // New directory blocks first, then one block for every entry, plus the tail block whose next field changes
+    size_t block_count = dir_blocks + count;
+    uint16_t *blocks = malloc(sizeof(*blocks) * (block_count + 1));
+    if(blocks == NULL) {
+        perror("Memory allocation failed");
+        free(entries);
+        return -1;
+    }
+
+    uint16_t start = mfs->alloc_policy == MFS_ALLOC_FIRST ? 1 : tail_block_number + 1;
+    if(alloc_free_blocks(mfs, start, block_count, blocks)) {
+        free(entries);
+        free(blocks);
+        return -1;
+    }
+
+    uint16_t previous = tail_block_number;
+    for(size_t i = 0; i < dir_blocks; i++) {
+        if(alloc_table_set(mfs, previous, blocks[i], get_block_previous(mfs, previous)) || alloc_table_set(mfs, blocks[i], BLOCK_EOF, previous)) {
+            free(entries);
+            free(blocks);
+            return -1;
+        }
+        previous = blocks[i];
+    }
+
+    for(unsigned int i = 0; i < count; i++) {
+        uint16_t type = types[i];
+        uint16_t block_number = blocks[dir_blocks + i];
+
+        if(type == MFS_TYPE_DIRECTORY) {
+            if(zero_block(mfs, block_number)) {
+                free(entries);
+                free(blocks);
+                return -1;
+            }
+        } else if(mfs->features & FEATURE_COMPRESS) {
+            // Compressed files always start with a cluster header
+            type |= ENTRY_FLAG_COMPRESSED;
+            if(compress_format_file(mfs, block_number)) {
+                free(entries);
+                free(blocks);
+                return -1;
+            }
+        }
+
+        uint8_t *entry = entries + (size_t) i * DIR_ENTRY_SIZE;
+        write16(entry, 0, type);
+        write16(entry, 2, block_number);
+        memcpy(&entry[DIR_ENTRY_NAME_OFFSET], names[i], strlen(names[i]));
+    }
+
+    blocks[block_count] = tail_block_number;
+    int ret = write_alloc_blocks(mfs, blocks, block_count + 1);
+
+    // The directory blocks were taken in order, so they are written front to back
+    if(ret == 0 && tail_len > 0) {
+        ret = batch_write_entries(mfs, block_offset(mfs, tail_block_number) + tail_addr, entries, tail_len);
+    }
+    previous = tail_block_number;
+    for(size_t i = 0; i < dir_blocks && ret == 0; i++) {
+        previous = get_block_next(mfs, previous);
+        ret = batch_write_entries(mfs, block_offset(mfs, previous), entries + tail_len + i * mfs->block_size, mfs->block_size);
+    }
+
+    free(entries);
+    free(blocks);
+
+    return ret;
+}
+
+// Creates the entries in a directory given by name and type
+int mfs_create_many(mfs_t *mfs, const char *path, unsigned int count, const char **names, const uint16_t *types) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_operation(mfs)) {
+        return -1;
+    }
+    int ret = create_many(mfs, path, count, names, types);
+    complete_operation(mfs, ret);
+    trace_record_names(mfs, TRACE_CREATE_MANY, start, ret, path, count, names, types);
+    return ret;
+}
+
+// Creates the entries listed in a text file, one name per line. Names ending in a slash are directories.
+int mfs_create_from_list(mfs_t *mfs, const char *path, const char *list_filename) {
+    FILE *f = fopen(list_filename, "r");
+    if(f == NULL) {
+        perror("Failed to open list");
+        return -1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char *list = malloc(sizeof(*list) * ((size_t) size + 1));
+    if(list == NULL) {
+        perror("Memory allocation failed");
+        fclose(f);
+        return -1;
+    }
+
+    size_t read = fread(list, sizeof(*list), (size_t) size, f);
+    fclose(f);
+    if(read != (size_t) size) {
+        perror("Failed to read list");
+        free(list);
+        return -1;
+    }
+    list[size] = '\0';
+
+    unsigned int capacity = 1;
+    for(long i = 0; i < size; i++) {
+        if(list[i] == '\n') {
+            capacity++;
+        }
+    }
+
+    const char **names = malloc(sizeof(*names) * capacity);
+    uint16_t *types = malloc(sizeof(*types) * capacity);
+    if(names == NULL || types == NULL) {
+        perror("Memory allocation failed");
+        free(names);
+        free(types);
+        free(list);
+        return -1;
+    }
+
+    // Split the list in place, skipping empty lines
+    unsigned int count = 0;
+    char *line = list;
+    while(line != NULL) {
+        char *name = strsep(&line, "\n");
+        size_t len = strlen(name);
+        if(len > 0 && name[len - 1] == '\r') {
+            name[--len] = '\0';
+        }
+        if(len == 0) {
+            continue;
+        }
+
+        types[count] = MFS_TYPE_FILE;
+        if(len > 1 && name[len - 1] == '/') {
+            name[len - 1] = '\0';
+            types[count] = MFS_TYPE_DIRECTORY;
+        }
+        names[count++] = name;
+    }
+
+    int ret = mfs_create_many(mfs, path, count, names, types);
+
+    free(names);
+    free(types);
+    free(list);
+
+    return ret;
+}
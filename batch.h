@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "mfs.h"
+
+int mfs_create_many(mfs_t *mfs, const char *path, unsigned int count, const char **names, const uint16_t *types);
+int mfs_create_from_list(mfs_t *mfs, const char *path, const char *list_filename);
@@ -0,0 +1,476 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "util.h"
+#include "mfs.h"
+#include "bench.h"
+#include "alloc_table.h"
+#include "blocks.h"
+#include "format.h"
+#include "layout.h"
+#include "parse_opts.h"
+
+// Positions are 16 bit, so the test file has to stay below 64 KiB
+#define BENCH_FILE_SIZE 60000
+#define BENCH_BLOCK_SIZE 512
+#define BENCH_CHUNK_SIZE 4096
+#define BENCH_RANDOM_READ_SIZE 64
+#define BENCH_ROUNDS 20
+#define BENCH_RANDOM_READS 20000
+
+static const char *bench_words[] = {
+    "block", "chain", "directory", "entry", "file", "the", "of", "and", "a", "to", "data", "is", "table",
+    "allocation", "journal", "read", "write", "next", "previous", "size", "free", "used", "root", "image",
+};
+
+double bench_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+// Text-like test data: words from a small vocabulary with a few numbers mixed in
+void bench_fill_corpus(uint8_t *buf, size_t len) {
+    uint32_t state = 1;
+    size_t i = 0;
+    while(i < len) {
+        state = state * 1103515245u + 12345u;
+        char word[16];
+        if((state >> 16) % 16 == 0) {
+            snprintf(word, sizeof(word), "%u", (state >> 8) % 10000);
+        } else {
+            strcpy(word, bench_words[(state >> 16) % (sizeof(bench_words) / sizeof(*bench_words))]);
+        }
+        for(size_t j = 0; word[j] != '\0' && i < len; j++) {
+            buf[i++] = (uint8_t) word[j];
+        }
+        if(i < len) {
+            buf[i++] = (uint8_t) ((state >> 24) % 12 == 0 ? '\n' : ' ');
+        }
+    }
+}
+
+double bench_mb_per_s(size_t bytes, double seconds) {
+    return seconds > 0 ? (double) bytes / seconds / 1e6 : 0;
+}
+
+// Creates a scratch image and times writing, reading back and randomly reading the test file
+int bench_run(char *filename, const char *label, int optc, char **optv, const uint8_t *corpus) {
+    if(mfs_create(filename, optc, optv)) {
+        fprintf(stderr, "Failed to create %s\n", filename);
+        return -1;
+    }
+
+    char *open_opts[] = { "durability=none" };
+    mfs_t *mfs = mfs_open(filename, 1, open_opts);
+    if(mfs == NULL) {
+        fprintf(stderr, "Failed to open %s\n", filename);
+        return -1;
+    }
+
+    uint8_t *buf = malloc(sizeof(*buf) * BENCH_FILE_SIZE);
+    if(buf == NULL) {
+        perror("Memory allocation failed");
+        mfs_free(mfs);
+        return -1;
+    }
+
+    int ret = 0;
+
+    // Every round writes a file of its own, the last one is read back
+    char path[PATH_SEG_MAX + 1];
+
+    double write_time = 0;
+    for(int round = 0; round < BENCH_ROUNDS && ret == 0; round++) {
+        snprintf(path, sizeof(path), "/bench%d", round);
+
+        double start = bench_seconds();
+        if(mfs_touch(mfs, path) || mfs_fopen(mfs, path)) {
+            ret = -1;
+            break;
+        }
+        for(size_t done = 0; done < BENCH_FILE_SIZE && ret == 0; done += BENCH_CHUNK_SIZE) {
+            size_t len = BENCH_FILE_SIZE - done < BENCH_CHUNK_SIZE ? BENCH_FILE_SIZE - done : BENCH_CHUNK_SIZE;
+            ret = mfs_fwrite(mfs, (uint16_t) len, (uint8_t *) corpus + done);
+        }
+        mfs_fclose(mfs);
+        write_time += bench_seconds() - start;
+    }
+
+    double read_time = 0;
+    for(int round = 0; round < BENCH_ROUNDS && ret == 0; round++) {
+        double start = bench_seconds();
+        if(mfs_fopen(mfs, path)) {
+            ret = -1;
+            break;
+        }
+        for(size_t done = 0; done < BENCH_FILE_SIZE && ret == 0; done += BENCH_CHUNK_SIZE) {
+            size_t len = BENCH_FILE_SIZE - done < BENCH_CHUNK_SIZE ? BENCH_FILE_SIZE - done : BENCH_CHUNK_SIZE;
+            ret = mfs_fread(mfs, (uint16_t) len, buf + done);
+        }
+        mfs_fclose(mfs);
+        read_time += bench_seconds() - start;
+    }
+
+    if(ret == 0 && memcmp(buf, corpus, BENCH_FILE_SIZE) != 0) {
+        fprintf(stderr, "%s: data read back does not match\n", label);
+        ret = -1;
+    }
+
+    double random_time = 0;
+    if(ret == 0 && mfs_fopen(mfs, path) == 0) {
+        uint32_t state = 7;
+        double start = bench_seconds();
+        for(int i = 0; i < BENCH_RANDOM_READS && ret == 0; i++) {
+            state = state * 1103515245u + 12345u;
+            uint16_t pos = (uint16_t) ((state >> 8) % (BENCH_FILE_SIZE - BENCH_RANDOM_READ_SIZE));
+            ret = mfs_fseek(mfs, pos) || mfs_fread(mfs, BENCH_RANDOM_READ_SIZE, buf);
+        }
+        random_time = bench_seconds() - start;
+        mfs_fclose(mfs);
+    }
+
+    if(ret == 0) {
+        // Blocks used by all rounds' files, including the root directory
+        unsigned int used = mfs->data_block_count - free_data_blocks(mfs);
+        printf("%-10s %10.1f %10.1f %10.1f %8u %10u\n", label,
+                bench_mb_per_s((size_t) BENCH_ROUNDS * BENCH_FILE_SIZE, write_time),
+                bench_mb_per_s((size_t) BENCH_ROUNDS * BENCH_FILE_SIZE, read_time),
+                bench_mb_per_s((size_t) BENCH_RANDOM_READS * BENCH_RANDOM_READ_SIZE, random_time),
+                used, used * mfs->block_size);
+    }
+
+    free(buf);
+    mfs_free(mfs);
+
+    return ret;
+}
+
+// Compares plain and compressed files. Options are passed to mfs_create() for both images.
+int mfs_bench(char *filename, int optc, char **optv) {
+    uint8_t *corpus = malloc(sizeof(*corpus) * BENCH_FILE_SIZE);
+    if(corpus == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    bench_fill_corpus(corpus, BENCH_FILE_SIZE);
+
+    unsigned long block_size = BENCH_BLOCK_SIZE;
+    for(int i = 0; i < optc; i++) {
+        char *opt = strdup(optv[i]);
+        char *name;
+        char *value;
+
+        parse_opt(opt, &name, &value);
+
+        if(strequals(name, "bs") && value) {
+            block_size = strtoul(value, NULL, 10);
+        }
+
+        free(opt);
+    }
+    if(block_size == 0) {
+        fprintf(stderr, "Invalid block size\n");
+        free(corpus);
+        return -1;
+    }
+
+    // Default to an image that fits the files of all rounds twice over, with journaling off so only the data path is
+    // measured. Options given on the command line come later and override these.
+    unsigned long block_count = 2 * ((unsigned long) BENCH_ROUNDS * BENCH_FILE_SIZE / block_size + BENCH_ROUNDS);
+    if(block_count > 0xFFFF) {
+        block_count = 0xFFFF;
+    }
+    char bs_opt[32];
+    char bc_opt[32];
+    snprintf(bs_opt, sizeof(bs_opt), "bs=%lu", block_size);
+    snprintf(bc_opt, sizeof(bc_opt), "bc=%lu", block_count);
+
+    char **opts = malloc(sizeof(*opts) * (optc + 4));
+    if(opts == NULL) {
+        perror("Memory allocation failed");
+        free(corpus);
+        return -1;
+    }
+    opts[0] = bs_opt;
+    opts[1] = bc_opt;
+    opts[2] = "jb=0";
+    for(int i = 0; i < optc; i++) {
+        opts[3 + i] = optv[i];
+    }
+
+    printf("File size: %u bytes, %d rounds, %d random reads of %d bytes\n", BENCH_FILE_SIZE, BENCH_ROUNDS, BENCH_RANDOM_READS, BENCH_RANDOM_READ_SIZE);
+    printf("%-10s %10s %10s %10s %8s %10s\n", "mode", "write MB/s", "read MB/s", "rand MB/s", "blocks", "bytes");
+
+    int ret = 0;
+
+    opts[3 + optc] = "compress=none";
+    if(bench_run(filename, "plain", optc + 4, opts, corpus)) {
+        ret = -1;
+    }
+
+    opts[3 + optc] = "compress=lz";
+    if(ret == 0 && bench_run(filename, "lz", optc + 4, opts, corpus)) {
+        ret = -1;
+    }
+
+    free(opts);
+    free(corpus);
+
+    return ret;
+}
+
+// Aging: files are created, appended to, deleted and rewritten at random through the public API until the image is
+// filled to a target, and the layout and read throughput are measured at several stages on the way
+#define AGE_BLOCK_COUNT 8192
+#define AGE_MAX_FILES 1024
+#define AGE_MAX_WRITE_BLOCKS 16
+#define AGE_FILL 90
+#define AGE_STAGES 4
+#define AGE_RANDOM_READS 2000
+#define AGE_MAX_OPS 1000000
+
+typedef struct {
+    bool used;
+    uint32_t size;
+} age_file_t;
+
+uint32_t age_random(uint32_t *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+void age_path(char *path, unsigned int index) {
+    snprintf(path, PATH_SEG_MAX + 1, "/age%u", index);
+}
+
+// Writes len bytes at pos in chunks the API takes
+int age_write(mfs_t *mfs, const char *path, uint32_t pos, uint32_t len, const uint8_t *corpus) {
+    if(mfs_fopen(mfs, path)) {
+        return -1;
+    }
+
+    int ret = mfs_fseek(mfs, pos);
+    for(uint32_t done = 0; done < len && ret == 0; done += BENCH_CHUNK_SIZE) {
+        uint32_t chunk = len - done < BENCH_CHUNK_SIZE ? len - done : BENCH_CHUNK_SIZE;
+        ret = mfs_fwrite(mfs, (uint16_t) chunk, (uint8_t *) corpus + (pos + done) % (BENCH_FILE_SIZE - BENCH_CHUNK_SIZE));
+    }
+
+    mfs_fclose(mfs);
+
+    return ret;
+}
+
+// Runs random operations until used blocks reach target. Writes that might not fit delete a file instead.
+int age_fill(mfs_t *mfs, age_file_t *files, uint32_t *state, uint32_t target, const uint8_t *corpus) {
+    char path[PATH_SEG_MAX + 1];
+    uint32_t max_write = AGE_MAX_WRITE_BLOCKS * mfs->block_size;
+
+    for(unsigned long op = 0; op < AGE_MAX_OPS; op++) {
+        uint32_t used = mfs->data_block_count - free_data_blocks(mfs);
+        if(used >= target) {
+            return 0;
+        }
+
+        unsigned int index = age_random(state) % AGE_MAX_FILES;
+        age_file_t *file = &files[index];
+        age_path(path, index);
+
+        uint32_t choice = age_random(state) % 100;
+        uint32_t len = 1 + age_random(state) % max_write;
+        bool room = alloc_table_free_count(mfs) > 2 * AGE_MAX_WRITE_BLOCKS + 2 && free_data_blocks(mfs) > 2 * AGE_MAX_WRITE_BLOCKS + 2;
+
+        if(file->used && (choice < 20 || !room)) {
+            if(mfs_rm(mfs, path)) {
+                return -1;
+            }
+            file->used = false;
+        } else if(!file->used && room) {
+            if(mfs_touch(mfs, path) || age_write(mfs, path, 0, len, corpus)) {
+                return -1;
+            }
+            file->used = true;
+            file->size = len;
+        } else if(file->used && choice < 65) {
+            if(age_write(mfs, path, file->size, len, corpus)) {
+                return -1;
+            }
+            file->size += len;
+        } else if(file->used) {
+            // Rewrite the whole file in place
+            if(age_write(mfs, path, 0, file->size, corpus)) {
+                return -1;
+            }
+        }
+    }
+
+    fprintf(stderr, "Fill level not reached after %d operations\n", AGE_MAX_OPS);
+    return -1;
+}
+
+// Reads every file from start to end, then reads small pieces of random files
+int age_measure(mfs_t *mfs, age_file_t *files, uint32_t *state, double *seq_out, double *random_out) {
+    char path[PATH_SEG_MAX + 1];
+    uint8_t buf[BENCH_CHUNK_SIZE];
+
+    size_t bytes = 0;
+    double start = bench_seconds();
+    for(unsigned int i = 0; i < AGE_MAX_FILES; i++) {
+        if(!files[i].used) {
+            continue;
+        }
+        age_path(path, i);
+        if(mfs_fopen(mfs, path)) {
+            return -1;
+        }
+        int ret = 0;
+        for(uint32_t done = 0; done < files[i].size && ret == 0; done += BENCH_CHUNK_SIZE) {
+            uint32_t chunk = files[i].size - done < BENCH_CHUNK_SIZE ? files[i].size - done : BENCH_CHUNK_SIZE;
+            ret = mfs_fread(mfs, (uint16_t) chunk, buf);
+        }
+        mfs_fclose(mfs);
+        if(ret) {
+            return -1;
+        }
+        bytes += files[i].size;
+    }
+    *seq_out = bench_mb_per_s(bytes, bench_seconds() - start);
+
+    bytes = 0;
+    start = bench_seconds();
+    for(int i = 0; i < AGE_RANDOM_READS; i++) {
+        unsigned int index = age_random(state) % AGE_MAX_FILES;
+        if(!files[index].used || files[index].size < BENCH_RANDOM_READ_SIZE) {
+            continue;
+        }
+        age_path(path, index);
+        uint32_t pos = age_random(state) % (files[index].size - BENCH_RANDOM_READ_SIZE + 1);
+        if(mfs_fopen(mfs, path)) {
+            return -1;
+        }
+        int ret = mfs_fseek(mfs, pos) || mfs_fread(mfs, BENCH_RANDOM_READ_SIZE, buf);
+        mfs_fclose(mfs);
+        if(ret) {
+            return -1;
+        }
+        bytes += BENCH_RANDOM_READ_SIZE;
+    }
+    *random_out = bench_mb_per_s(bytes, bench_seconds() - start);
+
+    return 0;
+}
+
+// Ages a scratch image in stages up to fill=N percent of its blocks used. Other options are passed to mfs_create().
+int mfs_age(char *filename, int optc, char **optv) {
+    unsigned long fill = AGE_FILL;
+    unsigned long stages = AGE_STAGES;
+    uint32_t state = 1;
+    unsigned long block_size = BENCH_BLOCK_SIZE;
+
+    for(int i = 0; i < optc; i++) {
+        char *opt = strdup(optv[i]);
+        char *name;
+        char *value;
+
+        parse_opt(opt, &name, &value);
+
+        if(strequals(name, "fill") && value) {
+            fill = strtoul(value, NULL, 10);
+        } else if(strequals(name, "stages") && value) {
+            stages = strtoul(value, NULL, 10);
+        } else if(strequals(name, "seed") && value) {
+            state = (uint32_t) strtoul(value, NULL, 10);
+        } else if(strequals(name, "bs") && value) {
+            block_size = strtoul(value, NULL, 10);
+        }
+
+        free(opt);
+    }
+    if(fill == 0 || fill > 99 || stages == 0 || stages > 100 || block_size == 0) {
+        fprintf(stderr, "Invalid aging options\n");
+        return -1;
+    }
+
+    // Journaling is off by default, as for bench, and options given on the command line override the defaults
+    char bs_opt[32];
+    char bc_opt[32];
+    snprintf(bs_opt, sizeof(bs_opt), "bs=%lu", block_size);
+    snprintf(bc_opt, sizeof(bc_opt), "bc=%u", AGE_BLOCK_COUNT);
+
+    char **opts = malloc(sizeof(*opts) * (optc + 3));
+    if(opts == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    opts[0] = bs_opt;
+    opts[1] = bc_opt;
+    opts[2] = "jb=0";
+    for(int i = 0; i < optc; i++) {
+        opts[3 + i] = optv[i];
+    }
+
+    if(mfs_create(filename, optc + 3, opts)) {
+        fprintf(stderr, "Failed to create %s\n", filename);
+        free(opts);
+        return -1;
+    }
+
+    // Opening takes the same options, e.g. alloc=chain, and doesn't wait for the disk unless told otherwise
+    opts[2] = "durability=none";
+    mfs_t *mfs = mfs_open(filename, optc + 3, opts);
+    free(opts);
+    if(mfs == NULL) {
+        fprintf(stderr, "Failed to open %s\n", filename);
+        return -1;
+    }
+
+    uint8_t *corpus = malloc(sizeof(*corpus) * BENCH_FILE_SIZE);
+    age_file_t *files = calloc(AGE_MAX_FILES, sizeof(*files));
+    if(corpus == NULL || files == NULL) {
+        perror("Memory allocation failed");
+        free(corpus);
+        free(files);
+        mfs_free(mfs);
+        return -1;
+    }
+    bench_fill_corpus(corpus, BENCH_FILE_SIZE);
+
+    printf("%u blocks of %u bytes, aged to %lu%% in %lu stages\n", mfs->data_block_count, mfs->block_size, fill, stages);
+    printf("%5s %5s %6s %10s %10s %10s %10s %10s %10s\n", "stage", "fill", "files", "blocks/run", "seek/chain", "free runs", "max free", "seq MB/s", "rand MB/s");
+
+    int ret = 0;
+    for(unsigned long stage = 1; stage <= stages && ret == 0; stage++) {
+        uint32_t target = (uint32_t) ((unsigned long) mfs->data_block_count * fill * stage / stages / 100);
+        double seq = 0;
+        double random = 0;
+
+        if(age_fill(mfs, files, &state, target, corpus) || age_measure(mfs, files, &state, &seq, &random)) {
+            ret = -1;
+            break;
+        }
+
+        unsigned int count = 0;
+        for(unsigned int i = 0; i < AGE_MAX_FILES; i++) {
+            count += files[i].used;
+        }
+
+        layout_t layout;
+        layout_scan(mfs, &layout);
+
+        unsigned int used = mfs->data_block_count - free_data_blocks(mfs);
+        printf("%5lu %4u%% %6u %10.2f %10.2f %10u %10u %10.1f %10.1f\n", stage, used * 100 / mfs->data_block_count, count,
+                layout.runs ? (double) layout.blocks / layout.runs : 0, layout.chains ? (double) layout.seek_blocks / layout.chains : 0,
+                layout.free_runs, layout.largest_free_run, seq, random);
+    }
+
+    free(files);
+    free(corpus);
+    mfs_free(mfs);
+
+    return ret;
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+int mfs_bench(char *filename, int optc, char **optv);
+int mfs_age(char *filename, int optc, char **optv);
@@ -0,0 +1,474 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "util.h"
+#include "format.h"
+#include "blocks.h"
+#include "blockmap.h"
+
+#define INDEX_EMPTY 0xFFFF
+
+struct blockmap {
+    // Offset of the block map in the image
+    size_t base;
+    // The whole map, kept in memory like the alloc table
+    uint8_t *table;
+    bool dedup;
+    // Open addressing hash table of the physical blocks with a hash, the hashes themselves are in the map
+    uint16_t *index;
+    uint32_t index_mask;
+    // Where the search for a free physical block continues
+    uint16_t free_hint;
+    // Unreferenced physical blocks
+    uint32_t free_count;
+};
+
+uint16_t blockmap_refs(blockmap_t *bm, uint16_t physical) {
+    return read16(bm->table, physical * BLOCK_MAP_ENTRY_SIZE + BM_REFS);
+}
+
+uint64_t blockmap_hash(blockmap_t *bm, uint16_t physical) {
+    return read64(bm->table, physical * BLOCK_MAP_ENTRY_SIZE + BM_HASH);
+}
+
+int blockmap_store(mfs_t *mfs, uint16_t n) {
+    size_t offset = (size_t) n * BLOCK_MAP_ENTRY_SIZE;
+    return write_metadata(mfs, mfs->blockmap->base + offset, mfs->blockmap->table + offset, BLOCK_MAP_ENTRY_SIZE);
+}
+
+size_t physical_offset(mfs_t *mfs, uint16_t physical) {
+    return mfs->blocks_base + block_bytes(mfs, physical);
+}
+
+uint64_t hash_block(const uint8_t *block, uint16_t len) {
+    uint64_t hash = 0x9E3779B97F4A7C15u ^ len;
+    uint16_t i = 0;
+    for(; i + 8 <= len; i += 8) {
+        hash = (hash ^ read64(block, i)) * 0xFF51AFD7ED558CCDu;
+        hash ^= hash >> 32;
+    }
+    for(; i < len; i++) {
+        hash = (hash ^ block[i]) * 0x100000001B3u;
+    }
+    hash ^= hash >> 29;
+    hash &= ~BM_HASH_HOLE;
+
+    // 0 marks blocks that aren't indexed
+    return hash != 0 ? hash : 1;
+}
+
+void index_insert(blockmap_t *bm, uint16_t physical) {
+    uint32_t slot = (uint32_t) blockmap_hash(bm, physical) & bm->index_mask;
+    while(bm->index[slot] != INDEX_EMPTY) {
+        slot = (slot + 1) & bm->index_mask;
+    }
+    bm->index[slot] = physical;
+}
+
+void index_remove(blockmap_t *bm, uint16_t physical) {
+    uint32_t slot = (uint32_t) blockmap_hash(bm, physical) & bm->index_mask;
+    while(bm->index[slot] != physical) {
+        if(bm->index[slot] == INDEX_EMPTY) {
+            return;
+        }
+        slot = (slot + 1) & bm->index_mask;
+    }
+
+    // Move later entries of the probe sequence up, so lookups don't stop at the gap
+    uint32_t next = slot;
+    while(1) {
+        next = (next + 1) & bm->index_mask;
+        if(bm->index[next] == INDEX_EMPTY) {
+            break;
+        }
+        uint32_t home = (uint32_t) blockmap_hash(bm, bm->index[next]) & bm->index_mask;
+        if(((next - home) & bm->index_mask) >= ((next - slot) & bm->index_mask)) {
+            bm->index[slot] = bm->index[next];
+            slot = next;
+        }
+    }
+    bm->index[slot] = INDEX_EMPTY;
+}
+
+// Returns the physical block holding exactly the given contents, or BLOCK_EOF if there is none
+uint16_t index_find(mfs_t *mfs, uint64_t hash, const uint8_t *block, uint8_t *scratch) {
+    blockmap_t *bm = mfs->blockmap;
+
+    uint32_t slot = (uint32_t) hash & bm->index_mask;
+    while(bm->index[slot] != INDEX_EMPTY) {
+        uint16_t physical = bm->index[slot];
+        if(blockmap_hash(bm, physical) == hash) {
+            // Hashes can collide, compare the contents
+            if(read_data(mfs, physical_offset(mfs, physical), scratch, mfs->block_size)) {
+                return BLOCK_EOF;
+            }
+            if(memcmp(scratch, block, mfs->block_size) == 0) {
+                return physical;
+            }
+        }
+        slot = (slot + 1) & bm->index_mask;
+    }
+
+    return BLOCK_EOF;
+}
+
+// Writes an empty block map into a new image with an entry for each chain block. Chain blocks start out on the physical
+// block with their number, if there is one, and only the root directory's is used.
+int blockmap_format(FILE *f, size_t base, uint16_t block_count, uint16_t data_block_count) {
+    size_t size = (size_t) block_count * BLOCK_MAP_ENTRY_SIZE;
+    uint8_t *table = calloc(size, sizeof(*table));
+    if(table == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    for(uint32_t i = 0; i < data_block_count; i++) {
+        write16(table, i * BLOCK_MAP_ENTRY_SIZE + BM_PHYSICAL, (uint16_t) i);
+    }
+    write16(table, BM_REFS, 1);
+
+    fseek(f, base, SEEK_SET);
+    size_t written = fwrite(table, sizeof(*table), size, f);
+    free(table);
+    if(written != size) {
+        perror("Write operation failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Writes the block map of the image resized to block_count chain blocks and data_block_count data blocks to base,
+// leaving the one in use alone. New chain blocks start out on the physical block with their number, if there is one.
+// The physical blocks that are dropped are unreferenced, so their fields are zero.
+int blockmap_write_resized(mfs_t *mfs, size_t base, uint16_t block_count, uint16_t data_block_count) {
+    size_t size = (size_t) block_count * BLOCK_MAP_ENTRY_SIZE;
+    uint8_t *table = calloc(size, sizeof(*table));
+    if(table == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    uint16_t kept = block_count < mfs->block_count ? block_count : mfs->block_count;
+    memcpy(table, mfs->blockmap->table, (size_t) kept * BLOCK_MAP_ENTRY_SIZE);
+    for(uint32_t i = kept; i < data_block_count; i++) {
+        write16(table, i * BLOCK_MAP_ENTRY_SIZE + BM_PHYSICAL, (uint16_t) i);
+    }
+
+    fseek(mfs->f, base, SEEK_SET);
+    size_t written = fwrite(table, sizeof(*table), size, mfs->f);
+    free(table);
+    if(written != size) {
+        perror("Write operation failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+int blockmap_open(mfs_t *mfs, size_t base, bool dedup) {
+    blockmap_t *bm = calloc(1, sizeof(*bm));
+    if(bm == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    size_t size = (size_t) mfs->block_count * BLOCK_MAP_ENTRY_SIZE;
+    bm->base = base;
+    bm->dedup = dedup;
+    bm->free_hint = 1;
+    bm->table = malloc(sizeof(*bm->table) * size);
+    if(bm->table == NULL) {
+        perror("Memory allocation failed");
+        free(bm);
+        return -1;
+    }
+
+    fseek(mfs->f, base, SEEK_SET);
+    size_t read = fread(bm->table, sizeof(*bm->table), size, mfs->f);
+    if(read != size) {
+        if(ferror(mfs->f)) {
+            perror("File read error");
+        } else if(feof(mfs->f)) {
+            fprintf(stderr, "File to short\n");
+        }
+        free(bm->table);
+        free(bm);
+        return -1;
+    }
+
+    // At least twice as many slots as physical blocks keeps the probe sequences short
+    uint32_t slots = 16;
+    while(slots < 2u * mfs->data_block_count) {
+        slots *= 2;
+    }
+    bm->index_mask = slots - 1;
+    bm->index = malloc(sizeof(*bm->index) * slots);
+    if(bm->index == NULL) {
+        perror("Memory allocation failed");
+        free(bm->table);
+        free(bm);
+        return -1;
+    }
+    memset(bm->index, 0xFF, sizeof(*bm->index) * slots);
+
+    mfs->blockmap = bm;
+
+    for(uint32_t i = 0; i < mfs->data_block_count; i++) {
+        uint64_t hash = blockmap_hash(bm, (uint16_t) i);
+        if(blockmap_refs(bm, (uint16_t) i) == 0) {
+            bm->free_count++;
+        } else if(hash != 0 && (hash & BM_HASH_HOLE) == 0) {
+            index_insert(bm, (uint16_t) i);
+        }
+    }
+
+    return 0;
+}
+
+void blockmap_free(mfs_t *mfs) {
+    if(mfs->blockmap == NULL) {
+        return;
+    }
+
+    free(mfs->blockmap->index);
+    free(mfs->blockmap->table);
+    free(mfs->blockmap);
+    mfs->blockmap = NULL;
+}
+
+uint16_t blockmap_physical(mfs_t *mfs, uint16_t block_number) {
+    return read16(mfs->blockmap->table, block_number * BLOCK_MAP_ENTRY_SIZE + BM_PHYSICAL);
+}
+
+unsigned int blockmap_count_used(mfs_t *mfs) {
+    return mfs->data_block_count - mfs->blockmap->free_count;
+}
+
+unsigned int blockmap_free_count(mfs_t *mfs) {
+    return mfs->blockmap->free_count;
+}
+
+// Returns true if no chain block refers to a physical block from start on
+bool blockmap_unreferenced(mfs_t *mfs, uint16_t start) {
+    for(uint32_t i = start; i < mfs->data_block_count; i++) {
+        if(blockmap_refs(mfs->blockmap, (uint16_t) i) > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void blockmap_set_physical(blockmap_t *bm, uint16_t block_number, uint16_t physical) {
+    write16(bm->table, block_number * BLOCK_MAP_ENTRY_SIZE + BM_PHYSICAL, physical);
+}
+
+void blockmap_set_refs(blockmap_t *bm, uint16_t physical, uint16_t refs) {
+    write16(bm->table, physical * BLOCK_MAP_ENTRY_SIZE + BM_REFS, refs);
+}
+
+void blockmap_set_hash(blockmap_t *bm, uint16_t physical, uint64_t hash) {
+    write64(bm->table, physical * BLOCK_MAP_ENTRY_SIZE + BM_HASH, hash);
+}
+
+// Returns an unreferenced physical block, preferring the one with the same number as the chain block
+uint16_t find_free_physical(mfs_t *mfs, uint16_t block_number) {
+    blockmap_t *bm = mfs->blockmap;
+
+    if(block_number < mfs->data_block_count && blockmap_refs(bm, block_number) == 0) {
+        return block_number;
+    }
+
+    for(uint32_t i = 0; i < mfs->data_block_count; i++) {
+        uint16_t physical = (uint16_t) ((bm->free_hint + i) % mfs->data_block_count);
+        if(physical != 0 && blockmap_refs(bm, physical) == 0) {
+            bm->free_hint = physical;
+            return physical;
+        }
+    }
+
+    fprintf(stderr, "All blocks are used\n");
+    return BLOCK_EOF;
+}
+
+// Points block_number at physical, which gains a reference
+int blockmap_point(mfs_t *mfs, uint16_t block_number, uint16_t physical) {
+    blockmap_t *bm = mfs->blockmap;
+
+    uint16_t refs = blockmap_refs(bm, physical);
+    if(refs == 0) {
+        bm->free_count--;
+    }
+    blockmap_set_physical(bm, block_number, physical);
+    blockmap_set_refs(bm, physical, refs + 1);
+
+    if(blockmap_store(mfs, block_number)) {
+        return -1;
+    }
+    return physical != block_number ? blockmap_store(mfs, physical) : 0;
+}
+
+// Drops a reference to a physical block, taking it out of the dedup index once it is unused
+int blockmap_unref(mfs_t *mfs, uint16_t physical) {
+    blockmap_t *bm = mfs->blockmap;
+
+    uint16_t refs = blockmap_refs(bm, physical);
+    if(refs == 0) {
+        fprintf(stderr, "Physical block 0x%04x is not referenced\n", physical);
+        return -1;
+    }
+
+    blockmap_set_refs(bm, physical, refs - 1);
+    if(refs == 1) {
+        bm->free_count++;
+    }
+    if(refs == 1 && blockmap_hash(bm, physical) != 0) {
+        index_remove(bm, physical);
+        blockmap_set_hash(bm, physical, 0);
+    }
+
+    return blockmap_store(mfs, physical);
+}
+
+// Gives a newly allocated chain block a physical block of its own
+int blockmap_attach(mfs_t *mfs, uint16_t block_number) {
+    uint16_t physical = find_free_physical(mfs, block_number);
+    if(physical == BLOCK_EOF) {
+        return -1;
+    }
+
+    return blockmap_point(mfs, block_number, physical);
+}
+
+// Called when a chain block is freed. Its physical block is only freed with the last reference.
+int blockmap_release(mfs_t *mfs, uint16_t block_number) {
+    return blockmap_unref(mfs, blockmap_physical(mfs, block_number));
+}
+
+// Points a chain block at the physical block of another one, dropping the one it had
+int blockmap_share(mfs_t *mfs, uint16_t block_number, uint16_t source) {
+    uint16_t physical = blockmap_physical(mfs, source);
+    uint16_t old = blockmap_physical(mfs, block_number);
+    if(physical == old) {
+        return 0;
+    }
+
+    if(blockmap_point(mfs, block_number, physical)) {
+        return -1;
+    }
+    return blockmap_unref(mfs, old);
+}
+
+// Writes data to a chain block. Physical blocks shared with other chain blocks are copied first, and with dedup on,
+// a block whose new contents already exist elsewhere is pointed at that copy instead of being written.
+int blockmap_write(mfs_t *mfs, uint16_t block_number, uint16_t offset, const uint8_t *buf, uint16_t len) {
+    blockmap_t *bm = mfs->blockmap;
+
+    uint16_t physical = blockmap_physical(mfs, block_number);
+    bool shared = blockmap_refs(bm, physical) > 1;
+
+    if(!bm->dedup && !shared) {
+        return write_data(mfs, physical_offset(mfs, physical) + offset, buf, len);
+    }
+
+    // Work on the complete new contents of the block
+    uint8_t *block = malloc(sizeof(*block) * mfs->block_size * 2);
+    if(block == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    uint8_t *scratch = block + mfs->block_size;
+
+    if(offset != 0 || len != mfs->block_size) {
+        if(read_data(mfs, physical_offset(mfs, physical), block, mfs->block_size)) {
+            free(block);
+            return -1;
+        }
+    }
+    memcpy(block + offset, buf, len);
+
+    uint64_t hash = 0;
+    if(bm->dedup) {
+        hash = hash_block(block, mfs->block_size);
+
+        uint16_t match = index_find(mfs, hash, block, scratch);
+        if(match == physical) {
+            // Nothing changed
+            free(block);
+            return 0;
+        }
+        if(match != BLOCK_EOF) {
+            free(block);
+            if(blockmap_point(mfs, block_number, match)) {
+                return -1;
+            }
+            return blockmap_unref(mfs, physical);
+        }
+    }
+
+    uint16_t target = physical;
+    if(shared) {
+        // Copy on write
+        target = find_free_physical(mfs, block_number);
+        if(target == BLOCK_EOF) {
+            free(block);
+            return -1;
+        }
+        if(blockmap_point(mfs, block_number, target) || blockmap_unref(mfs, physical)) {
+            free(block);
+            return -1;
+        }
+    } else if(blockmap_hash(bm, physical) != 0) {
+        // The old contents are gone
+        index_remove(bm, physical);
+    }
+
+    int ret = write_data(mfs, physical_offset(mfs, target), block, mfs->block_size);
+    free(block);
+    if(ret) {
+        return -1;
+    }
+
+    if(bm->dedup) {
+        blockmap_set_hash(bm, target, hash);
+        index_insert(bm, target);
+        return blockmap_store(mfs, target);
+    }
+
+    return 0;
+}
+
+// Returns the length of the hole a chain block stands for, 0 if it holds data
+uint32_t blockmap_hole_blocks(mfs_t *mfs, uint16_t block_number) {
+    uint64_t hash = blockmap_hash(mfs->blockmap, blockmap_physical(mfs, block_number));
+    return (hash & BM_HASH_HOLE) ? (uint32_t) (hash & ~BM_HASH_HOLE) : 0;
+}
+
+// Turns a chain block into a hole of the given length, or back into a data block with undefined contents if it is 0.
+// Holes shared with a copy of the file get a physical block of their own first, so the copy keeps its length.
+int blockmap_set_hole(mfs_t *mfs, uint16_t block_number, uint32_t blocks) {
+    blockmap_t *bm = mfs->blockmap;
+
+    uint16_t physical = blockmap_physical(mfs, block_number);
+    uint64_t hash = blockmap_hash(bm, physical);
+
+    if(blockmap_refs(bm, physical) > 1) {
+        uint16_t target = find_free_physical(mfs, block_number);
+        if(target == BLOCK_EOF) {
+            return -1;
+        }
+        if(blockmap_point(mfs, block_number, target) || blockmap_unref(mfs, physical)) {
+            return -1;
+        }
+        physical = target;
+    } else if(hash != 0 && (hash & BM_HASH_HOLE) == 0) {
+        index_remove(bm, physical);
+    }
+
+    blockmap_set_hash(bm, physical, blocks > 0 ? BM_HASH_HOLE | blocks : 0);
+    return blockmap_store(mfs, physical);
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mfs.h"
+
+int blockmap_format(FILE *f, size_t base, uint16_t block_count, uint16_t data_block_count);
+int blockmap_write_resized(mfs_t *mfs, size_t base, uint16_t block_count, uint16_t data_block_count);
+
+int blockmap_open(mfs_t *mfs, size_t base, bool dedup);
+void blockmap_free(mfs_t *mfs);
+
+uint16_t blockmap_physical(mfs_t *mfs, uint16_t block_number);
+unsigned int blockmap_count_used(mfs_t *mfs);
+unsigned int blockmap_free_count(mfs_t *mfs);
+bool blockmap_unreferenced(mfs_t *mfs, uint16_t start);
+
+int blockmap_attach(mfs_t *mfs, uint16_t block_number);
+int blockmap_release(mfs_t *mfs, uint16_t block_number);
+int blockmap_share(mfs_t *mfs, uint16_t block_number, uint16_t source);
+int blockmap_write(mfs_t *mfs, uint16_t block_number, uint16_t offset, const uint8_t *buf, uint16_t len);
+
+uint32_t blockmap_hole_blocks(mfs_t *mfs, uint16_t block_number);
+int blockmap_set_hole(mfs_t *mfs, uint16_t block_number, uint32_t blocks);
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mfs.h"
+
+// Block level helpers shared by the modules built on top of mfs.c
+
+typedef struct {
+    uint16_t type;
+    uint16_t block_number;
+    char *name;
+} directory_entry_t;
+
+typedef struct {
+    mfs_t *mfs;
+    uint16_t block_number;
+    uint8_t *block;
+    bool reached_eof;
+    uint16_t entry_addr;
+    directory_entry_t entry;
+} directory_iterator_t;
+
+// Block arithmetic on positions. Block sizes that are powers of two use shifts and masks, others divide.
+static inline uint32_t block_of_pos(const mfs_t *mfs, size_t pos) {
+    return mfs->block_shift ? (uint32_t) (pos >> mfs->block_shift) : (uint32_t) (pos / mfs->block_size);
+}
+
+static inline uint16_t offset_in_block(const mfs_t *mfs, size_t pos) {
+    return mfs->block_shift ? (uint16_t) (pos & (mfs->block_size - 1u)) : (uint16_t) (pos % mfs->block_size);
+}
+
+static inline size_t block_bytes(const mfs_t *mfs, size_t blocks) {
+    return mfs->block_shift ? blocks << mfs->block_shift : blocks * mfs->block_size;
+}
+
+size_t block_offset(mfs_t *mfs, uint16_t block_number);
+int read_block(mfs_t *mfs, uint16_t block_number, uint8_t *block);
+int read_metadata(mfs_t *mfs, size_t offset, uint8_t *buf, uint16_t len);
+int pread_metadata(mfs_t *mfs, size_t offset, uint8_t *buf, uint16_t len);
+int write_metadata(mfs_t *mfs, size_t offset, const uint8_t *buf, uint16_t len);
+int read_data(mfs_t *mfs, size_t offset, uint8_t *buf, size_t len);
+int write_data(mfs_t *mfs, size_t offset, const uint8_t *buf, size_t len);
+int write_block_data(mfs_t *mfs, uint16_t block_number, uint16_t offset, const uint8_t *buf, uint16_t len);
+
+uint16_t get_block_next(mfs_t *mfs, uint16_t block_number);
+uint16_t get_block_previous(mfs_t *mfs, uint16_t block_number);
+int set_block(mfs_t *mfs, uint16_t block, uint16_t previous, uint16_t next);
+int set_block_next(mfs_t *mfs, uint16_t block, uint16_t next);
+int set_block_previous(mfs_t *mfs, uint16_t block, uint16_t previous);
+uint16_t alloc_free_block(mfs_t *mfs, uint16_t previous, uint16_t next, uint16_t parent, uint16_t goal);
+int free_block(mfs_t *mfs, uint16_t block_number);
+int free_chain(mfs_t *mfs, uint16_t block_number);
+int release_blocks(mfs_t *mfs, uint16_t *blocks, size_t count);
+uint32_t free_data_blocks(mfs_t *mfs);
+int alloc_free_blocks(mfs_t *mfs, uint16_t start, size_t count, uint16_t *blocks);
+int write_alloc_blocks(mfs_t *mfs, uint16_t *blocks, size_t count);
+int clone_chain(mfs_t *mfs, uint16_t source, uint16_t block_number, uint16_t parent);
+
+int find_file(mfs_t *mfs, const char *path, uint16_t *dir_block_number_out, uint16_t *block_number_out, uint16_t *type_out);
+uint32_t file_block_hole(mfs_t *mfs, uint16_t block_number);
+int set_file_block_hole(mfs_t *mfs, uint16_t block_number, uint32_t blocks);
+
+int remove_path(mfs_t *mfs, const char *path, bool recursive);
+
+int mfs_block_for_directory_path(mfs_t *mfs, const char *path, uint16_t *block_number_out);
+
+uint8_t *scratch_get(mfs_t *mfs, size_t len);
+void scratch_put(mfs_t *mfs, uint8_t *buf);
+int zero_block(mfs_t *mfs, uint16_t block_number);
+
+void split_path(const char *path, size_t *dir_len_out, const char **name_out, size_t *name_len_out);
+int block_for_directory(mfs_t *mfs, const char *path, size_t len, uint16_t *block_number_out);
+
+int open_directory_iterator(directory_iterator_t *it, mfs_t *mfs, uint16_t block_number);
+directory_entry_t *next_directory_entry(directory_iterator_t *it);
+directory_entry_t *find_directory_entry(directory_iterator_t *it, const uint8_t *pattern);
+void close_directory_iterator(directory_iterator_t *it);
+
+int begin_operation(mfs_t *mfs);
+void complete_operation(mfs_t *mfs, int result);
+uint64_t monotonic_ms(void);
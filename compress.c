@@ -0,0 +1,471 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "util.h"
+#include "format.h"
+#include "blocks.h"
+#include "compress.h"
+#include "export.h"
+#include "lz.h"
+
+#define CLUSTER_CACHE_ENTRIES 4
+
+typedef struct {
+    bool valid;
+    uint32_t cluster;
+    uint64_t last_used;
+    uint8_t *data;
+} cluster_cache_entry_t;
+
+struct compress_file {
+    uint32_t cluster_size;
+    // Where each cluster starts, how many blocks it occupies and how much data it holds
+    uint32_t count;
+    uint32_t capacity;
+    uint16_t *starts;
+    uint16_t *blocks;
+    uint32_t *raw_lens;
+    uint32_t size;
+    // Decompressed clusters, so reads close to each other don't decompress the same cluster again
+    cluster_cache_entry_t cache[CLUSTER_CACHE_ENTRIES];
+    uint64_t clock;
+    // The cluster being written is kept here and only compressed and stored once the writer moves on to another
+    // cluster, closes the file or syncs, so a run of small writes compresses it once. It may be one past the last
+    // stored cluster.
+    cluster_cache_entry_t *dirty;
+    uint32_t dirty_len;
+    // Stored form of a cluster: header and data, padded to whole blocks
+    uint8_t *stored;
+    uint32_t stored_capacity;
+};
+
+uint32_t compress_cluster_size(mfs_t *mfs) {
+    uint32_t size = (uint32_t) mfs->cluster_blocks * mfs->block_size;
+    return size < CLUSTER_MAX_SIZE ? size : CLUSTER_MAX_SIZE;
+}
+
+uint16_t compress_stored_blocks(mfs_t *mfs, uint32_t stored_len) {
+    return (uint16_t) block_of_pos(mfs, CLUSTER_HEADER_SIZE + stored_len + mfs->block_size - 1);
+}
+
+// Follows the chain count - 1 blocks from block_number
+uint16_t compress_walk(mfs_t *mfs, uint16_t block_number, uint16_t count) {
+    for(uint16_t i = 1; i < count; i++) {
+        block_number = get_block_next(mfs, block_number);
+    }
+    return block_number;
+}
+
+// Writes the header of an empty cluster into the first block of a new compressed file
+int compress_format_file(mfs_t *mfs, uint16_t block_number) {
+    uint8_t header[CLUSTER_HEADER_SIZE];
+    write32(header, 0, 0);
+    write32(header, 4, 0);
+    return write_block_data(mfs, block_number, 0, header, CLUSTER_HEADER_SIZE);
+}
+
+int compress_read_header(mfs_t *mfs, uint16_t block_number, uint32_t *raw_len, uint32_t *stored_len) {
+    uint8_t header[CLUSTER_HEADER_SIZE];
+    if(read_data(mfs, block_offset(mfs, block_number), header, CLUSTER_HEADER_SIZE)) {
+        return -1;
+    }
+    *raw_len = read32(header, 0);
+    *stored_len = read32(header, 4);
+    return 0;
+}
+
+int compress_add_cluster(compress_file_t *cf, uint16_t start, uint16_t blocks, uint32_t raw_len) {
+    if(cf->count == cf->capacity) {
+        uint32_t capacity = cf->capacity ? cf->capacity * 2 : 16;
+        uint16_t *starts = realloc(cf->starts, sizeof(*starts) * capacity);
+        if(starts) cf->starts = starts;
+        uint16_t *block_counts = realloc(cf->blocks, sizeof(*block_counts) * capacity);
+        if(block_counts) cf->blocks = block_counts;
+        uint32_t *raw_lens = realloc(cf->raw_lens, sizeof(*raw_lens) * capacity);
+        if(raw_lens) cf->raw_lens = raw_lens;
+        if(starts == NULL || block_counts == NULL || raw_lens == NULL) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        cf->capacity = capacity;
+    }
+
+    cf->starts[cf->count] = start;
+    cf->blocks[cf->count] = blocks;
+    cf->raw_lens[cf->count] = raw_len;
+    cf->count++;
+    cf->size += raw_len;
+
+    return 0;
+}
+
+void compress_free_file(compress_file_t *cf) {
+    for(int i = 0; i < CLUSTER_CACHE_ENTRIES; i++) {
+        free(cf->cache[i].data);
+    }
+    free(cf->starts);
+    free(cf->blocks);
+    free(cf->raw_lens);
+    free(cf->stored);
+    free(cf);
+}
+
+// Indexes the clusters of the file starting at block_number. Only cluster headers are read.
+int compress_open(mfs_t *mfs, uint16_t block_number) {
+    compress_file_t *cf = calloc(1, sizeof(*cf));
+    if(cf == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    cf->cluster_size = compress_cluster_size(mfs);
+    cf->stored_capacity = compress_stored_blocks(mfs, cf->cluster_size) * (uint32_t) mfs->block_size;
+    cf->stored = malloc(sizeof(*cf->stored) * cf->stored_capacity);
+    if(cf->stored == NULL) {
+        perror("Memory allocation failed");
+        compress_free_file(cf);
+        return -1;
+    }
+    for(int i = 0; i < CLUSTER_CACHE_ENTRIES; i++) {
+        cf->cache[i].data = malloc(sizeof(*cf->cache[i].data) * cf->cluster_size);
+        if(cf->cache[i].data == NULL) {
+            perror("Memory allocation failed");
+            compress_free_file(cf);
+            return -1;
+        }
+    }
+
+    while(block_number != BLOCK_EOF) {
+        uint32_t raw_len;
+        uint32_t stored_len;
+        if(compress_read_header(mfs, block_number, &raw_len, &stored_len)) {
+            compress_free_file(cf);
+            return -1;
+        }
+
+        raw_len &= ~CLUSTER_RAW;
+        if(raw_len > cf->cluster_size || stored_len > cf->stored_capacity - CLUSTER_HEADER_SIZE) {
+            fprintf(stderr, "Corrupt cluster header in block 0x%04x\n", block_number);
+            compress_free_file(cf);
+            return -1;
+        }
+
+        uint16_t blocks = compress_stored_blocks(mfs, stored_len);
+        if(compress_add_cluster(cf, block_number, blocks, raw_len)) {
+            compress_free_file(cf);
+            return -1;
+        }
+
+        block_number = get_block_next(mfs, compress_walk(mfs, block_number, blocks));
+    }
+
+    mfs->file_clusters = cf;
+    mfs->file_pos = 0;
+
+    return 0;
+}
+
+void compress_close(mfs_t *mfs) {
+    if(mfs->file_clusters) {
+        compress_free_file(mfs->file_clusters);
+        mfs->file_clusters = NULL;
+    }
+}
+
+// Length of the data in a cluster, including what hasn't been stored yet
+uint32_t compress_cluster_len(compress_file_t *cf, uint32_t cluster) {
+    if(cf->dirty && cf->dirty->cluster == cluster) {
+        return cf->dirty_len;
+    }
+    return cf->raw_lens[cluster];
+}
+
+uint32_t compress_file_size(mfs_t *mfs) {
+    compress_file_t *cf = mfs->file_clusters;
+    if(cf->dirty == NULL) {
+        return cf->size;
+    }
+
+    uint32_t cluster = cf->dirty->cluster;
+    return cf->size - (cluster < cf->count ? cf->raw_lens[cluster] : 0) + cf->dirty_len;
+}
+
+// Returns the least recently used cache entry, claimed for the given cluster. The dirty cluster is never taken.
+cluster_cache_entry_t *compress_cache_claim(compress_file_t *cf, uint32_t cluster) {
+    cluster_cache_entry_t *victim = cf->dirty == &cf->cache[0] ? &cf->cache[1] : &cf->cache[0];
+    for(int i = 1; i < CLUSTER_CACHE_ENTRIES; i++) {
+        cluster_cache_entry_t *entry = &cf->cache[i];
+        if(entry == cf->dirty) {
+            continue;
+        }
+        if(victim->valid && (!entry->valid || entry->last_used < victim->last_used)) {
+            victim = entry;
+        }
+    }
+
+    victim->valid = false;
+    victim->cluster = cluster;
+    victim->last_used = ++cf->clock;
+
+    return victim;
+}
+
+// Returns the decompressed data of a cluster, from the cache if possible
+uint8_t *compress_load_cluster(mfs_t *mfs, uint32_t cluster) {
+    compress_file_t *cf = mfs->file_clusters;
+
+    for(int i = 0; i < CLUSTER_CACHE_ENTRIES; i++) {
+        cluster_cache_entry_t *entry = &cf->cache[i];
+        if(entry->valid && entry->cluster == cluster) {
+            entry->last_used = ++cf->clock;
+            return entry->data;
+        }
+    }
+
+    cluster_cache_entry_t *victim = compress_cache_claim(cf, cluster);
+
+    // Read the stored cluster block by block
+    uint16_t block_number = cf->starts[cluster];
+    for(uint16_t i = 0; i < cf->blocks[cluster]; i++) {
+        if(i > 0) {
+            block_number = get_block_next(mfs, block_number);
+        }
+        if(read_data(mfs, block_offset(mfs, block_number), cf->stored + (size_t) i * mfs->block_size, mfs->block_size)) {
+            return NULL;
+        }
+    }
+
+    uint32_t raw_len = read32(cf->stored, 0);
+    uint32_t stored_len = read32(cf->stored, 4);
+    uint8_t *payload = cf->stored + CLUSTER_HEADER_SIZE;
+
+    if(raw_len & CLUSTER_RAW) {
+        memcpy(victim->data, payload, raw_len & ~CLUSTER_RAW);
+    } else if(lz_decompress(payload, stored_len, victim->data, raw_len)) {
+        fprintf(stderr, "Corrupt cluster in block 0x%04x\n", cf->starts[cluster]);
+        return NULL;
+    }
+
+    victim->valid = true;
+
+    return victim->data;
+}
+
+// Compresses a cluster and writes it back, growing or shrinking its part of the chain to the number of blocks needed.
+// cluster may be one past the last cluster to append a new one.
+int compress_store_cluster(mfs_t *mfs, uint32_t cluster, const uint8_t *data, uint32_t raw_len) {
+    compress_file_t *cf = mfs->file_clusters;
+
+    uint8_t *payload = cf->stored + CLUSTER_HEADER_SIZE;
+    size_t stored_len = raw_len > 0 ? lz_compress(data, raw_len, payload, raw_len - 1) : 0;
+    if(stored_len == 0 && raw_len > 0) {
+        // Incompressible, store as is
+        memcpy(payload, data, raw_len);
+        stored_len = raw_len;
+        write32(cf->stored, 0, raw_len | CLUSTER_RAW);
+    } else {
+        write32(cf->stored, 0, raw_len);
+    }
+    write32(cf->stored, 4, (uint32_t) stored_len);
+
+    uint16_t needed = compress_stored_blocks(mfs, (uint32_t) stored_len);
+
+    uint16_t first;
+    uint16_t count;
+    if(cluster < cf->count) {
+        first = cf->starts[cluster];
+        count = cf->blocks[cluster];
+    } else {
+        // Append a block for the new cluster behind the last one
+        uint16_t last = compress_walk(mfs, cf->starts[cf->count - 1], cf->blocks[cf->count - 1]);
+        first = alloc_free_block(mfs, last, BLOCK_EOF, mfs->file_dir_block_number, mfs->file_goal_block_number);
+        if(first == 0 || set_block_next(mfs, last, first)) {
+            return -1;
+        }
+        count = 1;
+    }
+
+    uint16_t last = compress_walk(mfs, first, count);
+
+    while(count < needed) {
+        uint16_t next = get_block_next(mfs, last);
+        uint16_t block_number = alloc_free_block(mfs, last, next, mfs->file_dir_block_number, mfs->file_goal_block_number);
+        if(block_number == 0 || set_block_next(mfs, last, block_number)) {
+            return -1;
+        }
+        if(next != BLOCK_EOF && set_block_previous(mfs, next, block_number)) {
+            return -1;
+        }
+        last = block_number;
+        count++;
+    }
+
+    if(count > needed) {
+        // Unlink and free the blocks the cluster doesn't need anymore
+        uint16_t new_last = compress_walk(mfs, first, needed);
+        uint16_t rest = get_block_next(mfs, last);
+        uint16_t block_number = get_block_next(mfs, new_last);
+        while(block_number != rest) {
+            uint16_t next = get_block_next(mfs, block_number);
+            if(free_block(mfs, block_number)) {
+                return -1;
+            }
+            block_number = next;
+        }
+        if(set_block_next(mfs, new_last, rest)) {
+            return -1;
+        }
+        if(rest != BLOCK_EOF && set_block_previous(mfs, rest, new_last)) {
+            return -1;
+        }
+        count = needed;
+    }
+
+    size_t total = CLUSTER_HEADER_SIZE + stored_len;
+    uint16_t block_number = first;
+    for(uint16_t i = 0; i < count; i++) {
+        if(i > 0) {
+            block_number = get_block_next(mfs, block_number);
+        }
+        size_t done = (size_t) i * mfs->block_size;
+        uint16_t len = (uint16_t) (total - done < mfs->block_size ? total - done : mfs->block_size);
+        if(write_block_data(mfs, block_number, 0, cf->stored + done, len)) {
+            return -1;
+        }
+    }
+
+    if(cluster < cf->count) {
+        cf->size = cf->size - cf->raw_lens[cluster] + raw_len;
+        cf->blocks[cluster] = count;
+        cf->raw_lens[cluster] = raw_len;
+        return 0;
+    }
+
+    return compress_add_cluster(cf, first, count, raw_len);
+}
+
+int compress_seek(mfs_t *mfs, uint32_t pos) {
+    if(pos > compress_file_size(mfs)) {
+        fprintf(stderr, "Position %u is past the end of the file\n", pos);
+        return -1;
+    }
+
+    mfs->file_pos = pos;
+
+    return 0;
+}
+
+int compress_read(mfs_t *mfs, uint16_t len, uint8_t *buf) {
+    compress_file_t *cf = mfs->file_clusters;
+
+    if(mfs->file_pos + len > compress_file_size(mfs)) {
+        fprintf(stderr, "Reached EOF\n");
+        return -1;
+    }
+
+    uint16_t done = 0;
+    while(done < len) {
+        uint32_t cluster = mfs->file_pos / cf->cluster_size;
+        uint32_t offset = mfs->file_pos % cf->cluster_size;
+
+        uint8_t *data = compress_load_cluster(mfs, cluster);
+        if(data == NULL) {
+            return -1;
+        }
+
+        uint32_t n = compress_cluster_len(cf, cluster) - offset;
+        if(n > (uint32_t) (len - done)) n = len - done;
+
+        memcpy(buf + done, data + offset, n);
+        done += n;
+        mfs->file_pos += n;
+    }
+
+    return 0;
+}
+
+// Writes the whole file to a file descriptor, one decompressed cluster at a time
+int compress_export(mfs_t *mfs, int fd) {
+    compress_file_t *cf = mfs->file_clusters;
+
+    for(uint32_t cluster = 0; cluster < cf->count; cluster++) {
+        uint8_t *data = compress_load_cluster(mfs, cluster);
+        if(data == NULL || export_write(fd, data, cf->raw_lens[cluster])) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+bool compress_dirty(mfs_t *mfs) {
+    return mfs->file_clusters && mfs->file_clusters->dirty;
+}
+
+// Compresses and stores the cluster being written, if there is one. Called within an operation.
+int compress_flush(mfs_t *mfs) {
+    compress_file_t *cf = mfs->file_clusters;
+    if(cf == NULL || cf->dirty == NULL) {
+        return 0;
+    }
+
+    cluster_cache_entry_t *entry = cf->dirty;
+    cf->dirty = NULL;
+
+    if(compress_store_cluster(mfs, entry->cluster, entry->data, cf->dirty_len)) {
+        // The cached copy no longer matches what is on disk
+        entry->valid = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+int compress_write(mfs_t *mfs, uint16_t len, const uint8_t *buf) {
+    compress_file_t *cf = mfs->file_clusters;
+
+    uint16_t done = 0;
+    while(done < len) {
+        uint32_t cluster = mfs->file_pos / cf->cluster_size;
+        uint32_t offset = mfs->file_pos % cf->cluster_size;
+
+        if(cf->dirty && cf->dirty->cluster != cluster && compress_flush(mfs)) {
+            return -1;
+        }
+
+        if(cf->dirty == NULL && cluster < cf->count) {
+            uint8_t *data = compress_load_cluster(mfs, cluster);
+            if(data == NULL) {
+                return -1;
+            }
+            for(int i = 0; i < CLUSTER_CACHE_ENTRIES; i++) {
+                if(cf->cache[i].data == data) {
+                    cf->dirty = &cf->cache[i];
+                }
+            }
+            cf->dirty_len = cf->raw_lens[cluster];
+        } else if(cf->dirty == NULL) {
+            // Starting a new cluster
+            cf->dirty = compress_cache_claim(cf, cluster);
+            cf->dirty->valid = true;
+            cf->dirty_len = 0;
+        }
+
+        uint32_t n = cf->cluster_size - offset;
+        if(n > (uint32_t) (len - done)) n = len - done;
+
+        memcpy(cf->dirty->data + offset, buf + done, n);
+        if(offset + n > cf->dirty_len) {
+            cf->dirty_len = offset + n;
+        }
+
+        done += n;
+        mfs->file_pos += n;
+    }
+
+    return 0;
+}
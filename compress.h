@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mfs.h"
+
+// Compressed files: the data is split into clusters of cluster_blocks blocks, each compressed on its own
+
+int compress_format_file(mfs_t *mfs, uint16_t block_number);
+
+int compress_open(mfs_t *mfs, uint16_t block_number);
+void compress_close(mfs_t *mfs);
+
+uint32_t compress_file_size(mfs_t *mfs);
+int compress_seek(mfs_t *mfs, uint32_t pos);
+int compress_read(mfs_t *mfs, uint16_t len, uint8_t *buf);
+int compress_write(mfs_t *mfs, uint16_t len, const uint8_t *buf);
+bool compress_dirty(mfs_t *mfs);
+int compress_flush(mfs_t *mfs);
+int compress_export(mfs_t *mfs, int fd);
@@ -0,0 +1,368 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "util.h"
+#include "format.h"
+#include "blocks.h"
+#include "dircache.h"
+
+// Directories are kept compact: entries fill the chain from the start and removing one moves the last entry into its
+// slot. Entry i of a directory is therefore always at slot i % (block_size / DIR_ENTRY_SIZE) of chain block
+// i / (block_size / DIR_ENTRY_SIZE), and all that needs to be cached about a directory is its chain, its entry count
+// and a hash of every name. Creating and removing entries then only reads the entries whose hash matches and writes
+// the slots involved, instead of scanning the directory for the name and for its end.
+
+#define DIRCACHE_DIRS 32
+
+typedef struct {
+    bool valid;
+    uint16_t block_number;
+    uint64_t last_used;
+    // Name hashes in directory order
+    uint32_t *hashes;
+    uint32_t count;
+    uint32_t capacity;
+    // The blocks of the chain, including empty ones behind the last entry
+    uint16_t *blocks;
+    uint32_t block_count;
+    uint32_t block_capacity;
+} dircache_dir_t;
+
+struct dircache {
+    dircache_dir_t dirs[DIRCACHE_DIRS];
+    size_t budget;
+    size_t used;
+    uint64_t clock;
+};
+
+static inline uint32_t dircache_hash(const char *name, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static inline size_t dircache_dir_size(const dircache_dir_t *dir) {
+    return dir->capacity * sizeof(*dir->hashes) + dir->block_capacity * sizeof(*dir->blocks);
+}
+
+int dircache_open(mfs_t *mfs, unsigned int budget_kb) {
+    dircache_t *cache = calloc(1, sizeof(*cache));
+    if(cache == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    cache->budget = (size_t) budget_kb * 1024u;
+    mfs->dircache = cache;
+
+    return 0;
+}
+
+void dircache_drop(dircache_t *cache, dircache_dir_t *dir) {
+    cache->used -= dircache_dir_size(dir);
+    free(dir->hashes);
+    free(dir->blocks);
+    memset(dir, 0, sizeof(*dir));
+}
+
+void dircache_free(mfs_t *mfs) {
+    if(mfs->dircache == NULL) {
+        return;
+    }
+
+    dircache_clear(mfs);
+    free(mfs->dircache);
+    mfs->dircache = NULL;
+}
+
+// Forgets all directories, for changes that aren't tracked one by one
+void dircache_clear(mfs_t *mfs) {
+    dircache_t *cache = mfs->dircache;
+    if(cache == NULL) {
+        return;
+    }
+
+    for(int i = 0; i < DIRCACHE_DIRS; i++) {
+        if(cache->dirs[i].valid) {
+            dircache_drop(cache, &cache->dirs[i]);
+        }
+    }
+}
+
+dircache_dir_t *dircache_find(dircache_t *cache, uint16_t block_number) {
+    for(int i = 0; i < DIRCACHE_DIRS; i++) {
+        if(cache->dirs[i].valid && cache->dirs[i].block_number == block_number) {
+            return &cache->dirs[i];
+        }
+    }
+    return NULL;
+}
+
+// Forgets a directory that was changed behind the cache's back or removed
+void dircache_forget(mfs_t *mfs, uint16_t block_number) {
+    dircache_t *cache = mfs->dircache;
+    if(cache == NULL) {
+        return;
+    }
+
+    dircache_dir_t *dir = dircache_find(cache, block_number);
+    if(dir) {
+        dircache_drop(cache, dir);
+    }
+}
+
+// Forgets the directories whose first block has been freed, after removing a directory or a whole tree
+void dircache_forget_freed(mfs_t *mfs) {
+    dircache_t *cache = mfs->dircache;
+    if(cache == NULL) {
+        return;
+    }
+
+    for(int i = 0; i < DIRCACHE_DIRS; i++) {
+        dircache_dir_t *dir = &cache->dirs[i];
+        if(dir->valid && get_block_next(mfs, dir->block_number) == BLOCK_UNUSED) {
+            dircache_drop(cache, dir);
+        }
+    }
+}
+
+// Makes room for size more bytes by dropping the least recently used directories other than keep
+bool dircache_reserve(dircache_t *cache, size_t size, const dircache_dir_t *keep) {
+    while(cache->used + size > cache->budget) {
+        dircache_dir_t *victim = NULL;
+        for(int i = 0; i < DIRCACHE_DIRS; i++) {
+            dircache_dir_t *dir = &cache->dirs[i];
+            if(dir->valid && dir != keep && (victim == NULL || dir->last_used < victim->last_used)) {
+                victim = dir;
+            }
+        }
+        if(victim == NULL) {
+            return false;
+        }
+        dircache_drop(cache, victim);
+    }
+    return true;
+}
+
+// Grows the arrays of a directory to hold count entries in block_count blocks
+bool dircache_grow(dircache_t *cache, dircache_dir_t *dir, uint32_t count, uint32_t block_count) {
+    uint32_t capacity = dir->capacity;
+    while(capacity < count) {
+        capacity = capacity ? capacity * 2 : 64;
+    }
+    uint32_t block_capacity = dir->block_capacity;
+    while(block_capacity < block_count) {
+        block_capacity = block_capacity ? block_capacity * 2 : 8;
+    }
+    if(capacity == dir->capacity && block_capacity == dir->block_capacity) {
+        return true;
+    }
+
+    size_t old_size = dircache_dir_size(dir);
+    size_t new_size = capacity * sizeof(*dir->hashes) + block_capacity * sizeof(*dir->blocks);
+    if(!dircache_reserve(cache, new_size - old_size, dir)) {
+        return false;
+    }
+
+    uint32_t *hashes = realloc(dir->hashes, sizeof(*hashes) * capacity);
+    if(hashes) dir->hashes = hashes;
+    uint16_t *blocks = realloc(dir->blocks, sizeof(*blocks) * block_capacity);
+    if(blocks) dir->blocks = blocks;
+    if(hashes == NULL || blocks == NULL) {
+        perror("Memory allocation failed");
+        return false;
+    }
+
+    dir->capacity = capacity;
+    dir->block_capacity = block_capacity;
+    cache->used += new_size - old_size;
+
+    return true;
+}
+
+// Reads a directory into a free slot of the cache. Returns NULL if it is larger than the whole cache.
+dircache_dir_t *dircache_load(mfs_t *mfs, uint16_t block_number) {
+    dircache_t *cache = mfs->dircache;
+
+    dircache_dir_t *dir = NULL;
+    for(int i = 0; i < DIRCACHE_DIRS && dir == NULL; i++) {
+        if(!cache->dirs[i].valid) {
+            dir = &cache->dirs[i];
+        }
+    }
+    if(dir == NULL) {
+        // Take the slot of the least recently used directory
+        dir = &cache->dirs[0];
+        for(int i = 1; i < DIRCACHE_DIRS; i++) {
+            if(cache->dirs[i].last_used < dir->last_used) {
+                dir = &cache->dirs[i];
+            }
+        }
+        dircache_drop(cache, dir);
+    }
+
+    dir->valid = true;
+    dir->block_number = block_number;
+
+    directory_iterator_t it;
+    if(open_directory_iterator(&it, mfs, block_number)) {
+        dircache_drop(cache, dir);
+        return NULL;
+    }
+
+    bool ok = dircache_grow(cache, dir, 1, 1);
+    if(ok) {
+        dir->blocks[dir->block_count++] = block_number;
+    }
+
+    while(ok && next_directory_entry(&it)) {
+        if(it.block_number != dir->blocks[dir->block_count - 1]) {
+            ok = dircache_grow(cache, dir, dir->count + 1, dir->block_count + 1);
+            if(!ok) {
+                break;
+            }
+            dir->blocks[dir->block_count++] = it.block_number;
+        }
+        ok = dircache_grow(cache, dir, dir->count + 1, dir->block_count);
+        if(ok) {
+            dir->hashes[dir->count++] = dircache_hash(it.entry.name, strnlen(it.entry.name, PATH_SEG_MAX));
+        }
+    }
+
+    // Empty blocks behind the end, the chain is only read from the alloc table. A chain running into an unused block
+    // is broken and isn't cached.
+    uint16_t next = get_block_next(mfs, dir->blocks[dir->block_count - 1]);
+    if(ok && it.reached_eof) {
+        next = BLOCK_EOF;
+    }
+    if(ok && it.entry_addr == 0 && it.block_number != dir->blocks[dir->block_count - 1]) {
+        // The end slot opens the block after the last entry
+        next = it.block_number;
+    }
+    while(ok && next != BLOCK_EOF && next != BLOCK_UNUSED) {
+        ok = dircache_grow(cache, dir, dir->count, dir->block_count + 1);
+        if(ok) {
+            dir->blocks[dir->block_count++] = next;
+            next = get_block_next(mfs, next);
+        }
+    }
+
+    close_directory_iterator(&it);
+
+    if(!ok || next == BLOCK_UNUSED) {
+        dircache_drop(cache, dir);
+        return NULL;
+    }
+
+    return dir;
+}
+
+static inline uint32_t dircache_per_block(mfs_t *mfs) {
+    return mfs->block_size / DIR_ENTRY_SIZE;
+}
+
+static inline void dircache_slot(mfs_t *mfs, const dircache_dir_t *dir, uint32_t index, uint16_t *block_out, uint16_t *addr_out) {
+    *block_out = dir->blocks[index / dircache_per_block(mfs)];
+    *addr_out = (uint16_t) (index % dircache_per_block(mfs) * DIR_ENTRY_SIZE);
+}
+
+// Looks a name up in the directory starting at block_number, loading the directory into the cache first if needed.
+// Returns false if the directory can't be cached, the caller has to scan it then.
+bool dircache_lookup(mfs_t *mfs, uint16_t block_number, const char *name, size_t name_len, dircache_lookup_t *out) {
+    dircache_t *cache = mfs->dircache;
+    if(cache == NULL) {
+        return false;
+    }
+
+    dircache_dir_t *dir = dircache_find(cache, block_number);
+    if(dir == NULL) {
+        dir = dircache_load(mfs, block_number);
+        if(dir == NULL) {
+            return false;
+        }
+    }
+    dir->last_used = ++cache->clock;
+
+    out->found = false;
+
+    uint32_t hash = dircache_hash(name, name_len);
+    for(uint32_t i = 0; i < dir->count; i++) {
+        if(dir->hashes[i] != hash) {
+            continue;
+        }
+
+        // Only entries with the same hash are read, to rule out collisions
+        uint16_t slot_block, slot_addr;
+        dircache_slot(mfs, dir, i, &slot_block, &slot_addr);
+        uint8_t entry[DIR_ENTRY_SIZE];
+        if(read_metadata(mfs, block_offset(mfs, slot_block) + slot_addr, entry, DIR_ENTRY_SIZE)) {
+            dircache_drop(cache, dir);
+            return false;
+        }
+
+        const char *entry_name = (const char *) &entry[DIR_ENTRY_NAME_OFFSET];
+        if(strncmp(entry_name, name, name_len) == 0 && entry_name[name_len] == '\0') {
+            out->found = true;
+            out->index = i;
+            out->type = read16(entry, 0);
+            out->block_number = read16(entry, 2);
+            out->slot_block = slot_block;
+            out->slot_addr = slot_addr;
+            break;
+        }
+    }
+
+    if(dir->count > 0) {
+        dircache_slot(mfs, dir, dir->count - 1, &out->last_block, &out->last_addr);
+    }
+
+    out->full = dir->count == dir->block_count * dircache_per_block(mfs);
+    if(out->full) {
+        out->end_block = dir->blocks[dir->block_count - 1];
+        out->end_addr = 0;
+    } else {
+        dircache_slot(mfs, dir, dir->count, &out->end_block, &out->end_addr);
+    }
+
+    return true;
+}
+
+// Records an entry written to the end slot. new_block is the block appended to the chain for it if the chain was full.
+void dircache_added(mfs_t *mfs, uint16_t block_number, const char *name, size_t name_len, uint16_t new_block) {
+    dircache_t *cache = mfs->dircache;
+    dircache_dir_t *dir = cache ? dircache_find(cache, block_number) : NULL;
+    if(dir == NULL) {
+        return;
+    }
+
+    bool full = dir->count == dir->block_count * dircache_per_block(mfs);
+    if(!dircache_grow(cache, dir, dir->count + 1, dir->block_count + (full ? 1 : 0))) {
+        dircache_drop(cache, dir);
+        return;
+    }
+
+    if(full) {
+        dir->blocks[dir->block_count++] = new_block;
+    }
+    dir->hashes[dir->count++] = dircache_hash(name, name_len);
+}
+
+// Records that the entry at index was removed and the last entry moved into its slot
+void dircache_removed(mfs_t *mfs, uint16_t block_number, uint32_t index) {
+    dircache_t *cache = mfs->dircache;
+    dircache_dir_t *dir = cache ? dircache_find(cache, block_number) : NULL;
+    if(dir == NULL || index >= dir->count) {
+        return;
+    }
+
+    dir->hashes[index] = dir->hashes[dir->count - 1];
+    dir->count--;
+}
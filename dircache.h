@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mfs.h"
+
+typedef struct {
+    bool found;
+    // The entry with the name, if found
+    uint32_t index;
+    uint16_t type;
+    uint16_t block_number;
+    uint16_t slot_block;
+    uint16_t slot_addr;
+    // The last entry of the directory, if it has any
+    uint16_t last_block;
+    uint16_t last_addr;
+    // The slot a new entry goes into. If the chain is full, a new block has to be appended behind end_block first.
+    uint16_t end_block;
+    uint16_t end_addr;
+    bool full;
+} dircache_lookup_t;
+
+int dircache_open(mfs_t *mfs, unsigned int budget_kb);
+void dircache_free(mfs_t *mfs);
+
+bool dircache_lookup(mfs_t *mfs, uint16_t block_number, const char *name, size_t name_len, dircache_lookup_t *out);
+void dircache_added(mfs_t *mfs, uint16_t block_number, const char *name, size_t name_len, uint16_t new_block);
+void dircache_removed(mfs_t *mfs, uint16_t block_number, uint32_t index);
+
+void dircache_forget(mfs_t *mfs, uint16_t block_number);
+void dircache_forget_freed(mfs_t *mfs);
+void dircache_clear(mfs_t *mfs);
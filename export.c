@@ -0,0 +1,223 @@
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+#include "format.h"
+#include "blocks.h"
+#include "compress.h"
+#include "stripe.h"
+#include "export.h"
+#include "writeback.h"
+
+// Exporting a file sends its contents to a file descriptor. Every physically contiguous run of blocks is moved from the
+// image to the descriptor by the kernel with sendfile() or splice(), so no data passes through user space. Only holes
+// and compressed files, which have no bytes in the image to send, are written from memory.
+
+#define EXPORT_ZERO_SIZE 4096
+
+static const uint8_t export_zeros[EXPORT_ZERO_SIZE];
+
+int export_write(int fd, const uint8_t *buf, size_t len) {
+    while(len > 0) {
+        ssize_t written = write(fd, buf, len);
+        if(written < 0 && errno == EINTR) {
+            continue;
+        }
+        if(written <= 0) {
+            perror("Failed to write output");
+            return -1;
+        }
+        buf += written;
+        len -= (size_t) written;
+    }
+
+    return 0;
+}
+
+int export_zeros_to(int fd, size_t len) {
+    while(len > 0) {
+        size_t chunk = len < EXPORT_ZERO_SIZE ? len : EXPORT_ZERO_SIZE;
+        if(export_write(fd, export_zeros, chunk)) {
+            return -1;
+        }
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+// Copies through a buffer, for descriptors neither sendfile() nor splice() can write to
+int export_copy(mfs_t *mfs, int fd, int in_fd, off_t offset, size_t len) {
+    uint8_t *buf = scratch_get(mfs, mfs->block_size);
+    if(buf == NULL) {
+        return -1;
+    }
+
+    while(len > 0) {
+        size_t chunk = len < mfs->block_size ? len : mfs->block_size;
+        ssize_t got = pread(in_fd, buf, chunk, offset);
+        if(got < 0 && errno == EINTR) {
+            continue;
+        }
+        if(got <= 0) {
+            perror("Failed to read image");
+            scratch_put(mfs, buf);
+            return -1;
+        }
+        if(export_write(fd, buf, (size_t) got)) {
+            scratch_put(mfs, buf);
+            return -1;
+        }
+        offset += got;
+        len -= (size_t) got;
+    }
+
+    scratch_put(mfs, buf);
+    return 0;
+}
+
+// Sends len bytes at offset of in_fd to fd
+int export_send(mfs_t *mfs, int fd, int in_fd, off_t offset, size_t len) {
+    bool use_splice = false;
+    while(len > 0) {
+        ssize_t sent = use_splice ? splice(in_fd, &offset, fd, NULL, len, SPLICE_F_MORE)
+                                  : sendfile(fd, in_fd, &offset, len);
+        if(sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if(sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            // sendfile() does not write to every kind of descriptor, splice() takes pipes and copying takes anything
+            if(!use_splice) {
+                use_splice = true;
+                continue;
+            }
+            return export_copy(mfs, fd, in_fd, offset, len);
+        }
+        if(sent <= 0) {
+            perror(use_splice ? "splice() failed" : "sendfile() failed");
+            return -1;
+        }
+        len -= (size_t) sent;
+    }
+
+    return 0;
+}
+
+// Sends a range of the image, which may be spread over the member files of a striped image
+int export_range(mfs_t *mfs, int fd, size_t offset, size_t len) {
+    if(mfs->stripe == NULL) {
+        return export_send(mfs, fd, fileno(mfs->f), (off_t) offset, len);
+    }
+
+    while(len > 0) {
+        uint16_t member;
+        off_t member_offset;
+        size_t chunk = stripe_locate(mfs, offset, len, &member, &member_offset);
+        if(export_send(mfs, fd, stripe_member_fd(mfs, member), member_offset, chunk)) {
+            return -1;
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+int export_chain(mfs_t *mfs, uint16_t block_number, int fd) {
+    // Everything written so far has to be in the image before the kernel reads it
+    if(writeback_drain(mfs) || fflush(mfs->f)) {
+        perror("Flush failed");
+        return -1;
+    }
+
+    size_t run_offset = 0;
+    size_t run_length = 0;
+    while(block_number != BLOCK_EOF) {
+        uint32_t hole = file_block_hole(mfs, block_number);
+        if(hole > 0) {
+            if(run_length > 0 && export_range(mfs, fd, run_offset, run_length)) {
+                return -1;
+            }
+            run_length = 0;
+            if(export_zeros_to(fd, block_bytes(mfs, hole))) {
+                return -1;
+            }
+        } else {
+            size_t offset = block_offset(mfs, block_number);
+            if(run_length > 0 && offset == run_offset + run_length) {
+                run_length += mfs->block_size;
+            } else {
+                if(run_length > 0 && export_range(mfs, fd, run_offset, run_length)) {
+                    return -1;
+                }
+                run_offset = offset;
+                run_length = mfs->block_size;
+            }
+        }
+
+        block_number = get_block_next(mfs, block_number);
+    }
+
+    if(run_length > 0 && export_range(mfs, fd, run_offset, run_length)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Compressed files have to be decompressed on the way out. Clusters are written from the cluster cache.
+int export_compressed(mfs_t *mfs, uint16_t block_number, int fd) {
+    if(mfs->file_open) {
+        fprintf(stderr, "Close the open file before exporting a compressed file\n");
+        return -1;
+    }
+
+    if(compress_open(mfs, block_number)) {
+        return -1;
+    }
+
+    int ret = compress_export(mfs, fd);
+
+    compress_close(mfs);
+    return ret;
+}
+
+int mfs_export(mfs_t *mfs, const char *path, int fd) {
+    uint16_t dir_block_number = 0;
+    uint16_t block_number = 0;
+    uint16_t type = 0;
+    if(find_file(mfs, path, &dir_block_number, &block_number, &type)) {
+        return -1;
+    }
+
+    if(type & ENTRY_FLAG_COMPRESSED) {
+        return export_compressed(mfs, block_number, fd);
+    }
+
+    return export_chain(mfs, block_number, fd);
+}
+
+int mfs_export_file(mfs_t *mfs, const char *path, const char *filename) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0) {
+        perror("Failed to open output file");
+        return -1;
+    }
+
+    int ret = mfs_export(mfs, path, fd);
+
+    if(close(fd)) {
+        perror("Failed to close output file");
+        ret = -1;
+    }
+
+    return ret;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mfs.h"
+
+int mfs_export(mfs_t *mfs, const char *path, int fd);
+int mfs_export_file(mfs_t *mfs, const char *path, const char *filename);
+
+int export_write(int fd, const uint8_t *buf, size_t len);
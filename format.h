@@ -0,0 +1,101 @@
+#pragma once
+
+#define BLOCK_UNUSED 0x0000
+#define BLOCK_EOF 0xFFFF
+
+#define MFS_TYPE_END 0
+#define MFS_TYPE_DIRECTORY 1
+#define MFS_TYPE_FILE 2
+
+#define ALLOC_TABLE_ENTRY_SIZE 4u
+
+#define DIR_ENTRY_SIZE 16
+#define DIR_ENTRY_NAME_OFFSET 4
+#define PATH_SEG_MAX (DIR_ENTRY_SIZE - DIR_ENTRY_NAME_OFFSET)
+
+// Version 1 images start with a 4 byte header holding only the block size and count. Later versions start with a
+// magic number that is never a valid block size, followed by the version and the rest of the superblock.
+#define MFS_MAGIC 0x464D
+#define MFS_VERSION 2
+
+#define SUPERBLOCK_V1_SIZE 4
+#define SUPERBLOCK_SIZE 64
+
+#define SB_MAGIC 0
+#define SB_VERSION 2
+#define SB_BLOCK_SIZE 4
+#define SB_BLOCK_COUNT 6
+#define SB_JOURNAL_BLOCKS 8
+
+// The journal follows the data blocks: a header, then a circular log of transaction records
+#define JOURNAL_MAGIC 0x4C4E524Au
+#define JOURNAL_RECORD_MAGIC 0x5458524Au
+
+#define JOURNAL_HEADER_SIZE 16
+#define JH_MAGIC 0
+#define JH_TAIL 4
+#define JH_TAIL_SEQ 8
+
+// Record: magic, length, sequence, writes (offset, length, data), checksum over everything before it
+#define JOURNAL_RECORD_HEADER_SIZE 16
+#define JOURNAL_WRITE_HEADER_SIZE 10
+#define JOURNAL_CHECKSUM_SIZE 4
+
+#define JOURNAL_DEFAULT_SIZE 4096
+#define JOURNAL_MIN_LOG_SIZE 512
+
+#define SB_FEATURES 10
+#define SB_CLUSTER_BLOCKS 12
+
+// New files are compressed
+#define FEATURE_COMPRESS 0x0001
+
+// The high byte of an entry's type field holds flags
+#define ENTRY_TYPE(type) ((type) & 0x00FF)
+#define ENTRY_FLAG_COMPRESSED 0x0100
+
+// Compressed files are stored as a sequence of clusters. Each starts a block with a header (raw length with
+// CLUSTER_RAW set if the data is stored uncompressed, stored length), followed by the data in as many blocks as needed.
+#define CLUSTER_BLOCKS 8
+#define CLUSTER_HEADER_SIZE 8
+#define CLUSTER_RAW 0x80000000u
+#define CLUSTER_MAX_SIZE (1u << 20)
+
+#define SB_BLOCK_MAP_BASE 16
+// First block of the directory listing the snapshots, 0 if there are none
+#define SB_SNAPSHOTS 24
+
+// With FEATURE_RELOCATED set, the alloc table, the data blocks and the journal are where these fields say instead of
+// following each other. Resizing moves the metadata behind the last data block, so the data never has to move.
+#define SB_ALLOC_TABLE_BASE 32
+#define SB_BLOCKS_BASE 40
+#define SB_JOURNAL_BASE 48
+
+// Chain blocks (alloc table and block map entries) on images with a block map. Chain blocks can share data blocks, so
+// there may be more of them than SB_BLOCK_COUNT data blocks. 0 means as many as there are data blocks.
+#define SB_CHAIN_BLOCKS 56
+// First block of the table of chains that several directory entries refer to, 0 if there is none (see share.c)
+#define SB_SHARED 58
+// First block of the table of holes on images without a block map, 0 if there is none (see hole.c)
+#define SB_HOLES 60
+
+// Chain blocks refer to the physical block holding their data through the block map, so several can share one
+#define FEATURE_BLOCK_MAP 0x0002
+// Data blocks with identical contents share one physical block
+#define FEATURE_DEDUP 0x0004
+// The image has been resized, see SB_ALLOC_TABLE_BASE
+#define FEATURE_RELOCATED 0x0008
+
+// Block map entry n: the physical block of chain block n, the number of chain blocks referring to physical block n
+// and the hash of its contents (0 if it isn't in the dedup index)
+#define BLOCK_MAP_ENTRY_SIZE 12
+#define BM_PHYSICAL 0
+#define BM_REFS 2
+#define BM_HASH 4
+// A chain block whose physical block has this bit set in the hash field is a hole: a run of as many blocks as the rest
+// of the field says that read as zeros. The physical block itself is never written.
+#define BM_HASH_HOLE 0x8000000000000000u
+// The data blocks are spread over SB_STRIPES member files in units of SB_STRIPE_UNIT blocks, see stripe.c
+#define FEATURE_STRIPED 0x0010
+#define SB_STRIPES 26
+#define SB_STRIPE_UNIT 28
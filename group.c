@@ -0,0 +1,196 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "blocks.h"
+#include "group.h"
+#include "stripe.h"
+#include "writeback.h"
+
+// With durability=group, operations complete without waiting for the disk and are made durable together. A group is
+// closed by the operation that fills it, or by a background thread once the oldest operation in it has waited for the
+// window, so the last operations of a burst become durable without waiting for more traffic. Every operation's writes
+// reach the kernel before it is counted, which leaves the thread only the writeback buffer and fdatasync() to do.
+
+struct group {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // Signalled when a group opens and when the thread has to stop
+    pthread_cond_t wake;
+    bool stop;
+};
+
+static inline void group_lock(mfs_t *mfs) {
+    if(mfs->group) {
+        pthread_mutex_lock(&mfs->group->lock);
+    }
+}
+
+static inline void group_unlock(mfs_t *mfs) {
+    if(mfs->group) {
+        pthread_mutex_unlock(&mfs->group->lock);
+    }
+}
+
+// Syncs the image and its members directly on their descriptors, which is safe beside the thread running operations
+int group_sync(mfs_t *mfs) {
+    if(writeback_drain(mfs)) {
+        return -1;
+    }
+
+    if(fdatasync(fileno(mfs->f))) {
+        perror("fdatasync() failed");
+        return -1;
+    }
+
+    for(uint16_t i = 0; i < stripe_members(mfs); i++) {
+        if(fdatasync(stripe_member_fd(mfs, i))) {
+            perror("fdatasync() failed");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void *group_thread(void *arg) {
+    mfs_t *mfs = arg;
+    group_t *group = mfs->group;
+
+    pthread_mutex_lock(&group->lock);
+    while(!group->stop) {
+        if(mfs->group_pending == 0) {
+            pthread_cond_wait(&group->wake, &group->lock);
+            continue;
+        }
+
+        uint64_t now = monotonic_ms();
+        uint64_t deadline_ms = mfs->group_start_ms + mfs->group_window_ms;
+        if(now < deadline_ms) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += (time_t) ((deadline_ms - now) / 1000u);
+            deadline.tv_nsec += (long) ((deadline_ms - now) % 1000u) * 1000000L;
+            if(deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&group->wake, &group->lock, &deadline);
+            continue;
+        }
+
+        // The window is over, close the group
+        uint64_t op = mfs->last_op;
+        mfs->group_pending = 0;
+        pthread_mutex_unlock(&group->lock);
+
+        int ret = group_sync(mfs);
+
+        pthread_mutex_lock(&group->lock);
+        if(ret == 0 && op > mfs->durable_op) {
+            mfs->durable_op = op;
+        }
+    }
+    pthread_mutex_unlock(&group->lock);
+
+    return NULL;
+}
+
+int group_open(mfs_t *mfs) {
+    group_t *group = calloc(1, sizeof(*group));
+    if(group == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->wake, NULL);
+
+    mfs->group = group;
+
+    if(pthread_create(&group->thread, NULL, group_thread, mfs)) {
+        fprintf(stderr, "Failed to start the group commit thread\n");
+        pthread_cond_destroy(&group->wake);
+        pthread_mutex_destroy(&group->lock);
+        free(group);
+        mfs->group = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Stops the thread. A group still open is left to the caller to commit.
+void group_free(mfs_t *mfs) {
+    group_t *group = mfs->group;
+    if(group == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&group->lock);
+    group->stop = true;
+    pthread_cond_signal(&group->wake);
+    pthread_mutex_unlock(&group->lock);
+    pthread_join(group->thread, NULL);
+
+    pthread_cond_destroy(&group->wake);
+    pthread_mutex_destroy(&group->lock);
+    free(group);
+    mfs->group = NULL;
+}
+
+// Counts a completed operation into the open group, opening one if needed. Returns true once the group is full.
+bool group_add(mfs_t *mfs) {
+    group_lock(mfs);
+    mfs->last_op++;
+    if(mfs->group_pending == 0) {
+        mfs->group_start_ms = monotonic_ms();
+        if(mfs->group) {
+            pthread_cond_signal(&mfs->group->wake);
+        }
+    }
+    mfs->group_pending++;
+    bool full = mfs->group_pending >= mfs->group_max_ops;
+    group_unlock(mfs);
+
+    return full;
+}
+
+// Counts a completed operation outside of groups
+void group_count(mfs_t *mfs) {
+    group_lock(mfs);
+    mfs->last_op++;
+    group_unlock(mfs);
+}
+
+// Closes the open group before syncing, returning the last operation the sync makes durable
+uint64_t group_close(mfs_t *mfs) {
+    group_lock(mfs);
+    uint64_t op = mfs->last_op;
+    mfs->group_pending = 0;
+    group_unlock(mfs);
+
+    return op;
+}
+
+void group_durable(mfs_t *mfs, uint64_t op) {
+    group_lock(mfs);
+    if(op > mfs->durable_op) {
+        mfs->durable_op = op;
+    }
+    group_unlock(mfs);
+}
+
+uint64_t group_durable_op(mfs_t *mfs) {
+    group_lock(mfs);
+    uint64_t op = mfs->durable_op;
+    group_unlock(mfs);
+
+    return op;
+}
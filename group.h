@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mfs.h"
+
+int group_open(mfs_t *mfs);
+void group_free(mfs_t *mfs);
+
+bool group_add(mfs_t *mfs);
+void group_count(mfs_t *mfs);
+uint64_t group_close(mfs_t *mfs);
+void group_durable(mfs_t *mfs, uint64_t op);
+uint64_t group_durable_op(mfs_t *mfs);
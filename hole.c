@@ -0,0 +1,249 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "util.h"
+#include "format.h"
+#include "blocks.h"
+#include "hole.h"
+
+// Without a block map, a chain block is its own physical block and has nowhere to say that it stands for a hole. The
+// chain blocks that do are listed in a table of (chain block, length in blocks) pairs, in a chain of its own that
+// SB_HOLES points to; the first pair with a zero chain block ends the table. Their data blocks are never written. The
+// table is kept in memory while the image is open.
+
+#define HOLE_ENTRY_SIZE 6
+// Position of a chain block in the table plus one
+#define HOLE_SLOTS 0x10000
+
+struct holes {
+    uint16_t *chains;
+    uint32_t *lengths;
+    uint32_t count;
+    uint32_t capacity;
+    // Blocks of the table's chain
+    uint16_t *blocks;
+    uint32_t block_count;
+    uint32_t *slots;
+};
+
+uint32_t holes_per_block(mfs_t *mfs) {
+    return mfs->block_size / HOLE_ENTRY_SIZE;
+}
+
+int holes_grow(holes_t *holes, uint32_t count, uint32_t block_count) {
+    if(count > holes->capacity) {
+        uint32_t capacity = holes->capacity ? holes->capacity * 2 : 64;
+        while(capacity < count) {
+            capacity *= 2;
+        }
+        uint16_t *chains = realloc(holes->chains, sizeof(*chains) * capacity);
+        if(chains) holes->chains = chains;
+        uint32_t *lengths = realloc(holes->lengths, sizeof(*lengths) * capacity);
+        if(lengths) holes->lengths = lengths;
+        if(chains == NULL || lengths == NULL) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        holes->capacity = capacity;
+    }
+
+    uint16_t *blocks = realloc(holes->blocks, sizeof(*blocks) * (block_count ? block_count : 1));
+    if(blocks == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    holes->blocks = blocks;
+
+    return 0;
+}
+
+holes_t *holes_new(void) {
+    holes_t *holes = calloc(1, sizeof(*holes));
+    if(holes == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    holes->slots = calloc(HOLE_SLOTS, sizeof(*holes->slots));
+    if(holes->slots == NULL) {
+        perror("Memory allocation failed");
+        free(holes);
+        return NULL;
+    }
+
+    return holes;
+}
+
+// Reads the table starting at block_number
+int holes_open(mfs_t *mfs, uint16_t block_number) {
+    holes_t *holes = holes_new();
+    if(holes == NULL) {
+        return -1;
+    }
+    mfs->holes = holes;
+
+    uint8_t *block = malloc(sizeof(*block) * mfs->block_size);
+    if(block == NULL) {
+        perror("Memory allocation failed");
+        holes_free(mfs);
+        return -1;
+    }
+
+    bool ended = false;
+    while(block_number != BLOCK_EOF) {
+        if(block_number >= mfs->block_count || holes->block_count == mfs->block_count) {
+            fprintf(stderr, "Chain of holes through block 0x%04x is broken\n", block_number);
+            free(block);
+            holes_free(mfs);
+            return -1;
+        }
+
+        if(holes_grow(holes, holes->count + holes_per_block(mfs), holes->block_count + 1) || read_block(mfs, block_number, block)) {
+            free(block);
+            holes_free(mfs);
+            return -1;
+        }
+        holes->blocks[holes->block_count++] = block_number;
+
+        for(uint32_t i = 0; !ended && i < holes_per_block(mfs); i++) {
+            uint16_t chain = read16(block, i * HOLE_ENTRY_SIZE);
+            if(chain == 0) {
+                ended = true;
+            } else {
+                holes->chains[holes->count] = chain;
+                holes->lengths[holes->count] = read32(block, i * HOLE_ENTRY_SIZE + 2);
+                holes->slots[chain] = ++holes->count;
+            }
+        }
+
+        block_number = get_block_next(mfs, block_number);
+    }
+
+    free(block);
+
+    return 0;
+}
+
+void holes_free(mfs_t *mfs) {
+    holes_t *holes = mfs->holes;
+    if(holes == NULL) {
+        return;
+    }
+
+    free(holes->chains);
+    free(holes->lengths);
+    free(holes->blocks);
+    free(holes->slots);
+    free(holes);
+    mfs->holes = NULL;
+}
+
+// Returns the length of the hole a chain block stands for, 0 if it holds data
+uint32_t holes_blocks(mfs_t *mfs, uint16_t block_number) {
+    if(mfs->holes == NULL || mfs->holes->slots[block_number] == 0) {
+        return 0;
+    }
+
+    return mfs->holes->lengths[mfs->holes->slots[block_number] - 1];
+}
+
+int holes_store(mfs_t *mfs, uint32_t slot) {
+    holes_t *holes = mfs->holes;
+    uint8_t entry[HOLE_ENTRY_SIZE] = { 0 };
+    if(slot < holes->count) {
+        write16(entry, 0, holes->chains[slot]);
+        write32(entry, 2, holes->lengths[slot]);
+    }
+
+    uint16_t block_number = holes->blocks[slot / holes_per_block(mfs)];
+    size_t offset = block_offset(mfs, block_number) + (slot % holes_per_block(mfs)) * HOLE_ENTRY_SIZE;
+
+    return write_metadata(mfs, offset, entry, HOLE_ENTRY_SIZE);
+}
+
+// Appends a block to the table, creating it first if the image has none
+int holes_add_block(mfs_t *mfs) {
+    if(mfs->holes == NULL) {
+        mfs->holes = holes_new();
+        if(mfs->holes == NULL) {
+            return -1;
+        }
+    }
+
+    holes_t *holes = mfs->holes;
+    if(holes_grow(holes, holes->count, holes->block_count + 1)) {
+        return -1;
+    }
+
+    uint16_t previous = holes->block_count > 0 ? holes->blocks[holes->block_count - 1] : BLOCK_EOF;
+    uint16_t block_number = alloc_free_block(mfs, previous, BLOCK_EOF, 0, 0);
+    if(block_number == 0 || zero_block(mfs, block_number)) {
+        return -1;
+    }
+
+    if(previous == BLOCK_EOF) {
+        uint8_t field[2];
+        write16(field, 0, block_number);
+        if(write_metadata(mfs, SB_HOLES, field, sizeof(field))) {
+            return -1;
+        }
+    } else if(set_block_next(mfs, previous, block_number)) {
+        return -1;
+    }
+
+    holes->blocks[holes->block_count++] = block_number;
+
+    return 0;
+}
+
+// Turns a chain block into a hole of the given length, or back into a data block with undefined contents if it is 0
+int holes_set(mfs_t *mfs, uint16_t block_number, uint32_t blocks) {
+    holes_t *holes = mfs->holes;
+    if(holes && holes->slots[block_number] != 0) {
+        uint32_t slot = holes->slots[block_number] - 1;
+        if(blocks > 0) {
+            holes->lengths[slot] = blocks;
+            return holes_store(mfs, slot);
+        }
+
+        // The last entry takes the place of this one
+        uint32_t last = holes->count - 1;
+        holes->slots[block_number] = 0;
+        holes->count--;
+        if(slot != last) {
+            holes->chains[slot] = holes->chains[last];
+            holes->lengths[slot] = holes->lengths[last];
+            holes->slots[holes->chains[slot]] = slot + 1;
+            if(holes_store(mfs, slot)) {
+                return -1;
+            }
+        }
+        return holes_store(mfs, last);
+    }
+
+    if(blocks == 0) {
+        return 0;
+    }
+
+    // A full table gets another block
+    if(holes == NULL || holes->count == holes->block_count * holes_per_block(mfs)) {
+        if(holes_add_block(mfs)) {
+            return -1;
+        }
+        holes = mfs->holes;
+    }
+    if(holes_grow(holes, holes->count + 1, holes->block_count)) {
+        return -1;
+    }
+
+    uint32_t slot = holes->count++;
+    holes->chains[slot] = block_number;
+    holes->lengths[slot] = blocks;
+    holes->slots[block_number] = slot + 1;
+
+    return holes_store(mfs, slot);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "mfs.h"
+
+int holes_open(mfs_t *mfs, uint16_t block_number);
+void holes_free(mfs_t *mfs);
+
+uint32_t holes_blocks(mfs_t *mfs, uint16_t block_number);
+int holes_set(mfs_t *mfs, uint16_t block_number, uint32_t blocks);
@@ -0,0 +1,548 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "format.h"
+#include "journal.h"
+#include "stripe.h"
+#include "alloc_table.h"
+#include "writeback.h"
+
+struct journal {
+    // Offset of the journal header in the image
+    size_t base;
+    // Size of the log behind the header
+    uint32_t capacity;
+    // Where the next record goes and where the oldest record that hasn't been checkpointed starts
+    uint32_t head;
+    uint32_t tail;
+    // Bytes from tail to head, including space skipped at the end of the log
+    uint32_t used;
+    // Sequence number of the next record
+    uint64_t seq;
+    // Record assembled by the current operation. The buffer grows until everything the operation writes fits.
+    uint8_t *txn;
+    uint32_t txn_len;
+    uint32_t txn_size;
+    // Long operations commit at their next consistent point once their record is this long, a quarter of the log
+    uint32_t split_len;
+    // Logged writes that haven't been applied in place yet, alloc table entries included
+    uint8_t *pending;
+    uint32_t pending_len;
+};
+
+uint32_t journal_checksum(const uint8_t *buf, size_t len) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < len; i++) {
+        hash ^= buf[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int journal_write_at(FILE *f, size_t offset, const uint8_t *buf, size_t len) {
+    fseek(f, offset, SEEK_SET);
+    size_t written = fwrite(buf, sizeof(*buf), len, f);
+    if(written != len) {
+        perror("Write operation failed");
+        return -1;
+    }
+    return 0;
+}
+
+int journal_read_at(FILE *f, size_t offset, uint8_t *buf, size_t len) {
+    fseek(f, offset, SEEK_SET);
+    size_t read = fread(buf, sizeof(*buf), len, f);
+    if(read != len) {
+        if(ferror(f)) {
+            perror("File read error");
+        } else if(feof(f)) {
+            fprintf(stderr, "File to short\n");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int journal_sync(mfs_t *mfs) {
+    if(writeback_drain(mfs) || fflush(mfs->f)) {
+        perror("Flush failed");
+        return -1;
+    }
+
+    if(mfs->durability != MFS_DURABILITY_NONE && fdatasync(fileno(mfs->f))) {
+        perror("fdatasync() failed");
+        return -1;
+    }
+    if(mfs->durability != MFS_DURABILITY_NONE && stripe_sync(mfs)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int journal_write_header(FILE *f, size_t base, uint32_t tail, uint64_t tail_seq) {
+    uint8_t header[JOURNAL_HEADER_SIZE] = { 0 };
+
+    write32(header, JH_MAGIC, JOURNAL_MAGIC);
+    write32(header, JH_TAIL, tail);
+    write64(header, JH_TAIL_SEQ, tail_seq);
+
+    return journal_write_at(f, base, header, JOURNAL_HEADER_SIZE);
+}
+
+// Writes an empty journal into a new image
+int journal_format(FILE *f, size_t base, size_t size) {
+    uint8_t *zero = calloc(size, sizeof(*zero));
+    if(zero == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    int ret = journal_write_at(f, base, zero, size);
+    free(zero);
+    if(ret) {
+        return -1;
+    }
+
+    return journal_write_header(f, base, 0, 1);
+}
+
+// Returns the length of the valid record with the given sequence number at pos in log, or 0
+uint32_t journal_record_at(const uint8_t *log, uint32_t capacity, uint32_t pos, uint64_t seq) {
+    if(capacity - pos < JOURNAL_RECORD_HEADER_SIZE + JOURNAL_CHECKSUM_SIZE) {
+        return 0;
+    }
+
+    const uint8_t *record = log + pos;
+    uint32_t len = read32(record, 4);
+
+    if(read32(record, 0) != JOURNAL_RECORD_MAGIC || read64(record, 8) != seq) {
+        return 0;
+    }
+    if(len < JOURNAL_RECORD_HEADER_SIZE + JOURNAL_CHECKSUM_SIZE || len > capacity - pos) {
+        return 0;
+    }
+    if(journal_checksum(record, len - JOURNAL_CHECKSUM_SIZE) != read32(record, len - JOURNAL_CHECKSUM_SIZE)) {
+        return 0;
+    }
+
+    return len;
+}
+
+// Calls fn for every write in a run of (offset, length, data) entries
+int journal_for_each_write(const uint8_t *entries, uint32_t len, int (*fn)(mfs_t *, size_t, const uint8_t *, uint16_t, void *), mfs_t *mfs, void *arg) {
+    uint32_t pos = 0;
+    while(pos + JOURNAL_WRITE_HEADER_SIZE <= len) {
+        size_t offset = (size_t) read64(entries, pos);
+        uint16_t write_len = read16(entries, pos + 8);
+        if(fn(mfs, offset, entries + pos + JOURNAL_WRITE_HEADER_SIZE, write_len, arg)) {
+            return -1;
+        }
+        pos += JOURNAL_WRITE_HEADER_SIZE + write_len;
+    }
+    return 0;
+}
+
+int journal_apply_write(mfs_t *mfs, size_t offset, const uint8_t *data, uint16_t len, void *arg) {
+    (void) arg;
+    if(mfs->writeback) {
+        return writeback_write(mfs, offset, data, len);
+    }
+    if(mfs->stripe) {
+        return stripe_write(mfs, offset, data, len);
+    }
+    return journal_write_at(mfs->f, offset, data, len);
+}
+
+int journal_open(mfs_t *mfs, size_t base, size_t size) {
+    if(size < JOURNAL_HEADER_SIZE + JOURNAL_MIN_LOG_SIZE) {
+        fprintf(stderr, "Journal too small\n");
+        return -1;
+    }
+
+    uint32_t capacity = (uint32_t) (size - JOURNAL_HEADER_SIZE);
+
+    uint8_t header[JOURNAL_HEADER_SIZE];
+    if(journal_read_at(mfs->f, base, header, JOURNAL_HEADER_SIZE)) {
+        return -1;
+    }
+    if(read32(header, JH_MAGIC) != JOURNAL_MAGIC) {
+        fprintf(stderr, "Invalid journal\n");
+        return -1;
+    }
+
+    uint32_t pos = read32(header, JH_TAIL);
+    uint64_t seq = read64(header, JH_TAIL_SEQ);
+    if(pos >= capacity) {
+        fprintf(stderr, "Invalid journal\n");
+        return -1;
+    }
+
+    uint8_t *log = malloc(sizeof(*log) * capacity);
+    if(log == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    if(journal_read_at(mfs->f, base + JOURNAL_HEADER_SIZE, log, capacity)) {
+        free(log);
+        return -1;
+    }
+
+    // Redo every complete record from the tail on. Records are applied in place, so replaying twice is harmless.
+    unsigned int replayed = 0;
+    uint32_t consumed = 0;
+    while(consumed < capacity) {
+        uint32_t len = journal_record_at(log, capacity, pos, seq);
+        if(len == 0 && pos != 0) {
+            // Records that don't fit at the end of the log continue at its start
+            len = journal_record_at(log, capacity, 0, seq);
+            if(len != 0) {
+                consumed += capacity - pos;
+                pos = 0;
+            }
+        }
+        if(len == 0 || consumed + len > capacity) {
+            break;
+        }
+
+        uint8_t *record = log + pos;
+        if(journal_for_each_write(record + JOURNAL_RECORD_HEADER_SIZE, len - JOURNAL_RECORD_HEADER_SIZE - JOURNAL_CHECKSUM_SIZE, journal_apply_write, mfs, NULL)) {
+            free(log);
+            return -1;
+        }
+
+        replayed++;
+        seq++;
+        pos += len;
+        consumed += len;
+        if(pos == capacity) {
+            pos = 0;
+        }
+    }
+
+    free(log);
+
+    if(replayed > 0) {
+        fprintf(stderr, "Replayed %u journal transaction%s\n", replayed, replayed == 1 ? "" : "s");
+        if(journal_sync(mfs)) {
+            return -1;
+        }
+    }
+
+    journal_t *journal = malloc(sizeof(*journal));
+    if(journal == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    journal->split_len = capacity / 4;
+    journal->txn_size = journal->split_len;
+    journal->txn = malloc(sizeof(*journal->txn) * journal->txn_size);
+    journal->pending = malloc(sizeof(*journal->pending) * capacity);
+    if(journal->txn == NULL || journal->pending == NULL) {
+        perror("Memory allocation failed");
+        free(journal->txn);
+        free(journal->pending);
+        free(journal);
+        return -1;
+    }
+
+    journal->base = base;
+    journal->capacity = capacity;
+    journal->head = pos;
+    journal->tail = pos;
+    journal->used = 0;
+    journal->seq = seq;
+    journal->txn_len = 0;
+    journal->pending_len = 0;
+
+    mfs->journal = journal;
+
+    if(replayed > 0) {
+        if(journal_write_header(mfs->f, base, pos, seq) || journal_sync(mfs)) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void journal_free(mfs_t *mfs) {
+    if(mfs->journal == NULL) {
+        return;
+    }
+
+    journal_commit(mfs);
+    journal_checkpoint(mfs);
+
+    free(mfs->journal->txn);
+    free(mfs->journal->pending);
+    free(mfs->journal);
+    mfs->journal = NULL;
+}
+
+// Sequence number the current transaction will be committed with
+uint64_t journal_seq(mfs_t *mfs) {
+    return mfs->journal->seq;
+}
+
+// Keeps a committed write until the checkpoint. The alloc table is kept as logged too: its pages in memory may already
+// hold later changes that must not reach the disk before their own transaction.
+int journal_track_write(mfs_t *mfs, size_t offset, const uint8_t *data, uint16_t len, void *arg) {
+    (void) arg;
+    journal_t *journal = mfs->journal;
+
+    uint8_t *entry = journal->pending + journal->pending_len;
+    write64(entry, 0, offset);
+    write16(entry, 8, len);
+    memcpy(entry + JOURNAL_WRITE_HEADER_SIZE, data, len);
+    journal->pending_len += JOURNAL_WRITE_HEADER_SIZE + len;
+
+    return 0;
+}
+
+// Whether a record of len bytes fits behind the head without overwriting records that haven't been checkpointed
+bool journal_fits(journal_t *journal, uint32_t len) {
+    uint32_t skipped = journal->head + len > journal->capacity ? journal->capacity - journal->head : 0;
+    return journal->used + skipped + len <= journal->capacity;
+}
+
+// A transaction larger than the whole log can't be logged. Everything logged before it is put in place first, then its
+// writes are applied directly, which leaves such an operation without atomicity.
+int journal_commit_in_place(mfs_t *mfs) {
+    journal_t *journal = mfs->journal;
+
+    fprintf(stderr, "Operation too large for the journal, written in place without it\n");
+
+    if(journal_checkpoint(mfs)) {
+        return -1;
+    }
+    if(journal_for_each_write(journal->txn + JOURNAL_RECORD_HEADER_SIZE, journal->txn_len - JOURNAL_RECORD_HEADER_SIZE, journal_apply_write, mfs, NULL)) {
+        return -1;
+    }
+    if(journal_sync(mfs)) {
+        return -1;
+    }
+
+    alloc_table_checkpoint(mfs, journal->seq + 1);
+    journal->txn_len = 0;
+
+    return 0;
+}
+
+// Appends the current transaction to the log as one record, checkpointing first if the log has no room for it. Its
+// writes are applied in place at the next checkpoint.
+int journal_commit(mfs_t *mfs) {
+    journal_t *journal = mfs->journal;
+    if(journal == NULL || journal->txn_len == 0) {
+        return 0;
+    }
+
+    uint32_t len = journal->txn_len + JOURNAL_CHECKSUM_SIZE;
+    if(len > journal->capacity) {
+        return journal_commit_in_place(mfs);
+    }
+
+    if(!journal_fits(journal, len) && journal_checkpoint(mfs)) {
+        return -1;
+    }
+    if(!journal_fits(journal, len)) {
+        // Too long for the space between the head and the end of the empty log, start the log over at its beginning
+        journal->head = 0;
+        journal->tail = 0;
+        if(journal_write_header(mfs->f, journal->base, 0, journal->seq) || journal_sync(mfs)) {
+            return -1;
+        }
+    }
+
+    write32(journal->txn, 0, JOURNAL_RECORD_MAGIC);
+    write32(journal->txn, 4, len);
+    write64(journal->txn, 8, journal->seq);
+    write32(journal->txn, journal->txn_len, journal_checksum(journal->txn, journal->txn_len));
+
+    if(journal->head + len > journal->capacity) {
+        // Skip the rest of the log, the record continues at its start
+        journal->used += journal->capacity - journal->head;
+        journal->head = 0;
+    }
+
+    if(journal_write_at(mfs->f, journal->base + JOURNAL_HEADER_SIZE + journal->head, journal->txn, len)) {
+        return -1;
+    }
+
+    journal->head += len;
+    journal->used += len;
+    journal->seq++;
+    if(journal->head == journal->capacity) {
+        journal->head = 0;
+    }
+
+    journal_for_each_write(journal->txn + JOURNAL_RECORD_HEADER_SIZE, journal->txn_len - JOURNAL_RECORD_HEADER_SIZE, journal_track_write, mfs, NULL);
+
+    journal->txn_len = 0;
+
+    return 0;
+}
+
+// Applies all logged writes in place and empties the log
+int journal_checkpoint(mfs_t *mfs) {
+    journal_t *journal = mfs->journal;
+    if(journal == NULL || journal->used == 0) {
+        return 0;
+    }
+
+    // The log has to be on disk before anything it describes is overwritten
+    if(journal_sync(mfs)) {
+        return -1;
+    }
+
+    if(journal_for_each_write(journal->pending, journal->pending_len, journal_apply_write, mfs, NULL)) {
+        return -1;
+    }
+
+    if(journal_sync(mfs)) {
+        return -1;
+    }
+
+    // Pages logged by the current transaction, which isn't committed yet, stay
+    alloc_table_checkpoint(mfs, journal->seq);
+
+    journal->tail = journal->head;
+    journal->used = 0;
+    journal->pending_len = 0;
+
+    if(journal_write_header(mfs->f, journal->base, journal->tail, journal->seq)) {
+        return -1;
+    }
+
+    return journal_sync(mfs);
+}
+
+// Checkpoints at the start of an operation while the log is more than half full, so most transactions find room
+int journal_reserve(mfs_t *mfs) {
+    journal_t *journal = mfs->journal;
+    if(journal->capacity - journal->used < 2 * journal->split_len) {
+        return journal_checkpoint(mfs);
+    }
+    return 0;
+}
+
+int journal_begin(mfs_t *mfs) {
+    if(mfs->journal == NULL) {
+        return 0;
+    }
+
+    return journal_reserve(mfs);
+}
+
+// Largest metadata write a single journal_write() call accepts
+uint16_t journal_write_limit(mfs_t *mfs) {
+    uint32_t limit = mfs->journal->split_len - JOURNAL_RECORD_HEADER_SIZE - JOURNAL_WRITE_HEADER_SIZE - JOURNAL_CHECKSUM_SIZE;
+    return limit < UINT16_MAX ? (uint16_t) limit : UINT16_MAX;
+}
+
+// Long operations call this where the image is consistent, say between two blocks of a write. Once their transaction
+// has grown long, it is committed there and the rest of the operation continues in a new one.
+int journal_split(mfs_t *mfs) {
+    journal_t *journal = mfs->journal;
+    if(journal == NULL || journal->txn_len < journal->split_len) {
+        return 0;
+    }
+
+    return journal_commit(mfs);
+}
+
+// Adds a metadata write to the current transaction. An operation's writes all go into one transaction, so it is
+// replayed either completely or not at all.
+int journal_write(mfs_t *mfs, size_t offset, const uint8_t *data, uint16_t len) {
+    journal_t *journal = mfs->journal;
+    uint32_t entry_len = JOURNAL_WRITE_HEADER_SIZE + len;
+
+    if(journal->txn_len == 0) {
+        journal->txn_len = JOURNAL_RECORD_HEADER_SIZE;
+    }
+
+    if(journal->txn_len + entry_len + JOURNAL_CHECKSUM_SIZE > journal->txn_size) {
+        uint32_t size = journal->txn_size;
+        while(journal->txn_len + entry_len + JOURNAL_CHECKSUM_SIZE > size) {
+            size *= 2;
+        }
+        uint8_t *grown = realloc(journal->txn, sizeof(*grown) * size);
+        if(grown == NULL) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        journal->txn = grown;
+        journal->txn_size = size;
+    }
+
+    uint8_t *entry = journal->txn + journal->txn_len;
+    write64(entry, 0, offset);
+    write16(entry, 8, len);
+    memcpy(entry + JOURNAL_WRITE_HEADER_SIZE, data, len);
+    journal->txn_len += entry_len;
+
+    return 0;
+}
+
+typedef struct {
+    size_t offset;
+    uint8_t *buf;
+    size_t len;
+    bool overlaps;
+} journal_range_t;
+
+int journal_overlay_write(mfs_t *mfs, size_t offset, const uint8_t *data, uint16_t len, void *arg) {
+    (void) mfs;
+    journal_range_t *range = arg;
+
+    size_t start = offset > range->offset ? offset : range->offset;
+    size_t end = offset + len < range->offset + range->len ? offset + len : range->offset + range->len;
+    if(start < end) {
+        range->overlaps = true;
+        if(range->buf) {
+            memcpy(range->buf + (start - range->offset), data + (start - offset), end - start);
+        }
+    }
+
+    return 0;
+}
+
+// Applies logged writes that haven't reached their place yet to data read from the image
+void journal_overlay(mfs_t *mfs, size_t offset, uint8_t *buf, size_t len) {
+    journal_t *journal = mfs->journal;
+    if(journal == NULL) {
+        return;
+    }
+
+    journal_range_t range = { offset, buf, len, false };
+    journal_for_each_write(journal->pending, journal->pending_len, journal_overlay_write, mfs, &range);
+    if(journal->txn_len > 0) {
+        journal_for_each_write(journal->txn + JOURNAL_RECORD_HEADER_SIZE, journal->txn_len - JOURNAL_RECORD_HEADER_SIZE, journal_overlay_write, mfs, &range);
+    }
+}
+
+// File data is written in place without logging. If the range still has logged metadata waiting for a checkpoint
+// (say, entries of a deleted directory whose block was reused), that metadata must not be applied over the data later.
+int journal_prepare_data_write(mfs_t *mfs, size_t offset, size_t len) {
+    journal_t *journal = mfs->journal;
+    if(journal == NULL) {
+        return 0;
+    }
+
+    journal_range_t range = { offset, NULL, len, false };
+    journal_for_each_write(journal->pending, journal->pending_len, journal_overlay_write, mfs, &range);
+    if(!range.overlaps) {
+        return 0;
+    }
+
+    // The current transaction isn't needed for that and stays uncommitted
+    return journal_checkpoint(mfs);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mfs.h"
+
+int journal_format(FILE *f, size_t base, size_t size);
+
+int journal_open(mfs_t *mfs, size_t base, size_t size);
+void journal_free(mfs_t *mfs);
+
+int journal_begin(mfs_t *mfs);
+int journal_write(mfs_t *mfs, size_t offset, const uint8_t *data, uint16_t len);
+uint16_t journal_write_limit(mfs_t *mfs);
+int journal_split(mfs_t *mfs);
+int journal_commit(mfs_t *mfs);
+uint64_t journal_seq(mfs_t *mfs);
+int journal_checkpoint(mfs_t *mfs);
+
+void journal_overlay(mfs_t *mfs, size_t offset, uint8_t *buf, size_t len);
+int journal_prepare_data_write(mfs_t *mfs, size_t offset, size_t len);
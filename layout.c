@@ -0,0 +1,93 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "format.h"
+#include "blocks.h"
+#include "blockmap.h"
+#include "layout.h"
+
+// Measures how the chains and the free space are laid out, straight from the alloc table. A chain starts at every used
+// block without a previous block; with a block map the places of its blocks are their physical blocks.
+
+uint16_t layout_place(mfs_t *mfs, uint16_t block_number) {
+    return mfs->blockmap ? blockmap_physical(mfs, block_number) : block_number;
+}
+
+unsigned int layout_bucket(uint32_t length) {
+    unsigned int bucket = 0;
+    while(length > 1 && bucket < LAYOUT_FREE_BUCKETS - 1) {
+        length >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void layout_scan(mfs_t *mfs, layout_t *layout) {
+    memset(layout, 0, sizeof(*layout));
+
+    uint32_t free_run = 0;
+    for(uint32_t i = 0; i <= mfs->block_count; i++) {
+        if(i < mfs->block_count && get_block_next(mfs, (uint16_t) i) == BLOCK_UNUSED) {
+            free_run++;
+            continue;
+        }
+
+        if(free_run > 0) {
+            layout->free_blocks += free_run;
+            layout->free_runs++;
+            layout->free_run_counts[layout_bucket(free_run)]++;
+            if(free_run > layout->largest_free_run) {
+                layout->largest_free_run = free_run;
+            }
+            free_run = 0;
+        }
+
+        if(i == mfs->block_count || get_block_previous(mfs, (uint16_t) i) != BLOCK_EOF) {
+            continue;
+        }
+
+        // Walk the chain starting here, bounded in case the table is damaged
+        uint32_t runs = 1;
+        uint32_t length = 1;
+        uint16_t block_number = (uint16_t) i;
+        uint16_t place = layout_place(mfs, block_number);
+        uint16_t next;
+        while((next = get_block_next(mfs, block_number)) != BLOCK_EOF && next != BLOCK_UNUSED && length < mfs->block_count) {
+            uint16_t next_place = layout_place(mfs, next);
+            if(next_place != place + 1) {
+                runs++;
+                layout->seek_blocks += next_place > place ? next_place - place - 1 : place - next_place + 1;
+            }
+            block_number = next;
+            place = next_place;
+            length++;
+        }
+
+        layout->chains++;
+        layout->blocks += length;
+        layout->runs += runs;
+        if(runs > 1) {
+            layout->fragmented_chains++;
+        }
+    }
+}
+
+int mfs_layout(mfs_t *mfs) {
+    layout_t layout;
+    layout_scan(mfs, &layout);
+
+    printf("%u chains, %u blocks in %u runs, %.2f blocks per run\n", layout.chains, layout.blocks, layout.runs, layout.runs ? (double) layout.blocks / layout.runs : 0);
+    printf("%u chains fragmented, %.2f blocks seek distance per chain\n", layout.fragmented_chains, layout.chains ? (double) layout.seek_blocks / layout.chains : 0);
+    printf("%u blocks free in %u runs, largest %u blocks\n", layout.free_blocks, layout.free_runs, layout.largest_free_run);
+
+    for(unsigned int i = 0; i < LAYOUT_FREE_BUCKETS; i++) {
+        if(layout.free_run_counts[i] > 0) {
+            printf("free runs of %5u-%-5u blocks: %u\n", 1u << i, (1u << (i + 1)) - 1, layout.free_run_counts[i]);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "mfs.h"
+
+#define LAYOUT_FREE_BUCKETS 17
+
+typedef struct {
+    uint32_t chains;
+    uint32_t blocks;
+    // Runs of blocks that follow each other in the image
+    uint32_t runs;
+    uint32_t fragmented_chains;
+    // Blocks skipped over or back between the runs of all chains
+    uint64_t seek_blocks;
+    uint32_t free_blocks;
+    uint32_t free_runs;
+    uint32_t largest_free_run;
+    // Free runs of 2^n to 2^(n+1)-1 blocks
+    uint32_t free_run_counts[LAYOUT_FREE_BUCKETS];
+} layout_t;
+
+void layout_scan(mfs_t *mfs, layout_t *layout);
+
+int mfs_layout(mfs_t *mfs);
@@ -0,0 +1,187 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+// LZ77 with an LZ4-style sequence format: a token holding the literal count and match length in its two nibbles,
+// extra length bytes for either when the nibble is full, the literals and a 16 bit little endian match offset.
+// The last sequence only has literals.
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_NIBBLE_MAX 15
+#define LZ_COPY_SIZE 16
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static size_t lz_write_length(uint8_t *dst, size_t op, size_t capacity, size_t len) {
+    while(len >= 255) {
+        if(op >= capacity) {
+            return 0;
+        }
+        dst[op++] = 255;
+        len -= 255;
+    }
+    if(op >= capacity) {
+        return 0;
+    }
+    dst[op++] = (uint8_t) len;
+    return op;
+}
+
+// Emits one sequence. match_len is 0 for the final literals-only sequence. Returns the new output position, or 0 if
+// the output doesn't fit.
+static size_t lz_write_sequence(uint8_t *dst, size_t op, size_t capacity, const uint8_t *literals, size_t literal_len, size_t offset, size_t match_len) {
+    if(op >= capacity) {
+        return 0;
+    }
+
+    size_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+    uint8_t token = (uint8_t) ((literal_len < LZ_NIBBLE_MAX ? literal_len : LZ_NIBBLE_MAX) << 4);
+    token |= (uint8_t) (match_code < LZ_NIBBLE_MAX ? match_code : LZ_NIBBLE_MAX);
+    dst[op++] = token;
+
+    if(literal_len >= LZ_NIBBLE_MAX && (op = lz_write_length(dst, op, capacity, literal_len - LZ_NIBBLE_MAX)) == 0) {
+        return 0;
+    }
+
+    if(capacity - op < literal_len) {
+        return 0;
+    }
+    memcpy(dst + op, literals, literal_len);
+    op += literal_len;
+
+    if(match_len == 0) {
+        return op;
+    }
+
+    if(capacity - op < 2) {
+        return 0;
+    }
+    dst[op++] = offset & 0xFF;
+    dst[op++] = (offset >> 8) & 0xFF;
+
+    if(match_code >= LZ_NIBBLE_MAX && (op = lz_write_length(dst, op, capacity, match_code - LZ_NIBBLE_MAX)) == 0) {
+        return 0;
+    }
+
+    return op;
+}
+
+// Returns the compressed size, or 0 if it doesn't fit into capacity bytes
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t capacity) {
+    uint32_t table[1 << LZ_HASH_BITS] = { 0 };
+
+    size_t ip = 0;
+    size_t anchor = 0;
+    size_t op = 0;
+
+    while(len >= LZ_MIN_MATCH && ip <= len - LZ_MIN_MATCH) {
+        uint32_t sequence = lz_read32(src + ip);
+        uint32_t h = lz_hash(sequence);
+        size_t ref = table[h];
+        table[h] = (uint32_t) ip;
+
+        if(ref < ip && ip - ref <= LZ_MAX_OFFSET && lz_read32(src + ref) == sequence) {
+            size_t match_len = LZ_MIN_MATCH;
+            while(ip + match_len < len && src[ref + match_len] == src[ip + match_len]) {
+                match_len++;
+            }
+
+            op = lz_write_sequence(dst, op, capacity, src + anchor, ip - anchor, ip - ref, match_len);
+            if(op == 0) {
+                return 0;
+            }
+
+            ip += match_len;
+            anchor = ip;
+        } else {
+            ip++;
+        }
+    }
+
+    return lz_write_sequence(dst, op, capacity, src + anchor, len - anchor, 0, 0);
+}
+
+static int lz_read_length(const uint8_t *src, size_t len, size_t *ip, size_t *value) {
+    uint8_t b;
+    do {
+        if(*ip >= len) {
+            return -1;
+        }
+        b = src[(*ip)++];
+        *value += b;
+    } while(b == 255);
+    return 0;
+}
+
+// Decompresses exactly raw_len bytes, returns -1 if the input is corrupt
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t raw_len) {
+    size_t ip = 0;
+    size_t op = 0;
+
+    while(ip < len) {
+        uint8_t token = src[ip++];
+
+        size_t literal_len = token >> 4;
+        if(literal_len == LZ_NIBBLE_MAX && lz_read_length(src, len, &ip, &literal_len)) {
+            return -1;
+        }
+        if(len - ip < literal_len || raw_len - op < literal_len) {
+            return -1;
+        }
+        if(literal_len <= LZ_COPY_SIZE && len - ip >= LZ_COPY_SIZE && raw_len - op >= LZ_COPY_SIZE) {
+            // Short literal runs are copied with one fixed size copy, overshooting into space written later
+            memcpy(dst + op, src + ip, LZ_COPY_SIZE);
+        } else {
+            memcpy(dst + op, src + ip, literal_len);
+        }
+        ip += literal_len;
+        op += literal_len;
+
+        if(ip == len) {
+            break;
+        }
+
+        if(len - ip < 2) {
+            return -1;
+        }
+        size_t offset = src[ip] | (size_t) src[ip + 1] << 8;
+        ip += 2;
+
+        size_t match_len = token & LZ_NIBBLE_MAX;
+        if(match_len == LZ_NIBBLE_MAX && lz_read_length(src, len, &ip, &match_len)) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+
+        if(offset == 0 || offset > op || raw_len - op < match_len) {
+            return -1;
+        }
+
+        if(offset >= LZ_COPY_SIZE && raw_len - op >= match_len + LZ_COPY_SIZE) {
+            // The source is at least one copy behind, so fixed size copies never read bytes they haven't written yet
+            for(size_t i = 0; i < match_len; i += LZ_COPY_SIZE) {
+                memcpy(dst + op + i, dst + op - offset + i, LZ_COPY_SIZE);
+            }
+        } else {
+            // Byte by byte, matches may overlap their own output
+            for(size_t i = 0; i < match_len; i++) {
+                dst[op + i] = dst[op - offset + i];
+            }
+        }
+        op += match_len;
+    }
+
+    return op == raw_len ? 0 : -1;
+}
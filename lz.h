@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst, size_t capacity);
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst, size_t raw_len);
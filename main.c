@@ -3,9 +3,19 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 #include "util.h"
 #include "mfs.h"
+#include "batch.h"
+#include "bench.h"
+#include "layout.h"
+#include "resize.h"
+#include "server.h"
+#include "trace.h"
+#include "snapshot.h"
+#include "tree.h"
+#include "export.h"
 
 int main_repl(mfs_t *mfs, int optc, char **optv);
 
@@ -34,8 +44,18 @@ int main(int argc, char **argv) {
     int ret;
     if(strequals("create", cmd)) {
         ret = mfs_create(filename, optc, optv);
+    } else if(strequals("resize", cmd)) {
+        ret = mfs_resize_image(filename, optc, optv) ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else if(strequals("serve", cmd)) {
+        ret = mfs_serve(filename, optc, optv) ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else if(strequals("replay", cmd)) {
+        ret = mfs_replay(filename, optc, optv) ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else if(strequals("age", cmd)) {
+        ret = mfs_age(filename, optc, optv) ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else if(strequals("bench", cmd)) {
+        ret = mfs_bench(filename, optc, optv) ? EXIT_FAILURE : EXIT_SUCCESS;
     } else if(strequals("repl", cmd)) {
-        mfs_t *mfs = mfs_open(filename);
+        mfs_t *mfs = mfs_open(filename, optc, optv);
         if(mfs == NULL) {
             fprintf(stderr, "Failed to open MFS file\n");
             return EXIT_FAILURE;
@@ -53,7 +73,7 @@ int main(int argc, char **argv) {
 }
 
 #define LINE_MAXLEN 1024
-#define ARGS_MAX 2
+#define ARGS_MAX 4
 #define READ_STRING_SIZE_INC 16
 
 char *read_string(FILE *stream) {
@@ -135,9 +155,13 @@ int main_repl(mfs_t *mfs, int optc, char **optv) {
             printf("Bye\n");
             break;
         } else if(strequals(cmd, "sync")) {
-            fflush(mfs->f);
+            mfs_sync(mfs);
+        } else if(strequals(cmd, "durable")) {
+            printf("Last operation: %llu, durable up to: %llu\n", (unsigned long long) mfs_last_op(mfs), (unsigned long long) mfs_durable_op(mfs));
         } else if(strequals(cmd, "info")) {
             mfs_info(mfs);
+        } else if(strequals(cmd, "layout")) {
+            mfs_layout(mfs);
         } else if(strequals(cmd, "mkdir")) {
             if(arg_count >= 2) {
                 mfs_mkdir(mfs, args[1]);
@@ -156,18 +180,99 @@ int main_repl(mfs_t *mfs, int optc, char **optv) {
             } else {
                 fprintf(stderr, "Missing path\n");
             }
+        } else if(strequals(cmd, "readdir")) {
+            if(arg_count >= 3) {
+                size_t max = strtoul(args[2], NULL, 10);
+                mfs_dir_cursor_t cursor = arg_count >= 4 ? (mfs_dir_cursor_t) strtoul(args[3], NULL, 0) : MFS_DIR_CURSOR_START;
+                mfs_dirent_t *entries = malloc(sizeof(*entries) * (max ? max : 1));
+                size_t count;
+                if(entries == NULL) {
+                    fprintf(stderr, "Memory allocation failed\n");
+                } else if(!mfs_readdir(mfs, args[1], &cursor, entries, max, &count)) {
+                    for(size_t i = 0; i < count; i++) {
+                        printf("0x%04x 0x%04x %s\n", entries[i].type, entries[i].block_number, entries[i].name);
+                    }
+                    if(cursor == MFS_DIR_CURSOR_END) {
+                        printf("end\n");
+                    } else {
+                        printf("next 0x%08x\n", cursor);
+                    }
+                }
+                free(entries);
+            } else {
+                fprintf(stderr, "Missing path or count\n");
+            }
         } else if(strequals(cmd, "touch")) {
             if(arg_count >= 2) {
                 mfs_touch(mfs, args[1]);
             } else {
                 fprintf(stderr, "Missing file name\n");
             }
-        } else if(strequals(cmd, "rm")) {
+        } else if(strequals(cmd, "create")) {
+            if(arg_count >= 3) {
+                mfs_create_from_list(mfs, args[1], args[2]);
+            } else {
+                fprintf(stderr, "Usage: create DIR LISTFILE\n");
+            }
+        } else if(strequals(cmd, "ctouch")) {
             if(arg_count >= 2) {
+                mfs_touch_compressed(mfs, args[1]);
+            } else {
+                fprintf(stderr, "Missing file name\n");
+            }
+        } else if(strequals(cmd, "rm")) {
+            if(arg_count >= 3 && strequals(args[1], "-r")) {
+                mfs_rm_recursive(mfs, args[2]);
+            } else if(arg_count >= 2) {
                 mfs_rm(mfs, args[1]);
             } else {
                 fprintf(stderr, "Missing file name\n");
             }
+        } else if(strequals(cmd, "find")) {
+            if(arg_count >= 2) {
+                mfs_find(mfs, args[1], arg_count >= 3 ? args[2] : NULL);
+            } else {
+                fprintf(stderr, "Usage: find PATH [PATTERN]\n");
+            }
+        } else if(strequals(cmd, "du")) {
+            if(arg_count >= 2) {
+                mfs_du(mfs, args[1]);
+            } else {
+                fprintf(stderr, "Missing path\n");
+            }
+        } else if(strequals(cmd, "tree")) {
+            if(arg_count >= 2) {
+                mfs_tree(mfs, args[1]);
+            } else {
+                fprintf(stderr, "Missing path\n");
+            }
+        } else if(strequals(cmd, "cp")) {
+            if(arg_count >= 3) {
+                mfs_cp(mfs, args[1], args[2]);
+            } else {
+                fprintf(stderr, "Missing file names\n");
+            }
+        } else if(strequals(cmd, "resize")) {
+            if(arg_count >= 2) {
+                unsigned long block_count = strtoul(args[1], NULL, 10);
+                if(block_count == 0 || block_count > 0xFFFF) {
+                    fprintf(stderr, "Invalid block count\n");
+                } else {
+                    mfs_resize(mfs, (uint16_t) block_count);
+                }
+            } else {
+                fprintf(stderr, "Missing block count\n");
+            }
+        } else if(strequals(cmd, "snapshot")) {
+            if(arg_count >= 2 && strequals(args[1], "list")) {
+                mfs_snapshot_list(mfs);
+            } else if(arg_count >= 3 && strequals(args[1], "create")) {
+                mfs_snapshot_create(mfs, args[2]);
+            } else if(arg_count >= 3 && strequals(args[1], "rm")) {
+                mfs_snapshot_delete(mfs, args[2]);
+            } else {
+                fprintf(stderr, "Usage: snapshot create|rm NAME, snapshot list\n");
+            }
         } else if(strequals(cmd, "fopen")) {
             if(arg_count >= 2) {
                 mfs_fopen(mfs, args[1]);
@@ -178,12 +283,24 @@ int main_repl(mfs_t *mfs, int optc, char **optv) {
             mfs_fclose(mfs);
         } else if(strequals(cmd, "finfo")) {
             mfs_finfo(mfs);
+        } else if(strequals(cmd, "fgoal")) {
+            if(arg_count >= 2) {
+                mfs_fgoal(mfs, (uint16_t) strtoul(args[1], NULL, 0));
+            } else {
+                fprintf(stderr, "Missing block number\n");
+            }
         } else if(strequals(cmd, "fseek")) {
             if(arg_count >= 2) {
-                mfs_fseek(mfs, (uint16_t) strtoul(args[1], NULL, 10));
+                mfs_fseek(mfs, (uint32_t) strtoul(args[1], NULL, 10));
             } else {
                 fprintf(stderr, "Missing position\n");
             }
+        } else if(strequals(cmd, "truncate")) {
+            if(arg_count >= 2) {
+                mfs_ftruncate(mfs, (uint32_t) strtoul(args[1], NULL, 10));
+            } else {
+                fprintf(stderr, "Missing size\n");
+            }
         } else if(strequals(cmd, "fwrite")) {
             char *str = read_string(stdin);
             if(str == NULL) {
@@ -194,6 +311,18 @@ int main_repl(mfs_t *mfs, int optc, char **optv) {
                 mfs_fwrite(mfs, sizeof(*str) * len, (uint8_t *) str);
                 free(str);
             }
+        } else if(strequals(cmd, "cat")) {
+            if(arg_count >= 3) {
+                mfs_export_file(mfs, args[1], args[2]);
+            } else if(arg_count >= 2) {
+                // The data goes to the descriptor directly, anything still buffered has to be out before it
+                fflush(stdout);
+                if(!mfs_export(mfs, args[1], STDOUT_FILENO)) {
+                    putchar('\n');
+                }
+            } else {
+                fprintf(stderr, "Missing path\n");
+            }
         } else if(strequals(cmd, "fread")) {
             if(arg_count >= 2) {
                 uint16_t len = (uint16_t) strtoul(args[1], NULL, 10);
@@ -1,91 +1,294 @@
 
+#define _GNU_SOURCE
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <libgen.h>
+#include <errno.h>
+#include <sys/file.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "util.h"
 #include "mfs.h"
+#include "format.h"
+#include "blocks.h"
+#include "blockmap.h"
+#include "compress.h"
+#include "dircache.h"
+#include "group.h"
+#include "hole.h"
+#include "journal.h"
 #include "parse_opts.h"
+#include "scan.h"
+#include "share.h"
+#include "snapshot.h"
+#include "alloc_table.h"
+#include "stripe.h"
+#include "trace.h"
+#include "tree.h"
+#include "writeback.h"
 
 #define BLOCK_SIZE 128
 #define BLOCK_COUNT 128
-#define META_INFO_BLOCK_SIZE 4
 
-#define BLOCK_UNUSED 0x0000
-#define BLOCK_EOF 0xFFFF
+// Chain blocks per data block on images with a block map, so that shared blocks leave room for more chains
+#define CHAIN_BLOCKS_FACTOR 2
 
-#define MFS_TYPE_END 0
-#define MFS_TYPE_DIRECTORY 1
-#define MFS_TYPE_FILE 2
+// Blocks per stripe unit and the most member files of a striped image
+#define STRIPE_UNIT 1
+#define STRIPE_MAX_MEMBERS 64
 
-#define ALLOC_TABLE_ENTRY_SIZE 4u
+// Number of blocks new chains leave free for the chain in front of them to grow into
+#define ALLOC_SPREAD 8
 
-#define DIR_ENTRY_SIZE 16
-#define PATH_SEG_MAX (DIR_ENTRY_SIZE - 4)
+// Largest gap between freed alloc table entries that is still covered by one write
+#define ALLOC_WRITE_GAP 16
 
-typedef struct {
-    uint16_t type;
-    uint16_t block_number;
-    char *name;
-} directory_entry_t;
+// Block buffers in the scratch arena, enough for a few nested directory iterators
+#define SCRATCH_BLOCKS 4
+
+// Threads walking the tree in find, du, tree and rm -r
+#define TREE_THREADS 4
+#define TREE_MAX_THREADS 64
+
+// Memory for alloc table pages in KiB, one page holds 256 entries
+#define ALLOC_MEM_KB 64
+
+// Entries ls fetches at a time
+#define LS_BATCH_ENTRIES 64
+
+// Smallest buffer for background writes in KiB, two pages
+#define WRITEBACK_MIN_KB 8
+
+// Memory for cached directory name hashes and chains in KiB
+#define DIR_CACHE_KB 256
+
+#define GROUP_WINDOW_MS 10
+#define GROUP_MAX_OPS 64
 
 typedef struct {
-    mfs_t *mfs;
-    uint16_t block_number;
-    uint8_t *block;
-    bool reached_eof;
-    uint16_t entry_addr;
-    directory_entry_t *entry;
-} directory_iterator_t;
+    const char *name;
+    uint16_t (*find)(mfs_t *mfs, uint16_t previous, uint16_t parent, uint16_t goal);
+} alloc_policy_t;
+
+size_t block_offset(mfs_t *mfs, uint16_t block_number) {
+    if(mfs->blockmap) {
+        // Chain blocks find their data through the block map
+        block_number = blockmap_physical(mfs, block_number);
+    }
 
-void write16(uint8_t *buf, size_t index, uint16_t data) {
-    buf[index] = data & 0xFF;
-    buf[index + 1] = (data >> 8) & 0xFF;
+    return mfs->blocks_base + block_bytes(mfs, block_number);
 }
 
-uint16_t read16(uint8_t *buf, size_t index) {
-    return buf[index + 1] << 8 | buf[index];
-}
+int read_metadata(mfs_t *mfs, size_t offset, uint8_t *buf, uint16_t len) {
+    if(mfs->writeback && writeback_overlaps(mfs, offset, len)) {
+        // Written by the caller, but still in the writeback buffer
+        if(writeback_read(mfs, offset, buf, len)) {
+            return -1;
+        }
+        journal_overlay(mfs, offset, buf, len);
+        return 0;
+    }
 
-directory_iterator_t *create_directory_iterator(mfs_t *mfs, uint16_t block_number) {
-    uint8_t *block = malloc(sizeof(*block) * mfs->block_size);
-    if (block == NULL) {
-        perror("Memory allocation failed");
-        return NULL;
+    if(mfs->stripe) {
+        // Directory blocks are in the member files
+        if(stripe_read(mfs, offset, buf, len)) {
+            return -1;
+        }
+        journal_overlay(mfs, offset, buf, len);
+        return 0;
     }
 
-    // Seek to first block of directory
-    fseek(mfs->f, mfs->blocks_base + block_number * mfs->block_size, SEEK_SET);
+    fseek(mfs->f, offset, SEEK_SET);
 
-    // Read block into memory
-    size_t read = fread(block, sizeof(*block), mfs->block_size, mfs->f);
-    if(read != mfs->block_size) {
+    size_t read = fread(buf, sizeof(*buf), len, mfs->f);
+    if(read != len) {
         if(ferror(mfs->f)) {
             perror("File read error");
         } else if(feof(mfs->f)) {
             fprintf(stderr, "File to short\n");
         }
-        free(block);
-        return NULL;
+        return -1;
     }
 
-    directory_iterator_t *it = malloc(sizeof(directory_iterator_t));
-    if (it == NULL) {
-        perror("Memory allocation failed");
-        free(block);
-        return NULL;
+    // Metadata written by operations still waiting in the journal
+    journal_overlay(mfs, offset, buf, len);
+
+    return 0;
+}
+
+// Like read_metadata(), but with positional reads that leave the FILE and its position alone, so several threads may
+// read at once while nothing is written. Writes still buffered in the FILE have to be flushed first.
+int pread_metadata(mfs_t *mfs, size_t offset, uint8_t *buf, uint16_t len) {
+    if(mfs->writeback && writeback_overlaps(mfs, offset, len)) {
+        if(writeback_read(mfs, offset, buf, len)) {
+            return -1;
+        }
+    } else if(mfs->stripe) {
+        // Directory blocks are in the member files
+        if(stripe_pread_at(mfs, offset, buf, len)) {
+            return -1;
+        }
+    } else {
+        size_t done = 0;
+        while(done < len) {
+            ssize_t read = pread(fileno(mfs->f), buf + done, len - done, (off_t) (offset + done));
+            if(read < 0) {
+                perror("File read error");
+                return -1;
+            }
+            if(read == 0) {
+                fprintf(stderr, "File to short\n");
+                return -1;
+            }
+            done += (size_t) read;
+        }
+    }
+
+    journal_overlay(mfs, offset, buf, len);
+
+    return 0;
+}
+
+// Alloc table entries and directory entries are written through here, so they can be journaled
+int write_metadata(mfs_t *mfs, size_t offset, const uint8_t *buf, uint16_t len) {
+    if(mfs->journal) {
+        return journal_write(mfs, offset, buf, len);
+    }
+
+    if(mfs->writeback) {
+        return writeback_write(mfs, offset, buf, len);
+    }
+
+    if(mfs->stripe) {
+        return stripe_write(mfs, offset, buf, len);
+    }
+
+    fseek(mfs->f, offset, SEEK_SET);
+
+    size_t written = fwrite(buf, sizeof(*buf), len, mfs->f);
+    if(written != len) {
+        perror("Write operation failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+int read_block(mfs_t *mfs, uint16_t block_number, uint8_t *block) {
+    return read_metadata(mfs, block_offset(mfs, block_number), block, mfs->block_size);
+}
+
+// File contents are read and written through here, they never go through the journal
+int read_data(mfs_t *mfs, size_t offset, uint8_t *buf, size_t len) {
+    if(mfs->writeback && writeback_overlaps(mfs, offset, len)) {
+        return writeback_read(mfs, offset, buf, len);
     }
 
-    directory_entry_t *entry = malloc(sizeof(directory_entry_t));
-    if (entry == NULL) {
+    if(mfs->stripe) {
+        return stripe_read(mfs, offset, buf, len);
+    }
+
+    fseek(mfs->f, offset, SEEK_SET);
+
+    size_t read = fread(buf, sizeof(*buf), len, mfs->f);
+    if(read != len) {
+        perror("Failed to read file into buffer");
+        return -1;
+    }
+
+    return 0;
+}
+
+int write_data(mfs_t *mfs, size_t offset, const uint8_t *buf, size_t len) {
+    if(journal_prepare_data_write(mfs, offset, len)) {
+        return -1;
+    }
+
+    if(mfs->writeback) {
+        return writeback_write(mfs, offset, buf, len);
+    }
+
+    if(mfs->stripe) {
+        return stripe_write(mfs, offset, buf, len);
+    }
+
+    fseek(mfs->f, offset, SEEK_SET);
+
+    size_t written = fwrite(buf, sizeof(*buf), len, mfs->f);
+    if(written != len) {
+        perror("Failed to write buffer to file");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Writes file data to part of a block. With a block map, the block's physical block may be shared and is left alone.
+int write_block_data(mfs_t *mfs, uint16_t block_number, uint16_t offset, const uint8_t *buf, uint16_t len) {
+    if(mfs->blockmap) {
+        return blockmap_write(mfs, block_number, offset, buf, len);
+    }
+
+    return write_data(mfs, block_offset(mfs, block_number) + offset, buf, len);
+}
+
+// Scratch space for buffers that only live during one call. Buffers are handed out and given back in LIFO order, so
+// the arena is a stack; requests that don't fit anymore (deeply nested iterators) fall back to malloc().
+uint8_t *scratch_get(mfs_t *mfs, size_t len) {
+    if(mfs->scratch_size - mfs->scratch_used >= len) {
+        uint8_t *buf = mfs->scratch + mfs->scratch_used;
+        mfs->scratch_used += len;
+        return buf;
+    }
+
+    uint8_t *buf = malloc(sizeof(*buf) * len);
+    if(buf == NULL) {
         perror("Memory allocation failed");
-        free(it);
-        free(block);
-        return NULL;
+    }
+    return buf;
+}
+
+// Gives back a buffer and everything handed out after it
+void scratch_put(mfs_t *mfs, uint8_t *buf) {
+    if(buf >= mfs->scratch && buf < mfs->scratch + mfs->scratch_size) {
+        mfs->scratch_used = (size_t) (buf - mfs->scratch);
+    } else {
+        free(buf);
+    }
+}
+
+// Clears a block that is about to become a directory block. Freed blocks keep their contents, which would otherwise
+// read as entries. The block is new, so it is written in place like file data.
+int zero_block(mfs_t *mfs, uint16_t block_number) {
+    uint8_t *block = scratch_get(mfs, mfs->block_size);
+    if(block == NULL) {
+        return -1;
+    }
+    memset(block, 0, mfs->block_size);
+
+    int ret = write_data(mfs, block_offset(mfs, block_number), block, mfs->block_size);
+    scratch_put(mfs, block);
+
+    return ret;
+}
+
+// Sets up an iterator in storage provided by the caller. Its block buffer comes from the scratch arena, so iterators
+// have to be closed in the reverse order they were opened in.
+int open_directory_iterator(directory_iterator_t *it, mfs_t *mfs, uint16_t block_number) {
+    uint8_t *block = scratch_get(mfs, mfs->block_size);
+    if(block == NULL) {
+        return -1;
+    }
+
+    // Read first block of directory into memory
+    if(read_block(mfs, block_number, block)) {
+        scratch_put(mfs, block);
+        return -1;
     }
 
     it->mfs = mfs;
@@ -93,34 +296,34 @@ directory_iterator_t *create_directory_iterator(mfs_t *mfs, uint16_t block_numbe
     it->block = block;
     it->reached_eof = false;
     it->entry_addr = 0;
-    it->entry = entry;
 
-    return it;
+    return 0;
 }
 
+// An entry that can't be read ends the chain, which keeps walks short and the block from being allocated
 uint16_t get_block_next(mfs_t *mfs, uint16_t block_number) {
-    return read16(mfs->alloc_table, block_number * ALLOC_TABLE_ENTRY_SIZE);
+    uint16_t next, previous;
+    if(alloc_table_get(mfs, block_number, &next, &previous)) {
+        return BLOCK_EOF;
+    }
+    return next;
 }
 
 uint16_t get_block_previous(mfs_t *mfs, uint16_t block_number) {
-    return read16(mfs->alloc_table, block_number * ALLOC_TABLE_ENTRY_SIZE + 2);
+    uint16_t next, previous;
+    if(alloc_table_get(mfs, block_number, &next, &previous)) {
+        return BLOCK_EOF;
+    }
+    return previous;
 }
 
 int set_block(mfs_t *mfs, uint16_t block, uint16_t previous, uint16_t next) {
-    size_t offset = block * ALLOC_TABLE_ENTRY_SIZE;
-
-    write16(mfs->alloc_table, offset, next);
-    write16(mfs->alloc_table, offset + 2, previous);
-
-    // Save to disk
-    fseek(mfs->f, mfs->alloc_table_base + offset, SEEK_SET);
-    size_t written = fwrite(mfs->alloc_table + offset, sizeof(*mfs->alloc_table), 4, mfs->f);
-    if (written != 4) {
-        perror("Write operation failed");
+    if(alloc_table_set(mfs, block, next, previous)) {
         return -1;
     }
 
-    return 0;
+    // Save to disk
+    return alloc_table_store(mfs, block, block);
 }
 
 int set_block_next(mfs_t *mfs, uint16_t block, uint16_t next) {
@@ -131,25 +334,98 @@ int set_block_previous(mfs_t *mfs, uint16_t block, uint16_t previous) {
     return set_block(mfs, block, previous, get_block_next(mfs, block));
 }
 
+// Returns the first block of a run of length free blocks, or 0 if there is none. Block 0 is always the root directory.
+uint16_t find_free_run(mfs_t *mfs, uint16_t length) {
+    uint32_t block_number = alloc_table_find_free(mfs, 1, mfs->block_count, length);
+    if(block_number >= mfs->block_count) {
+        return 0;
+    }
+
+    return (uint16_t) block_number;
+}
+
+// Like find_free_run(), but searches upwards from start first and wraps around to the beginning of the table
+uint16_t find_free_run_from(mfs_t *mfs, uint16_t start, uint16_t length) {
+    if(start < 1 || start >= mfs->block_count) {
+        start = 1;
+    }
+
+    uint32_t block_number = alloc_table_find_free(mfs, start, mfs->block_count, length);
+    if(block_number >= mfs->block_count && start > 1) {
+        block_number = alloc_table_find_free(mfs, 1, mfs->block_count, length);
+    }
+    if(block_number >= mfs->block_count) {
+        return 0;
+    }
+
+    return (uint16_t) block_number;
+}
+
 uint16_t find_free_block(mfs_t *mfs) {
-    for(uint16_t block_number = 1; block_number < mfs->block_count; block_number++) {
-        uint16_t value = get_block_next(mfs, block_number);
+    return find_free_run(mfs, 1);
+}
 
-        if(value == BLOCK_UNUSED) {
-            return block_number;
-        }
+uint16_t alloc_policy_first(mfs_t *mfs, uint16_t previous, uint16_t parent, uint16_t goal) {
+    (void) previous;
+    (void) parent;
+    (void) goal;
+    return find_free_block(mfs);
+}
+
+uint16_t alloc_policy_chain(mfs_t *mfs, uint16_t previous, uint16_t parent, uint16_t goal) {
+    (void) parent;
+    (void) goal;
+    if(previous == BLOCK_EOF) {
+        return find_free_block(mfs);
     }
 
-    return 0;
+    // Continue the chain directly behind its last block
+    return find_free_run_from(mfs, previous + 1, 1);
+}
+
+uint16_t alloc_policy_parent(mfs_t *mfs, uint16_t previous, uint16_t parent, uint16_t goal) {
+    (void) goal;
+    if(previous != BLOCK_EOF) {
+        return find_free_run_from(mfs, previous + 1, 1);
+    }
+
+    // Start new chains after the parent directory, leaving room behind whatever chain precedes them to grow
+    uint16_t run = find_free_run_from(mfs, parent + 1, 2 * ALLOC_SPREAD);
+    if(run != 0) {
+        return run + ALLOC_SPREAD;
+    }
+
+    return find_free_run_from(mfs, parent + 1, 1);
+}
+
+uint16_t alloc_policy_goal(mfs_t *mfs, uint16_t previous, uint16_t parent, uint16_t goal) {
+    if(goal != 0) {
+        return find_free_run_from(mfs, goal, 1);
+    }
+
+    return alloc_policy_parent(mfs, previous, parent, goal);
 }
 
-uint16_t alloc_free_block(mfs_t *mfs, uint16_t previous, uint16_t next) {
-    uint16_t free_block = find_free_block(mfs);
+const alloc_policy_t alloc_policies[] = {
+    [MFS_ALLOC_FIRST] = { "first", alloc_policy_first },
+    [MFS_ALLOC_CHAIN] = { "chain", alloc_policy_chain },
+    [MFS_ALLOC_PARENT] = { "parent", alloc_policy_parent },
+    [MFS_ALLOC_GOAL] = { "goal", alloc_policy_goal },
+};
+
+// previous is the block the new one is chained after (or BLOCK_EOF), parent the first block of the directory it
+// belongs to and goal a preferred block number (or 0). The open-time allocation policy decides how these are used.
+uint16_t alloc_free_block(mfs_t *mfs, uint16_t previous, uint16_t next, uint16_t parent, uint16_t goal) {
+    uint16_t free_block = alloc_policies[mfs->alloc_policy].find(mfs, previous, parent, goal);
     if(free_block == 0) {
         fprintf(stderr, "All blocks are used\n");
         return 0;
     }
 
+    if(mfs->blockmap && blockmap_attach(mfs, free_block)) {
+        return 0;
+    }
+
     if(set_block(mfs, free_block, previous, next)) {
         return 0;
     }
@@ -157,150 +433,493 @@ uint16_t alloc_free_block(mfs_t *mfs, uint16_t previous, uint16_t next) {
     return free_block;
 }
 
-directory_entry_t *next_directory_entry(directory_iterator_t *it) {
-    if(it->entry_addr >= it->mfs->block_size) {
-        // End of block reached
-        it->entry_addr = 0;
-
-        // Read next block
-        uint16_t next_block_number = get_block_next(it->mfs, it->block_number);
-        if(next_block_number == BLOCK_EOF) {
-            // The directory contains no more entries
-            it->reached_eof = true;
-            return NULL;
-        }
-        if(next_block_number == BLOCK_UNUSED) {
-            fprintf(stderr, "Block 0x%04x is unused\n", it->block_number);
-            return NULL;
-        }
+// Returns a block to the alloc table. Shared data stays until its last block is freed.
+int free_block(mfs_t *mfs, uint16_t block_number) {
+    if(mfs->blockmap && blockmap_release(mfs, block_number)) {
+        return -1;
+    }
 
-        it->block_number = next_block_number;
+    return set_block(mfs, block_number, BLOCK_UNUSED, BLOCK_UNUSED);
+}
 
-        // Seek to first block of directory
-        fseek(it->mfs->f, it->mfs->blocks_base + next_block_number * it->mfs->block_size, SEEK_SET);
+int compare_block_numbers(const void *a, const void *b) {
+    return (int) *(const uint16_t *) a - (int) *(const uint16_t *) b;
+}
 
-        // Read block into memory
-        size_t read = fread(it->block, sizeof(*it->block), it->mfs->block_size, it->mfs->f);
-        if(read != it->mfs->block_size) {
-            if(ferror(it->mfs->f)) {
-                perror("File read error");
-            } else if(feof(it->mfs->f)) {
-                fprintf(stderr, "File to short\n");
+// Frees a whole chain. The entries are cleared in memory and written back in runs of nearby blocks, so a chain laid
+// out in one piece costs a single alloc table write instead of one per block.
+int free_chain(mfs_t *mfs, uint16_t block_number) {
+    size_t capacity = 16;
+    size_t count = 0;
+    uint16_t *blocks = malloc(sizeof(*blocks) * capacity);
+    if(blocks == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    while(block_number != BLOCK_EOF) {
+        if(count == mfs->block_count || block_number == BLOCK_UNUSED) {
+            fprintf(stderr, "Chain through block 0x%04x is broken\n", block_number);
+            free(blocks);
+            return -1;
+        }
+        if(count == capacity) {
+            capacity *= 2;
+            uint16_t *grown = realloc(blocks, sizeof(*blocks) * capacity);
+            if(grown == NULL) {
+                perror("Memory allocation failed");
+                free(blocks);
+                return -1;
             }
-            return NULL;
+            blocks = grown;
         }
+        blocks[count++] = block_number;
+        block_number = get_block_next(mfs, block_number);
     }
 
-    uint16_t entry_type = read16(it->block, it->entry_addr);
-
-    if(entry_type == MFS_TYPE_END) {
-        return NULL;
-    }
+    int ret = release_blocks(mfs, blocks, count);
 
-    uint16_t entry_block = read16(it->block, it->entry_addr + 2);
-    char *entry_name = (char *) (&it->block[it->entry_addr + 4]);
+    free(blocks);
 
-    it->entry->type = entry_type;
-    it->entry->block_number = entry_block;
-    it->entry->name = entry_name;
+    return ret;
+}
 
-    it->entry_addr += DIR_ENTRY_SIZE;
+// Marks a set of blocks as unused, from any number of chains, and writes their alloc table entries in one batch
+int release_blocks(mfs_t *mfs, uint16_t *blocks, size_t count) {
+    for(size_t i = 0; i < count; i++) {
+        if(mfs->blockmap && blockmap_release(mfs, blocks[i])) {
+            return -1;
+        }
+        if(mfs->holes && holes_set(mfs, blocks[i], 0)) {
+            return -1;
+        }
+        if(alloc_table_set(mfs, blocks[i], BLOCK_UNUSED, BLOCK_UNUSED)) {
+            return -1;
+        }
+    }
 
-    return it->entry;
+    return write_alloc_blocks(mfs, blocks, count);
 }
 
-void free_directory_iterator(directory_iterator_t *it) {
-    free(it->block);
-    free(it->entry);
-    free(it);
+// Writes the alloc table entries of a set of blocks that were changed in memory. The blocks are sorted and written in
+// runs of nearby blocks.
+int write_alloc_blocks(mfs_t *mfs, uint16_t *blocks, size_t count) {
+    qsort(blocks, count, sizeof(*blocks), compare_block_numbers);
+
+    int ret = 0;
+    size_t run_start = 0;
+    for(size_t i = 1; i <= count && ret == 0; i++) {
+        // Entries in between are rewritten unchanged when that saves a separate write
+        if(i == count || blocks[i] - blocks[i - 1] > ALLOC_WRITE_GAP) {
+            ret = alloc_table_store(mfs, blocks[run_start], blocks[i - 1]);
+            run_start = i;
+        }
+    }
+
+    return ret;
 }
 
-int mfs_block_for_directory_path(mfs_t *mfs, const char *path, uint16_t *block_number_out) {
-    uint16_t block_number = 0;
+// Data blocks that don't hold anything. With a block map these are the unreferenced physical blocks.
+uint32_t free_data_blocks(mfs_t *mfs) {
+    return mfs->blockmap ? blockmap_free_count(mfs) : alloc_table_free_count(mfs);
+}
 
-    if(path[0] != '/') {
-        fprintf(stderr, "Path has to be absolute\n");
+// Takes count free blocks in one pass over the alloc table, from start on and wrapping around, and makes them chains
+// of one block in memory. The caller links them as needed and writes the entries with write_alloc_blocks().
+int alloc_free_blocks(mfs_t *mfs, uint16_t start, size_t count, uint16_t *blocks) {
+    if(count > alloc_table_free_count(mfs) || count > free_data_blocks(mfs)) {
+        fprintf(stderr, "All blocks are used\n");
         return -1;
     }
 
-    char *path_copy = strdup(path), *path_copy_start = path_copy;
-    char *path_seg;
-    while((path_seg = strsep(&path_copy, "/"))) {
-        // Skip empty segments
-        if(path_seg[0] == '\0') {
-            continue;
+    if(start == 0 || start >= mfs->block_count) {
+        start = 1;
+    }
+
+    uint32_t pos = start;
+    uint32_t end = mfs->block_count;
+    for(size_t i = 0; i < count; i++) {
+        uint32_t block_number = alloc_table_find_free(mfs, pos, end, 1);
+        if(block_number >= end && end != start) {
+            // Continue with the blocks in front of start
+            pos = 1;
+            end = start;
+            block_number = alloc_table_find_free(mfs, pos, end, 1);
+        }
+        if(block_number >= end) {
+            fprintf(stderr, "All blocks are used\n");
+            return -1;
         }
 
-        if(strlen(path_seg) + 1 > PATH_SEG_MAX) {
-            fprintf(stderr, "Path segment too long: %s\n", path_seg);
-            free(path_copy_start);
+        if(mfs->blockmap && blockmap_attach(mfs, (uint16_t) block_number)) {
             return -1;
         }
 
-        directory_iterator_t *it = create_directory_iterator(mfs, block_number);
-        if(it == NULL) {
-            fprintf(stderr, "Failed to iterate directory\n");
+        if(alloc_table_set(mfs, (uint16_t) block_number, BLOCK_EOF, BLOCK_EOF)) {
             return -1;
         }
 
-        bool found = false;
+        blocks[i] = (uint16_t) block_number;
+        pos = block_number + 1;
+    }
 
-        while(next_directory_entry(it)) {
-            // Compare the name of the subdirectory with the one we are searching for
-            if(strequals(it->entry->name, path_seg)) {
-                // Only descend to directories
-                if(it->entry->type != MFS_TYPE_DIRECTORY) {
-                    fprintf(stderr, "%s is not a directory\n", it->entry->name);
-                    free_directory_iterator(it);
-                    free(path_copy_start);
-                    return -1;
-                }
+    return 0;
+}
 
-                // We found the subdirectory
-                found = true;
-                block_number = it->entry->block_number;
-                break;
-            }
-        }
+bool advance_directory_block(directory_iterator_t *it) {
+    // End of block reached
+    it->entry_addr = 0;
 
-        free_directory_iterator(it);
+    // Read next block
+    uint16_t next_block_number = get_block_next(it->mfs, it->block_number);
+    if(next_block_number == BLOCK_EOF) {
+        // The directory contains no more entries
+        it->reached_eof = true;
+        return false;
+    }
+    if(next_block_number == BLOCK_UNUSED) {
+        fprintf(stderr, "Block 0x%04x is unused\n", it->block_number);
+        return false;
+    }
 
-        if(!found) {
-            fprintf(stderr, "%s does not exist\n", path_seg);
-            free(path_copy_start);
-            return -1;
+    it->block_number = next_block_number;
+
+    // Read block into memory
+    return read_block(it->mfs, next_block_number, it->block) == 0;
+}
+
+directory_entry_t *read_directory_entry(directory_iterator_t *it) {
+    it->entry.type = read16(it->block, it->entry_addr);
+    it->entry.block_number = read16(it->block, it->entry_addr + 2);
+    it->entry.name = (char *) (&it->block[it->entry_addr + DIR_ENTRY_NAME_OFFSET]);
+
+    it->entry_addr += DIR_ENTRY_SIZE;
+
+    return &it->entry;
+}
+
+directory_entry_t *next_directory_entry(directory_iterator_t *it) {
+    if(it->entry_addr >= it->mfs->block_size) {
+        if(!advance_directory_block(it)) {
+            return NULL;
         }
     }
 
-    free(path_copy_start);
+    uint16_t entry_type = read16(it->block, it->entry_addr);
 
-    *block_number_out = block_number;
+    if(entry_type == MFS_TYPE_END) {
+        return NULL;
+    }
 
-    return 0;
+    return read_directory_entry(it);
 }
 
-int mfs_create(char *filename, int optc, char **optv) {
-    uint16_t block_size = BLOCK_SIZE;
-    uint16_t block_count = BLOCK_COUNT;
+// Skips ahead to the next entry matching a pattern built by scan_directory_pattern(). Leaves the iterator in the
+// same state as a next_directory_entry() loop that stopped at that entry, or at the end of the directory.
+directory_entry_t *find_directory_entry(directory_iterator_t *it, const uint8_t *pattern) {
+    while(1) {
+        if(it->entry_addr >= it->mfs->block_size) {
+            if(!advance_directory_block(it)) {
+                return NULL;
+            }
+        }
 
-    for(int i = 0; i < optc; i++) {
-        char *opt = strdup(optv[i]);
-        char *name;
-        char *value;
+        uint16_t addr = it->mfs->scan_block(it->block, it->entry_addr, it->mfs->block_size, pattern);
+        if(addr >= it->mfs->block_size) {
+            it->entry_addr = it->mfs->block_size;
+            continue;
+        }
 
-        parse_opt(opt, &name, &value);
+        it->entry_addr = addr;
 
-        if(strequals(name, "bs")) {
-            if(value) {
-                block_size = (uint16_t) strtoul(value, NULL, 10);
-            }
-        } else if(strequals(name, "bc")) {
-            if(value) {
-                block_count = (uint16_t) strtoul(value, NULL, 10);
-            }
+        if(read16(it->block, addr) == MFS_TYPE_END) {
+            return NULL;
         }
 
-        free(opt);
+        return read_directory_entry(it);
+    }
+}
+
+void close_directory_iterator(directory_iterator_t *it) {
+    scratch_put(it->mfs, it->block);
+}
+
+uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000u + (uint64_t) ts.tv_nsec / 1000000u;
+}
+
+// Pushes everything written so far to the disk and marks all completed operations as durable
+int commit_operations(mfs_t *mfs) {
+    uint64_t op = group_close(mfs);
+
+    if(writeback_drain(mfs)) {
+        return -1;
+    }
+
+    if(fflush(mfs->f)) {
+        perror("Flush failed");
+        return -1;
+    }
+
+    if(fdatasync(fileno(mfs->f))) {
+        perror("fdatasync() failed");
+        return -1;
+    }
+
+    if(stripe_sync(mfs)) {
+        return -1;
+    }
+
+    group_durable(mfs, op);
+
+    return 0;
+}
+
+// Like begin_operation(), for writes to the open file. A compressed cluster being written stays in memory.
+int begin_file_write(mfs_t *mfs) {
+    if(mfs->read_only) {
+        fprintf(stderr, "The image is mounted read-only\n");
+        return -1;
+    }
+
+    return journal_begin(mfs);
+}
+
+// Called once at the start of every modifying operation
+int begin_operation(mfs_t *mfs) {
+    if(begin_file_write(mfs)) {
+        return -1;
+    }
+
+    // Other operations may look at the open file's blocks, so the cluster it is writing is stored first
+    if(compress_flush(mfs)) {
+        complete_operation(mfs, -1);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Stores the cluster of the open compressed file that is still only in memory, as an operation of its own
+int store_open_cluster(mfs_t *mfs) {
+    if(!compress_dirty(mfs)) {
+        return 0;
+    }
+
+    if(begin_operation(mfs)) {
+        return -1;
+    }
+    complete_operation(mfs, 0);
+
+    return 0;
+}
+
+// Called once at the end of every modifying operation with its result. Only operations that succeeded are numbered.
+void complete_operation(mfs_t *mfs, int result) {
+    // All metadata the operation wrote goes into the journal as one transaction
+    journal_commit(mfs);
+
+    if(result != 0) {
+        return;
+    }
+
+    switch(mfs->durability) {
+        case MFS_DURABILITY_OP:
+            group_count(mfs);
+            commit_operations(mfs);
+            break;
+        case MFS_DURABILITY_GROUP:
+            // The group thread syncs descriptors only, so the operation has to be out of the stdio buffer first
+            if(fflush(mfs->f)) {
+                perror("Flush failed");
+                return;
+            }
+            // Everything issued within the window shares one fdatasync(), the group thread closes it when it ends
+            if(group_add(mfs)) {
+                commit_operations(mfs);
+            }
+            break;
+        default:
+            group_count(mfs);
+            break;
+    }
+}
+
+// Splits a path into the directory part and the last segment like dirname() and basename(), but in place: the
+// directory is the first dir_len characters of the path. Trailing slashes are ignored, and a path made of slashes only
+// has an empty last segment.
+void split_path(const char *path, size_t *dir_len_out, const char **name_out, size_t *name_len_out) {
+    size_t end = strlen(path);
+    while(end > 0 && path[end - 1] == '/') {
+        end--;
+    }
+
+    size_t start = end;
+    while(start > 0 && path[start - 1] != '/') {
+        start--;
+    }
+
+    size_t dir_len = start;
+    while(dir_len > 1 && path[dir_len - 1] == '/') {
+        dir_len--;
+    }
+
+    *dir_len_out = end == 0 && path[0] == '/' ? 1 : dir_len;
+    *name_out = path + start;
+    *name_len_out = end - start;
+}
+
+// Resolves the directory at the first len characters of path
+int block_for_directory(mfs_t *mfs, const char *path, size_t len, uint16_t *block_number_out) {
+    uint16_t block_number = mfs->root_block_number;
+
+    if(len == 0 || path[0] != '/') {
+        fprintf(stderr, "Path has to be absolute\n");
+        return -1;
+    }
+
+    size_t pos = 0;
+    while(pos < len) {
+        // Skip empty segments
+        if(path[pos] == '/') {
+            pos++;
+            continue;
+        }
+
+        const char *path_seg = path + pos;
+        size_t seg_len = 0;
+        while(pos + seg_len < len && path_seg[seg_len] != '/') {
+            seg_len++;
+        }
+        pos += seg_len;
+
+        if(seg_len + 1 > PATH_SEG_MAX) {
+            fprintf(stderr, "Path segment too long: %.*s\n", (int) seg_len, path_seg);
+            return -1;
+        }
+
+        directory_iterator_t it;
+        if(open_directory_iterator(&it, mfs, block_number)) {
+            fprintf(stderr, "Failed to iterate directory\n");
+            return -1;
+        }
+
+        bool found = false;
+
+        uint8_t pattern[SCAN_PATTERN_SIZE];
+        scan_directory_pattern_len(pattern, path_seg, seg_len);
+
+        // Search for the subdirectory
+        if(find_directory_entry(&it, pattern)) {
+            // Only descend to directories
+            if(ENTRY_TYPE(it.entry.type) != MFS_TYPE_DIRECTORY) {
+                fprintf(stderr, "%s is not a directory\n", it.entry.name);
+                close_directory_iterator(&it);
+                return -1;
+            }
+
+            // We found the subdirectory
+            found = true;
+            block_number = it.entry.block_number;
+        }
+
+        close_directory_iterator(&it);
+
+        if(!found) {
+            fprintf(stderr, "%.*s does not exist\n", (int) seg_len, path_seg);
+            return -1;
+        }
+    }
+
+    *block_number_out = block_number;
+
+    return 0;
+}
+
+int mfs_block_for_directory_path(mfs_t *mfs, const char *path, uint16_t *block_number_out) {
+    return block_for_directory(mfs, path, strlen(path), block_number_out);
+}
+
+int mfs_create(char *filename, int optc, char **optv) {
+    uint16_t block_size = BLOCK_SIZE;
+    uint16_t block_count = BLOCK_COUNT;
+    unsigned long chain_blocks = 0;
+    int journal_blocks = -1;
+    uint16_t features = 0;
+    unsigned long cluster_blocks = CLUSTER_BLOCKS;
+    unsigned long stripes = 0;
+    unsigned long stripe_unit = STRIPE_UNIT;
+
+    for(int i = 0; i < optc; i++) {
+        char *opt = strdup(optv[i]);
+        char *name;
+        char *value;
+
+        parse_opt(opt, &name, &value);
+
+        if(strequals(name, "bs")) {
+            if(value) {
+                block_size = (uint16_t) strtoul(value, NULL, 10);
+            }
+        } else if(strequals(name, "bc")) {
+            if(value) {
+                block_count = (uint16_t) strtoul(value, NULL, 10);
+            }
+        } else if(strequals(name, "chain_blocks")) {
+            if(value) {
+                chain_blocks = strtoul(value, NULL, 10);
+            }
+        } else if(strequals(name, "jb")) {
+            if(value) {
+                journal_blocks = (int) strtoul(value, NULL, 10);
+            }
+        } else if(strequals(name, "compress")) {
+            if(value && strequals(value, "lz")) {
+                features |= FEATURE_COMPRESS;
+            } else if(value && strequals(value, "none")) {
+                features &= ~FEATURE_COMPRESS;
+            } else {
+                fprintf(stderr, "Unknown compression %s\n", value ? value : "");
+                free(opt);
+                return -1;
+            }
+        } else if(strequals(name, "cb")) {
+            if(value) {
+                cluster_blocks = strtoul(value, NULL, 10);
+            }
+        } else if(strequals(name, "blockmap")) {
+            if(value && strequals(value, "on")) {
+                features |= FEATURE_BLOCK_MAP;
+            } else if(value && strequals(value, "off")) {
+                features &= ~(FEATURE_BLOCK_MAP | FEATURE_DEDUP);
+            } else {
+                fprintf(stderr, "Unknown block map mode %s\n", value ? value : "");
+                free(opt);
+                return -1;
+            }
+        } else if(strequals(name, "dedup")) {
+            if(value && strequals(value, "on")) {
+                features |= FEATURE_BLOCK_MAP | FEATURE_DEDUP;
+            } else if(value && strequals(value, "off")) {
+                features &= ~FEATURE_DEDUP;
+            } else {
+                fprintf(stderr, "Unknown dedup mode %s\n", value ? value : "");
+                free(opt);
+                return -1;
+            }
+        } else if(strequals(name, "stripes")) {
+            if(value) {
+                stripes = strtoul(value, NULL, 10);
+            }
+        } else if(strequals(name, "su")) {
+            if(value) {
+                stripe_unit = strtoul(value, NULL, 10);
+            }
+        }
+
+        free(opt);
     }
 
     if(block_size == 0 || (block_size / DIR_ENTRY_SIZE) * DIR_ENTRY_SIZE != block_size) {
@@ -311,10 +930,45 @@ int mfs_create(char *filename, int optc, char **optv) {
         return -1;
     }
 
+    if(journal_blocks < 0) {
+        journal_blocks = (JOURNAL_DEFAULT_SIZE + block_size - 1) / block_size;
+    }
+    if(journal_blocks > 0xFFFF || (journal_blocks > 0 && (size_t) journal_blocks * block_size < JOURNAL_HEADER_SIZE + JOURNAL_MIN_LOG_SIZE)) {
+        fprintf(stderr, "Invalid journal size\n");
+        return -1;
+    }
+    if(cluster_blocks == 0 || cluster_blocks > 0xFFFF || cluster_blocks * block_size > CLUSTER_MAX_SIZE) {
+        fprintf(stderr, "Invalid cluster size\n");
+        return -1;
+    }
+    if(stripes > STRIPE_MAX_MEMBERS || stripe_unit == 0 || stripe_unit > 0xFFFF) {
+        fprintf(stderr, "Invalid stripe geometry\n");
+        return -1;
+    }
+    if(stripes > 0) {
+        features |= FEATURE_STRIPED;
+    }
+
+    // Chain blocks sharing data blocks only need entries of their own, so images with a block map get more of them
+    if(chain_blocks == 0) {
+        chain_blocks = features & FEATURE_BLOCK_MAP ? (unsigned long) block_count * CHAIN_BLOCKS_FACTOR : block_count;
+        if(chain_blocks > 0xFFFF) {
+            chain_blocks = 0xFFFF;
+        }
+    }
+    if(chain_blocks < block_count || chain_blocks > 0xFFFF || (chain_blocks != block_count && !(features & FEATURE_BLOCK_MAP))) {
+        fprintf(stderr, "Invalid chain block count\n");
+        return -1;
+    }
+
 #ifdef DEBUG
     printf("Block size: %u\n", block_size);
     printf("Block count: %u\n", block_count);
-    printf("Expected file size: %lu\n", (unsigned long) (META_INFO_BLOCK_SIZE + block_count * 2u + block_count * block_size));
+    printf("Chain blocks: %lu\n", chain_blocks);
+    printf("Journal blocks: %d\n", journal_blocks);
+    printf("Cluster blocks: %lu\n", cluster_blocks);
+    printf("Features: 0x%04x\n", features);
+    printf("Expected file size: %lu\n", (unsigned long) (SUPERBLOCK_SIZE + chain_blocks * ALLOC_TABLE_ENTRY_SIZE + (block_count + journal_blocks) * (unsigned long) block_size));
 #endif
 
     FILE *f = fopen(filename, "wb");
@@ -324,19 +978,35 @@ int mfs_create(char *filename, int optc, char **optv) {
         return EXIT_FAILURE;
     }
 
+    size_t journal_base = SUPERBLOCK_SIZE + chain_blocks * ALLOC_TABLE_ENTRY_SIZE + (size_t) block_count * block_size;
+    size_t block_map_base = journal_base + (size_t) journal_blocks * block_size;
+
     {
-        uint8_t *meta_info_block = malloc(sizeof(*meta_info_block) * META_INFO_BLOCK_SIZE);
+        uint8_t *meta_info_block = calloc(SUPERBLOCK_SIZE, sizeof(*meta_info_block));
         if (meta_info_block == NULL) {
             perror("Memory allocation failed");
             fclose(f);
             return EXIT_FAILURE;
         }
 
-        write16(meta_info_block, 0, block_size);
-        write16(meta_info_block, 2, block_count);
+        write16(meta_info_block, SB_MAGIC, MFS_MAGIC);
+        write16(meta_info_block, SB_VERSION, MFS_VERSION);
+        write16(meta_info_block, SB_BLOCK_SIZE, block_size);
+        write16(meta_info_block, SB_BLOCK_COUNT, block_count);
+        write16(meta_info_block, SB_JOURNAL_BLOCKS, (uint16_t) journal_blocks);
+        write16(meta_info_block, SB_FEATURES, features);
+        write16(meta_info_block, SB_CLUSTER_BLOCKS, (uint16_t) cluster_blocks);
+        if(features & FEATURE_BLOCK_MAP) {
+            write64(meta_info_block, SB_BLOCK_MAP_BASE, block_map_base);
+            write16(meta_info_block, SB_CHAIN_BLOCKS, (uint16_t) chain_blocks);
+        }
+        if(features & FEATURE_STRIPED) {
+            write16(meta_info_block, SB_STRIPES, (uint16_t) stripes);
+            write16(meta_info_block, SB_STRIPE_UNIT, (uint16_t) stripe_unit);
+        }
 
-        size_t written = fwrite(meta_info_block, sizeof(*meta_info_block), META_INFO_BLOCK_SIZE, f);
-        if (written != META_INFO_BLOCK_SIZE) {
+        size_t written = fwrite(meta_info_block, sizeof(*meta_info_block), SUPERBLOCK_SIZE, f);
+        if (written != SUPERBLOCK_SIZE) {
             perror("Write operation failed");
             fclose(f);
             return EXIT_FAILURE;
@@ -347,7 +1017,7 @@ int mfs_create(char *filename, int optc, char **optv) {
 
     {
         // AllocTable contains 16 bit addresses
-        size_t alloc_table_size = block_count * ALLOC_TABLE_ENTRY_SIZE;
+        size_t alloc_table_size = chain_blocks * ALLOC_TABLE_ENTRY_SIZE;
 
         uint8_t *alloc_table = calloc(alloc_table_size, sizeof(*alloc_table));
         if (alloc_table == NULL) {
@@ -371,7 +1041,13 @@ int mfs_create(char *filename, int optc, char **optv) {
         free(alloc_table);
     }
 
-    {
+    if(features & FEATURE_STRIPED) {
+        // The data blocks go to the member files, which read as zeros from the start
+        if(stripe_format(filename, (uint16_t) stripes, (uint16_t) stripe_unit, block_size, block_count)) {
+            fclose(f);
+            return EXIT_FAILURE;
+        }
+    } else {
         uint8_t *block = calloc(block_size, sizeof(*block));
         if (block == NULL) {
             perror("Memory allocation failed");
@@ -392,6 +1068,20 @@ int mfs_create(char *filename, int optc, char **optv) {
         free(block);
     }
 
+    if(journal_blocks > 0) {
+        if(journal_format(f, journal_base, (size_t) journal_blocks * block_size)) {
+            fclose(f);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if(features & FEATURE_BLOCK_MAP) {
+        if(blockmap_format(f, block_map_base, (uint16_t) chain_blocks, block_count)) {
+            fclose(f);
+            return EXIT_FAILURE;
+        }
+    }
+
 #ifdef DEBUG
     struct stat st;
     fflush(f);
@@ -407,9 +1097,107 @@ int mfs_create(char *filename, int optc, char **optv) {
     return EXIT_SUCCESS;
 }
 
-mfs_t *mfs_open(char *filename) {
+mfs_t *mfs_open(char *filename, int optc, char **optv) {
     size_t read;
 
+    mfs_alloc_policy_t alloc_policy = MFS_ALLOC_FIRST;
+    mfs_durability_t durability = MFS_DURABILITY_SYNC;
+    unsigned int group_window_ms = GROUP_WINDOW_MS;
+    unsigned int group_max_ops = GROUP_MAX_OPS;
+    const char *snapshot = NULL;
+    const char *trace = NULL;
+    unsigned int threads = TREE_THREADS;
+    unsigned int alloc_mem = ALLOC_MEM_KB;
+    unsigned int writeback = 0;
+    unsigned int dir_cache = DIR_CACHE_KB;
+
+    for(int i = 0; i < optc; i++) {
+        char *opt = strdup(optv[i]);
+        char *name;
+        char *value;
+
+        parse_opt(opt, &name, &value);
+
+        if(strequals(name, "alloc")) {
+            bool known = false;
+            for(int j = 0; value && j < (int) (sizeof(alloc_policies) / sizeof(*alloc_policies)); j++) {
+                if(strequals(value, alloc_policies[j].name)) {
+                    alloc_policy = (mfs_alloc_policy_t) j;
+                    known = true;
+                }
+            }
+            if(!known) {
+                fprintf(stderr, "Unknown allocation policy %s\n", value ? value : "");
+                free(opt);
+                return NULL;
+            }
+        } else if(strequals(name, "durability")) {
+            if(value && strequals(value, "none")) {
+                durability = MFS_DURABILITY_NONE;
+            } else if(value && strequals(value, "sync")) {
+                durability = MFS_DURABILITY_SYNC;
+            } else if(value && strequals(value, "op")) {
+                durability = MFS_DURABILITY_OP;
+            } else if(value && strequals(value, "group")) {
+                durability = MFS_DURABILITY_GROUP;
+            } else {
+                fprintf(stderr, "Unknown durability mode %s\n", value ? value : "");
+                free(opt);
+                return NULL;
+            }
+        } else if(strequals(name, "group_ms")) {
+            if(value) {
+                group_window_ms = (unsigned int) strtoul(value, NULL, 10);
+            }
+        } else if(strequals(name, "group_ops")) {
+            if(value) {
+                group_max_ops = (unsigned int) strtoul(value, NULL, 10);
+            }
+        } else if(strequals(name, "snapshot")) {
+            if(value) {
+                // Points into the option itself, which outlives the copy
+                snapshot = optv[i] + (value - opt);
+            }
+        } else if(strequals(name, "trace")) {
+            if(value) {
+                trace = optv[i] + (value - opt);
+            }
+        } else if(strequals(name, "threads")) {
+            if(value) {
+                threads = (unsigned int) strtoul(value, NULL, 10);
+            }
+            if(threads < 1 || threads > TREE_MAX_THREADS) {
+                fprintf(stderr, "threads must be between 1 and %u\n", TREE_MAX_THREADS);
+                free(opt);
+                return NULL;
+            }
+        } else if(strequals(name, "alloc_mem")) {
+            if(value) {
+                alloc_mem = (unsigned int) strtoul(value, NULL, 10);
+            }
+            if(alloc_mem < 1) {
+                fprintf(stderr, "alloc_mem must be at least 1\n");
+                free(opt);
+                return NULL;
+            }
+        } else if(strequals(name, "writeback")) {
+            if(value) {
+                writeback = (unsigned int) strtoul(value, NULL, 10);
+            }
+            if(writeback > 0 && writeback < WRITEBACK_MIN_KB) {
+                fprintf(stderr, "writeback must be 0 or at least %u\n", WRITEBACK_MIN_KB);
+                free(opt);
+                return NULL;
+            }
+        } else if(strequals(name, "dir_cache")) {
+            if(value) {
+                dir_cache = (unsigned int) strtoul(value, NULL, 10);
+            }
+        }
+
+        free(opt);
+    }
+
     FILE *f = fopen(filename, "r+b");
 
     if (f == NULL) {
@@ -417,49 +1205,86 @@ mfs_t *mfs_open(char *filename) {
         return NULL;
     }
 
-    uint8_t *meta_info_block = (uint8_t *) malloc(sizeof(*meta_info_block) * META_INFO_BLOCK_SIZE);
+    // Two processes writing the same image would corrupt it, share it through `serve` instead
+    if (flock(fileno(f), LOCK_EX | LOCK_NB)) {
+        if (errno == EWOULDBLOCK) {
+            fprintf(stderr, "The image is in use by another process\n");
+        } else {
+            perror("flock() failed");
+        }
+        fclose(f);
+        return NULL;
+    }
+
+    uint8_t *meta_info_block = (uint8_t *) calloc(SUPERBLOCK_SIZE, sizeof(*meta_info_block));
     if (meta_info_block == NULL) {
         perror("Memory allocation failed");
         fclose(f);
         return NULL;
     }
 
-    read = fread(meta_info_block, sizeof(uint8_t), META_INFO_BLOCK_SIZE, f);
-    if (read != META_INFO_BLOCK_SIZE) {
+    read = fread(meta_info_block, sizeof(uint8_t), SUPERBLOCK_V1_SIZE, f);
+    if (read == SUPERBLOCK_V1_SIZE && read16(meta_info_block, SB_MAGIC) == MFS_MAGIC) {
+        read += fread(meta_info_block + SUPERBLOCK_V1_SIZE, sizeof(uint8_t), SUPERBLOCK_SIZE - SUPERBLOCK_V1_SIZE, f);
+        if (read == SUPERBLOCK_SIZE && read16(meta_info_block, SB_VERSION) != MFS_VERSION) {
+            fprintf(stderr, "Unsupported version %u\n", read16(meta_info_block, SB_VERSION));
+            free(meta_info_block);
+            fclose(f);
+            return NULL;
+        }
+    } else if (read == SUPERBLOCK_V1_SIZE) {
+        // Version 1 header, convert it to the current layout
+        uint16_t block_size = read16(meta_info_block, 0);
+        uint16_t block_count = read16(meta_info_block, 2);
+        memset(meta_info_block, 0, SUPERBLOCK_SIZE);
+        write16(meta_info_block, SB_BLOCK_SIZE, block_size);
+        write16(meta_info_block, SB_BLOCK_COUNT, block_count);
+        read = SUPERBLOCK_SIZE;
+    }
+    if (read != SUPERBLOCK_SIZE) {
         if (ferror(f)) {
             perror("File read error");
         } else if (feof(f)) {
             fprintf(stderr, "File to short\n");
         }
+        free(meta_info_block);
         fclose(f);
         return NULL;
     }
 
-    uint16_t block_size = read16(meta_info_block, 0);
-    uint16_t block_count = read16(meta_info_block, 2);
+    bool v1 = read16(meta_info_block, SB_MAGIC) != MFS_MAGIC;
+    uint16_t block_size = read16(meta_info_block, SB_BLOCK_SIZE);
+    uint16_t block_count = read16(meta_info_block, SB_BLOCK_COUNT);
+    uint16_t journal_blocks = read16(meta_info_block, SB_JOURNAL_BLOCKS);
+    uint16_t features = read16(meta_info_block, SB_FEATURES);
+    uint16_t chain_blocks = read16(meta_info_block, SB_CHAIN_BLOCKS);
+    if(chain_blocks == 0 || !(features & FEATURE_BLOCK_MAP)) {
+        chain_blocks = block_count;
+    }
+    uint16_t cluster_blocks = read16(meta_info_block, SB_CLUSTER_BLOCKS);
+    size_t block_map_base = read64(meta_info_block, SB_BLOCK_MAP_BASE);
+    uint16_t snapshot_dir_block_number = read16(meta_info_block, SB_SNAPSHOTS);
+    uint16_t shared_block_number = read16(meta_info_block, SB_SHARED);
+    uint16_t holes_block_number = read16(meta_info_block, SB_HOLES);
+    uint16_t stripes = read16(meta_info_block, SB_STRIPES);
+    uint16_t stripe_unit = read16(meta_info_block, SB_STRIPE_UNIT);
+
+    size_t alloc_table_base = v1 ? SUPERBLOCK_V1_SIZE : SUPERBLOCK_SIZE;
+    size_t blocks_base = alloc_table_base + chain_blocks * ALLOC_TABLE_ENTRY_SIZE;
+    size_t journal_base = blocks_base + (size_t) block_count * block_size;
+    if (features & FEATURE_RELOCATED) {
+        alloc_table_base = read64(meta_info_block, SB_ALLOC_TABLE_BASE);
+        blocks_base = read64(meta_info_block, SB_BLOCKS_BASE);
+        journal_base = read64(meta_info_block, SB_JOURNAL_BASE);
+    }
 
     free(meta_info_block);
 
-    // AllocTable contains 16 bit addresses
-    size_t alloc_table_size = block_count * ALLOC_TABLE_ENTRY_SIZE;
-
-    uint8_t *alloc_table = malloc(sizeof(*alloc_table) * alloc_table_size);
-    if (alloc_table == NULL) {
-        perror("Memory allocation failed");
-        fclose(f);
-        return NULL;
+    if(cluster_blocks == 0) {
+        cluster_blocks = CLUSTER_BLOCKS;
     }
 
-    read = fread(alloc_table, sizeof(uint8_t), alloc_table_size, f);
-    if (read != alloc_table_size) {
-        if (ferror(f)) {
-            perror("File read error");
-        } else if (feof(f)) {
-            fprintf(stderr, "File to short\n");
-        }
-        fclose(f);
-        return NULL;
-    }
+    scan_init();
 
     mfs_t *mfs = malloc(sizeof(mfs_t));
     if (mfs == NULL) {
@@ -468,602 +1293,1467 @@ mfs_t *mfs_open(char *filename) {
         return NULL;
     }
 
-    size_t alloc_table_base = META_INFO_BLOCK_SIZE;
-    size_t blocks_base = alloc_table_base + block_count * ALLOC_TABLE_ENTRY_SIZE;
-
     mfs->f = f;
     mfs->block_size = block_size;
-    mfs->block_count = block_count;
+    mfs->block_shift = 0;
+    if((block_size & (block_size - 1)) == 0) {
+        while((1u << mfs->block_shift) < block_size) {
+            mfs->block_shift++;
+        }
+    }
+    mfs->scan_block = scan_directory_block_for(block_size);
+    mfs->block_count = chain_blocks;
+    mfs->data_block_count = block_count;
     mfs->alloc_table_base = alloc_table_base;
     mfs->blocks_base = blocks_base;
-    mfs->alloc_table = alloc_table;
+    mfs->features = features;
+    mfs->cluster_blocks = cluster_blocks;
+    mfs->alloc_table = NULL;
+    mfs->journal = NULL;
+    mfs->blockmap = NULL;
+    mfs->stripe = NULL;
+    mfs->trace = NULL;
+    mfs->writeback = NULL;
+    mfs->dircache = NULL;
+    mfs->group = NULL;
+    mfs->share = NULL;
+    mfs->holes = NULL;
+    mfs->snapshot_dir_block_number = snapshot_dir_block_number;
+    mfs->root_block_number = 0;
+    mfs->read_only = false;
+    mfs->alloc_policy = alloc_policy;
+    mfs->durability = durability;
+    mfs->group_window_ms = group_window_ms;
+    mfs->group_max_ops = group_max_ops;
+    mfs->threads = threads;
+    mfs->group_pending = 0;
+    mfs->group_start_ms = 0;
+    mfs->last_op = 0;
+    mfs->durable_op = 0;
     mfs->file_open = false;
+    mfs->file_dir_block_number = 0;
+    mfs->file_goal_block_number = 0;
     mfs->file_start_block_number = 0;
     mfs->file_block_number = 0;
+    mfs->file_block_index = 0;
+    mfs->file_node_index = 0;
     mfs->file_offset = 0;
+    mfs->file_compressed = false;
+    mfs->file_pos = 0;
+    mfs->file_clusters = NULL;
+    mfs->scratch = malloc(sizeof(*mfs->scratch) * SCRATCH_BLOCKS * block_size);
+    mfs->scratch_size = SCRATCH_BLOCKS * block_size;
+    mfs->scratch_used = 0;
+
+    if (mfs->scratch == NULL) {
+        perror("Memory allocation failed");
+        free(mfs);
+        fclose(f);
+        return NULL;
+    }
 
-    return mfs;
-}
-
-void mfs_free(mfs_t *mfs) {
-    free(mfs->alloc_table);
-    fclose(mfs->f);
-    free(mfs);
-}
+    // The journal may have directory entries to replay into the member files
+    if (features & FEATURE_STRIPED) {
+        if (stripe_open(mfs, filename, stripes, stripe_unit)) {
+            free(mfs->scratch);
+            free(mfs);
+            fclose(f);
+            return NULL;
+        }
+    }
+
+    // Replay the journal before anything else is read from the image
+    if (journal_blocks > 0) {
+        if (journal_open(mfs, journal_base, (size_t) journal_blocks * block_size)) {
+            fprintf(stderr, "Failed to open journal\n");
+            stripe_free(mfs);
+            free(mfs->scratch);
+            free(mfs);
+            fclose(f);
+            return NULL;
+        }
+    }
+
+    // The alloc table is read in pages as they are needed
+    if (alloc_table_open(mfs, alloc_mem)) {
+        mfs_free(mfs);
+        return NULL;
+    }
+
+    if (features & FEATURE_BLOCK_MAP) {
+        if (blockmap_open(mfs, block_map_base, (features & FEATURE_DEDUP) != 0)) {
+            fprintf(stderr, "Failed to read block map\n");
+            mfs_free(mfs);
+            return NULL;
+        }
+
+        if (shared_block_number != 0 && share_open(mfs, shared_block_number)) {
+            fprintf(stderr, "Failed to read shared chains\n");
+            mfs_free(mfs);
+            return NULL;
+        }
+    } else if (holes_block_number != 0 && holes_open(mfs, holes_block_number)) {
+        fprintf(stderr, "Failed to read holes\n");
+        mfs_free(mfs);
+        return NULL;
+    }
+
+    // Writes are buffered and written by a background thread from here on
+    if (writeback > 0) {
+        if (writeback_open(mfs, writeback)) {
+            mfs_free(mfs);
+            return NULL;
+        }
+    }
+
+    // Groups of operations are closed in the background when their window ends
+    if (durability == MFS_DURABILITY_GROUP) {
+        if (group_open(mfs)) {
+            mfs_free(mfs);
+            return NULL;
+        }
+    }
+
+    if (dir_cache > 0) {
+        if (dircache_open(mfs, dir_cache)) {
+            mfs_free(mfs);
+            return NULL;
+        }
+    }
+
+    if (snapshot) {
+        // Mount the snapshot read-only in place of the root directory
+        if (snapshot_find(mfs, snapshot, &mfs->root_block_number)) {
+            mfs_free(mfs);
+            return NULL;
+        }
+        mfs->read_only = true;
+    }
+
+    if (trace) {
+        if (trace_open(mfs, trace)) {
+            mfs_free(mfs);
+            return NULL;
+        }
+    }
+
+    return mfs;
+}
+
+void mfs_free(mfs_t *mfs) {
+    store_open_cluster(mfs);
+    compress_close(mfs);
+    trace_close(mfs);
+
+    group_free(mfs);
+
+    // Checkpoint the journal, so the image is complete without replaying it
+    journal_free(mfs);
+
+    if(mfs->group_pending > 0) {
+        commit_operations(mfs);
+    }
+
+    writeback_free(mfs);
+    dircache_free(mfs);
+    share_free(mfs);
+    holes_free(mfs);
+    blockmap_free(mfs);
+    stripe_free(mfs);
+    alloc_table_free(mfs);
+    free(mfs->scratch);
+    fclose(mfs->f);
+    free(mfs);
+}
+
+int sync_image(mfs_t *mfs) {
+    if(store_open_cluster(mfs)) {
+        return -1;
+    }
+
+    if(mfs->durability == MFS_DURABILITY_NONE) {
+        // Hand the data to the OS, but don't wait for the disk
+        if(writeback_drain(mfs) || fflush(mfs->f)) {
+            perror("Flush failed");
+            return -1;
+        }
+        return 0;
+    }
+
+    return commit_operations(mfs);
+}
+
+int mfs_sync(mfs_t *mfs) {
+    uint64_t start = trace_clock(mfs);
+    int ret = sync_image(mfs);
+    trace_record(mfs, TRACE_SYNC, start, ret, NULL, NULL, 0);
+    return ret;
+}
+
+// Operations are numbered from 1 in the order they complete. Operation n is on disk once mfs_durable_op() >= n.
+uint64_t mfs_last_op(mfs_t *mfs) {
+    return mfs->last_op;
+}
+
+uint64_t mfs_durable_op(mfs_t *mfs) {
+    return group_durable_op(mfs);
+}
 
 int mfs_info(mfs_t *mfs) {
     printf("Block size: %u\n", mfs->block_size);
-    printf("Block count: %u\n", mfs->block_count);
+    printf("Block count: %u\n", mfs->data_block_count);
+    if(mfs->block_count != mfs->data_block_count) {
+        printf("Chain blocks: %u\n", mfs->block_count);
+    }
+    if(mfs->features & FEATURE_COMPRESS) {
+        printf("Compression: lz, %u blocks per cluster\n", mfs->cluster_blocks);
+    }
+    if(mfs->features & FEATURE_STRIPED) {
+        printf("Striped over %u files, %u blocks per unit\n", stripe_members(mfs), stripe_unit_blocks(mfs));
+    }
 
-    unsigned int unused = 0;
-    unsigned int used = 0;
-    for(uint16_t i = 0; i < mfs->block_count; i++) {
-        uint16_t value = get_block_next(mfs, i);
+    // Every chain block needs a physical block, so what is left is the smaller of the two
+    unsigned int unused = alloc_table_free_count(mfs);
+    unsigned int used = mfs->block_count - unused;
+    if(free_data_blocks(mfs) < unused) {
+        unused = free_data_blocks(mfs);
+    }
+    printf("%u blocks (%u bytes) used, %u unused (%u bytes)\n", used, used * mfs->block_size, unused, unused * mfs->block_size);
 
-        if(value == BLOCK_UNUSED) {
-            unused++;
-        } else {
-            used++;
+    if(mfs->blockmap) {
+        unsigned int physical = blockmap_count_used(mfs);
+        printf("Deduplication: %s\n", mfs->features & FEATURE_DEDUP ? "on" : "off");
+        printf("%u physical blocks (%u bytes) hold the data, %u blocks shared\n", physical, physical * mfs->block_size, used - physical);
+    }
+
+    return 0;
+}
+
+// Makes sure a directory has no entry with a name yet and finds the slot for a new entry. With *full_out set the
+// directory has no free slot and the new entry goes into a block appended behind *slot_block_out.
+int find_entry_slot(mfs_t *mfs, uint16_t block_number, const char *name, size_t name_len, uint16_t *slot_block_out, uint16_t *slot_addr_out, bool *full_out) {
+    bool exists;
+    dircache_lookup_t lookup;
+    if(dircache_lookup(mfs, block_number, name, name_len, &lookup)) {
+        exists = lookup.found;
+        *slot_block_out = lookup.end_block;
+        *slot_addr_out = lookup.end_addr;
+        *full_out = lookup.full;
+    } else {
+        directory_iterator_t it;
+        if(open_directory_iterator(&it, mfs, block_number)) {
+            fprintf(stderr, "Failed to iterate directory\n");
+            return -1;
         }
+
+        uint8_t pattern[SCAN_PATTERN_SIZE];
+        scan_directory_pattern_len(pattern, name, name_len);
+
+        // Look for an entry with the name we'd like to use, stopping at the end slot otherwise
+        exists = find_directory_entry(&it, pattern) != NULL;
+
+        *slot_block_out = it.block_number;
+        *slot_addr_out = it.entry_addr;
+        *full_out = it.reached_eof;
+
+        close_directory_iterator(&it);
+    }
+
+    if(exists) {
+        fprintf(stderr, "%.*s already exists\n", (int) name_len, name);
+        return -1;
     }
-    printf("%u blocks (%u bytes) used, %u unused (%u bytes)\n", used, used * mfs->block_size, unused, unused * mfs->block_size);
 
     return 0;
 }
 
-int mfs_mkdir(mfs_t *mfs, const char *path) {
-    char *path_copy1 = strdup(path);
-    char *path_copy2 = strdup(path);
-    char *dir = dirname(path_copy1);
-    char *name = basename(path_copy2);
+int mkdir_path(mfs_t *mfs, const char *path) {
+    size_t dir_len, name_len;
+    const char *name;
+    split_path(path, &dir_len, &name, &name_len);
 
-    if(strequals(name, "/")) {
+    if(name_len == 0) {
         fprintf(stderr, "The root directory can not be modified\n");
-        free(path_copy1);
-        free(path_copy2);
         return -1;
     }
 
-    if(strlen(name) + 1 > PATH_SEG_MAX) {
-        fprintf(stderr, "Directory name too long: %s\n", name);
-        free(path_copy1);
-        free(path_copy2);
+    if(name_len + 1 > PATH_SEG_MAX) {
+        fprintf(stderr, "Directory name too long: %.*s\n", (int) name_len, name);
         return -1;
     }
 
     uint16_t block_number = 0;
-    int ret = mfs_block_for_directory_path(mfs, dir, &block_number);
+    int ret = block_for_directory(mfs, path, dir_len, &block_number);
     if(ret) {
-        free(path_copy1);
-        free(path_copy2);
         return -1;
     }
 
-    directory_iterator_t *it = create_directory_iterator(mfs, block_number);
-    if(it == NULL) {
-        free(path_copy1);
-        free(path_copy2);
+    uint16_t dir_block_number = 0;
+    uint16_t empty_addr = 0;
+    bool reached_eof = false;
+    if(find_entry_slot(mfs, block_number, name, name_len, &dir_block_number, &empty_addr, &reached_eof)) {
+        return -1;
+    }
+
+    // Find first free block
+    uint16_t new_block_number = alloc_free_block(mfs, BLOCK_EOF, BLOCK_EOF, block_number, 0);
+    if(new_block_number == 0 || zero_block(mfs, new_block_number)) {
+        return -1;
+    }
+
+    uint16_t entry_block_number = dir_block_number;
+    if(reached_eof) {
+        entry_block_number = alloc_free_block(mfs, dir_block_number, BLOCK_EOF, block_number, 0);
+        if(entry_block_number == 0 || zero_block(mfs, entry_block_number)) {
+            return -1;
+        }
+
+        if(set_block_next(mfs, dir_block_number, entry_block_number)) {
+            dircache_forget(mfs, block_number);
+            return -1;
+        }
+    }
+
+    // Write the entry for the new directory in its parent directory
+    uint8_t entry[DIR_ENTRY_SIZE] = { 0 };
+
+    write16(entry, 0, MFS_TYPE_DIRECTORY);
+    write16(entry, 2, new_block_number);
+    memcpy(&entry[DIR_ENTRY_NAME_OFFSET], name, name_len);
+
+    if(write_metadata(mfs, block_offset(mfs, entry_block_number) + empty_addr, entry, DIR_ENTRY_SIZE)) {
+        dircache_forget(mfs, block_number);
         return -1;
     }
 
-    bool exists = false;
-    while(next_directory_entry(it)) {
-        // Compare the name of the subdirectory with the one we are searching for
-        if(strequals(it->entry->name, name)) {
-            exists = true;
+    dircache_added(mfs, block_number, name, name_len, entry_block_number);
+
+    return 0;
+}
+
+int mfs_mkdir(mfs_t *mfs, const char *path) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_operation(mfs)) {
+        return -1;
+    }
+    int ret = mkdir_path(mfs, path);
+    complete_operation(mfs, ret);
+    trace_record(mfs, TRACE_MKDIR, start, ret, path, NULL, 0);
+    return ret;
+}
+
+// Fills entries with up to max entries of a directory, starting at *cursor, and moves the cursor behind them. Memory use
+// doesn't depend on the size of the directory. Entries removed or added between calls may be missed, because removing
+// an entry moves the last entry into its slot; a cursor pointing at a block the directory no longer has ends the
+// listing.
+int read_directory_page(mfs_t *mfs, const char *path, mfs_dir_cursor_t *cursor, mfs_dirent_t *entries, size_t max, size_t *count_out) {
+    *count_out = 0;
+    if(*cursor == MFS_DIR_CURSOR_END) {
+        return 0;
+    }
+
+    uint16_t block_number = 0;
+    if(mfs_block_for_directory_path(mfs, path, &block_number)) {
+        fprintf(stderr, "Directory %s not found\n", path);
+        return -1;
+    }
+
+    // Block 0 is the first block of the root directory and never part of another one, so 0 can mean the start
+    uint16_t cursor_block = (uint16_t) (*cursor >> 16);
+    uint16_t cursor_addr = (uint16_t) *cursor;
+    if(cursor_addr > mfs->block_size || cursor_addr % DIR_ENTRY_SIZE != 0) {
+        fprintf(stderr, "Invalid directory cursor\n");
+        return -1;
+    }
+    if(cursor_block != 0) {
+        // Only the alloc table is read to find the block in the directory's chain
+        while(block_number != cursor_block && block_number != BLOCK_EOF && block_number != BLOCK_UNUSED) {
+            block_number = get_block_next(mfs, block_number);
+        }
+        if(block_number != cursor_block) {
+            *cursor = MFS_DIR_CURSOR_END;
+            return 0;
+        }
+    }
+
+    directory_iterator_t it;
+    if(open_directory_iterator(&it, mfs, block_number)) {
+        fprintf(stderr, "Failed to iterate directory\n");
+        return -1;
+    }
+    it.entry_addr = cursor_addr;
+
+    size_t count = 0;
+    bool done = false;
+    while(count < max) {
+        if(next_directory_entry(&it) == NULL) {
+            done = true;
             break;
         }
+
+        mfs_dirent_t *entry = &entries[count++];
+        entry->type = it.entry.type;
+        entry->block_number = it.entry.block_number;
+        memcpy(entry->name, it.entry.name, MFS_NAME_MAX);
+        entry->name[MFS_NAME_MAX - 1] = '\0';
     }
 
-    uint16_t dir_block_number = it->block_number;
-    uint16_t empty_addr = it->entry_addr;
-    bool reached_eof = it->reached_eof;
+    if(done && !it.reached_eof && it.entry_addr < mfs->block_size && read16(it.block, it.entry_addr) != MFS_TYPE_END) {
+        // Stopped on a broken chain rather than at the end of the directory
+        close_directory_iterator(&it);
+        return -1;
+    }
 
-    free_directory_iterator(it);
+    *cursor = done ? MFS_DIR_CURSOR_END : (mfs_dir_cursor_t) it.block_number << 16 | it.entry_addr;
+    *count_out = count;
 
-    if(exists) {
-        fprintf(stderr, "%s already exists\n", name);
-        free(path_copy1);
-        free(path_copy2);
+    close_directory_iterator(&it);
+
+    return 0;
+}
+
+int mfs_readdir(mfs_t *mfs, const char *path, mfs_dir_cursor_t *cursor, mfs_dirent_t *entries, size_t max, size_t *count_out) {
+    uint64_t start = trace_clock(mfs);
+    mfs_dir_cursor_t from = *cursor;
+    int ret = read_directory_page(mfs, path, cursor, entries, max, count_out);
+    trace_record_args(mfs, TRACE_READDIR, start, ret, path, NULL, max > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t) max, from);
+    return ret;
+}
+
+int list_directory(mfs_t *mfs, const char *path) {
+    mfs_dirent_t entries[LS_BATCH_ENTRIES];
+    mfs_dir_cursor_t cursor = MFS_DIR_CURSOR_START;
+
+    while(cursor != MFS_DIR_CURSOR_END) {
+        size_t count;
+        if(read_directory_page(mfs, path, &cursor, entries, LS_BATCH_ENTRIES, &count)) {
+            return -1;
+        }
+
+        for(size_t i = 0; i < count; i++) {
+            uint16_t type = ENTRY_TYPE(entries[i].type);
+            printf("%-4s 0x%04x %-*s%s\n", type == MFS_TYPE_DIRECTORY ? "dir" : type == MFS_TYPE_FILE ? "file" : "unkn", entries[i].block_number, PATH_SEG_MAX, entries[i].name, entries[i].type & ENTRY_FLAG_COMPRESSED ? " (compressed)" : "");
+        }
+    }
+
+    return 0;
+}
+
+int mfs_ls(mfs_t *mfs, const char *path) {
+    uint64_t start = trace_clock(mfs);
+    int ret = list_directory(mfs, path);
+    trace_record(mfs, TRACE_LS, start, ret, path, NULL, 0);
+    return ret;
+}
+
+int touch_path(mfs_t *mfs, const char *path, uint16_t flags) {
+    size_t dir_len, name_len;
+    const char *name;
+    split_path(path, &dir_len, &name, &name_len);
+
+    if(name_len == 0) {
+        fprintf(stderr, "The root directory can not be modified\n");
+        return -1;
+    }
+
+    if(name_len + 1 > PATH_SEG_MAX) {
+        fprintf(stderr, "File name too long: %.*s\n", (int) name_len, name);
         return -1;
+    }
+
+    uint16_t block_number = 0;
+    int ret = block_for_directory(mfs, path, dir_len, &block_number);
+    if(ret) {
+        fprintf(stderr, "Failed to open directory\n");
+        return -1;
+    }
+
+    uint16_t dir_block_number = 0;
+    uint16_t empty_addr = 0;
+    bool reached_eof = false;
+    if(find_entry_slot(mfs, block_number, name, name_len, &dir_block_number, &empty_addr, &reached_eof)) {
+        return -1;
+    }
+
+    uint16_t new_block_number = alloc_free_block(mfs, BLOCK_EOF, BLOCK_EOF, block_number, 0);
+    if(new_block_number == 0) {
+        fprintf(stderr, "All blocks are used\n");
+        return -1;
+    }
+
+    uint16_t entry_block_number = dir_block_number;
+    if(reached_eof) {
+        entry_block_number = alloc_free_block(mfs, dir_block_number, BLOCK_EOF, block_number, 0);
+        if(entry_block_number == 0) {
+            fprintf(stderr, "All blocks are used\n");
+            return -1;
+        }
+        if(zero_block(mfs, entry_block_number)) {
+            return -1;
+        }
+
+        if(set_block_next(mfs, dir_block_number, entry_block_number)) {
+            dircache_forget(mfs, block_number);
+            return -1;
+        }
+    }
+
+    if(flags & ENTRY_FLAG_COMPRESSED) {
+        // Compressed files always start with a cluster header
+        if(compress_format_file(mfs, new_block_number)) {
+            dircache_forget(mfs, block_number);
+            return -1;
+        }
+    }
+
+    // Write the entry for the new file in its parent directory
+    uint8_t entry[DIR_ENTRY_SIZE] = { 0 };
+
+    write16(entry, 0, MFS_TYPE_FILE | flags);
+    write16(entry, 2, new_block_number);
+    memcpy(&entry[DIR_ENTRY_NAME_OFFSET], name, name_len);
+
+    if(write_metadata(mfs, block_offset(mfs, entry_block_number) + empty_addr, entry, DIR_ENTRY_SIZE)) {
+        dircache_forget(mfs, block_number);
+        return -1;
+    }
+
+    dircache_added(mfs, block_number, name, name_len, entry_block_number);
+
+    return 0;
+}
+
+int mfs_touch(mfs_t *mfs, const char *path) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_operation(mfs)) {
+        return -1;
+    }
+    int ret = touch_path(mfs, path, mfs->features & FEATURE_COMPRESS ? ENTRY_FLAG_COMPRESSED : 0);
+    complete_operation(mfs, ret);
+    trace_record(mfs, TRACE_TOUCH, start, ret, path, NULL, 0);
+    return ret;
+}
+
+// Creates a compressed file, whether or not the image compresses new files by default
+int mfs_touch_compressed(mfs_t *mfs, const char *path) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_operation(mfs)) {
+        return -1;
+    }
+    int ret = touch_path(mfs, path, ENTRY_FLAG_COMPRESSED);
+    complete_operation(mfs, ret);
+    trace_record(mfs, TRACE_CTOUCH, start, ret, path, NULL, 0);
+    return ret;
+}
+
+// Removes an entry and frees its chain, or with recursive set everything below a directory as well
+int remove_path(mfs_t *mfs, const char *path, bool recursive) {
+    size_t dir_len, name_len;
+    const char *name;
+    split_path(path, &dir_len, &name, &name_len);
+
+    if(name_len == 0) {
+        fprintf(stderr, "The root directory can not be modified\n");
+        return -1;
+    }
+
+    if(name_len + 1 > PATH_SEG_MAX) {
+        fprintf(stderr, "File name too long: %.*s\n", (int) name_len, name);
+        return -1;
+    }
+
+    uint16_t block_number = 0;
+    int ret = block_for_directory(mfs, path, dir_len, &block_number);
+    if(ret) {
+        fprintf(stderr, "Directory %.*s not found\n", (int) dir_len, path);
+        return -1;
+    }
+
+    bool found = false;
+    uint16_t last_entry_addr = 0;
+    uint16_t last_entry_block = 0;
+    uint16_t file_block_number = 0;
+    uint16_t file_type = 0;
+    uint16_t file_entry_addr = 0;
+    uint16_t file_entry_block = 0;
+
+    dircache_lookup_t lookup;
+    bool cached = dircache_lookup(mfs, block_number, name, name_len, &lookup);
+    if(cached) {
+        // The cache knows where the entry and the last entry are without reading the directory
+        found = lookup.found;
+        file_block_number = lookup.block_number;
+        file_type = lookup.type;
+        file_entry_addr = lookup.slot_addr;
+        file_entry_block = lookup.slot_block;
+        last_entry_addr = lookup.last_addr;
+        last_entry_block = lookup.last_block;
     } else {
-        // Find first free block
-        uint16_t new_block_number = alloc_free_block(mfs, BLOCK_EOF, BLOCK_EOF);
-        if(new_block_number == 0) {
-            free(path_copy1);
-            free(path_copy2);
+        directory_iterator_t it;
+        if(open_directory_iterator(&it, mfs, block_number)) {
+            fprintf(stderr, "Failed to iterate directory\n");
+            return -1;
+        }
+
+        uint8_t pattern[SCAN_PATTERN_SIZE];
+        scan_directory_pattern_len(pattern, name, name_len);
+
+        if(find_directory_entry(&it, pattern)) {
+            found = true;
+            file_block_number = it.entry.block_number;
+            file_type = it.entry.type;
+            // it.entry_addr is incremented after the entry is read, so it refers to the next entry
+            file_entry_addr = it.entry_addr - DIR_ENTRY_SIZE;
+            file_entry_block = it.block_number;
+
+            // Skip to the end of the directory to locate the last entry
+            scan_directory_end_pattern(pattern);
+            find_directory_entry(&it, pattern);
+
+            if(it.reached_eof) {
+                last_entry_addr = mfs->block_size - DIR_ENTRY_SIZE;
+                last_entry_block = it.block_number;
+            } else if(it.entry_addr == 0) {
+                // The terminator starts a block, so the last entry ends the previous one
+                last_entry_addr = mfs->block_size - DIR_ENTRY_SIZE;
+                last_entry_block = get_block_previous(mfs, it.block_number);
+            } else {
+                last_entry_addr = it.entry_addr - DIR_ENTRY_SIZE;
+                last_entry_block = it.block_number;
+            }
+        }
+
+        close_directory_iterator(&it);
+    }
+
+    if(found) {
+        int freed;
+        if(recursive && ENTRY_TYPE(file_type) == MFS_TYPE_DIRECTORY) {
+            freed = tree_free(mfs, file_block_number);
+        } else {
+            // Snapshots may still refer to a file's chain
+            freed = share_release(mfs, file_block_number);
+        }
+        // Cached directories whose chains were just freed are gone
+        dircache_forget_freed(mfs);
+        if(freed) {
+            return -1;
+        }
+
+        uint8_t entry[DIR_ENTRY_SIZE];
+        // The last entry takes the place of the removed one and its own slot becomes the end of the directory
+        if(last_entry_block != file_entry_block || last_entry_addr != file_entry_addr) {
+            if(read_metadata(mfs, block_offset(mfs, last_entry_block) + last_entry_addr, entry, DIR_ENTRY_SIZE)) {
+                fprintf(stderr, "Failed to read entry\n");
+                dircache_forget(mfs, block_number);
+                return -1;
+            }
+            if(write_metadata(mfs, block_offset(mfs, file_entry_block) + file_entry_addr, entry, DIR_ENTRY_SIZE)) {
+                fprintf(stderr, "Failed to write entry\n");
+                dircache_forget(mfs, block_number);
+                return -1;
+            }
+        }
+        memset(entry, 0, DIR_ENTRY_SIZE);
+        if(write_metadata(mfs, block_offset(mfs, last_entry_block) + last_entry_addr, entry, DIR_ENTRY_SIZE)) {
+            fprintf(stderr, "Failed to write entry\n");
+            dircache_forget(mfs, block_number);
+            return -1;
+        }
+
+        if(cached) {
+            dircache_removed(mfs, block_number, lookup.index);
+        }
+    } else {
+        fprintf(stderr, "File not found\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int rm_path(mfs_t *mfs, const char *path) {
+    return remove_path(mfs, path, false);
+}
+
+int mfs_rm(mfs_t *mfs, const char *path) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_operation(mfs)) {
+        return -1;
+    }
+    int ret = rm_path(mfs, path);
+    complete_operation(mfs, ret);
+    trace_record(mfs, TRACE_RM, start, ret, path, NULL, 0);
+    return ret;
+}
+
+int mfs_rmdir(mfs_t *mfs, const char *path) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_operation(mfs)) {
+        return -1;
+    }
+    int ret = rm_path(mfs, path);
+    complete_operation(mfs, ret);
+    trace_record(mfs, TRACE_RMDIR, start, ret, path, NULL, 0);
+    return ret;
+}
+
+// Looks up a file, returning the first block of the directory it is in, its first block and the type of its entry
+int find_file(mfs_t *mfs, const char *path, uint16_t *dir_block_number_out, uint16_t *block_number_out, uint16_t *type_out) {
+    size_t dir_len, name_len;
+    const char *name;
+    split_path(path, &dir_len, &name, &name_len);
+
+    if(name_len == 0) {
+        fprintf(stderr, "The root directory can not be modified\n");
+        return -1;
+    }
+
+    if(name_len + 1 > PATH_SEG_MAX) {
+        fprintf(stderr, "Directory name too long: %.*s\n", (int) name_len, name);
+        return -1;
+    }
+
+    uint16_t block_number = 0;
+    int ret = block_for_directory(mfs, path, dir_len, &block_number);
+    if(ret) {
+        fprintf(stderr, "Directory %.*s not found\n", (int) dir_len, path);
+        return -1;
+    }
+
+    directory_iterator_t it;
+    if(open_directory_iterator(&it, mfs, block_number)) {
+        fprintf(stderr, "Failed to iterate directory\n");
+        return -1;
+    }
+
+    bool found = false;
+    uint16_t file_block_number = 0;
+    uint16_t type = 0;
+
+    uint8_t pattern[SCAN_PATTERN_SIZE];
+    scan_directory_pattern_len(pattern, name, name_len);
+
+    if(find_directory_entry(&it, pattern)) {
+        if(ENTRY_TYPE(it.entry.type) != MFS_TYPE_FILE) {
+            fprintf(stderr, "Not a file\n");
+            close_directory_iterator(&it);
+            return -1;
+        }
+
+        found = true;
+        file_block_number = it.entry.block_number;
+        type = it.entry.type;
+    }
+
+    close_directory_iterator(&it);
+
+    if(!found) {
+        fprintf(stderr, "File not found\n");
+        return -1;
+    }
+
+    *dir_block_number_out = block_number;
+    *block_number_out = file_block_number;
+    *type_out = type;
+
+    return 0;
+}
+
+int open_file(mfs_t *mfs, const char *path) {
+    if(mfs->file_open) {
+        fprintf(stderr, "Only one file can be open at a time\n");
+        return -1;
+    }
+
+    uint16_t block_number = 0;
+    uint16_t file_block_number = 0;
+    uint16_t type = 0;
+    if(find_file(mfs, path, &block_number, &file_block_number, &type)) {
+        return -1;
+    }
+
+    bool compressed = (type & ENTRY_FLAG_COMPRESSED) != 0;
+    if(compressed && compress_open(mfs, file_block_number)) {
+        fprintf(stderr, "Failed to open compressed file\n");
+        return -1;
+    }
+
+    mfs->file_open = true;
+    mfs->file_compressed = compressed;
+    mfs->file_dir_block_number = block_number;
+    mfs->file_goal_block_number = 0;
+    mfs->file_start_block_number = file_block_number;
+    mfs->file_block_number = file_block_number;
+    mfs->file_block_index = 0;
+    mfs->file_node_index = 0;
+    mfs->file_offset = 0;
+
+    return 0;
+}
+
+int mfs_fopen(mfs_t *mfs, const char *path) {
+    uint64_t start = trace_clock(mfs);
+    int ret = open_file(mfs, path);
+    trace_record(mfs, TRACE_FOPEN, start, ret, path, NULL, 0);
+    return ret;
+}
+
+int close_file(mfs_t *mfs) {
+    if(!mfs->file_open) {
+        fprintf(stderr, "No open file\n");
+        return -1;
+    }
+
+    int ret = store_open_cluster(mfs);
+    compress_close(mfs);
+
+    mfs->file_open = false;
+    mfs->file_compressed = false;
+
+    return ret;
+}
+
+int mfs_fclose(mfs_t *mfs) {
+    uint64_t start = trace_clock(mfs);
+    int ret = close_file(mfs);
+    trace_record(mfs, TRACE_FCLOSE, start, ret, NULL, NULL, 0);
+    return ret;
+}
+
+int mfs_finfo(mfs_t *mfs) {
+    printf("Open:           %s\n", mfs->file_open ? "yes" : "no");
+    if(mfs->file_open) {
+        printf("Start block:    0x%04x\n", mfs->file_start_block_number);
+        if(mfs->file_compressed) {
+            printf("Compressed:     yes\n");
+            printf("Size:           %u\n", compress_file_size(mfs));
+            printf("Position:       %u\n", mfs->file_pos);
+        } else {
+            printf("Current block:  0x%04x\n", mfs->file_block_number);
+            printf("Current offset: %u\n", mfs->file_offset);
+        }
+        if(mfs->file_goal_block_number != 0) {
+            printf("Goal block:     0x%04x\n", mfs->file_goal_block_number);
+        }
+    }
+    return 0;
+}
+
+int set_file_goal(mfs_t *mfs, uint16_t block_number) {
+    if(!mfs->file_open) {
+        fprintf(stderr, "No open file\n");
+        return -1;
+    }
+
+    if(block_number >= mfs->block_count) {
+        fprintf(stderr, "Block 0x%04x is out of range\n", block_number);
+        return -1;
+    }
+
+    mfs->file_goal_block_number = block_number;
+
+    return 0;
+}
+
+int mfs_fgoal(mfs_t *mfs, uint16_t block_number) {
+    uint64_t start = trace_clock(mfs);
+    int ret = set_file_goal(mfs, block_number);
+    trace_record(mfs, TRACE_FGOAL, start, ret, NULL, NULL, block_number);
+    return ret;
+}
+
+// Returns the length of the hole a file block stands for, 0 if it holds data. Images with a block map mark holes in
+// it, others list them in a table.
+uint32_t file_block_hole(mfs_t *mfs, uint16_t block_number) {
+    return mfs->blockmap ? blockmap_hole_blocks(mfs, block_number) : holes_blocks(mfs, block_number);
+}
+
+// Turns a file block into a hole of the given length, or back into a data block with undefined contents if it is 0
+int set_file_block_hole(mfs_t *mfs, uint16_t block_number, uint32_t blocks) {
+    return mfs->blockmap ? blockmap_set_hole(mfs, block_number, blocks) : holes_set(mfs, block_number, blocks);
+}
+
+// Number of blocks of the file a chain block covers
+uint32_t file_block_span(mfs_t *mfs, uint16_t block_number) {
+    uint32_t hole = file_block_hole(mfs, block_number);
+    return hole > 0 ? hole : 1;
+}
+
+// Moves the open file to the chain block covering file_block_index. Returns false if the position is past the end of
+// the file, leaving the last chain block current.
+bool locate_file_block(mfs_t *mfs) {
+    while(mfs->file_block_index < mfs->file_node_index) {
+        uint16_t previous = get_block_previous(mfs, mfs->file_block_number);
+        if(previous == BLOCK_EOF) {
+            fprintf(stderr, "Block 0x%04x has no previous block\n", mfs->file_block_number);
+            return false;
+        }
+        mfs->file_block_number = previous;
+        mfs->file_node_index -= file_block_span(mfs, previous);
+    }
+
+    uint32_t span = file_block_span(mfs, mfs->file_block_number);
+    while(mfs->file_block_index - mfs->file_node_index >= span) {
+        uint16_t next = get_block_next(mfs, mfs->file_block_number);
+        if(next == BLOCK_EOF) {
+            return false;
+        }
+        mfs->file_block_number = next;
+        mfs->file_node_index += span;
+        span = file_block_span(mfs, next);
+    }
+
+    return true;
+}
+
+// Positions past the end of the file are fine, writing there fills the gap with a hole
+int seek_file(mfs_t *mfs, uint32_t pos) {
+    if(!mfs->file_open) {
+        fprintf(stderr, "No open file\n");
+        return -1;
+    }
+
+    if(mfs->file_compressed) {
+        return compress_seek(mfs, pos);
+    }
+
+    mfs->file_block_index = block_of_pos(mfs, pos);
+    mfs->file_offset = offset_in_block(mfs, pos);
+
+    if(!locate_file_block(mfs) && mfs->file_block_index < mfs->file_node_index) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int mfs_fseek(mfs_t *mfs, uint32_t pos) {
+    uint64_t start = trace_clock(mfs);
+    int ret = seek_file(mfs, pos);
+    trace_record(mfs, TRACE_FSEEK, start, ret, NULL, NULL, pos);
+    return ret;
+}
+
+// Adds a chain block to the open file between previous and next
+uint16_t insert_file_block(mfs_t *mfs, uint16_t previous, uint16_t next) {
+    uint16_t block_number = alloc_free_block(mfs, previous, next, mfs->file_dir_block_number, mfs->file_goal_block_number);
+    if(block_number == 0) {
+        return 0;
+    }
+    if(mfs->file_goal_block_number != 0) {
+        // Keep following the goal with the rest of the file
+        mfs->file_goal_block_number = block_number + 1;
+    }
+    if(set_block_next(mfs, previous, block_number)) {
+        return 0;
+    }
+    if(next != BLOCK_EOF && set_block_previous(mfs, next, block_number)) {
+        return 0;
+    }
+    return block_number;
+}
+
+int zero_file_block(mfs_t *mfs, uint16_t block_number) {
+    uint8_t *block = scratch_get(mfs, mfs->block_size);
+    if(block == NULL) {
+        return -1;
+    }
+    memset(block, 0, mfs->block_size);
+
+    int ret = write_block_data(mfs, block_number, 0, block, mfs->block_size);
+    scratch_put(mfs, block);
+
+    return ret;
+}
+
+// Appends a hole of the given number of blocks behind previous. Returns the last block of the file, or 0 on failure.
+uint16_t extend_file(mfs_t *mfs, uint16_t previous, uint32_t blocks) {
+    if(blocks == 0) {
+        return previous;
+    }
+
+    uint16_t hole = insert_file_block(mfs, previous, BLOCK_EOF);
+    if(hole == 0 || set_file_block_hole(mfs, hole, blocks)) {
+        return 0;
+    }
+
+    return hole;
+}
+
+// Makes the block at the open file's position a data block: blocks past the end are appended, with a hole in front if
+// the position is further out, and holes are split around it
+int prepare_file_block(mfs_t *mfs) {
+    if(!locate_file_block(mfs)) {
+        if(mfs->file_block_index < mfs->file_node_index) {
+            return -1;
+        }
+
+        uint32_t end = mfs->file_node_index + file_block_span(mfs, mfs->file_block_number);
+        uint16_t previous = extend_file(mfs, mfs->file_block_number, mfs->file_block_index - end);
+        if(previous == 0) {
             return -1;
         }
 
-        if(reached_eof) {
-            block_number = alloc_free_block(mfs, dir_block_number, BLOCK_EOF);
-            if(block_number == 0) {
-                free(path_copy1);
-                free(path_copy2);
-                return -1;
-            }
-
-            if(set_block_next(mfs, dir_block_number, block_number)) {
-                free(path_copy1);
-                free(path_copy2);
-                return -1;
-            }
-        } else {
-            block_number = dir_block_number;
+        uint16_t block_number = insert_file_block(mfs, previous, BLOCK_EOF);
+        if(block_number == 0 || zero_file_block(mfs, block_number)) {
+            return -1;
         }
 
-        // Write the entry for the new directory in its parent directory
-        fseek(mfs->f, mfs->blocks_base + mfs->block_size * block_number + empty_addr, SEEK_SET);
+        mfs->file_block_number = block_number;
+        mfs->file_node_index = mfs->file_block_index;
+
+        return 0;
+    }
 
-        uint8_t entry[DIR_ENTRY_SIZE] = { 0 };
+    uint32_t hole = file_block_hole(mfs, mfs->file_block_number);
+    if(hole == 0) {
+        return 0;
+    }
 
-        write16(entry, 0, MFS_TYPE_DIRECTORY);
-        write16(entry, 2, new_block_number);
-        strcpy((char *) &entry[4], name);
+    uint32_t before = mfs->file_block_index - mfs->file_node_index;
+    uint32_t after = hole - before - 1;
+    uint16_t next = get_block_next(mfs, mfs->file_block_number);
 
-        size_t written2 = fwrite(entry, sizeof(*entry), DIR_ENTRY_SIZE, mfs->f);
-        if (written2 != DIR_ENTRY_SIZE) {
-            perror("Write operation failed");
-            free(path_copy1);
-            free(path_copy2);
+    // The hole's chain block stays in place, so the directory entry never has to change
+    if(before > 0) {
+        if(set_file_block_hole(mfs, mfs->file_block_number, before)) {
+            return -1;
+        }
+        uint16_t block_number = insert_file_block(mfs, mfs->file_block_number, next);
+        if(block_number == 0) {
             return -1;
         }
+        mfs->file_block_number = block_number;
+        mfs->file_node_index = mfs->file_block_index;
+    } else if(set_file_block_hole(mfs, mfs->file_block_number, 0)) {
+        return -1;
     }
 
-    free(path_copy1);
-    free(path_copy2);
+    if(zero_file_block(mfs, mfs->file_block_number)) {
+        return -1;
+    }
+
+    if(after > 0) {
+        uint16_t block_number = insert_file_block(mfs, mfs->file_block_number, next);
+        if(block_number == 0 || set_file_block_hole(mfs, block_number, after)) {
+            return -1;
+        }
+    }
 
     return 0;
 }
 
-int mfs_rmdir(mfs_t *mfs, const char *path) {
-    return mfs_rm(mfs, path);
-}
+// Gives the open file a chain of its own before it is changed, if snapshots still refer to its chain. Only the chain
+// blocks are copied, they share all data blocks with the old chain.
+int unshare_open_file(mfs_t *mfs) {
+    uint16_t source = mfs->file_start_block_number;
+    if(share_refs(mfs, source) == 1) {
+        return 0;
+    }
 
-int mfs_ls(mfs_t *mfs, const char *path) {
-    uint16_t block_number = 0;
-    int ret = mfs_block_for_directory_path(mfs, path, &block_number);
-    if(ret) {
-        fprintf(stderr, "Directory %s not found\n", path);
+    uint16_t dir_block_number = mfs->file_dir_block_number;
+    uint16_t block_number = alloc_free_block(mfs, BLOCK_EOF, BLOCK_EOF, dir_block_number, 0);
+    if(block_number == 0 || clone_chain(mfs, source, block_number, dir_block_number)) {
         return -1;
     }
 
-    directory_iterator_t *it = create_directory_iterator(mfs, block_number);
-    if(it == NULL) {
+    // Only the live tree is changed, so the file's entry is the only one in its directory referring to the chain
+    directory_iterator_t it;
+    if(open_directory_iterator(&it, mfs, dir_block_number)) {
         fprintf(stderr, "Failed to iterate directory\n");
         return -1;
     }
 
-    while(next_directory_entry(it)) {
-        printf("%-4s 0x%04x %-*s\n", it->entry->type == MFS_TYPE_DIRECTORY ? "dir" : it->entry->type == MFS_TYPE_FILE ? "file" : "unkn", it->entry->block_number, PATH_SEG_MAX, it->entry->name);
+    bool found = false;
+    size_t entry_offset = 0;
+    while(!found && next_directory_entry(&it)) {
+        if(ENTRY_TYPE(it.entry.type) == MFS_TYPE_FILE && it.entry.block_number == source) {
+            found = true;
+            entry_offset = block_offset(mfs, it.block_number) + it.entry_addr - DIR_ENTRY_SIZE;
+        }
     }
 
-    free_directory_iterator(it);
-
-    return 0;
-}
-
-int mfs_touch(mfs_t *mfs, const char *path) {
-    char *path_copy1 = strdup(path);
-    char *path_copy2 = strdup(path);
-    char *dir = dirname(path_copy1);
-    char *name = basename(path_copy2);
+    close_directory_iterator(&it);
 
-    if(strequals(name, "/")) {
-        fprintf(stderr, "The root directory can not be modified\n");
-        free(path_copy1);
-        free(path_copy2);
+    if(!found) {
+        fprintf(stderr, "File entry not found\n");
         return -1;
     }
 
-    if(strlen(name) + 1 > PATH_SEG_MAX) {
-        fprintf(stderr, "File name too long: %s\n", name);
-        free(path_copy1);
-        free(path_copy2);
+    uint8_t field[2];
+    write16(field, 0, block_number);
+    if(write_metadata(mfs, entry_offset + 2, field, sizeof(field))) {
         return -1;
     }
+    dircache_forget(mfs, dir_block_number);
 
-    uint16_t block_number = 0;
-    int ret = mfs_block_for_directory_path(mfs, dir, &block_number);
-    if(ret) {
-        fprintf(stderr, "Failed to open directory\n");
-        free(path_copy1);
-        free(path_copy2);
+    if(share_release(mfs, source)) {
         return -1;
     }
 
-    directory_iterator_t *it = create_directory_iterator(mfs, block_number);
-    if(it == NULL) {
-        fprintf(stderr, "Failed to iterate directory\n");
-        free(path_copy1);
-        free(path_copy2);
+    // The position is the same in the new chain
+    mfs->file_start_block_number = block_number;
+    if(mfs->file_compressed) {
+        uint32_t pos = mfs->file_pos;
+        compress_close(mfs);
+        return compress_open(mfs, block_number) || compress_seek(mfs, pos) ? -1 : 0;
+    }
+
+    mfs->file_block_number = block_number;
+    mfs->file_node_index = 0;
+    locate_file_block(mfs);
+
+    return 0;
+}
+
+int write_file(mfs_t *mfs, uint16_t len, uint8_t *buf) {
+    if(!mfs->file_open) {
+        fprintf(stderr, "No open file\n");
         return -1;
     }
 
-    bool exists = false;
+    if(unshare_open_file(mfs)) {
+        return -1;
+    }
 
-    while(next_directory_entry(it)) {
-        // Compare the name of the entry with the one we'd like to use
-        if(strequals(it->entry->name, name)) {
-            exists = true;
-            break;
-        }
+    if(mfs->file_compressed) {
+        return compress_write(mfs, len, buf);
     }
 
-    uint16_t dir_block_number = it->block_number;
-    uint16_t empty_addr = it->entry_addr;
-    bool reached_eof = it->reached_eof;
+    uint16_t buf_offset = 0;
+    uint16_t remaining = len;
 
-    free_directory_iterator(it);
+    while(remaining > 0) {
+        if(mfs->file_offset == mfs->block_size) {
+            mfs->file_block_index++;
+            mfs->file_offset = 0;
+        }
 
-    if(exists) {
-        fprintf(stderr, "%s already exists\n", name);
-        free(path_copy1);
-        free(path_copy2);
-        return -1;
-    } else {
-        uint16_t new_block_number = alloc_free_block(mfs, BLOCK_EOF, BLOCK_EOF);
-        if(new_block_number == 0) {
-            fprintf(stderr, "All blocks are used\n");
-            free(path_copy1);
-            free(path_copy2);
+        if(prepare_file_block(mfs)) {
             return -1;
         }
 
-        if(reached_eof) {
-            block_number = alloc_free_block(mfs, dir_block_number, BLOCK_EOF);
-            if(block_number == 0) {
-                fprintf(stderr, "All blocks are used\n");
-                free(path_copy1);
-                free(path_copy2);
-                return -1;
-            }
+        uint16_t to_write = mfs->block_size - mfs->file_offset;
+        if(to_write > remaining) to_write = remaining;
 
-            if(set_block_next(mfs, dir_block_number, block_number)) {
-                free(path_copy1);
-                free(path_copy2);
-                return -1;
-            }
-        } else {
-            block_number = dir_block_number;
+        if(write_block_data(mfs, mfs->file_block_number, mfs->file_offset, buf + buf_offset, to_write)) {
+            return -1;
         }
 
-        // Write the entry for the new directory in its parent directory
-        fseek(mfs->f, mfs->blocks_base + mfs->block_size * block_number + empty_addr, SEEK_SET);
-
-        uint8_t entry[DIR_ENTRY_SIZE] = { 0 };
-
-        write16(entry, 0, MFS_TYPE_FILE);
-        write16(entry, 2, new_block_number);
-        strcpy((char *) &entry[4], name);
+        buf_offset += to_write;
+        remaining -= to_write;
+        mfs->file_offset += to_write;
 
-        size_t written2 = fwrite(entry, sizeof(*entry), DIR_ENTRY_SIZE, mfs->f);
-        if (written2 != DIR_ENTRY_SIZE) {
-            perror("Write operation failed");
-            free(path_copy1);
-            free(path_copy2);
+        // Every block written so far is part of the file, a long write may commit here
+        if(journal_split(mfs)) {
             return -1;
         }
     }
 
-    free(path_copy1);
-    free(path_copy2);
-
     return 0;
 }
 
-int mfs_rm(mfs_t *mfs, const char *path) {
-    char *path_copy1 = strdup(path);
-    char *path_copy2 = strdup(path);
-    char *dir = dirname(path_copy1);
-    char *name = basename(path_copy2);
-
-    if(strequals(name, "/")) {
-        fprintf(stderr, "The root directory can not be modified\n");
-        free(path_copy1);
-        free(path_copy2);
+int mfs_fwrite(mfs_t *mfs, uint16_t len, uint8_t *buf) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_file_write(mfs)) {
         return -1;
     }
-
-    if(strlen(name) + 1 > PATH_SEG_MAX) {
-        fprintf(stderr, "File name too long: %s\n", name);
-        free(path_copy1);
-        free(path_copy2);
-        return -1;
+    // On a striped image the blocks are written by all members at once
+    stripe_begin(mfs, false);
+    int ret = write_file(mfs, len, buf);
+    if(stripe_end(mfs)) {
+        ret = -1;
     }
+    complete_operation(mfs, ret);
+    trace_record(mfs, TRACE_FWRITE, start, ret, NULL, NULL, len);
+    return ret;
+}
 
-    uint16_t block_number = 0;
-    int ret = mfs_block_for_directory_path(mfs, dir, &block_number);
-    if(ret) {
-        fprintf(stderr, "Directory %s not found\n", dir);
-        free(path_copy1);
-        free(path_copy2);
+int read_file(mfs_t *mfs, uint16_t len, uint8_t *buf) {
+    if(!mfs->file_open) {
+        fprintf(stderr, "No open file\n");
         return -1;
     }
 
-    directory_iterator_t *it = create_directory_iterator(mfs, block_number);
-    if(it == NULL) {
-        fprintf(stderr, "Failed to iterate directory\n");
-        free(path_copy1);
-        free(path_copy2);
-        return -1;
+    if(mfs->file_compressed) {
+        return compress_read(mfs, len, buf);
     }
 
-    bool found = false;
-    uint16_t last_entry_addr = 0;
-    uint16_t last_entry_block = 0;
-    uint16_t file_block_number = 0;
-    uint16_t file_entry_addr = 0;
-    uint16_t file_entry_block = 0;
+    uint16_t buf_offset = 0;
+    uint16_t remaining = len;
 
-    while(next_directory_entry(it)) {
-        last_entry_addr = it->entry_addr;
-        last_entry_block = it->block_number;
-        if(!found && strequals(it->entry->name, name)) {
-            found = true;
-            file_block_number = it->entry->block_number;
-            // FIXME: it->entry_addr is incremented after entry is read, so it refers do the next entry
-            file_entry_addr = it->entry_addr;
-            file_entry_block = it->block_number;
+    while(remaining > 0) {
+        if(mfs->file_offset == mfs->block_size) {
+            mfs->file_block_index++;
+            mfs->file_offset = 0;
         }
-    }
-
-    free_directory_iterator(it);
-    free(path_copy1);
-    free(path_copy2);
 
-    if(found) {
-        while(file_block_number != BLOCK_EOF) {
-            uint16_t next_block_number = get_block_next(mfs, file_block_number);
-            set_block(mfs, file_block_number, BLOCK_UNUSED, BLOCK_UNUSED);
-            file_block_number = next_block_number;
-        }
-        uint8_t *entry = malloc(sizeof(*entry) * DIR_ENTRY_SIZE);
-        if(entry == NULL) {
-            perror("No memory for entry");
-            return -1;
-        }
-        fseek(mfs->f, mfs->blocks_base + mfs->block_size * last_entry_block + last_entry_addr, SEEK_SET);
-        size_t read = fread(entry, sizeof(*entry), DIR_ENTRY_SIZE, mfs->f);
-        if(read != DIR_ENTRY_SIZE) {
-            perror("Failed to read entry");
-            free(entry);
+        if(!locate_file_block(mfs)) {
+            fprintf(stderr, "Reached EOF\n");
             return -1;
         }
-        fseek(mfs->f, mfs->blocks_base + mfs->block_size * file_entry_block + file_entry_addr, SEEK_SET);
-        size_t written = fwrite(entry, sizeof(*entry), DIR_ENTRY_SIZE, mfs->f);
-        if(written != DIR_ENTRY_SIZE) {
-            perror("Failed to write entry");
-            free(entry);
+
+        uint16_t to_read = mfs->block_size - mfs->file_offset;
+        if(to_read > remaining) to_read = remaining;
+
+        if(file_block_hole(mfs, mfs->file_block_number) > 0) {
+            // Holes read as zeros without touching the image
+            memset(buf + buf_offset, 0, to_read);
+        } else if(read_data(mfs, block_offset(mfs, mfs->file_block_number) + mfs->file_offset, buf + buf_offset, to_read)) {
             return -1;
         }
-        free(entry);
-    } else {
-        fprintf(stderr, "File not found\n");
-        return -1;
+
+        buf_offset += to_read;
+        remaining -= to_read;
+        mfs->file_offset += to_read;
     }
 
     return 0;
 }
 
-int mfs_fopen(mfs_t *mfs, const char *path) {
-    if(mfs->file_open) {
-        fprintf(stderr, "Only one file can be open at a time\n");
-        return -1;
+int mfs_fread(mfs_t *mfs, uint16_t len, uint8_t *buf) {
+    uint64_t start = trace_clock(mfs);
+    // On a striped image the blocks are read by all members at once, buf is complete once stripe_end() returns.
+    // Compressed clusters are decompressed as soon as they are read, so they are read one after the other.
+    if(!mfs->file_compressed) {
+        stripe_begin(mfs, true);
     }
+    int ret = read_file(mfs, len, buf);
+    if(stripe_end(mfs)) {
+        ret = -1;
+    }
+    trace_record(mfs, TRACE_FREAD, start, ret, NULL, NULL, len);
+    return ret;
+}
 
-    char *path_copy1 = strdup(path);
-    char *path_copy2 = strdup(path);
-    char *dir = dirname(path_copy1);
-    char *name = basename(path_copy2);
-
-    if(strequals(name, "/")) {
-        fprintf(stderr, "The root directory can not be modified\n");
-        free(path_copy1);
-        free(path_copy2);
+// Cuts the open file after the block holding its last byte and frees the rest of the chain in one go, or extends it
+// with blocks reading as zeros. A file keeps at least its first block.
+int truncate_file(mfs_t *mfs, uint32_t size) {
+    if(!mfs->file_open) {
+        fprintf(stderr, "No open file\n");
         return -1;
     }
 
-    if(strlen(name) + 1 > PATH_SEG_MAX) {
-        fprintf(stderr, "Directory name too long: %s\n", name);
-        free(path_copy1);
-        free(path_copy2);
+    if(mfs->file_compressed) {
+        fprintf(stderr, "Compressed files can not be truncated\n");
         return -1;
     }
 
-    uint16_t block_number = 0;
-    int ret = mfs_block_for_directory_path(mfs, dir, &block_number);
-    if(ret) {
-        fprintf(stderr, "Directory %s not found\n", dir);
-        free(path_copy1);
-        free(path_copy2);
+    if(unshare_open_file(mfs)) {
         return -1;
     }
 
-    directory_iterator_t *it = create_directory_iterator(mfs, block_number);
-    if(it == NULL) {
-        fprintf(stderr, "Failed to iterate directory\n");
-        free(path_copy1);
-        free(path_copy2);
-        return -1;
+    uint32_t block_index = mfs->file_block_index;
+    uint16_t offset = mfs->file_offset;
+
+    uint32_t blocks = block_of_pos(mfs, (size_t) size + mfs->block_size - 1);
+    if(blocks == 0) {
+        blocks = 1;
     }
 
-    bool found = false;
-    uint16_t file_block_number = 0;
+    // Find the chain block holding the new last block
+    mfs->file_block_index = blocks - 1;
+    if(!locate_file_block(mfs)) {
+        if(mfs->file_block_index < mfs->file_node_index) {
+            return -1;
+        }
+
+        uint32_t end = mfs->file_node_index + file_block_span(mfs, mfs->file_block_number);
+        if(extend_file(mfs, mfs->file_block_number, blocks - end) == 0) {
+            return -1;
+        }
+    } else {
+        uint16_t last = mfs->file_block_number;
+        uint32_t hole = file_block_hole(mfs, last);
 
-    while(next_directory_entry(it)) {
-        if(strequals(it->entry->name, name)) {
-            if(it->entry->type != MFS_TYPE_FILE) {
-                fprintf(stderr, "Not a file\n");
-                free(path_copy1);
-                free(path_copy2);
-                free_directory_iterator(it);
+        if(hole > 0 && blocks - mfs->file_node_index < hole) {
+            if(set_file_block_hole(mfs, last, blocks - mfs->file_node_index)) {
+                return -1;
+            }
+        } else if(hole == 0 && offset_in_block(mfs, size) != 0) {
+            // Whatever followed the new end in its block must read as zeros if the file grows again
+            uint16_t end = offset_in_block(mfs, size);
+            uint8_t *zeros = scratch_get(mfs, mfs->block_size - end);
+            if(zeros == NULL) {
+                return -1;
+            }
+            memset(zeros, 0, mfs->block_size - end);
+            int ret = write_block_data(mfs, last, end, zeros, mfs->block_size - end);
+            scratch_put(mfs, zeros);
+            if(ret) {
                 return -1;
             }
+        } else if(hole == 0 && size == 0 && zero_file_block(mfs, last)) {
+            return -1;
+        }
 
-            found = true;
-            file_block_number = it->entry->block_number;
+        uint16_t tail = get_block_next(mfs, last);
+        if(tail != BLOCK_EOF) {
+            if(set_block_next(mfs, last, BLOCK_EOF) || free_chain(mfs, tail)) {
+                return -1;
+            }
         }
     }
 
-    free_directory_iterator(it);
-    free(path_copy1);
-    free(path_copy2);
-
-    if(found) {
-        mfs->file_open = true;
-        mfs->file_start_block_number = file_block_number;
-        mfs->file_block_number = file_block_number;
-        mfs->file_block_index = 0;
-        mfs->file_offset = 0;
-    } else {
-        fprintf(stderr, "File not found\n");
-        return -1;
-    }
+    // The position stays where it was, even if that is past the new end now
+    mfs->file_block_number = mfs->file_start_block_number;
+    mfs->file_node_index = 0;
+    mfs->file_block_index = block_index;
+    mfs->file_offset = offset;
+    locate_file_block(mfs);
 
     return 0;
 }
 
-int mfs_fclose(mfs_t *mfs) {
-    if(!mfs->file_open) {
-        fprintf(stderr, "No open file\n");
+int mfs_ftruncate(mfs_t *mfs, uint32_t size) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_operation(mfs)) {
         return -1;
     }
-
-    mfs->file_open = false;
-
-    return 0;
+    int ret = truncate_file(mfs, size);
+    complete_operation(mfs, ret);
+    trace_record(mfs, TRACE_FTRUNCATE, start, ret, NULL, NULL, size);
+    return ret;
 }
 
-int mfs_finfo(mfs_t *mfs) {
-    printf("Open:           %s\n", mfs->file_open ? "yes" : "no");
-    if(mfs->file_open) {
-        printf("Start block:    0x%04x\n", mfs->file_start_block_number);
-        printf("Current block:  0x%04x\n", mfs->file_block_number);
-        printf("Current offset: %u\n", mfs->file_offset);
+// Copies length bytes between two places in the image inside the kernel
+int copy_image_range(mfs_t *mfs, size_t from, size_t to, size_t length) {
+    if(journal_prepare_data_write(mfs, to, length)) {
+        return -1;
     }
-    return 0;
-}
 
-int mfs_fseek(mfs_t *mfs, uint16_t pos) {
-    if(!mfs->file_open) {
-        fprintf(stderr, "No open file\n");
+    // Nothing may be left in the stdio buffer or the writeback buffer, in either direction
+    if(writeback_drain_range(mfs, from, length) || writeback_drain_range(mfs, to, length)) {
+        return -1;
+    }
+    if(fflush(mfs->f)) {
+        perror("Flush failed");
         return -1;
     }
 
-    uint16_t block_index = pos / mfs->block_size;
-    uint16_t offset = pos % mfs->block_size;
-
-    if(block_index < mfs->file_block_index) {
-        while(block_index < mfs->file_block_index) {
-            uint16_t previous = get_block_previous(mfs, mfs->file_block_number);
-            if(previous == BLOCK_EOF) {
-                fprintf(stderr, "Block 0x%04x has no previous block\n", mfs->file_block_number);
-                return -1;
+    int fd = fileno(mfs->f);
+    off_t in = (off_t) from;
+    off_t out = (off_t) to;
+    // The blocks of a striped image are spread over the member files, they are always copied through a buffer
+    while(mfs->stripe == NULL && length > 0) {
+        ssize_t copied = copy_file_range(fd, &in, fd, &out, length, 0);
+        if(copied <= 0) {
+            if(copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)) {
+                break;
             }
-            mfs->file_block_number = previous;
-            mfs->file_block_index--;
-        }
-    } else if(block_index > mfs->file_block_index) {
-        while(block_index > mfs->file_block_index) {
-            uint16_t next = get_block_next(mfs, mfs->file_block_number);
-            if(next == BLOCK_EOF) {
-                fprintf(stderr, "Block 0x%04x has no next block\n", mfs->file_block_number);
+            perror("copy_file_range() failed");
+            return -1;
+        }
+        length -= (size_t) copied;
+    }
+
+    if(length > 0) {
+        // Not supported here, copy through a buffer instead
+        uint8_t *block = scratch_get(mfs, mfs->block_size);
+        if(block == NULL) {
+            return -1;
+        }
+        while(length > 0) {
+            size_t len = length < mfs->block_size ? length : mfs->block_size;
+            if(read_data(mfs, (size_t) in, block, len) || write_data(mfs, (size_t) out, block, len)) {
+                scratch_put(mfs, block);
                 return -1;
             }
-            mfs->file_block_number = next;
-            mfs->file_block_index++;
+            in += (off_t) len;
+            out += (off_t) len;
+            length -= len;
         }
+        scratch_put(mfs, block);
     }
 
-    mfs->file_offset = offset;
-
     return 0;
 }
 
-int mfs_fwrite(mfs_t *mfs, uint16_t len, uint8_t *buf) {
-    if(!mfs->file_open) {
-        fprintf(stderr, "No open file\n");
-        return -1;
-    }
-
-    uint16_t buf_offset = 0;
-    uint16_t remaining = len;
-
-    while(remaining > 0) {
-        fseek(mfs->f, mfs->blocks_base + mfs->file_block_number * mfs->block_size + mfs->file_offset, SEEK_SET);
+// Gives the chain starting at block_number (the first block of a new, empty file) as many blocks as the source chain
+// and the same contents. With a block map the blocks share their physical blocks with the source's, otherwise runs of
+// blocks are copied with copy_file_range() and holes stay holes.
+int clone_chain(mfs_t *mfs, uint16_t source, uint16_t block_number, uint16_t parent) {
+    size_t run_from = 0;
+    size_t run_to = 0;
+    size_t run_length = 0;
+
+    while(1) {
+        if(mfs->blockmap) {
+            if(blockmap_share(mfs, block_number, source)) {
+                return -1;
+            }
+        } else if(holes_blocks(mfs, source) > 0) {
+            // Holes have no data to copy
+            if(holes_set(mfs, block_number, holes_blocks(mfs, source))) {
+                return -1;
+            }
+        } else {
+            size_t from = block_offset(mfs, source);
+            size_t to = block_offset(mfs, block_number);
+            if(run_length > 0 && run_from + run_length == from && run_to + run_length == to) {
+                run_length += mfs->block_size;
+            } else {
+                if(run_length > 0 && copy_image_range(mfs, run_from, run_to, run_length)) {
+                    return -1;
+                }
+                run_from = from;
+                run_to = to;
+                run_length = mfs->block_size;
+            }
+        }
 
-        uint16_t to_write = mfs->block_size - mfs->file_offset;
-        if(to_write > remaining) to_write = remaining;
+        source = get_block_next(mfs, source);
+        if(source == BLOCK_EOF) {
+            break;
+        }
 
-        size_t written = fwrite(buf + buf_offset, sizeof(uint8_t), to_write, mfs->f);
-        if (written != to_write) {
-            perror("Failed to write buffer to file");
+        uint16_t next_block_number = alloc_free_block(mfs, block_number, BLOCK_EOF, parent, 0);
+        if(next_block_number == 0) {
             return -1;
         }
-
-        buf_offset += to_write;
-        remaining -= to_write;
-
-        if(remaining > 0) {
-            uint16_t next_block_number = get_block_next(mfs, mfs->file_block_number);
-            if(next_block_number == BLOCK_EOF) {
-                next_block_number = alloc_free_block(mfs, mfs->file_block_number, BLOCK_EOF);
-                if(next_block_number == 0) {
-                    return -1;
-                }
-                if(set_block_next(mfs, mfs->file_block_number, next_block_number)) {
-                    return -1;
-                }
-            }
-            mfs->file_block_number = next_block_number;
-            mfs->file_block_index++;
-            mfs->file_offset = 0;
-        } else {
-            mfs->file_offset += to_write;
+        if(set_block_next(mfs, block_number, next_block_number)) {
+            return -1;
         }
+        block_number = next_block_number;
+    }
+
+    if(run_length > 0) {
+        return copy_image_range(mfs, run_from, run_to, run_length);
     }
 
     return 0;
 }
 
-int mfs_fread(mfs_t *mfs, uint16_t len, uint8_t *buf) {
-    if(!mfs->file_open) {
-        fprintf(stderr, "No open file\n");
+int cp_path(mfs_t *mfs, const char *source_path, const char *path) {
+    uint16_t source_dir_block_number = 0;
+    uint16_t source_block_number = 0;
+    uint16_t type = 0;
+    if(find_file(mfs, source_path, &source_dir_block_number, &source_block_number, &type)) {
         return -1;
     }
 
-    uint16_t buf_offset = 0;
-    uint16_t remaining = len;
-
-    while(remaining > 0) {
-        fseek(mfs->f, mfs->blocks_base + mfs->file_block_number * mfs->block_size + mfs->file_offset, SEEK_SET);
-
-        uint16_t to_read = mfs->block_size - mfs->file_offset;
-        if(to_read > remaining) to_read = remaining;
+    // The copy has the same flags, so a compressed file stays compressed
+    if(touch_path(mfs, path, type & ~ENTRY_TYPE(type))) {
+        return -1;
+    }
 
-        size_t read = fread(buf + buf_offset, sizeof(uint8_t), to_read, mfs->f);
-        if (read != to_read) {
-            perror("Failed to read file into buffer");
-            return -1;
-        }
+    uint16_t dir_block_number = 0;
+    uint16_t block_number = 0;
+    if(find_file(mfs, path, &dir_block_number, &block_number, &type)) {
+        return -1;
+    }
 
-        buf_offset += to_read;
-        remaining -= to_read;
+    return clone_chain(mfs, source_block_number, block_number, dir_block_number);
+}
 
-        if(remaining > 0) {
-            uint16_t next_block_number = get_block_next(mfs, mfs->file_block_number);
-            if (next_block_number == BLOCK_EOF) {
-                fprintf(stderr, "Reached EOF\n");
-                return -1;
-            }
-            mfs->file_block_number = next_block_number;
-            mfs->file_block_index++;
-            mfs->file_offset = 0;
-        } else {
-            mfs->file_offset += to_read;
-        }
+int mfs_cp(mfs_t *mfs, const char *source_path, const char *path) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_operation(mfs)) {
+        return -1;
     }
-
-    return 0;
+    int ret = cp_path(mfs, source_path, path);
+    complete_operation(mfs, ret);
+    trace_record(mfs, TRACE_CP, start, ret, source_path, path, 0);
+    return ret;
 }
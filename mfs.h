@@ -1,36 +1,126 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
+typedef enum {
+    MFS_ALLOC_FIRST,
+    MFS_ALLOC_CHAIN,
+    MFS_ALLOC_PARENT,
+    MFS_ALLOC_GOAL
+} mfs_alloc_policy_t;
+
+typedef enum {
+    MFS_DURABILITY_NONE,
+    MFS_DURABILITY_SYNC,
+    MFS_DURABILITY_OP,
+    MFS_DURABILITY_GROUP
+} mfs_durability_t;
+
+// Position in a directory listing: the block and the offset of the next entry in it. Listings start at
+// MFS_DIR_CURSOR_START and are done once mfs_readdir() returns MFS_DIR_CURSOR_END.
+typedef uint32_t mfs_dir_cursor_t;
+#define MFS_DIR_CURSOR_START 0u
+#define MFS_DIR_CURSOR_END 0xFFFFFFFFu
+
+// Longest name including the terminating zero
+#define MFS_NAME_MAX 12
+
+typedef struct {
+    uint16_t type;
+    uint16_t block_number;
+    char name[MFS_NAME_MAX];
+} mfs_dirent_t;
+
+typedef struct journal journal_t;
+typedef struct compress_file compress_file_t;
+typedef struct blockmap blockmap_t;
+typedef struct stripe stripe_t;
+typedef struct trace trace_t;
+typedef struct alloc_table alloc_table_t;
+typedef struct writeback writeback_t;
+typedef struct dircache dircache_t;
+typedef struct group group_t;
+typedef struct share share_t;
+typedef struct holes holes_t;
+
 typedef struct {
     FILE *f;
     uint16_t block_size;
+    // log2 of the block size if it is a power of two, otherwise 0
+    uint8_t block_shift;
+    // Chain blocks, the entries of the alloc table that chains are made of
     uint16_t block_count;
+    // Data blocks in the image. Without a block map every chain block is its own data block and both counts are equal.
+    uint16_t data_block_count;
     size_t alloc_table_base;
     size_t blocks_base;
-    uint8_t *alloc_table;
+    uint16_t features;
+    uint16_t cluster_blocks;
+    alloc_table_t *alloc_table;
+    journal_t *journal;
+    blockmap_t *blockmap;
+    stripe_t *stripe;
+    trace_t *trace;
+    writeback_t *writeback;
+    dircache_t *dircache;
+    group_t *group;
+    share_t *share;
+    holes_t *holes;
+    // Directory scan specialized for the block size
+    uint16_t (*scan_block)(const uint8_t *block, uint16_t start, uint16_t size, const uint8_t *pattern);
+    uint16_t snapshot_dir_block_number;
+    uint16_t root_block_number;
+    bool read_only;
+    mfs_alloc_policy_t alloc_policy;
+    mfs_durability_t durability;
+    unsigned int group_window_ms;
+    unsigned int group_max_ops;
+    unsigned int group_pending;
+    unsigned int threads;
+    uint64_t group_start_ms;
+    uint64_t last_op;
+    uint64_t durable_op;
     bool file_open;
+    uint16_t file_dir_block_number;
+    uint16_t file_goal_block_number;
     uint16_t file_start_block_number;
     uint16_t file_block_number;
-    uint16_t file_block_index;
+    uint32_t file_block_index;
+    uint32_t file_node_index;
     uint16_t file_offset;
+    bool file_compressed;
+    uint32_t file_pos;
+    compress_file_t *file_clusters;
+    uint8_t *scratch;
+    size_t scratch_size;
+    size_t scratch_used;
 } mfs_t;
 
-mfs_t *mfs_open(char *filename);
+mfs_t *mfs_open(char *filename, int optc, char **optv);
 void mfs_free(mfs_t *mfs);
 
 int mfs_create(char *filename, int optc, char **optv);
 
+int mfs_sync(mfs_t *mfs);
+uint64_t mfs_last_op(mfs_t *mfs);
+uint64_t mfs_durable_op(mfs_t *mfs);
+
 int mfs_info(mfs_t *mfs);
 int mfs_mkdir(mfs_t *mfs, const char *path);
 int mfs_rmdir(mfs_t *mfs, const char *path);
 int mfs_ls(mfs_t *mfs, const char *path);
+int mfs_readdir(mfs_t *mfs, const char *path, mfs_dir_cursor_t *cursor, mfs_dirent_t *entries, size_t max, size_t *count_out);
 int mfs_touch(mfs_t *mfs, const char *path);
+int mfs_touch_compressed(mfs_t *mfs, const char *path);
 int mfs_rm(mfs_t *mfs, const char *path);
+int mfs_cp(mfs_t *mfs, const char *source_path, const char *path);
 int mfs_fopen(mfs_t *mfs, const char *path);
 int mfs_fclose(mfs_t *mfs);
 int mfs_finfo(mfs_t *mfs);
-int mfs_fseek(mfs_t *mfs, uint16_t pos);
+int mfs_fgoal(mfs_t *mfs, uint16_t block_number);
+int mfs_fseek(mfs_t *mfs, uint32_t pos);
 int mfs_fwrite(mfs_t *mfs, uint16_t len, uint8_t *buf);
 int mfs_fread(mfs_t *mfs, uint16_t len, uint8_t *buf);
+int mfs_ftruncate(mfs_t *mfs, uint32_t size);
@@ -0,0 +1,286 @@
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "format.h"
+#include "blocks.h"
+#include "blockmap.h"
+#include "alloc_table.h"
+#include "journal.h"
+#include "parse_opts.h"
+#include "resize.h"
+#include "stripe.h"
+#include "trace.h"
+#include "writeback.h"
+
+// Resizing keeps the data blocks where they are and writes the alloc table, the block map and the journal for the new
+// size behind the last data block. The superblock switches over to them with a single write, so an interrupted resize
+// leaves the old image intact.
+
+int resize_sync(mfs_t *mfs) {
+    if(writeback_drain(mfs) || fflush(mfs->f)) {
+        perror("Flush failed");
+        return -1;
+    }
+
+    if(fdatasync(fileno(mfs->f))) {
+        perror("fdatasync() failed");
+        return -1;
+    }
+
+    return stripe_sync(mfs);
+}
+
+int resize_write_at(mfs_t *mfs, size_t offset, const uint8_t *buf, size_t len) {
+    fseek(mfs->f, offset, SEEK_SET);
+
+    size_t written = fwrite(buf, sizeof(*buf), len, mfs->f);
+    if(written != len) {
+        perror("Write operation failed");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Chain blocks and data blocks that are dropped must be unused, nothing is moved to make room
+int resize_check_shrink(mfs_t *mfs, uint16_t chain_blocks, uint16_t block_count) {
+    for(uint32_t i = chain_blocks; i < mfs->block_count; i++) {
+        if(get_block_next(mfs, (uint16_t) i) != BLOCK_UNUSED) {
+            fprintf(stderr, "Block 0x%04x is still in use\n", i);
+            return -1;
+        }
+    }
+
+    if(mfs->blockmap && !blockmap_unreferenced(mfs, block_count)) {
+        fprintf(stderr, "Data above block 0x%04x is still in use\n", block_count);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Resizes the image to block_count data blocks. Images with a block map keep their ratio of chain blocks to data blocks.
+int resize_image(mfs_t *mfs, uint16_t block_count) {
+    if(block_count == 0) {
+        fprintf(stderr, "Invalid block count\n");
+        return -1;
+    }
+
+    if(block_count == mfs->data_block_count) {
+        return 0;
+    }
+
+    uint32_t chain_blocks = block_count;
+    if(mfs->blockmap) {
+        chain_blocks = (uint32_t) ((uint64_t) block_count * mfs->block_count / mfs->data_block_count);
+        if(chain_blocks > 0xFFFF) {
+            chain_blocks = 0xFFFF;
+        }
+        if(chain_blocks < block_count) {
+            chain_blocks = block_count;
+        }
+    }
+
+    if((chain_blocks < mfs->block_count || block_count < mfs->data_block_count) && resize_check_shrink(mfs, (uint16_t) chain_blocks, block_count)) {
+        return -1;
+    }
+
+    // The image is read and written directly from here on, nothing may be left in the writeback buffer
+    if(writeback_drain(mfs)) {
+        return -1;
+    }
+
+    uint8_t superblock[SUPERBLOCK_SIZE];
+    fseek(mfs->f, 0, SEEK_SET);
+    if(fread(superblock, sizeof(*superblock), SUPERBLOCK_SIZE, mfs->f) != SUPERBLOCK_SIZE || read16(superblock, SB_MAGIC) != MFS_MAGIC) {
+        fprintf(stderr, "Only images with a version %u superblock can be resized\n", MFS_VERSION);
+        return -1;
+    }
+
+    // Everything logged so far goes to its place, the journal starts over at its new location
+    if(journal_commit(mfs) || journal_checkpoint(mfs)) {
+        return -1;
+    }
+
+    struct stat st;
+    if(fflush(mfs->f) || fstat(fileno(mfs->f), &st)) {
+        perror("fstat() failed");
+        return -1;
+    }
+    size_t old_end = (size_t) st.st_size;
+    size_t old_tail = mfs->blocks_base + (size_t) mfs->data_block_count * mfs->block_size;
+
+    size_t journal_size = (size_t) read16(superblock, SB_JOURNAL_BLOCKS) * mfs->block_size;
+    size_t alloc_table_size = (size_t) chain_blocks * ALLOC_TABLE_ENTRY_SIZE;
+    size_t block_map_size = mfs->blockmap ? (size_t) chain_blocks * BLOCK_MAP_ENTRY_SIZE : 0;
+    size_t tail_size = alloc_table_size + journal_size + block_map_size;
+
+    // The new metadata must not overwrite the old before the superblock points at it
+    size_t tail = mfs->blocks_base + (size_t) block_count * mfs->block_size;
+    if(tail < old_end && tail + tail_size > old_tail) {
+        tail = old_end;
+    }
+
+    size_t alloc_table_base = tail;
+    size_t journal_base = alloc_table_base + alloc_table_size;
+    size_t block_map_base = journal_base + journal_size;
+
+    uint8_t *alloc_table = calloc(alloc_table_size, sizeof(*alloc_table));
+    if(alloc_table == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    if(alloc_table_copy(mfs, alloc_table, chain_blocks < mfs->block_count ? (uint16_t) chain_blocks : mfs->block_count)) {
+        free(alloc_table);
+        return -1;
+    }
+
+    if(resize_write_at(mfs, alloc_table_base, alloc_table, alloc_table_size)) {
+        free(alloc_table);
+        return -1;
+    }
+    if(journal_size > 0 && journal_format(mfs->f, journal_base, journal_size)) {
+        free(alloc_table);
+        return -1;
+    }
+    if(mfs->blockmap && blockmap_write_resized(mfs, block_map_base, (uint16_t) chain_blocks, block_count)) {
+        free(alloc_table);
+        return -1;
+    }
+
+    write16(superblock, SB_BLOCK_COUNT, block_count);
+    write16(superblock, SB_FEATURES, mfs->features | FEATURE_RELOCATED);
+    write64(superblock, SB_ALLOC_TABLE_BASE, alloc_table_base);
+    write64(superblock, SB_BLOCKS_BASE, mfs->blocks_base);
+    write64(superblock, SB_JOURNAL_BASE, journal_base);
+    if(mfs->blockmap) {
+        write64(superblock, SB_BLOCK_MAP_BASE, block_map_base);
+        write16(superblock, SB_CHAIN_BLOCKS, (uint16_t) chain_blocks);
+    }
+
+    if(resize_sync(mfs) || resize_write_at(mfs, 0, superblock, SUPERBLOCK_SIZE) || resize_sync(mfs)) {
+        free(alloc_table);
+        return -1;
+    }
+
+    // The image has switched over, now the in-memory state follows
+    uint16_t old_block_count = mfs->data_block_count;
+
+    journal_free(mfs);
+    free(alloc_table);
+    mfs->alloc_table_base = alloc_table_base;
+    mfs->block_count = (uint16_t) chain_blocks;
+    mfs->data_block_count = block_count;
+    mfs->features |= FEATURE_RELOCATED;
+
+    // Pages are read again from the new table
+    if(alloc_table_reset(mfs)) {
+        return -1;
+    }
+
+    if(journal_size > 0 && journal_open(mfs, journal_base, journal_size)) {
+        fprintf(stderr, "Failed to open journal\n");
+        return -1;
+    }
+
+    if(mfs->blockmap) {
+        bool dedup = (mfs->features & FEATURE_DEDUP) != 0;
+        blockmap_free(mfs);
+        if(blockmap_open(mfs, block_map_base, dedup)) {
+            fprintf(stderr, "Failed to read block map\n");
+            return -1;
+        }
+    }
+
+    size_t end = block_map_base + block_map_size;
+    if(mfs->stripe) {
+        // The data blocks are in the member files, which only have to follow the new size
+        if(stripe_resize(mfs)) {
+            return -1;
+        }
+    } else if(block_count > old_block_count) {
+        // New blocks are expected to be zeroed. Past the old end of the file they are, but the old metadata isn't.
+        size_t stale_end = mfs->blocks_base + (size_t) block_count * mfs->block_size;
+        if(stale_end > old_end) {
+            stale_end = old_end;
+        }
+        if(stale_end > old_tail) {
+            uint8_t *zero = calloc(stale_end - old_tail, sizeof(*zero));
+            if(zero == NULL) {
+                perror("Memory allocation failed");
+                return -1;
+            }
+            int ret = resize_write_at(mfs, old_tail, zero, stale_end - old_tail);
+            free(zero);
+            if(ret) {
+                return -1;
+            }
+        }
+    }
+
+    if(end < old_end) {
+        if(fflush(mfs->f) || ftruncate(fileno(mfs->f), (off_t) end)) {
+            perror("ftruncate() failed");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int mfs_resize(mfs_t *mfs, uint16_t block_count) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_operation(mfs)) {
+        return -1;
+    }
+    int ret = resize_image(mfs, block_count);
+    complete_operation(mfs, ret);
+    trace_record(mfs, TRACE_RESIZE, start, ret, NULL, NULL, block_count);
+    return ret;
+}
+
+int mfs_resize_image(char *filename, int optc, char **optv) {
+    unsigned long block_count = 0;
+
+    for(int i = 0; i < optc; i++) {
+        char *opt = strdup(optv[i]);
+        char *name;
+        char *value;
+
+        parse_opt(opt, &name, &value);
+
+        if(strequals(name, "bc")) {
+            if(value) {
+                block_count = strtoul(value, NULL, 10);
+            }
+        }
+
+        free(opt);
+    }
+
+    if(block_count == 0 || block_count > 0xFFFF) {
+        fprintf(stderr, "Invalid block count\n");
+        return -1;
+    }
+
+    mfs_t *mfs = mfs_open(filename, 0, NULL);
+    if(mfs == NULL) {
+        fprintf(stderr, "Failed to open MFS file\n");
+        return -1;
+    }
+
+    int ret = mfs_resize(mfs, (uint16_t) block_count);
+
+    mfs_free(mfs);
+
+    return ret;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "mfs.h"
+
+int mfs_resize(mfs_t *mfs, uint16_t block_count);
+int mfs_resize_image(char *filename, int optc, char **optv);
@@ -0,0 +1,341 @@
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+// Entries are matched on everything but the block number field
+#define ENTRY_MASK_TYPE 0x0003
+#define ENTRY_MASK_NAME 0xFFF0
+
+// Alloc table entries are scanned in groups, one mask bit per entry
+#define ALLOC_GROUP 32
+
+// Block sizes with their own instance of the directory scan, 128 << i for i below this
+#define SCAN_BLOCK_SIZES 6
+
+typedef uint32_t (*scan_alloc_count_t)(const uint8_t *table, uint32_t groups);
+typedef uint32_t (*scan_alloc_mask_t)(const uint8_t *table);
+
+static inline bool alloc_entry_free(const uint8_t *table, uint32_t index) {
+    // Only the next field marks an entry as used
+    const uint8_t *entry = table + index * ALLOC_TABLE_ENTRY_SIZE;
+    return entry[0] == 0 && entry[1] == 0;
+}
+
+// The directory scans are always inlined, so instances with a constant size get a fixed loop bound to unroll against
+static inline __attribute__((always_inline)) uint16_t scan_directory_kernel_scalar(const uint8_t *block, uint16_t start, uint16_t size, const uint8_t *pattern) {
+#pragma GCC unroll 4
+    for(uint16_t addr = start; addr < size; addr += DIR_ENTRY_SIZE) {
+        const uint8_t *entry = block + addr;
+
+        if(entry[0] == 0 && entry[1] == 0) {
+            return addr;
+        }
+
+        if(memcmp(entry + DIR_ENTRY_NAME_OFFSET, pattern + DIR_ENTRY_NAME_OFFSET, PATH_SEG_MAX) == 0) {
+            return addr;
+        }
+    }
+
+    return size;
+}
+
+static uint32_t scan_alloc_mask_scalar(const uint8_t *table) {
+    uint32_t mask = 0;
+    for(uint32_t i = 0; i < ALLOC_GROUP; i++) {
+        mask |= (uint32_t) alloc_entry_free(table, i) << i;
+    }
+    return mask;
+}
+
+static uint32_t scan_alloc_count_scalar(const uint8_t *table, uint32_t groups) {
+    uint32_t count = 0;
+    for(uint32_t i = 0; i < groups * ALLOC_GROUP; i++) {
+        count += alloc_entry_free(table, i);
+    }
+    return count;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) uint16_t scan_directory_kernel_sse2(const uint8_t *block, uint16_t start, uint16_t size, const uint8_t *pattern) {
+    __m128i p = _mm_loadu_si128((const __m128i *) pattern);
+
+#pragma GCC unroll 4
+    for(uint16_t addr = start; addr < size; addr += DIR_ENTRY_SIZE) {
+        __m128i entry = _mm_loadu_si128((const __m128i *) (block + addr));
+        int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(entry, p));
+
+        // The pattern's type field is zero, so the same compare also finds the terminator
+        if((eq & ENTRY_MASK_TYPE) == ENTRY_MASK_TYPE || (eq & ENTRY_MASK_NAME) == ENTRY_MASK_NAME) {
+            return addr;
+        }
+    }
+
+    return size;
+}
+
+// The table is little endian, so masking each 32 bit lane to its low half leaves the next field
+__attribute__((target("sse2")))
+static inline uint32_t alloc_mask4_sse2(const uint8_t *table, __m128i field) {
+    __m128i entries = _mm_and_si128(_mm_loadu_si128((const __m128i *) table), field);
+    return (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(entries, _mm_setzero_si128())));
+}
+
+__attribute__((target("sse2")))
+static uint32_t scan_alloc_mask_sse2(const uint8_t *table) {
+    __m128i field = _mm_set1_epi32(0xFFFF);
+    uint32_t mask = 0;
+    for(uint32_t i = 0; i < ALLOC_GROUP; i += 4) {
+        mask |= alloc_mask4_sse2(table + i * ALLOC_TABLE_ENTRY_SIZE, field) << i;
+    }
+    return mask;
+}
+
+__attribute__((target("sse2,popcnt")))
+static uint32_t scan_alloc_count_sse2(const uint8_t *table, uint32_t groups) {
+    uint32_t count = 0;
+    for(uint32_t g = 0; g < groups; g++) {
+        count += (uint32_t) __builtin_popcount(scan_alloc_mask_sse2(table + g * ALLOC_GROUP * ALLOC_TABLE_ENTRY_SIZE));
+    }
+    return count;
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) uint16_t scan_directory_kernel_avx2(const uint8_t *block, uint16_t start, uint16_t size, const uint8_t *pattern) {
+    __m256i p = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) pattern));
+
+    uint16_t addr = start;
+
+    // Two entries per vector
+#pragma GCC unroll 2
+    for(; addr + 2 * DIR_ENTRY_SIZE <= size; addr += 2 * DIR_ENTRY_SIZE) {
+        __m256i entries = _mm256_loadu_si256((const __m256i *) (block + addr));
+        uint32_t eq = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(entries, p));
+
+        uint16_t lo = (uint16_t) eq;
+        if((lo & ENTRY_MASK_TYPE) == ENTRY_MASK_TYPE || (lo & ENTRY_MASK_NAME) == ENTRY_MASK_NAME) {
+            return addr;
+        }
+
+        uint16_t hi = (uint16_t) (eq >> 16);
+        if((hi & ENTRY_MASK_TYPE) == ENTRY_MASK_TYPE || (hi & ENTRY_MASK_NAME) == ENTRY_MASK_NAME) {
+            return addr + DIR_ENTRY_SIZE;
+        }
+    }
+
+    if(addr < size) {
+        return scan_directory_kernel_sse2(block, addr, size, pattern);
+    }
+
+    return size;
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t alloc_mask8_avx2(const uint8_t *table, __m256i field) {
+    __m256i entries = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) table), field);
+    return (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(entries, _mm256_setzero_si256())));
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan_alloc_mask_avx2(const uint8_t *table) {
+    __m256i field = _mm256_set1_epi32(0xFFFF);
+    return alloc_mask8_avx2(table, field)
+           | alloc_mask8_avx2(table + 8 * ALLOC_TABLE_ENTRY_SIZE, field) << 8
+           | alloc_mask8_avx2(table + 16 * ALLOC_TABLE_ENTRY_SIZE, field) << 16
+           | alloc_mask8_avx2(table + 24 * ALLOC_TABLE_ENTRY_SIZE, field) << 24;
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint32_t scan_alloc_count_avx2(const uint8_t *table, uint32_t groups) {
+    __m256i field = _mm256_set1_epi32(0xFFFF);
+    __m256i zero = _mm256_setzero_si256();
+    // Compare results are -1 per free entry, so subtracting them counts per lane
+    __m256i counts = _mm256_setzero_si256();
+    for(uint32_t i = 0; i < groups * ALLOC_GROUP; i += 8) {
+        __m256i entries = _mm256_and_si256(_mm256_loadu_si256((const __m256i *) (table + i * ALLOC_TABLE_ENTRY_SIZE)), field);
+        counts = _mm256_sub_epi32(counts, _mm256_cmpeq_epi32(entries, zero));
+    }
+
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *) lanes, counts);
+    uint32_t count = 0;
+    for(int i = 0; i < 8; i++) {
+        count += lanes[i];
+    }
+    return count;
+}
+#endif
+
+// One generic instance per kernel and one for each common block size, which mfs_open() selects once per image
+#define SCAN_INSTANCES(isa, attr) \
+    attr static uint16_t scan_directory_block_##isa(const uint8_t *block, uint16_t start, uint16_t size, const uint8_t *pattern) { \
+        return scan_directory_kernel_##isa(block, start, size, pattern); \
+    } \
+    SCAN_INSTANCE(isa, attr, 128) \
+    SCAN_INSTANCE(isa, attr, 256) \
+    SCAN_INSTANCE(isa, attr, 512) \
+    SCAN_INSTANCE(isa, attr, 1024) \
+    SCAN_INSTANCE(isa, attr, 2048) \
+    SCAN_INSTANCE(isa, attr, 4096) \
+    static const scan_directory_block_t scan_directory_block_##isa##_sizes[SCAN_BLOCK_SIZES] = { \
+        scan_directory_block_##isa##_128, scan_directory_block_##isa##_256, scan_directory_block_##isa##_512, \
+        scan_directory_block_##isa##_1024, scan_directory_block_##isa##_2048, scan_directory_block_##isa##_4096 \
+    };
+
+#define SCAN_INSTANCE(isa, attr, n) \
+    attr static uint16_t scan_directory_block_##isa##_##n(const uint8_t *block, uint16_t start, uint16_t size, const uint8_t *pattern) { \
+        (void) size; \
+        return scan_directory_kernel_##isa(block, start, n, pattern); \
+    }
+
+SCAN_INSTANCES(scalar, )
+#ifdef SCAN_X86
+SCAN_INSTANCES(sse2, __attribute__((target("sse2"))))
+SCAN_INSTANCES(avx2, __attribute__((target("avx2"))))
+#endif
+
+static scan_directory_block_t scan_directory_block_impl = scan_directory_block_scalar;
+static const scan_directory_block_t *scan_directory_block_sizes = scan_directory_block_scalar_sizes;
+static scan_alloc_count_t scan_alloc_count_impl = scan_alloc_count_scalar;
+static scan_alloc_mask_t scan_alloc_mask_impl = scan_alloc_mask_scalar;
+
+void scan_init(void) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        scan_directory_block_impl = scan_directory_block_avx2;
+        scan_directory_block_sizes = scan_directory_block_avx2_sizes;
+        scan_alloc_count_impl = scan_alloc_count_avx2;
+        scan_alloc_mask_impl = scan_alloc_mask_avx2;
+    } else if(__builtin_cpu_supports("sse2")) {
+        scan_directory_block_impl = scan_directory_block_sse2;
+        scan_directory_block_sizes = scan_directory_block_sse2_sizes;
+        scan_alloc_mask_impl = scan_alloc_mask_sse2;
+        if(__builtin_cpu_supports("popcnt")) {
+            scan_alloc_count_impl = scan_alloc_count_sse2;
+        }
+    }
+#endif
+}
+
+void scan_directory_pattern(uint8_t *pattern, const char *name) {
+    // Entries are written zero-padded, so a whole-field compare is equivalent to strcmp
+    memset(pattern, 0, SCAN_PATTERN_SIZE);
+    strncpy((char *) pattern + DIR_ENTRY_NAME_OFFSET, name, PATH_SEG_MAX);
+}
+
+// Same for a name that is part of a longer string, such as a path segment
+void scan_directory_pattern_len(uint8_t *pattern, const char *name, size_t len) {
+    memset(pattern, 0, SCAN_PATTERN_SIZE);
+    memcpy(pattern + DIR_ENTRY_NAME_OFFSET, name, len < PATH_SEG_MAX ? len : PATH_SEG_MAX);
+}
+
+void scan_directory_end_pattern(uint8_t *pattern) {
+    // Stored names are NUL-terminated within the field, so a name without NUL never matches
+    memset(pattern, 0, SCAN_PATTERN_SIZE);
+    memset(pattern + DIR_ENTRY_NAME_OFFSET, 0xFF, PATH_SEG_MAX);
+}
+
+// Returns the address of the first entry at or after start that matches the pattern or terminates the directory,
+// or size if there is none in this block
+uint16_t scan_directory_block(const uint8_t *block, uint16_t start, uint16_t size, const uint8_t *pattern) {
+    return scan_directory_block_impl(block, start, size, pattern);
+}
+
+// Returns the directory scan specialized for a block size, or the generic one for sizes without an instance. Must be
+// called after scan_init().
+scan_directory_block_t scan_directory_block_for(uint16_t size) {
+    for(unsigned int i = 0; i < SCAN_BLOCK_SIZES; i++) {
+        if(size == 128u << i) {
+            return scan_directory_block_sizes[i];
+        }
+    }
+    return scan_directory_block_impl;
+}
+
+// Counts the free entries in [start, end) of an alloc table
+uint32_t scan_alloc_count_free(const uint8_t *table, uint32_t start, uint32_t end) {
+    if(start >= end) {
+        return 0;
+    }
+
+    uint32_t groups = (end - start) / ALLOC_GROUP;
+    uint32_t count = scan_alloc_count_impl(table + start * ALLOC_TABLE_ENTRY_SIZE, groups);
+
+    for(uint32_t i = start + groups * ALLOC_GROUP; i < end; i++) {
+        count += alloc_entry_free(table, i);
+    }
+
+    return count;
+}
+
+// Returns the first entry in [start, end) that begins a run of at least length free entries, or end if there is none
+uint32_t scan_alloc_find_free(const uint8_t *table, uint32_t start, uint32_t end, uint32_t length) {
+    uint32_t run_start = start;
+    uint32_t run = 0;
+    uint32_t i = start;
+
+    while(i < end) {
+        uint32_t mask;
+        uint32_t n;
+        if(end - i >= ALLOC_GROUP) {
+            mask = scan_alloc_mask_impl(table + i * ALLOC_TABLE_ENTRY_SIZE);
+            n = ALLOC_GROUP;
+        } else {
+            mask = 0;
+            n = end - i;
+            for(uint32_t j = 0; j < n; j++) {
+                mask |= (uint32_t) alloc_entry_free(table, i + j) << j;
+            }
+        }
+
+        if(mask == 0) {
+            // Nothing free in this group
+            run = 0;
+        } else if(n == ALLOC_GROUP && mask == 0xFFFFFFFFu) {
+            // Everything free in this group
+            if(run == 0) {
+                run_start = i;
+            }
+            run += n;
+            if(run >= length) {
+                return run_start;
+            }
+        } else {
+            for(uint32_t j = 0; j < n; j++) {
+                if(run == 0) {
+                    // Skip straight to the next free entry
+                    uint32_t rest = mask >> j;
+                    if(rest == 0) {
+                        break;
+                    }
+                    j += (uint32_t) __builtin_ctz(rest);
+                }
+
+                if(mask & (1u << j)) {
+                    if(run == 0) {
+                        run_start = i + j;
+                    }
+                    run++;
+                    if(run >= length) {
+                        return run_start;
+                    }
+                } else {
+                    run = 0;
+                }
+            }
+        }
+
+        i += n;
+    }
+
+    return end;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "format.h"
+
+// A directory entry compared as one 16 byte vector: zero type and block fields followed by the zero-padded name
+#define SCAN_PATTERN_SIZE DIR_ENTRY_SIZE
+
+typedef uint16_t (*scan_directory_block_t)(const uint8_t *block, uint16_t start, uint16_t size, const uint8_t *pattern);
+
+void scan_init(void);
+
+void scan_directory_pattern(uint8_t *pattern, const char *name);
+void scan_directory_pattern_len(uint8_t *pattern, const char *name, size_t len);
+void scan_directory_end_pattern(uint8_t *pattern);
+uint16_t scan_directory_block(const uint8_t *block, uint16_t start, uint16_t size, const uint8_t *pattern);
+scan_directory_block_t scan_directory_block_for(uint16_t size);
+
+uint32_t scan_alloc_count_free(const uint8_t *table, uint32_t start, uint32_t end);
+uint32_t scan_alloc_find_free(const uint8_t *table, uint32_t start, uint32_t end, uint32_t length);
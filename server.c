@@ -0,0 +1,625 @@
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "util.h"
+#include "format.h"
+#include "blocks.h"
+#include "alloc_table.h"
+#include "server.h"
+
+// The server keeps one image open and serves any number of clients from a single thread. Requests are taken in the
+// order they arrive, every complete request in a client's input is handled at once and all the responses go out with
+// as few writes as possible, so pipelined requests cost one round trip between them.
+
+#define SERVER_BACKLOG 64
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_SIZE 65536
+// Large enough for a write of 64 KiB to a long path
+#define SERVER_MAX_PAYLOAD (6 + 4096 + 0xFFFF)
+// Directory entries read at a time for SERVER_OP_READDIR
+#define SERVER_READDIR_BATCH 64
+
+typedef struct server_client {
+    int fd;
+    uint8_t *in;
+    size_t in_len;
+    size_t in_size;
+    uint8_t *out;
+    size_t out_pos;
+    size_t out_len;
+    size_t out_size;
+    // EPOLLOUT is requested while responses are waiting for room in the socket
+    bool waiting;
+    struct server_client *previous;
+    struct server_client *next;
+} server_client_t;
+
+static volatile sig_atomic_t server_stop = 0;
+
+// All connected clients
+static server_client_t *server_clients = NULL;
+
+void server_handle_signal(int sig) {
+    (void) sig;
+    server_stop = 1;
+}
+
+void server_free_client(int epoll_fd, server_client_t *client) {
+    if(client->previous) {
+        client->previous->next = client->next;
+    } else {
+        server_clients = client->next;
+    }
+    if(client->next) {
+        client->next->previous = client->previous;
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    free(client->in);
+    free(client->out);
+    free(client);
+}
+
+// Makes room for len more bytes of output, returns where they go
+uint8_t *server_reserve(server_client_t *client, size_t len) {
+    if(client->out_pos > 0 && client->out_pos == client->out_len) {
+        client->out_pos = 0;
+        client->out_len = 0;
+    }
+
+    if(client->out_len + len > client->out_size) {
+        size_t size = client->out_size * 2;
+        if(size < client->out_len + len) {
+            size = client->out_len + len;
+        }
+        uint8_t *out = realloc(client->out, sizeof(*out) * size);
+        if(out == NULL) {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+        client->out = out;
+        client->out_size = size;
+    }
+
+    return client->out + client->out_len;
+}
+
+// Returns the payload as a string, the caller frees it
+char *server_string(const uint8_t *payload, size_t len) {
+    char *str = malloc(sizeof(*str) * (len + 1));
+    if(str == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    memcpy(str, payload, len);
+    str[len] = '\0';
+
+    return str;
+}
+
+int server_ls(mfs_t *mfs, server_client_t *client, const char *path, uint32_t *len_out) {
+    uint16_t block_number = 0;
+    if(mfs_block_for_directory_path(mfs, path, &block_number)) {
+        fprintf(stderr, "Directory %s not found\n", path);
+        return -1;
+    }
+
+    directory_iterator_t it;
+    if(open_directory_iterator(&it, mfs, block_number)) {
+        fprintf(stderr, "Failed to iterate directory\n");
+        return -1;
+    }
+
+    uint32_t len = 0;
+    while(next_directory_entry(&it)) {
+        uint8_t *entry = server_reserve(client, SERVER_HEADER_SIZE + len + DIR_ENTRY_SIZE);
+        if(entry == NULL) {
+            close_directory_iterator(&it);
+            return -1;
+        }
+        entry += SERVER_HEADER_SIZE + len;
+
+        memset(entry, 0, DIR_ENTRY_SIZE);
+        write16(entry, 0, it.entry.type);
+        write16(entry, 2, it.entry.block_number);
+        strncpy((char *) &entry[DIR_ENTRY_NAME_OFFSET], it.entry.name, PATH_SEG_MAX);
+        len += DIR_ENTRY_SIZE;
+    }
+
+    close_directory_iterator(&it);
+
+    *len_out = len;
+
+    return 0;
+}
+
+// One page of a directory listing, read in batches so a large page doesn't need a large buffer
+int server_readdir(mfs_t *mfs, server_client_t *client, const char *path, mfs_dir_cursor_t cursor, uint16_t max, uint32_t *len_out) {
+    mfs_dirent_t entries[SERVER_READDIR_BATCH];
+
+    uint32_t len = 4;
+    while(max > 0 && cursor != MFS_DIR_CURSOR_END) {
+        size_t count;
+        if(mfs_readdir(mfs, path, &cursor, entries, max < SERVER_READDIR_BATCH ? max : SERVER_READDIR_BATCH, &count)) {
+            return -1;
+        }
+
+        uint8_t *entry = server_reserve(client, SERVER_HEADER_SIZE + len + count * DIR_ENTRY_SIZE);
+        if(entry == NULL) {
+            return -1;
+        }
+        entry += SERVER_HEADER_SIZE + len;
+
+        for(size_t i = 0; i < count; i++, entry += DIR_ENTRY_SIZE) {
+            memset(entry, 0, DIR_ENTRY_SIZE);
+            write16(entry, 0, entries[i].type);
+            write16(entry, 2, entries[i].block_number);
+            memcpy(&entry[DIR_ENTRY_NAME_OFFSET], entries[i].name, MFS_NAME_MAX);
+        }
+        len += (uint32_t) count * DIR_ENTRY_SIZE;
+        max -= (uint16_t) count;
+    }
+
+    uint8_t *header = server_reserve(client, SERVER_HEADER_SIZE + len);
+    if(header == NULL) {
+        return -1;
+    }
+    write32(header, SERVER_HEADER_SIZE, cursor);
+
+    *len_out = len;
+
+    return 0;
+}
+
+// Opens the file, runs the request on it and closes it again, so no state is left behind between requests
+int server_file(mfs_t *mfs, uint16_t op, const char *path, uint32_t pos, uint8_t *data, uint16_t len) {
+    if(mfs_fopen(mfs, path)) {
+        return -1;
+    }
+
+    int ret;
+    if(op == SERVER_OP_TRUNCATE) {
+        ret = mfs_ftruncate(mfs, pos);
+    } else {
+        ret = mfs_fseek(mfs, pos);
+        if(ret == 0 && op == SERVER_OP_READ) {
+            ret = mfs_fread(mfs, len, data);
+        } else if(ret == 0) {
+            ret = mfs_fwrite(mfs, len, data);
+        }
+    }
+
+    mfs_fclose(mfs);
+
+    return ret;
+}
+
+// Handles one request and appends its response, returns -1 if the client has to be dropped
+int server_handle_request(mfs_t *mfs, server_client_t *client, const uint8_t *request) {
+    uint32_t payload_len = read32(request, SH_LENGTH);
+    uint32_t id = read32(request, SH_ID);
+    uint16_t op = read16(request, SH_OP);
+    const uint8_t *payload = request + SERVER_HEADER_SIZE;
+
+    if(server_reserve(client, SERVER_HEADER_SIZE) == NULL) {
+        return -1;
+    }
+    size_t response = client->out_len;
+
+    uint16_t status = SERVER_STATUS_OK;
+    uint32_t len = 0;
+    char *path = NULL;
+    int ret = 0;
+
+    switch(op) {
+        case SERVER_OP_MKDIR:
+        case SERVER_OP_RMDIR:
+        case SERVER_OP_TOUCH:
+        case SERVER_OP_CTOUCH:
+        case SERVER_OP_RM:
+        case SERVER_OP_LS:
+            path = server_string(payload, payload_len);
+            if(path == NULL) {
+                return -1;
+            }
+            if(op == SERVER_OP_MKDIR) {
+                ret = mfs_mkdir(mfs, path);
+            } else if(op == SERVER_OP_RMDIR) {
+                ret = mfs_rmdir(mfs, path);
+            } else if(op == SERVER_OP_TOUCH) {
+                ret = mfs_touch(mfs, path);
+            } else if(op == SERVER_OP_CTOUCH) {
+                ret = mfs_touch_compressed(mfs, path);
+            } else if(op == SERVER_OP_RM) {
+                ret = mfs_rm(mfs, path);
+            } else {
+                ret = server_ls(mfs, client, path, &len);
+            }
+            break;
+        case SERVER_OP_CP: {
+            path = server_string(payload, payload_len);
+            if(path == NULL) {
+                return -1;
+            }
+            size_t source_len = strlen(path);
+            if(source_len == payload_len) {
+                status = SERVER_STATUS_BAD_REQUEST;
+            } else {
+                ret = mfs_cp(mfs, path, path + source_len + 1);
+            }
+            break;
+        }
+        case SERVER_OP_READ: {
+            if(payload_len < 6) {
+                status = SERVER_STATUS_BAD_REQUEST;
+                break;
+            }
+            path = server_string(payload + 6, payload_len - 6);
+            if(path == NULL) {
+                return -1;
+            }
+            len = read16(payload, 4);
+            uint8_t *data = server_reserve(client, SERVER_HEADER_SIZE + len);
+            if(data == NULL) {
+                free(path);
+                return -1;
+            }
+            ret = server_file(mfs, op, path, read32(payload, 0), data + SERVER_HEADER_SIZE, (uint16_t) len);
+            break;
+        }
+        case SERVER_OP_WRITE: {
+            uint16_t path_len = payload_len < 6 ? 0 : read16(payload, 4);
+            if(payload_len < 6 || payload_len - 6 < path_len || payload_len - 6 - path_len > 0xFFFF) {
+                status = SERVER_STATUS_BAD_REQUEST;
+                break;
+            }
+            path = server_string(payload + 6, path_len);
+            if(path == NULL) {
+                return -1;
+            }
+            // The data stays in the input buffer, nothing else touches it before the write is done
+            ret = server_file(mfs, op, path, read32(payload, 0), (uint8_t *) payload + 6 + path_len, (uint16_t) (payload_len - 6 - path_len));
+            break;
+        }
+        case SERVER_OP_TRUNCATE:
+            if(payload_len < 4) {
+                status = SERVER_STATUS_BAD_REQUEST;
+                break;
+            }
+            path = server_string(payload + 4, payload_len - 4);
+            if(path == NULL) {
+                return -1;
+            }
+            ret = server_file(mfs, op, path, read32(payload, 0), NULL, 0);
+            break;
+        case SERVER_OP_READDIR:
+            if(payload_len < 6) {
+                status = SERVER_STATUS_BAD_REQUEST;
+                break;
+            }
+            path = server_string(payload + 6, payload_len - 6);
+            if(path == NULL) {
+                return -1;
+            }
+            ret = server_readdir(mfs, client, path, read32(payload, 0), read16(payload, 4), &len);
+            break;
+        case SERVER_OP_SYNC:
+            ret = mfs_sync(mfs);
+            break;
+        case SERVER_OP_INFO: {
+            uint8_t *info = server_reserve(client, SERVER_HEADER_SIZE + 8);
+            if(info == NULL) {
+                return -1;
+            }
+            info += SERVER_HEADER_SIZE;
+            write16(info, 0, mfs->block_size);
+            write16(info, 2, mfs->data_block_count);
+            write32(info, 4, alloc_table_free_count(mfs));
+            len = 8;
+            break;
+        }
+        default:
+            status = SERVER_STATUS_BAD_REQUEST;
+            break;
+    }
+
+    free(path);
+
+    if(ret) {
+        status = SERVER_STATUS_ERROR;
+    }
+    if(status != SERVER_STATUS_OK) {
+        len = 0;
+    }
+
+    uint8_t *header = client->out + response;
+    write32(header, SH_LENGTH, len);
+    write32(header, SH_ID, id);
+    write16(header, SH_STATUS, status);
+    write16(header, SH_STATUS + 2, 0);
+    client->out_len = response + SERVER_HEADER_SIZE + len;
+
+    return 0;
+}
+
+// Handles every complete request in the client's input
+int server_handle_input(mfs_t *mfs, server_client_t *client) {
+    size_t pos = 0;
+
+    while(client->in_len - pos >= SERVER_HEADER_SIZE) {
+        uint32_t payload_len = read32(client->in, pos + SH_LENGTH);
+        if(payload_len > SERVER_MAX_PAYLOAD) {
+            fprintf(stderr, "Request too large\n");
+            return -1;
+        }
+        if(client->in_len - pos < SERVER_HEADER_SIZE + payload_len) {
+            break;
+        }
+
+        if(server_handle_request(mfs, client, client->in + pos)) {
+            return -1;
+        }
+        pos += SERVER_HEADER_SIZE + payload_len;
+    }
+
+    memmove(client->in, client->in + pos, client->in_len - pos);
+    client->in_len -= pos;
+
+    return 0;
+}
+
+// Writes as much of the pending output as the socket takes and asks for EPOLLOUT if anything is left
+int server_flush(int epoll_fd, server_client_t *client) {
+    while(client->out_pos < client->out_len) {
+        ssize_t written = send(client->fd, client->out + client->out_pos, client->out_len - client->out_pos, MSG_NOSIGNAL);
+        if(written < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        client->out_pos += (size_t) written;
+    }
+
+    bool waiting = client->out_pos < client->out_len;
+    if(waiting != client->waiting) {
+        struct epoll_event event = { .events = EPOLLIN | (waiting ? EPOLLOUT : 0), .data.ptr = client };
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event)) {
+            perror("epoll_ctl() failed");
+            return -1;
+        }
+        client->waiting = waiting;
+    }
+
+    return 0;
+}
+
+// Reads everything the client sent, returns -1 once it has hung up
+int server_read(server_client_t *client) {
+    while(1) {
+        if(client->in_size - client->in_len < SERVER_READ_SIZE) {
+            size_t size = client->in_len + SERVER_READ_SIZE;
+            uint8_t *in = realloc(client->in, sizeof(*in) * size);
+            if(in == NULL) {
+                perror("Memory allocation failed");
+                return -1;
+            }
+            client->in = in;
+            client->in_size = size;
+        }
+
+        ssize_t received = recv(client->fd, client->in + client->in_len, client->in_size - client->in_len, 0);
+        if(received < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if(received == 0) {
+            return -1;
+        }
+        client->in_len += (size_t) received;
+
+        // Don't let one client hold up the others, the rest is read on the next round
+        if(client->in_len > SERVER_HEADER_SIZE + SERVER_MAX_PAYLOAD) {
+            return 0;
+        }
+    }
+}
+
+int server_accept(int epoll_fd, int listen_fd) {
+    while(1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(fd < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+                return 0;
+            }
+            perror("accept() failed");
+            return -1;
+        }
+
+        server_client_t *client = calloc(1, sizeof(*client));
+        if(client == NULL) {
+            perror("Memory allocation failed");
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = client };
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+            perror("epoll_ctl() failed");
+            close(fd);
+            free(client);
+            continue;
+        }
+
+        client->next = server_clients;
+        if(server_clients) {
+            server_clients->previous = client;
+        }
+        server_clients = client;
+    }
+}
+
+// A socket left behind by a server that is gone refuses connections
+bool server_stale_socket(struct sockaddr_un *addr) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return false;
+    }
+
+    bool stale = connect(fd, (struct sockaddr *) addr, sizeof(*addr)) && errno == ECONNREFUSED;
+    close(fd);
+
+    return stale;
+}
+
+int server_listen(const char *socket_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        perror("socket() failed");
+        return -1;
+    }
+
+    if(bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        if(errno != EADDRINUSE || !server_stale_socket(&addr)) {
+            fprintf(stderr, "Failed to bind %s: ", socket_path);
+            perror(NULL);
+            close(fd);
+            return -1;
+        }
+        unlink(socket_path);
+        if(bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+            perror("bind() failed");
+            close(fd);
+            return -1;
+        }
+    }
+
+    if(listen(fd, SERVER_BACKLOG)) {
+        perror("listen() failed");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int server_run(mfs_t *mfs, int epoll_fd, int listen_fd) {
+    struct epoll_event events[SERVER_MAX_EVENTS];
+
+    while(!server_stop) {
+        int n = epoll_wait(epoll_fd, events, SERVER_MAX_EVENTS, -1);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait() failed");
+            return -1;
+        }
+        for(int i = 0; i < n; i++) {
+            server_client_t *client = events[i].data.ptr;
+            if(client == NULL) {
+                if(server_accept(epoll_fd, listen_fd)) {
+                    return -1;
+                }
+                continue;
+            }
+
+            bool hung_up = false;
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                hung_up = server_read(client) != 0;
+            }
+
+            // Whatever arrived before the client hung up is still answered as far as the socket allows
+            if(server_handle_input(mfs, client) || server_flush(epoll_fd, client) || hung_up) {
+                server_free_client(epoll_fd, client);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int mfs_serve(char *filename, int optc, char **optv) {
+    if(optc < 1) {
+        fprintf(stderr, "Missing socket path\n");
+        return -1;
+    }
+    const char *socket_path = optv[0];
+
+    // The image is locked while it is open, so this is the only process writing it
+    mfs_t *mfs = mfs_open(filename, optc - 1, optv + 1);
+    if(mfs == NULL) {
+        fprintf(stderr, "Failed to open MFS file\n");
+        return -1;
+    }
+
+    int listen_fd = server_listen(socket_path);
+    if(listen_fd < 0) {
+        mfs_free(mfs);
+        return -1;
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    if(epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event)) {
+        perror("epoll setup failed");
+        if(epoll_fd >= 0) {
+            close(epoll_fd);
+        }
+        close(listen_fd);
+        unlink(socket_path);
+        mfs_free(mfs);
+        return -1;
+    }
+
+    struct sigaction action = { .sa_handler = server_handle_signal };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("Serving %s on %s\n", filename, socket_path);
+    fflush(stdout);
+
+    int ret = server_run(mfs, epoll_fd, listen_fd);
+
+    while(server_clients) {
+        server_free_client(epoll_fd, server_clients);
+    }
+    close(epoll_fd);
+    close(listen_fd);
+    unlink(socket_path);
+
+    mfs_free(mfs);
+
+    return ret;
+}
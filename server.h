@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "mfs.h"
+
+// Requests and responses start with a header: payload length (u32), request id (u32), then the operation (u16) in a
+// request or the status (u16, 0 on success) in a response, and two reserved bytes. All fields are little endian.
+// Responses come back in the order of the requests, so a client may send many requests before reading any response.
+#define SERVER_HEADER_SIZE 12
+#define SH_LENGTH 0
+#define SH_ID 4
+#define SH_OP 8
+#define SH_STATUS 8
+
+#define SERVER_STATUS_OK 0
+#define SERVER_STATUS_ERROR 1
+#define SERVER_STATUS_BAD_REQUEST 2
+
+// Payload: the path, without a terminating zero
+#define SERVER_OP_MKDIR 1
+#define SERVER_OP_RMDIR 2
+#define SERVER_OP_TOUCH 3
+#define SERVER_OP_CTOUCH 4
+#define SERVER_OP_RM 5
+// Payload: the source path, a zero byte and the destination path
+#define SERVER_OP_CP 6
+// Payload: the path. Response: the directory entries as stored, DIR_ENTRY_SIZE bytes each.
+#define SERVER_OP_LS 7
+// Payload: position (u32), length (u16), path. Response: the data.
+#define SERVER_OP_READ 8
+// Payload: position (u32), path length (u16), path, data
+#define SERVER_OP_WRITE 9
+// Payload: size (u32), path
+#define SERVER_OP_TRUNCATE 10
+// No payload
+#define SERVER_OP_SYNC 11
+// No payload. Response: block size (u16), block count (u16), free blocks (u32).
+#define SERVER_OP_INFO 12
+// Payload: cursor (u32, 0 to start), most entries to return (u16), path. Response: the cursor to continue from
+// (u32, 0xFFFFFFFF once the directory is done), then the entries like SERVER_OP_LS.
+#define SERVER_OP_READDIR 13
+
+int mfs_serve(char *filename, int optc, char **optv);
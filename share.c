@@ -0,0 +1,262 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "util.h"
+#include "format.h"
+#include "blocks.h"
+#include "share.h"
+
+// Snapshots refer to the chains of the live tree's files instead of copying them. Chains that more than one directory
+// entry refers to are listed in a table with the number of entries, in a chain of its own that SB_SHARED points to.
+// Entries are (first block, references) pairs, the first pair with a zero first block ends the table. A chain that
+// isn't listed has a single entry referring to it. The table is kept in memory while the image is open.
+
+#define SHARE_ENTRY_SIZE 4
+// Position of a chain in the table plus one, by its first block
+#define SHARE_SLOTS 0x10000
+
+struct share {
+    uint16_t *chains;
+    uint16_t *refs;
+    uint32_t count;
+    uint32_t capacity;
+    // Blocks of the table's chain
+    uint16_t *blocks;
+    uint32_t block_count;
+    uint32_t *slots;
+};
+
+uint32_t share_per_block(mfs_t *mfs) {
+    return mfs->block_size / SHARE_ENTRY_SIZE;
+}
+
+int share_grow(share_t *share, uint32_t count, uint32_t block_count) {
+    if(count > share->capacity) {
+        uint32_t capacity = share->capacity ? share->capacity * 2 : 64;
+        while(capacity < count) {
+            capacity *= 2;
+        }
+        uint16_t *chains = realloc(share->chains, sizeof(*chains) * capacity);
+        if(chains) share->chains = chains;
+        uint16_t *refs = realloc(share->refs, sizeof(*refs) * capacity);
+        if(refs) share->refs = refs;
+        if(chains == NULL || refs == NULL) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        share->capacity = capacity;
+    }
+
+    uint16_t *blocks = realloc(share->blocks, sizeof(*blocks) * (block_count ? block_count : 1));
+    if(blocks == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+    share->blocks = blocks;
+
+    return 0;
+}
+
+share_t *share_new(void) {
+    share_t *share = calloc(1, sizeof(*share));
+    if(share == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    share->slots = calloc(SHARE_SLOTS, sizeof(*share->slots));
+    if(share->slots == NULL) {
+        perror("Memory allocation failed");
+        free(share);
+        return NULL;
+    }
+
+    return share;
+}
+
+// Reads the table starting at block_number
+int share_open(mfs_t *mfs, uint16_t block_number) {
+    share_t *share = share_new();
+    if(share == NULL) {
+        return -1;
+    }
+    mfs->share = share;
+
+    uint8_t *block = malloc(sizeof(*block) * mfs->block_size);
+    if(block == NULL) {
+        perror("Memory allocation failed");
+        share_free(mfs);
+        return -1;
+    }
+
+    bool ended = false;
+    while(block_number != BLOCK_EOF) {
+        if(block_number >= mfs->block_count || share->block_count == mfs->block_count) {
+            fprintf(stderr, "Chain of shared chains through block 0x%04x is broken\n", block_number);
+            free(block);
+            share_free(mfs);
+            return -1;
+        }
+
+        if(share_grow(share, share->count + share_per_block(mfs), share->block_count + 1) || read_block(mfs, block_number, block)) {
+            free(block);
+            share_free(mfs);
+            return -1;
+        }
+        share->blocks[share->block_count++] = block_number;
+
+        for(uint32_t i = 0; !ended && i < share_per_block(mfs); i++) {
+            uint16_t chain = read16(block, i * SHARE_ENTRY_SIZE);
+            if(chain == 0) {
+                ended = true;
+            } else {
+                share->chains[share->count] = chain;
+                share->refs[share->count] = read16(block, i * SHARE_ENTRY_SIZE + 2);
+                share->slots[chain] = ++share->count;
+            }
+        }
+
+        block_number = get_block_next(mfs, block_number);
+    }
+
+    free(block);
+
+    return 0;
+}
+
+void share_free(mfs_t *mfs) {
+    share_t *share = mfs->share;
+    if(share == NULL) {
+        return;
+    }
+
+    free(share->chains);
+    free(share->refs);
+    free(share->blocks);
+    free(share->slots);
+    free(share);
+    mfs->share = NULL;
+}
+
+// Number of directory entries referring to the chain starting at block_number
+uint16_t share_refs(mfs_t *mfs, uint16_t block_number) {
+    if(mfs->share == NULL || mfs->share->slots[block_number] == 0) {
+        return 1;
+    }
+
+    return mfs->share->refs[mfs->share->slots[block_number] - 1];
+}
+
+int share_store(mfs_t *mfs, uint32_t slot) {
+    share_t *share = mfs->share;
+    uint8_t entry[SHARE_ENTRY_SIZE] = { 0 };
+    if(slot < share->count) {
+        write16(entry, 0, share->chains[slot]);
+        write16(entry, 2, share->refs[slot]);
+    }
+
+    uint16_t block_number = share->blocks[slot / share_per_block(mfs)];
+    size_t offset = block_offset(mfs, block_number) + (slot % share_per_block(mfs)) * SHARE_ENTRY_SIZE;
+
+    return write_metadata(mfs, offset, entry, SHARE_ENTRY_SIZE);
+}
+
+// Appends a block to the table, creating it first if the image has none
+int share_add_block(mfs_t *mfs) {
+    if(mfs->share == NULL) {
+        mfs->share = share_new();
+        if(mfs->share == NULL) {
+            return -1;
+        }
+    }
+
+    share_t *share = mfs->share;
+    if(share_grow(share, share->count, share->block_count + 1)) {
+        return -1;
+    }
+
+    uint16_t previous = share->block_count > 0 ? share->blocks[share->block_count - 1] : BLOCK_EOF;
+    uint16_t block_number = alloc_free_block(mfs, previous, BLOCK_EOF, 0, 0);
+    if(block_number == 0 || zero_block(mfs, block_number)) {
+        return -1;
+    }
+
+    if(previous == BLOCK_EOF) {
+        uint8_t field[2];
+        write16(field, 0, block_number);
+        if(write_metadata(mfs, SB_SHARED, field, sizeof(field))) {
+            return -1;
+        }
+    } else if(set_block_next(mfs, previous, block_number)) {
+        return -1;
+    }
+
+    share->blocks[share->block_count++] = block_number;
+
+    return 0;
+}
+
+// One more directory entry refers to the chain starting at block_number
+int share_add(mfs_t *mfs, uint16_t block_number) {
+    share_t *share = mfs->share;
+    if(share && share->slots[block_number] != 0) {
+        uint32_t slot = share->slots[block_number] - 1;
+        if(share->refs[slot] == 0xFFFF) {
+            fprintf(stderr, "Chain 0x%04x is shared too often\n", block_number);
+            return -1;
+        }
+        share->refs[slot]++;
+        return share_store(mfs, slot);
+    }
+
+    // A full table gets another block
+    if(share == NULL || share->count == share->block_count * share_per_block(mfs)) {
+        if(share_add_block(mfs)) {
+            return -1;
+        }
+        share = mfs->share;
+    }
+    if(share_grow(share, share->count + 1, share->block_count)) {
+        return -1;
+    }
+
+    uint32_t slot = share->count++;
+    share->chains[slot] = block_number;
+    share->refs[slot] = 2;
+    share->slots[block_number] = slot + 1;
+
+    return share_store(mfs, slot);
+}
+
+// Drops a directory entry's reference to the chain starting at block_number. The chain is freed with the last one.
+int share_release(mfs_t *mfs, uint16_t block_number) {
+    share_t *share = mfs->share;
+    if(share == NULL || share->slots[block_number] == 0) {
+        return free_chain(mfs, block_number);
+    }
+
+    uint32_t slot = share->slots[block_number] - 1;
+    if(share->refs[slot] > 2) {
+        share->refs[slot]--;
+        return share_store(mfs, slot);
+    }
+
+    // Down to a single entry, which the table doesn't list. The last entry takes the place of this one.
+    uint32_t last = share->count - 1;
+    share->slots[block_number] = 0;
+    share->count--;
+    if(slot != last) {
+        share->chains[slot] = share->chains[last];
+        share->refs[slot] = share->refs[last];
+        share->slots[share->chains[slot]] = slot + 1;
+        if(share_store(mfs, slot)) {
+            return -1;
+        }
+    }
+
+    return share_store(mfs, last);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "mfs.h"
+
+int share_open(mfs_t *mfs, uint16_t block_number);
+void share_free(mfs_t *mfs);
+
+uint16_t share_refs(mfs_t *mfs, uint16_t block_number);
+int share_add(mfs_t *mfs, uint16_t block_number);
+int share_release(mfs_t *mfs, uint16_t block_number);
@@ -0,0 +1,363 @@
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "util.h"
+#include "format.h"
+#include "blocks.h"
+#include "scan.h"
+#include "share.h"
+#include "snapshot.h"
+#include "trace.h"
+
+// Snapshots are copies of the directory tree whose entries refer to the same file chains as the live tree's, see
+// share.c. A file gets a chain of its own when it is changed, which shares all its blocks with the old one through the
+// block map. Snapshots are listed in a directory of their own, which the superblock points to.
+
+int snapshot_check_name(const char *name) {
+    if(name[0] == '\0' || strchr(name, '/') != NULL) {
+        fprintf(stderr, "Invalid snapshot name: %s\n", name);
+        return -1;
+    }
+
+    if(strlen(name) + 1 > PATH_SEG_MAX) {
+        fprintf(stderr, "Snapshot name too long: %s\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Looks up a snapshot without complaining if it doesn't exist
+int snapshot_lookup(mfs_t *mfs, const char *name, uint16_t *block_number_out, bool *found_out) {
+    *found_out = false;
+
+    if(mfs->snapshot_dir_block_number == 0) {
+        return 0;
+    }
+
+    directory_iterator_t it;
+    if(open_directory_iterator(&it, mfs, mfs->snapshot_dir_block_number)) {
+        fprintf(stderr, "Failed to iterate snapshots\n");
+        return -1;
+    }
+
+    uint8_t pattern[SCAN_PATTERN_SIZE];
+    scan_directory_pattern(pattern, name);
+
+    if(find_directory_entry(&it, pattern)) {
+        *found_out = true;
+        *block_number_out = it.entry.block_number;
+    }
+
+    close_directory_iterator(&it);
+
+    return 0;
+}
+
+int snapshot_find(mfs_t *mfs, const char *name, uint16_t *block_number_out) {
+    if(snapshot_check_name(name)) {
+        return -1;
+    }
+
+    bool found = false;
+    if(snapshot_lookup(mfs, name, block_number_out, &found)) {
+        return -1;
+    }
+
+    if(!found) {
+        fprintf(stderr, "Snapshot %s not found\n", name);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Copies a directory, pointing its entries at copies of the directories in it and at the same chains for the files
+int snapshot_clone_directory(mfs_t *mfs, uint16_t source, uint16_t parent, uint16_t *block_number_out) {
+    uint16_t first_block_number = alloc_free_block(mfs, BLOCK_EOF, BLOCK_EOF, parent, 0);
+    if(first_block_number == 0) {
+        return -1;
+    }
+
+    uint8_t *block = malloc(sizeof(*block) * mfs->block_size);
+    if(block == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    uint16_t block_number = first_block_number;
+    bool ended = false;
+
+    while(1) {
+        if(read_block(mfs, source, block)) {
+            free(block);
+            return -1;
+        }
+
+        for(uint16_t addr = 0; !ended && addr < mfs->block_size; addr += DIR_ENTRY_SIZE) {
+            uint16_t type = read16(block, addr);
+            uint16_t child = read16(block, addr + 2);
+            uint16_t clone = child;
+
+            int ret = 0;
+            if(type == MFS_TYPE_END) {
+                ended = true;
+            } else if(ENTRY_TYPE(type) == MFS_TYPE_DIRECTORY) {
+                ret = snapshot_clone_directory(mfs, child, first_block_number, &clone);
+            } else if(ENTRY_TYPE(type) == MFS_TYPE_FILE) {
+                ret = share_add(mfs, child);
+            }
+            if(ret) {
+                free(block);
+                return -1;
+            }
+
+            write16(block, addr + 2, clone);
+        }
+
+        // The copy isn't reachable before the snapshot's entry is written, so it doesn't need the journal
+        if(write_data(mfs, block_offset(mfs, block_number), block, mfs->block_size)) {
+            free(block);
+            return -1;
+        }
+
+        source = get_block_next(mfs, source);
+        if(source == BLOCK_EOF) {
+            break;
+        }
+
+        uint16_t next_block_number = alloc_free_block(mfs, block_number, BLOCK_EOF, parent, 0);
+        if(next_block_number == 0 || set_block_next(mfs, block_number, next_block_number)) {
+            free(block);
+            return -1;
+        }
+        block_number = next_block_number;
+    }
+
+    free(block);
+
+    *block_number_out = first_block_number;
+
+    return 0;
+}
+
+// Frees a directory with everything in it, or drops a reference to a file's chain
+int snapshot_free_tree(mfs_t *mfs, uint16_t block_number, uint16_t type) {
+    if(ENTRY_TYPE(type) == MFS_TYPE_DIRECTORY) {
+        directory_iterator_t it;
+        if(open_directory_iterator(&it, mfs, block_number)) {
+            fprintf(stderr, "Failed to iterate directory\n");
+            return -1;
+        }
+
+        while(next_directory_entry(&it)) {
+            if(snapshot_free_tree(mfs, it.entry.block_number, it.entry.type)) {
+                close_directory_iterator(&it);
+                return -1;
+            }
+        }
+
+        close_directory_iterator(&it);
+
+        return free_chain(mfs, block_number);
+    }
+
+    return share_release(mfs, block_number);
+}
+
+int snapshot_add_entry(mfs_t *mfs, const char *name, uint16_t root_block_number) {
+    if(mfs->snapshot_dir_block_number == 0) {
+        uint16_t block_number = alloc_free_block(mfs, BLOCK_EOF, BLOCK_EOF, 0, 0);
+        if(block_number == 0 || zero_block(mfs, block_number)) {
+            return -1;
+        }
+
+        uint8_t field[2];
+        write16(field, 0, block_number);
+        if(write_metadata(mfs, SB_SNAPSHOTS, field, sizeof(field))) {
+            return -1;
+        }
+
+        mfs->snapshot_dir_block_number = block_number;
+    }
+
+    directory_iterator_t it;
+    if(open_directory_iterator(&it, mfs, mfs->snapshot_dir_block_number)) {
+        fprintf(stderr, "Failed to iterate snapshots\n");
+        return -1;
+    }
+
+    // The name is known to be free, so this stops at the end slot
+    uint8_t pattern[SCAN_PATTERN_SIZE];
+    scan_directory_end_pattern(pattern);
+    find_directory_entry(&it, pattern);
+
+    uint16_t block_number = it.block_number;
+    uint16_t empty_addr = it.entry_addr;
+    bool reached_eof = it.reached_eof;
+
+    close_directory_iterator(&it);
+
+    if(reached_eof) {
+        uint16_t new_block_number = alloc_free_block(mfs, block_number, BLOCK_EOF, 0, 0);
+        if(new_block_number == 0 || zero_block(mfs, new_block_number)) {
+            return -1;
+        }
+        if(set_block_next(mfs, block_number, new_block_number)) {
+            return -1;
+        }
+        block_number = new_block_number;
+    }
+
+    uint8_t entry[DIR_ENTRY_SIZE] = { 0 };
+
+    write16(entry, 0, MFS_TYPE_DIRECTORY);
+    write16(entry, 2, root_block_number);
+    strcpy((char *) &entry[DIR_ENTRY_NAME_OFFSET], name);
+
+    return write_metadata(mfs, block_offset(mfs, block_number) + empty_addr, entry, DIR_ENTRY_SIZE);
+}
+
+int snapshot_create(mfs_t *mfs, const char *name) {
+    if(snapshot_check_name(name)) {
+        return -1;
+    }
+
+    if(mfs->blockmap == NULL) {
+        fprintf(stderr, "Snapshots need an image with a block map\n");
+        return -1;
+    }
+
+    uint16_t root_block_number = 0;
+    bool exists = false;
+    if(snapshot_lookup(mfs, name, &root_block_number, &exists)) {
+        return -1;
+    }
+    if(exists) {
+        fprintf(stderr, "Snapshot %s already exists\n", name);
+        return -1;
+    }
+
+    if(snapshot_clone_directory(mfs, mfs->root_block_number, 0, &root_block_number)) {
+        return -1;
+    }
+
+    return snapshot_add_entry(mfs, name, root_block_number);
+}
+
+int snapshot_delete(mfs_t *mfs, const char *name) {
+    if(snapshot_check_name(name)) {
+        return -1;
+    }
+
+    if(mfs->snapshot_dir_block_number == 0) {
+        fprintf(stderr, "Snapshot %s not found\n", name);
+        return -1;
+    }
+
+    directory_iterator_t it;
+    if(open_directory_iterator(&it, mfs, mfs->snapshot_dir_block_number)) {
+        fprintf(stderr, "Failed to iterate snapshots\n");
+        return -1;
+    }
+
+    uint8_t pattern[SCAN_PATTERN_SIZE];
+    scan_directory_pattern(pattern, name);
+
+    if(find_directory_entry(&it, pattern) == NULL) {
+        close_directory_iterator(&it);
+        fprintf(stderr, "Snapshot %s not found\n", name);
+        return -1;
+    }
+
+    uint16_t root_block_number = it.entry.block_number;
+    uint16_t entry_block = it.block_number;
+    uint16_t entry_addr = it.entry_addr - DIR_ENTRY_SIZE;
+
+    // Skip to the end to find the last entry, which takes the place of the deleted one
+    scan_directory_end_pattern(pattern);
+    find_directory_entry(&it, pattern);
+
+    uint16_t last_block = it.block_number;
+    uint16_t last_addr;
+    if(it.reached_eof) {
+        last_addr = mfs->block_size - DIR_ENTRY_SIZE;
+    } else if(it.entry_addr == 0) {
+        last_block = get_block_previous(mfs, it.block_number);
+        last_addr = mfs->block_size - DIR_ENTRY_SIZE;
+    } else {
+        last_addr = it.entry_addr - DIR_ENTRY_SIZE;
+    }
+
+    close_directory_iterator(&it);
+
+    uint8_t entry[DIR_ENTRY_SIZE];
+    if(last_block != entry_block || last_addr != entry_addr) {
+        if(read_metadata(mfs, block_offset(mfs, last_block) + last_addr, entry, DIR_ENTRY_SIZE)) {
+            return -1;
+        }
+        if(write_metadata(mfs, block_offset(mfs, entry_block) + entry_addr, entry, DIR_ENTRY_SIZE)) {
+            return -1;
+        }
+    }
+
+    memset(entry, 0, DIR_ENTRY_SIZE);
+    if(write_metadata(mfs, block_offset(mfs, last_block) + last_addr, entry, DIR_ENTRY_SIZE)) {
+        return -1;
+    }
+
+    return snapshot_free_tree(mfs, root_block_number, MFS_TYPE_DIRECTORY);
+}
+
+int mfs_snapshot_create(mfs_t *mfs, const char *name) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_operation(mfs)) {
+        return -1;
+    }
+    int ret = snapshot_create(mfs, name);
+    complete_operation(mfs, ret);
+    trace_record(mfs, TRACE_SNAPSHOT_CREATE, start, ret, name, NULL, 0);
+    return ret;
+}
+
+int mfs_snapshot_delete(mfs_t *mfs, const char *name) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_operation(mfs)) {
+        return -1;
+    }
+    int ret = snapshot_delete(mfs, name);
+    complete_operation(mfs, ret);
+    trace_record(mfs, TRACE_SNAPSHOT_DELETE, start, ret, name, NULL, 0);
+    return ret;
+}
+
+int snapshot_list(mfs_t *mfs) {
+    if(mfs->snapshot_dir_block_number == 0) {
+        return 0;
+    }
+
+    directory_iterator_t it;
+    if(open_directory_iterator(&it, mfs, mfs->snapshot_dir_block_number)) {
+        fprintf(stderr, "Failed to iterate snapshots\n");
+        return -1;
+    }
+
+    while(next_directory_entry(&it)) {
+        printf("snap 0x%04x %-*s\n", it.entry.block_number, PATH_SEG_MAX, it.entry.name);
+    }
+
+    close_directory_iterator(&it);
+
+    return 0;
+}
+
+int mfs_snapshot_list(mfs_t *mfs) {
+    uint64_t start = trace_clock(mfs);
+    int ret = snapshot_list(mfs);
+    trace_record(mfs, TRACE_SNAPSHOT_LIST, start, ret, NULL, NULL, 0);
+    return ret;
+}
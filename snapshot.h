@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "mfs.h"
+
+int snapshot_find(mfs_t *mfs, const char *name, uint16_t *block_number_out);
+
+int mfs_snapshot_create(mfs_t *mfs, const char *name);
+int mfs_snapshot_list(mfs_t *mfs);
+int mfs_snapshot_delete(mfs_t *mfs, const char *name);
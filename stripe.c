@@ -0,0 +1,580 @@
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "format.h"
+#include "blocks.h"
+#include "stripe.h"
+
+// A striped image keeps its data blocks in member files next to the image, FILENAME.0 to FILENAME.N-1, like RAID 0:
+// the blocks are dealt out in stripe units of a few blocks, unit n going to member n % N. The image file itself only
+// holds the metadata, its data region stays empty. Every member has a thread of its own, so the blocks of a large read
+// or write are transferred by all members at once.
+
+typedef enum {
+    STRIPE_READ,
+    STRIPE_WRITE,
+    STRIPE_SYNC
+} stripe_op_t;
+
+typedef struct {
+    stripe_op_t op;
+    off_t offset;
+    uint8_t *buf;
+    size_t len;
+} stripe_request_t;
+
+typedef struct {
+    int fd;
+    pthread_t thread;
+    bool started;
+    stripe_request_t *queue;
+    size_t queue_head;
+    size_t queue_len;
+    size_t queue_size;
+} stripe_member_t;
+
+struct stripe {
+    uint16_t members;
+    uint16_t unit;
+    stripe_member_t *member;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    // Requests queued or in progress
+    size_t pending;
+    bool failed;
+    bool stopping;
+    bool batch;
+    bool queue_reads;
+};
+
+#define STRIPE_QUEUE_SIZE_INC 16
+
+char *stripe_member_name(const char *filename, uint16_t member) {
+    size_t len = strlen(filename) + 8;
+    char *name = malloc(sizeof(*name) * len);
+    if(name == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    snprintf(name, len, "%s.%u", filename, member);
+
+    return name;
+}
+
+// Size of a member holding its share of the first block_count blocks
+off_t stripe_member_size(uint16_t members, uint16_t unit, uint16_t block_size, uint16_t block_count, uint16_t member) {
+    uint32_t units = ((uint32_t) block_count + unit - 1) / unit;
+    uint32_t blocks = units / members * unit;
+
+    if(member < units % members) {
+        // The member holds one unit of the last, partial round, which may be the short last unit
+        uint32_t last = (units / members * members + member) * unit;
+        uint32_t rest = block_count - last;
+        blocks += rest < unit ? rest : unit;
+    }
+
+    return (off_t) blocks * block_size;
+}
+
+// Creates the members of a new image, reading as zeros
+int stripe_format(const char *filename, uint16_t members, uint16_t unit, uint16_t block_size, uint16_t block_count) {
+    for(uint16_t i = 0; i < members; i++) {
+        char *name = stripe_member_name(filename, i);
+        if(name == NULL) {
+            return -1;
+        }
+
+        int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if(fd < 0) {
+            perror("Failed to open stripe member");
+            free(name);
+            return -1;
+        }
+        free(name);
+
+        if(ftruncate(fd, stripe_member_size(members, unit, block_size, block_count, i))) {
+            perror("ftruncate() failed");
+            close(fd);
+            return -1;
+        }
+
+        close(fd);
+    }
+
+    return 0;
+}
+
+// Reads what is there, the rest of a member past its end reads as zeros
+int stripe_pread(int fd, uint8_t *buf, size_t len, off_t offset) {
+    while(len > 0) {
+        ssize_t read = pread(fd, buf, len, offset);
+        if(read < 0) {
+            perror("Failed to read file into buffer");
+            return -1;
+        }
+        if(read == 0) {
+            memset(buf, 0, len);
+            break;
+        }
+        buf += read;
+        len -= (size_t) read;
+        offset += read;
+    }
+
+    return 0;
+}
+
+int stripe_pwrite(int fd, const uint8_t *buf, size_t len, off_t offset) {
+    while(len > 0) {
+        ssize_t written = pwrite(fd, buf, len, offset);
+        if(written <= 0) {
+            perror("Failed to write buffer to file");
+            return -1;
+        }
+        buf += written;
+        len -= (size_t) written;
+        offset += written;
+    }
+
+    return 0;
+}
+
+int stripe_perform(stripe_member_t *member, stripe_request_t *request) {
+    switch(request->op) {
+        case STRIPE_READ:
+            return stripe_pread(member->fd, request->buf, request->len, request->offset);
+        case STRIPE_WRITE:
+            return stripe_pwrite(member->fd, request->buf, request->len, request->offset);
+        case STRIPE_SYNC:
+            if(fdatasync(member->fd)) {
+                perror("fdatasync() failed");
+                return -1;
+            }
+            return 0;
+    }
+
+    return -1;
+}
+
+typedef struct {
+    stripe_t *stripe;
+    stripe_member_t *member;
+} stripe_worker_t;
+
+// Works through the queue of one member in order, so requests for the same block never overtake each other
+void *stripe_worker(void *arg) {
+    stripe_worker_t *worker = arg;
+    stripe_t *stripe = worker->stripe;
+    stripe_member_t *member = worker->member;
+    free(worker);
+
+    pthread_mutex_lock(&stripe->lock);
+
+    while(1) {
+        while(!stripe->stopping && member->queue_head == member->queue_len) {
+            pthread_cond_wait(&stripe->work, &stripe->lock);
+        }
+        if(member->queue_head == member->queue_len) {
+            break;
+        }
+
+        stripe_request_t request = member->queue[member->queue_head];
+        member->queue_head++;
+        if(member->queue_head == member->queue_len) {
+            member->queue_head = 0;
+            member->queue_len = 0;
+        }
+
+        pthread_mutex_unlock(&stripe->lock);
+
+        int ret = stripe_perform(member, &request);
+        if(request.op == STRIPE_WRITE) {
+            // Writes are queued with a copy of the data
+            free(request.buf);
+        }
+
+        pthread_mutex_lock(&stripe->lock);
+
+        if(ret) {
+            stripe->failed = true;
+        }
+        stripe->pending--;
+        if(stripe->pending == 0) {
+            pthread_cond_broadcast(&stripe->done);
+        }
+    }
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    return NULL;
+}
+
+int stripe_queue(stripe_t *stripe, uint16_t member_index, stripe_request_t *request) {
+    stripe_member_t *member = &stripe->member[member_index];
+
+    pthread_mutex_lock(&stripe->lock);
+
+    if(member->queue_len == member->queue_size) {
+        size_t size = member->queue_size + STRIPE_QUEUE_SIZE_INC;
+        stripe_request_t *queue = realloc(member->queue, sizeof(*queue) * size);
+        if(queue == NULL) {
+            pthread_mutex_unlock(&stripe->lock);
+            perror("Memory allocation failed");
+            return -1;
+        }
+        member->queue = queue;
+        member->queue_size = size;
+    }
+
+    member->queue[member->queue_len] = *request;
+    member->queue_len++;
+    stripe->pending++;
+
+    pthread_cond_broadcast(&stripe->work);
+    pthread_mutex_unlock(&stripe->lock);
+
+    return 0;
+}
+
+// Waits for everything queued so far, returns -1 if any of it failed
+int stripe_wait(stripe_t *stripe) {
+    pthread_mutex_lock(&stripe->lock);
+
+    while(stripe->pending > 0) {
+        pthread_cond_wait(&stripe->done, &stripe->lock);
+    }
+
+    bool failed = stripe->failed;
+    stripe->failed = false;
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    return failed ? -1 : 0;
+}
+
+int stripe_open(mfs_t *mfs, const char *filename, uint16_t members, uint16_t unit) {
+    if(members == 0 || unit == 0) {
+        fprintf(stderr, "Invalid stripe geometry\n");
+        return -1;
+    }
+
+    stripe_t *stripe = calloc(1, sizeof(*stripe));
+    if(stripe == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    stripe->member = calloc(members, sizeof(*stripe->member));
+    if(stripe->member == NULL) {
+        perror("Memory allocation failed");
+        free(stripe);
+        return -1;
+    }
+
+    stripe->members = members;
+    stripe->unit = unit;
+    pthread_mutex_init(&stripe->lock, NULL);
+    pthread_cond_init(&stripe->work, NULL);
+    pthread_cond_init(&stripe->done, NULL);
+
+    for(uint16_t i = 0; i < members; i++) {
+        stripe->member[i].fd = -1;
+    }
+
+    mfs->stripe = stripe;
+
+    for(uint16_t i = 0; i < members; i++) {
+        stripe_member_t *member = &stripe->member[i];
+
+        char *name = stripe_member_name(filename, i);
+        if(name == NULL) {
+            stripe_free(mfs);
+            return -1;
+        }
+
+        member->fd = open(name, mfs->read_only ? O_RDONLY : O_RDWR);
+        if(member->fd < 0) {
+            fprintf(stderr, "Failed to open stripe member %s: ", name);
+            perror(NULL);
+            free(name);
+            stripe_free(mfs);
+            return -1;
+        }
+        free(name);
+
+        stripe_worker_t *worker = malloc(sizeof(*worker));
+        if(worker == NULL) {
+            perror("Memory allocation failed");
+            stripe_free(mfs);
+            return -1;
+        }
+        worker->stripe = stripe;
+        worker->member = member;
+
+        if(pthread_create(&member->thread, NULL, stripe_worker, worker)) {
+            fprintf(stderr, "Failed to start stripe worker\n");
+            free(worker);
+            stripe_free(mfs);
+            return -1;
+        }
+        member->started = true;
+    }
+
+    return 0;
+}
+
+void stripe_free(mfs_t *mfs) {
+    stripe_t *stripe = mfs->stripe;
+    if(stripe == NULL) {
+        return;
+    }
+
+    stripe_wait(stripe);
+
+    pthread_mutex_lock(&stripe->lock);
+    stripe->stopping = true;
+    pthread_cond_broadcast(&stripe->work);
+    pthread_mutex_unlock(&stripe->lock);
+
+    for(uint16_t i = 0; i < stripe->members; i++) {
+        stripe_member_t *member = &stripe->member[i];
+        if(member->started) {
+            pthread_join(member->thread, NULL);
+        }
+        if(member->fd >= 0) {
+            close(member->fd);
+        }
+        free(member->queue);
+    }
+
+    pthread_cond_destroy(&stripe->done);
+    pthread_cond_destroy(&stripe->work);
+    pthread_mutex_destroy(&stripe->lock);
+    free(stripe->member);
+    free(stripe);
+
+    mfs->stripe = NULL;
+}
+
+// Offsets outside the data region are in the image file itself
+int stripe_primary_io(mfs_t *mfs, bool write, size_t offset, uint8_t *buf, size_t len) {
+    fseek(mfs->f, offset, SEEK_SET);
+
+    if(write) {
+        if(fwrite(buf, sizeof(*buf), len, mfs->f) != len) {
+            perror("Failed to write buffer to file");
+            return -1;
+        }
+        return 0;
+    }
+
+    if(fread(buf, sizeof(*buf), len, mfs->f) != len) {
+        if(ferror(mfs->f)) {
+            perror("File read error");
+        } else if(feof(mfs->f)) {
+            fprintf(stderr, "File to short\n");
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+// Maps an offset in the data region to a member and the offset in it. Returns how much of len is contiguous there.
+size_t stripe_locate(mfs_t *mfs, size_t offset, size_t len, uint16_t *member_out, off_t *member_offset_out) {
+    stripe_t *stripe = mfs->stripe;
+    size_t data_end = mfs->blocks_base + block_bytes(mfs, mfs->data_block_count);
+
+    size_t rel = offset - mfs->blocks_base;
+    uint32_t block = block_of_pos(mfs, rel);
+    uint32_t unit = block / stripe->unit;
+    uint32_t member_block = unit / stripe->members * stripe->unit + block % stripe->unit;
+    size_t in_block = offset_in_block(mfs, rel);
+
+    // The rest of the stripe unit is contiguous in the member
+    size_t chunk = block_bytes(mfs, stripe->unit - block % stripe->unit) - in_block;
+    if(chunk > len) {
+        chunk = len;
+    }
+    if(chunk > data_end - offset) {
+        chunk = data_end - offset;
+    }
+
+    *member_out = (uint16_t) (unit % stripe->members);
+    *member_offset_out = (off_t) block_bytes(mfs, member_block) + (off_t) in_block;
+
+    return chunk;
+}
+
+int stripe_io(mfs_t *mfs, stripe_op_t op, size_t offset, uint8_t *buf, size_t len) {
+    stripe_t *stripe = mfs->stripe;
+    size_t data_end = mfs->blocks_base + (size_t) mfs->data_block_count * mfs->block_size;
+
+    bool queued = stripe->batch && (op == STRIPE_WRITE || stripe->queue_reads);
+    if(!queued && stripe_wait(stripe)) {
+        return -1;
+    }
+
+    while(len > 0) {
+        if(offset < mfs->blocks_base || offset >= data_end) {
+            size_t chunk = offset < mfs->blocks_base ? mfs->blocks_base - offset : len;
+            if(chunk > len) {
+                chunk = len;
+            }
+            if(queued && stripe_wait(stripe)) {
+                return -1;
+            }
+            if(stripe_primary_io(mfs, op == STRIPE_WRITE, offset, buf, chunk)) {
+                return -1;
+            }
+            offset += chunk;
+            buf += chunk;
+            len -= chunk;
+            continue;
+        }
+
+        uint16_t member;
+        off_t member_offset;
+        size_t chunk = stripe_locate(mfs, offset, len, &member, &member_offset);
+
+        stripe_request_t request = { op, member_offset, buf, chunk };
+
+        if(queued) {
+            if(op == STRIPE_WRITE) {
+                request.buf = malloc(sizeof(*request.buf) * chunk);
+                if(request.buf == NULL) {
+                    perror("Memory allocation failed");
+                    return -1;
+                }
+                memcpy(request.buf, buf, chunk);
+            }
+            if(stripe_queue(stripe, member, &request)) {
+                if(op == STRIPE_WRITE) {
+                    free(request.buf);
+                }
+                return -1;
+            }
+        } else if(stripe_perform(&stripe->member[member], &request)) {
+            return -1;
+        }
+
+        offset += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+// Reads the data region with positional reads from the calling thread, bypassing the members' threads and queues, so
+// several threads may read at once. Nothing may be written meanwhile.
+int stripe_pread_at(mfs_t *mfs, size_t offset, uint8_t *buf, size_t len) {
+    while(len > 0) {
+        uint16_t member;
+        off_t member_offset;
+        size_t chunk = stripe_locate(mfs, offset, len, &member, &member_offset);
+        if(stripe_pread(mfs->stripe->member[member].fd, buf, chunk, member_offset)) {
+            return -1;
+        }
+        offset += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+int stripe_read(mfs_t *mfs, size_t offset, uint8_t *buf, size_t len) {
+    return stripe_io(mfs, STRIPE_READ, offset, buf, len);
+}
+
+int stripe_write(mfs_t *mfs, size_t offset, const uint8_t *buf, size_t len) {
+    return stripe_io(mfs, STRIPE_WRITE, offset, (uint8_t *) buf, len);
+}
+
+// Until stripe_end(), writes are handed to the members' threads instead of waiting for each one. Reads are too if
+// queue_reads is set, so their buffers must not be looked at before stripe_end() returns.
+void stripe_begin(mfs_t *mfs, bool queue_reads) {
+    if(mfs->stripe == NULL) {
+        return;
+    }
+
+    mfs->stripe->batch = true;
+    mfs->stripe->queue_reads = queue_reads;
+}
+
+int stripe_end(mfs_t *mfs) {
+    if(mfs->stripe == NULL) {
+        return 0;
+    }
+
+    mfs->stripe->batch = false;
+    mfs->stripe->queue_reads = false;
+
+    return stripe_wait(mfs->stripe);
+}
+
+// Flushes all members to the disk at the same time
+int stripe_sync(mfs_t *mfs) {
+    stripe_t *stripe = mfs->stripe;
+    if(stripe == NULL) {
+        return 0;
+    }
+
+    for(uint16_t i = 0; i < stripe->members; i++) {
+        stripe_request_t request = { STRIPE_SYNC, 0, NULL, 0 };
+        if(stripe_queue(stripe, i, &request)) {
+            stripe_wait(stripe);
+            return -1;
+        }
+    }
+
+    return stripe_wait(stripe);
+}
+
+// Fits the members to the image's block count. Blocks dropped by shrinking are cut off, so they read as zeros when the
+// image grows again.
+int stripe_resize(mfs_t *mfs) {
+    stripe_t *stripe = mfs->stripe;
+    if(stripe == NULL) {
+        return 0;
+    }
+
+    if(stripe_wait(stripe)) {
+        return -1;
+    }
+
+    for(uint16_t i = 0; i < stripe->members; i++) {
+        off_t size = stripe_member_size(stripe->members, stripe->unit, mfs->block_size, mfs->data_block_count, i);
+        if(ftruncate(stripe->member[i].fd, size)) {
+            perror("ftruncate() failed");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+uint16_t stripe_members(mfs_t *mfs) {
+    return mfs->stripe ? mfs->stripe->members : 0;
+}
+
+uint16_t stripe_unit_blocks(mfs_t *mfs) {
+    return mfs->stripe ? mfs->stripe->unit : 0;
+}
+
+int stripe_member_fd(mfs_t *mfs, uint16_t member) {
+    return mfs->stripe->member[member].fd;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "mfs.h"
+
+int stripe_format(const char *filename, uint16_t members, uint16_t unit, uint16_t block_size, uint16_t block_count);
+int stripe_open(mfs_t *mfs, const char *filename, uint16_t members, uint16_t unit);
+void stripe_free(mfs_t *mfs);
+
+uint16_t stripe_members(mfs_t *mfs);
+uint16_t stripe_unit_blocks(mfs_t *mfs);
+
+size_t stripe_locate(mfs_t *mfs, size_t offset, size_t len, uint16_t *member_out, off_t *member_offset_out);
+int stripe_member_fd(mfs_t *mfs, uint16_t member);
+
+int stripe_read(mfs_t *mfs, size_t offset, uint8_t *buf, size_t len);
+int stripe_pread_at(mfs_t *mfs, size_t offset, uint8_t *buf, size_t len);
+int stripe_write(mfs_t *mfs, size_t offset, const uint8_t *buf, size_t len);
+
+void stripe_begin(mfs_t *mfs, bool queue_reads);
+int stripe_end(mfs_t *mfs);
+int stripe_sync(mfs_t *mfs);
+int stripe_resize(mfs_t *mfs);
@@ -0,0 +1,611 @@
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "batch.h"
+#include "format.h"
+#include "parse_opts.h"
+#include "resize.h"
+#include "snapshot.h"
+#include "trace.h"
+#include "tree.h"
+
+// A trace starts with a header (magic, version) followed by one record per library call: the operation, whether it
+// failed, the lengths of up to two paths, the call's arguments (position, length, size, block or directory cursor),
+// when it started in nanoseconds since the trace was opened and how long it took, then the paths. File contents aren't
+// recorded, replaying a write writes as many bytes of a fixed pattern. The second path of a batch create holds its
+// names, one per line like in a list file.
+#define TRACE_MAGIC 0x5453464Du
+#define TRACE_VERSION 2
+#define TRACE_HEADER_SIZE 8
+
+#define TRACE_RECORD_SIZE 28
+#define TR_OP 0
+#define TR_FAILED 1
+#define TR_PATH_LEN 2
+#define TR_PATH2_LEN 4
+#define TR_ARG 8
+#define TR_ARG2 12
+#define TR_TIME 16
+#define TR_DURATION 24
+
+// Version 1 records have a 16 bit second path length and a single argument
+#define TRACE_V1_RECORD_SIZE 22
+#define TR_V1_PATH2_LEN 4
+#define TR_V1_ARG 6
+#define TR_V1_TIME 10
+#define TR_V1_DURATION 18
+
+#define TRACE_OP_COUNT (TRACE_TREE + 1)
+#define TRACE_LATENCIES_SIZE_INC 1024
+
+struct trace {
+    FILE *f;
+    uint64_t origin;
+};
+
+static const char *trace_op_names[TRACE_OP_COUNT] = {
+    NULL, "mkdir", "touch", "ctouch", "rm", "cp", "fopen", "fclose", "fseek", "fread", "fwrite", "ftruncate", "sync",
+    "rmdir", "ls", "readdir", "fgoal", "resize", "snapshot", "snap rm", "snap list", "create", "rm -r", "find", "du",
+    "tree"
+};
+
+uint64_t trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+int trace_open(mfs_t *mfs, const char *filename) {
+    trace_t *trace = malloc(sizeof(*trace));
+    if(trace == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    trace->f = fopen(filename, "wb");
+    if(trace->f == NULL) {
+        perror("Failed to open trace file");
+        free(trace);
+        return -1;
+    }
+
+    uint8_t header[TRACE_HEADER_SIZE] = { 0 };
+    write32(header, 0, TRACE_MAGIC);
+    write16(header, 4, TRACE_VERSION);
+    if(fwrite(header, sizeof(*header), TRACE_HEADER_SIZE, trace->f) != TRACE_HEADER_SIZE) {
+        perror("Write operation failed");
+        fclose(trace->f);
+        free(trace);
+        return -1;
+    }
+
+    trace->origin = trace_now_ns();
+    mfs->trace = trace;
+
+    return 0;
+}
+
+void trace_close(mfs_t *mfs) {
+    if(mfs->trace == NULL) {
+        return;
+    }
+
+    if(fclose(mfs->trace->f)) {
+        perror("Failed to write trace file");
+    }
+    free(mfs->trace);
+    mfs->trace = NULL;
+}
+
+// Start time of a call for trace_record(), 0 if nothing is traced
+uint64_t trace_clock(mfs_t *mfs) {
+    return mfs->trace ? trace_now_ns() : 0;
+}
+
+void trace_record(mfs_t *mfs, trace_op_t op, uint64_t start, int ret, const char *path, const char *path2, uint32_t arg) {
+    trace_record_args(mfs, op, start, ret, path, path2, arg, 0);
+}
+
+void trace_record_args(mfs_t *mfs, trace_op_t op, uint64_t start, int ret, const char *path, const char *path2, uint32_t arg, uint32_t arg2) {
+    trace_t *trace = mfs->trace;
+    if(trace == NULL) {
+        return;
+    }
+
+    uint64_t duration = trace_now_ns() - start;
+    size_t path_len = path ? strlen(path) : 0;
+    size_t path2_len = path2 ? strlen(path2) : 0;
+
+    uint8_t record[TRACE_RECORD_SIZE];
+    record[TR_OP] = (uint8_t) op;
+    record[TR_FAILED] = ret != 0;
+    write16(record, TR_PATH_LEN, (uint16_t) path_len);
+    write32(record, TR_PATH2_LEN, (uint32_t) path2_len);
+    write32(record, TR_ARG, arg);
+    write32(record, TR_ARG2, arg2);
+    write64(record, TR_TIME, start - trace->origin);
+    write32(record, TR_DURATION, duration > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t) duration);
+
+    // A short write shows up when the trace is closed
+    fwrite(record, sizeof(*record), TRACE_RECORD_SIZE, trace->f);
+    fwrite(path, sizeof(*path), path_len, trace->f);
+    fwrite(path2, sizeof(*path2), path2_len, trace->f);
+}
+
+// Records a batch create with its names joined into the second path, directories ending in a slash
+void trace_record_names(mfs_t *mfs, trace_op_t op, uint64_t start, int ret, const char *path, unsigned int count, const char **names, const uint16_t *types) {
+    if(mfs->trace == NULL) {
+        return;
+    }
+
+    size_t len = 0;
+    for(unsigned int i = 0; i < count; i++) {
+        len += strlen(names[i]) + 2;
+    }
+
+    char *list = malloc(sizeof(*list) * (len + 1));
+    if(list == NULL) {
+        perror("Memory allocation failed");
+        return;
+    }
+
+    char *end = list;
+    for(unsigned int i = 0; i < count; i++) {
+        size_t name_len = strlen(names[i]);
+        memcpy(end, names[i], name_len);
+        end += name_len;
+        if(types[i] == MFS_TYPE_DIRECTORY) {
+            *end++ = '/';
+        }
+        *end++ = '\n';
+    }
+    *end = '\0';
+
+    trace_record_args(mfs, op, start, ret, path, list, count, 0);
+    free(list);
+}
+
+typedef struct {
+    trace_op_t op;
+    bool failed;
+    uint32_t arg;
+    uint32_t arg2;
+    uint64_t time;
+    uint32_t duration;
+    char *path;
+    char *path2;
+} trace_entry_t;
+
+char *trace_read_path(FILE *f, uint32_t len) {
+    char *path = malloc(sizeof(*path) * (len + 1));
+    if(path == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    if(fread(path, sizeof(*path), len, f) != len) {
+        fprintf(stderr, "Truncated trace\n");
+        free(path);
+        return NULL;
+    }
+    path[len] = '\0';
+
+    return path;
+}
+
+// Returns 1 with the next entry, 0 at the end of the trace
+int trace_read_entry(FILE *f, uint16_t version, trace_entry_t *entry) {
+    uint8_t record[TRACE_RECORD_SIZE];
+    size_t size = version == 1 ? TRACE_V1_RECORD_SIZE : TRACE_RECORD_SIZE;
+    size_t read = fread(record, sizeof(*record), size, f);
+    if(read == 0 && feof(f)) {
+        return 0;
+    }
+    if(read != size) {
+        fprintf(stderr, "Truncated trace\n");
+        return -1;
+    }
+
+    entry->op = (trace_op_t) record[TR_OP];
+    entry->failed = record[TR_FAILED] != 0;
+    uint32_t path2_len;
+    if(version == 1) {
+        path2_len = read16(record, TR_V1_PATH2_LEN);
+        entry->arg = read32(record, TR_V1_ARG);
+        entry->arg2 = 0;
+        entry->time = read64(record, TR_V1_TIME);
+        entry->duration = read32(record, TR_V1_DURATION);
+    } else {
+        path2_len = read32(record, TR_PATH2_LEN);
+        entry->arg = read32(record, TR_ARG);
+        entry->arg2 = read32(record, TR_ARG2);
+        entry->time = read64(record, TR_TIME);
+        entry->duration = read32(record, TR_DURATION);
+    }
+
+    if(entry->op < TRACE_MKDIR || entry->op >= TRACE_OP_COUNT) {
+        fprintf(stderr, "Unknown operation %u in trace\n", record[TR_OP]);
+        return -1;
+    }
+
+    entry->path = trace_read_path(f, read16(record, TR_PATH_LEN));
+    if(entry->path == NULL) {
+        return -1;
+    }
+    entry->path2 = trace_read_path(f, path2_len);
+    if(entry->path2 == NULL) {
+        free(entry->path);
+        return -1;
+    }
+
+    return 1;
+}
+
+// Lists a page of a directory from the recorded cursor
+int trace_readdir(mfs_t *mfs, trace_entry_t *entry) {
+    mfs_dirent_t *entries = malloc(sizeof(*entries) * (entry->arg ? entry->arg : 1));
+    if(entries == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    mfs_dir_cursor_t cursor = entry->arg2;
+    size_t count;
+    int ret = mfs_readdir(mfs, entry->path, &cursor, entries, entry->arg, &count);
+    free(entries);
+
+    return ret;
+}
+
+// Creates the entries of a batch from the names in the second path
+int trace_create_many(mfs_t *mfs, trace_entry_t *entry) {
+    const char **names = malloc(sizeof(*names) * (entry->arg ? entry->arg : 1));
+    uint16_t *types = malloc(sizeof(*types) * (entry->arg ? entry->arg : 1));
+    if(names == NULL || types == NULL) {
+        perror("Memory allocation failed");
+        free(names);
+        free(types);
+        return -1;
+    }
+
+    unsigned int count = 0;
+    char *line = entry->path2;
+    while(line != NULL && count < entry->arg) {
+        char *name = strsep(&line, "\n");
+        size_t len = strlen(name);
+        if(len == 0) {
+            continue;
+        }
+
+        types[count] = MFS_TYPE_FILE;
+        if(len > 1 && name[len - 1] == '/') {
+            name[len - 1] = '\0';
+            types[count] = MFS_TYPE_DIRECTORY;
+        }
+        names[count++] = name;
+    }
+
+    int ret = mfs_create_many(mfs, entry->path, count, names, types);
+
+    free(names);
+    free(types);
+
+    return ret;
+}
+
+// Calls that list something print to standard output
+bool trace_op_prints(trace_op_t op) {
+    return op == TRACE_LS || op == TRACE_SNAPSHOT_LIST || op == TRACE_FIND || op == TRACE_DU || op == TRACE_TREE;
+}
+
+int trace_execute(mfs_t *mfs, trace_entry_t *entry, uint8_t *buf) {
+    switch(entry->op) {
+        case TRACE_MKDIR:
+            return mfs_mkdir(mfs, entry->path);
+        case TRACE_TOUCH:
+            return mfs_touch(mfs, entry->path);
+        case TRACE_CTOUCH:
+            return mfs_touch_compressed(mfs, entry->path);
+        case TRACE_RM:
+            return mfs_rm(mfs, entry->path);
+        case TRACE_CP:
+            return mfs_cp(mfs, entry->path, entry->path2);
+        case TRACE_FOPEN:
+            return mfs_fopen(mfs, entry->path);
+        case TRACE_FCLOSE:
+            return mfs_fclose(mfs);
+        case TRACE_FSEEK:
+            return mfs_fseek(mfs, entry->arg);
+        case TRACE_FREAD:
+            return mfs_fread(mfs, (uint16_t) entry->arg, buf);
+        case TRACE_FWRITE:
+            return mfs_fwrite(mfs, (uint16_t) entry->arg, buf);
+        case TRACE_FTRUNCATE:
+            return mfs_ftruncate(mfs, entry->arg);
+        case TRACE_SYNC:
+            return mfs_sync(mfs);
+        case TRACE_RMDIR:
+            return mfs_rmdir(mfs, entry->path);
+        case TRACE_LS:
+            return mfs_ls(mfs, entry->path);
+        case TRACE_READDIR:
+            return trace_readdir(mfs, entry);
+        case TRACE_FGOAL:
+            return mfs_fgoal(mfs, (uint16_t) entry->arg);
+        case TRACE_RESIZE:
+            return mfs_resize(mfs, (uint16_t) entry->arg);
+        case TRACE_SNAPSHOT_CREATE:
+            return mfs_snapshot_create(mfs, entry->path);
+        case TRACE_SNAPSHOT_DELETE:
+            return mfs_snapshot_delete(mfs, entry->path);
+        case TRACE_SNAPSHOT_LIST:
+            return mfs_snapshot_list(mfs);
+        case TRACE_CREATE_MANY:
+            return trace_create_many(mfs, entry);
+        case TRACE_RM_RECURSIVE:
+            return mfs_rm_recursive(mfs, entry->path);
+        case TRACE_FIND:
+            return mfs_find(mfs, entry->path, entry->path2[0] != '\0' ? entry->path2 : NULL);
+        case TRACE_DU:
+            return mfs_du(mfs, entry->path);
+        case TRACE_TREE:
+            return mfs_tree(mfs, entry->path);
+    }
+
+    return -1;
+}
+
+typedef struct {
+    uint64_t *latencies;
+    size_t count;
+    size_t size;
+    size_t errors;
+    // Sum of the latencies in the trace
+    uint64_t recorded;
+} trace_stats_t;
+
+int trace_add_latency(trace_stats_t *stats, uint64_t latency) {
+    if(stats->count == stats->size) {
+        size_t size = stats->size + TRACE_LATENCIES_SIZE_INC;
+        uint64_t *latencies = realloc(stats->latencies, sizeof(*latencies) * size);
+        if(latencies == NULL) {
+            perror("Memory allocation failed");
+            return -1;
+        }
+        stats->latencies = latencies;
+        stats->size = size;
+    }
+
+    stats->latencies[stats->count] = latency;
+    stats->count++;
+
+    return 0;
+}
+
+int compare_latencies(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+double trace_percentile_us(trace_stats_t *stats, unsigned int percent) {
+    size_t index = (stats->count * percent + 99) / 100;
+    if(index > 0) {
+        index--;
+    }
+    return (double) stats->latencies[index] / 1000.0;
+}
+
+void trace_report(trace_stats_t *stats, uint64_t elapsed, size_t bytes_read, size_t bytes_written, size_t differed) {
+    size_t total = 0;
+    for(int op = TRACE_MKDIR; op < TRACE_OP_COUNT; op++) {
+        total += stats[op].count;
+    }
+
+    double seconds = (double) elapsed / 1e9;
+    printf("Replayed %zu operations in %.3f s, %.0f ops/s, %.2f MB read, %.2f MB written, %.2f MB/s\n", total, seconds,
+            seconds > 0 ? (double) total / seconds : 0, (double) bytes_read / 1e6, (double) bytes_written / 1e6,
+            seconds > 0 ? (double) (bytes_read + bytes_written) / 1e6 / seconds : 0);
+    printf("%-10s %8s %6s %10s %10s %10s %10s %10s %10s\n", "operation", "count", "errors", "mean us", "p50 us", "p90 us", "p99 us", "max us", "traced us");
+
+    for(int op = TRACE_MKDIR; op < TRACE_OP_COUNT; op++) {
+        trace_stats_t *s = &stats[op];
+        if(s->count == 0) {
+            continue;
+        }
+
+        qsort(s->latencies, s->count, sizeof(*s->latencies), compare_latencies);
+
+        uint64_t sum = 0;
+        for(size_t i = 0; i < s->count; i++) {
+            sum += s->latencies[i];
+        }
+
+        printf("%-10s %8zu %6zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", trace_op_names[op], s->count, s->errors,
+                (double) sum / (double) s->count / 1000.0, trace_percentile_us(s, 50), trace_percentile_us(s, 90),
+                trace_percentile_us(s, 99), (double) s->latencies[s->count - 1] / 1000.0,
+                (double) s->recorded / (double) s->count / 1000.0);
+    }
+
+    if(differed > 0) {
+        printf("%zu operations failed or succeeded unlike when they were recorded\n", differed);
+    }
+}
+
+// Creates a fresh image and runs the calls of a trace against it, either back to back or at the times they were
+// recorded at. Other options are passed to mfs_create() and mfs_open().
+int mfs_replay(char *filename, int optc, char **optv) {
+    if(optc < 1) {
+        fprintf(stderr, "Missing trace file\n");
+        return -1;
+    }
+    const char *trace_filename = optv[0];
+    optc--;
+    optv++;
+
+    bool original_timing = false;
+    for(int i = 0; i < optc; i++) {
+        char *opt = strdup(optv[i]);
+        char *name;
+        char *value;
+
+        parse_opt(opt, &name, &value);
+
+        if(strequals(name, "timing")) {
+            if(value && strequals(value, "original")) {
+                original_timing = true;
+            } else if(value && strequals(value, "fast")) {
+                original_timing = false;
+            } else {
+                fprintf(stderr, "Unknown timing %s\n", value ? value : "");
+                free(opt);
+                return -1;
+            }
+        }
+
+        free(opt);
+    }
+
+    FILE *f = fopen(trace_filename, "rb");
+    if(f == NULL) {
+        perror("Failed to open trace file");
+        return -1;
+    }
+
+    uint8_t header[TRACE_HEADER_SIZE];
+    if(fread(header, sizeof(*header), TRACE_HEADER_SIZE, f) != TRACE_HEADER_SIZE || read32(header, 0) != TRACE_MAGIC) {
+        fprintf(stderr, "Not a trace file: %s\n", trace_filename);
+        fclose(f);
+        return -1;
+    }
+    uint16_t version = read16(header, 4);
+    if(version < 1 || version > TRACE_VERSION) {
+        fprintf(stderr, "Unsupported trace version %u\n", version);
+        fclose(f);
+        return -1;
+    }
+
+    if(mfs_create(filename, optc, optv)) {
+        fprintf(stderr, "Failed to create %s\n", filename);
+        fclose(f);
+        return -1;
+    }
+
+    mfs_t *mfs = mfs_open(filename, optc, optv);
+    if(mfs == NULL) {
+        fprintf(stderr, "Failed to open %s\n", filename);
+        fclose(f);
+        return -1;
+    }
+
+    uint8_t *buf = malloc(sizeof(*buf) * 0x10000);
+    trace_stats_t *stats = calloc(TRACE_OP_COUNT, sizeof(*stats));
+    if(buf == NULL || stats == NULL) {
+        perror("Memory allocation failed");
+        free(buf);
+        free(stats);
+        mfs_free(mfs);
+        fclose(f);
+        return -1;
+    }
+    for(size_t i = 0; i < 0x10000; i++) {
+        buf[i] = (uint8_t) ('a' + i % 26);
+    }
+
+    // Listings go to /dev/null, so only the report is printed
+    fflush(stdout);
+    int null_fd = open("/dev/null", O_WRONLY);
+    int stdout_fd = dup(STDOUT_FILENO);
+
+    size_t bytes_read = 0;
+    size_t bytes_written = 0;
+    size_t differed = 0;
+    int ret = 0;
+
+    uint64_t origin = trace_now_ns();
+    trace_entry_t entry;
+    int more;
+    while((more = trace_read_entry(f, version, &entry)) > 0) {
+        if(original_timing) {
+            uint64_t due = origin + entry.time;
+            struct timespec ts = { (time_t) (due / 1000000000u), (long) (due % 1000000000u) };
+            int err;
+            do {
+                err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+            } while(err == EINTR);
+        }
+
+        bool quiet = trace_op_prints(entry.op) && null_fd >= 0 && stdout_fd >= 0;
+        if(quiet) {
+            fflush(stdout);
+            dup2(null_fd, STDOUT_FILENO);
+        }
+
+        uint64_t start = trace_now_ns();
+        int failed = trace_execute(mfs, &entry, buf) != 0;
+        uint64_t latency = trace_now_ns() - start;
+
+        if(quiet) {
+            fflush(stdout);
+            dup2(stdout_fd, STDOUT_FILENO);
+        }
+
+        trace_stats_t *s = &stats[entry.op];
+        if(trace_add_latency(s, latency)) {
+            ret = -1;
+        }
+        s->recorded += entry.duration;
+        if(failed) {
+            s->errors++;
+        } else if(entry.op == TRACE_FREAD) {
+            bytes_read += (uint16_t) entry.arg;
+        } else if(entry.op == TRACE_FWRITE) {
+            bytes_written += (uint16_t) entry.arg;
+        }
+        if(failed != entry.failed) {
+            differed++;
+        }
+
+        free(entry.path);
+        free(entry.path2);
+
+        if(ret) {
+            break;
+        }
+    }
+    if(more < 0) {
+        ret = -1;
+    }
+
+    uint64_t elapsed = trace_now_ns() - origin;
+
+    mfs_free(mfs);
+    fclose(f);
+    if(null_fd >= 0) {
+        close(null_fd);
+    }
+    if(stdout_fd >= 0) {
+        close(stdout_fd);
+    }
+
+    trace_report(stats, elapsed, bytes_read, bytes_written, differed);
+
+    for(int op = 0; op < TRACE_OP_COUNT; op++) {
+        free(stats[op].latencies);
+    }
+    free(stats);
+    free(buf);
+
+    return ret;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "mfs.h"
+
+typedef enum {
+    TRACE_MKDIR = 1,
+    TRACE_TOUCH,
+    TRACE_CTOUCH,
+    TRACE_RM,
+    TRACE_CP,
+    TRACE_FOPEN,
+    TRACE_FCLOSE,
+    TRACE_FSEEK,
+    TRACE_FREAD,
+    TRACE_FWRITE,
+    TRACE_FTRUNCATE,
+    TRACE_SYNC,
+    TRACE_RMDIR,
+    TRACE_LS,
+    TRACE_READDIR,
+    TRACE_FGOAL,
+    TRACE_RESIZE,
+    TRACE_SNAPSHOT_CREATE,
+    TRACE_SNAPSHOT_DELETE,
+    TRACE_SNAPSHOT_LIST,
+    TRACE_CREATE_MANY,
+    TRACE_RM_RECURSIVE,
+    TRACE_FIND,
+    TRACE_DU,
+    TRACE_TREE
+} trace_op_t;
+
+int trace_open(mfs_t *mfs, const char *filename);
+void trace_close(mfs_t *mfs);
+
+uint64_t trace_clock(mfs_t *mfs);
+void trace_record(mfs_t *mfs, trace_op_t op, uint64_t start, int ret, const char *path, const char *path2, uint32_t arg);
+void trace_record_args(mfs_t *mfs, trace_op_t op, uint64_t start, int ret, const char *path, const char *path2, uint32_t arg, uint32_t arg2);
+void trace_record_names(mfs_t *mfs, trace_op_t op, uint64_t start, int ret, const char *path, unsigned int count, const char **names, const uint16_t *types);
+
+int mfs_replay(char *filename, int optc, char **optv);
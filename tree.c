@@ -0,0 +1,676 @@
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "util.h"
+#include "format.h"
+#include "blocks.h"
+#include "alloc_table.h"
+#include "share.h"
+#include "trace.h"
+#include "tree.h"
+
+// Recursive operations walk a directory tree with a pool of threads. Every thread keeps a queue of directories still to
+// be scanned: it adds the subdirectories it finds to the back and takes its next directory from there, so it works
+// depth first, while a thread that runs out of work steals from the front of another thread's queue, taking over the
+// largest pieces of the tree left. Directory blocks are read with pread(), the alloc table is read from memory, and
+// nothing is written until all threads are done.
+
+typedef enum {
+    TREE_FIND,
+    TREE_DU,
+    TREE_LIST,
+    TREE_FREE
+} tree_mode_t;
+
+typedef struct {
+    uint16_t block_number;
+    char *path;
+} tree_task_t;
+
+typedef struct {
+    char *path;
+    uint16_t type;
+    uint16_t block_number;
+    uint32_t blocks;
+} tree_entry_t;
+
+typedef struct tree tree_t;
+
+typedef struct {
+    tree_t *tree;
+    unsigned int index;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    tree_task_t *tasks;
+    size_t head;
+    size_t tail;
+    size_t size;
+    uint8_t *block;
+    // Results of this thread, merged when all are done
+    tree_entry_t *entries;
+    size_t entry_count;
+    size_t entry_size;
+    uint16_t *blocks;
+    size_t block_count;
+    size_t block_size;
+    uint32_t files;
+    uint32_t directories;
+    uint64_t chain_blocks;
+} tree_worker_t;
+
+struct tree {
+    mfs_t *mfs;
+    tree_mode_t mode;
+    const char *pattern;
+    unsigned int worker_count;
+    tree_worker_t *workers;
+    // Directories queued or being scanned, the walk is over when none are left
+    atomic_size_t pending;
+    atomic_bool failed;
+    // Directories already queued, so a damaged tree with a directory linked twice can't make the walk go round
+    atomic_uchar *queued;
+};
+
+#define TREE_SIZE_INC 64
+
+void tree_fail(tree_t *tree) {
+    atomic_store(&tree->failed, true);
+}
+
+// Block 0 is the root directory, so a chain block is in use when its next field is set
+bool tree_block_used(mfs_t *mfs, uint16_t block_number) {
+    return block_number < mfs->block_count && get_block_next(mfs, block_number) != BLOCK_UNUSED;
+}
+
+int tree_push(tree_worker_t *worker, uint16_t block_number, char *path) {
+    tree_t *tree = worker->tree;
+
+    if(!tree_block_used(tree->mfs, block_number)) {
+        fprintf(stderr, "Directory 0x%04x is not in use\n", block_number);
+        free(path);
+        tree_fail(tree);
+        return -1;
+    }
+
+    if(atomic_exchange(&tree->queued[block_number], 1)) {
+        fprintf(stderr, "Directory 0x%04x is linked more than once\n", block_number);
+        free(path);
+        tree_fail(tree);
+        return -1;
+    }
+
+    pthread_mutex_lock(&worker->lock);
+    if(worker->head == worker->tail) {
+        worker->head = 0;
+        worker->tail = 0;
+    }
+    if(worker->tail == worker->size) {
+        size_t size = worker->size + TREE_SIZE_INC;
+        tree_task_t *tasks = realloc(worker->tasks, sizeof(*tasks) * size);
+        if(tasks == NULL) {
+            pthread_mutex_unlock(&worker->lock);
+            perror("Memory allocation failed");
+            free(path);
+            tree_fail(tree);
+            return -1;
+        }
+        worker->tasks = tasks;
+        worker->size = size;
+    }
+    worker->tasks[worker->tail++] = (tree_task_t) { block_number, path };
+    atomic_fetch_add(&tree->pending, 1);
+    pthread_mutex_unlock(&worker->lock);
+
+    return 0;
+}
+
+bool tree_pop(tree_worker_t *worker, tree_task_t *task) {
+    bool found = false;
+
+    pthread_mutex_lock(&worker->lock);
+    if(worker->head < worker->tail) {
+        *task = worker->tasks[--worker->tail];
+        found = true;
+    }
+    pthread_mutex_unlock(&worker->lock);
+
+    return found;
+}
+
+bool tree_steal(tree_worker_t *worker, tree_task_t *task) {
+    tree_t *tree = worker->tree;
+
+    for(unsigned int i = 1; i < tree->worker_count; i++) {
+        tree_worker_t *victim = &tree->workers[(worker->index + i) % tree->worker_count];
+
+        bool found = false;
+        pthread_mutex_lock(&victim->lock);
+        if(victim->head < victim->tail) {
+            *task = victim->tasks[victim->head++];
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if(found) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+int tree_add_entry(tree_worker_t *worker, char *path, uint16_t type, uint16_t block_number, uint32_t blocks) {
+    if(worker->entry_count == worker->entry_size) {
+        size_t size = worker->entry_size + TREE_SIZE_INC;
+        tree_entry_t *entries = realloc(worker->entries, sizeof(*entries) * size);
+        if(entries == NULL) {
+            perror("Memory allocation failed");
+            tree_fail(worker->tree);
+            return -1;
+        }
+        worker->entries = entries;
+        worker->entry_size = size;
+    }
+
+    worker->entries[worker->entry_count++] = (tree_entry_t) { path, type, block_number, blocks };
+
+    return 0;
+}
+
+int tree_collect(tree_worker_t *worker, uint16_t block_number) {
+    if(worker->block_count == worker->block_size) {
+        size_t size = worker->block_size ? 2 * worker->block_size : TREE_SIZE_INC;
+        uint16_t *blocks = realloc(worker->blocks, sizeof(*blocks) * size);
+        if(blocks == NULL) {
+            perror("Memory allocation failed");
+            tree_fail(worker->tree);
+            return -1;
+        }
+        worker->blocks = blocks;
+        worker->block_size = size;
+    }
+    worker->blocks[worker->block_count++] = block_number;
+
+    return 0;
+}
+
+// Walks a chain in the alloc table, adding its blocks to the worker's list if collect is set. Returns its length.
+uint32_t tree_walk_chain(tree_worker_t *worker, uint16_t block_number, bool collect) {
+    mfs_t *mfs = worker->tree->mfs;
+    uint32_t length = 0;
+
+    while(block_number != BLOCK_EOF) {
+        if(!tree_block_used(mfs, block_number) || length == mfs->block_count) {
+            fprintf(stderr, "Chain through block 0x%04x is broken\n", block_number);
+            tree_fail(worker->tree);
+            return length;
+        }
+
+        if(collect && tree_collect(worker, block_number)) {
+            return length;
+        }
+
+        length++;
+        block_number = get_block_next(mfs, block_number);
+    }
+
+    return length;
+}
+
+char *tree_join(const char *dir, const char *name, size_t name_len) {
+    size_t dir_len = strlen(dir);
+    // The root is the only directory whose path ends in a slash
+    bool slash = dir_len == 0 || dir[dir_len - 1] != '/';
+
+    char *path = malloc(sizeof(*path) * (dir_len + slash + name_len + 1));
+    if(path == NULL) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+
+    memcpy(path, dir, dir_len);
+    if(slash) {
+        path[dir_len] = '/';
+    }
+    memcpy(path + dir_len + slash, name, name_len);
+    path[dir_len + slash + name_len] = '\0';
+
+    return path;
+}
+
+void tree_visit(tree_worker_t *worker, const char *dir, const uint8_t *entry) {
+    tree_t *tree = worker->tree;
+    uint16_t type = read16(entry, 0);
+    uint16_t block_number = read16(entry, 2);
+    const char *name = (const char *) &entry[DIR_ENTRY_NAME_OFFSET];
+    size_t name_len = strnlen(name, PATH_SEG_MAX);
+    bool directory = ENTRY_TYPE(type) == MFS_TYPE_DIRECTORY;
+
+    if(tree->mode == TREE_FREE) {
+        // Directory blocks are collected when the directory is scanned. Files whose chain snapshots still refer to are
+        // listed instead, only their reference is dropped.
+        if(directory) {
+            tree_push(worker, block_number, NULL);
+        } else if(share_refs(tree->mfs, block_number) > 1) {
+            tree_add_entry(worker, NULL, type, block_number, 0);
+        } else {
+            tree_walk_chain(worker, block_number, true);
+        }
+        return;
+    }
+
+    uint32_t blocks = tree_walk_chain(worker, block_number, false);
+    worker->chain_blocks += blocks;
+    if(directory) {
+        worker->directories++;
+    } else {
+        worker->files++;
+    }
+
+    if(tree->mode == TREE_DU && !directory) {
+        return;
+    }
+
+    char *path = tree_join(dir, name, name_len);
+    if(path == NULL) {
+        tree_fail(tree);
+        return;
+    }
+
+    bool listed = tree->mode == TREE_LIST;
+    if(tree->mode == TREE_FIND) {
+        char pattern_name[PATH_SEG_MAX + 1] = { 0 };
+        memcpy(pattern_name, name, name_len);
+        listed = tree->pattern == NULL || fnmatch(tree->pattern, pattern_name, 0) == 0;
+    }
+
+    if(!directory) {
+        if(!listed || tree_add_entry(worker, path, type, block_number, blocks)) {
+            free(path);
+        }
+        return;
+    }
+
+    if(listed) {
+        // The task frees its own copy of the path
+        char *entry_path = strdup(path);
+        if(entry_path == NULL || tree_add_entry(worker, entry_path, type, block_number, blocks)) {
+            free(entry_path);
+            free(path);
+            return;
+        }
+    }
+
+    tree_push(worker, block_number, path);
+}
+
+void tree_scan(tree_worker_t *worker, tree_task_t *task) {
+    tree_t *tree = worker->tree;
+    mfs_t *mfs = tree->mfs;
+
+    uint16_t block_number = task->block_number;
+    uint32_t count = 0;
+    bool ended = false;
+    while(block_number != BLOCK_EOF && !atomic_load(&tree->failed)) {
+        if(!tree_block_used(mfs, block_number) || count++ == mfs->block_count) {
+            fprintf(stderr, "Directory chain through block 0x%04x is broken\n", block_number);
+            tree_fail(tree);
+            return;
+        }
+
+        if(tree->mode == TREE_FREE && tree_collect(worker, block_number)) {
+            return;
+        }
+
+        // Removing entries can leave empty blocks behind the last one, which are only collected
+        if(!ended && pread_metadata(mfs, block_offset(mfs, block_number), worker->block, mfs->block_size)) {
+            tree_fail(tree);
+            return;
+        }
+
+        for(uint16_t addr = 0; !ended && addr + DIR_ENTRY_SIZE <= mfs->block_size; addr += DIR_ENTRY_SIZE) {
+            if(read16(worker->block, addr) == MFS_TYPE_END) {
+                ended = true;
+            } else {
+                tree_visit(worker, task->path, &worker->block[addr]);
+            }
+        }
+
+        if(ended && tree->mode != TREE_FREE) {
+            return;
+        }
+
+        block_number = get_block_next(mfs, block_number);
+    }
+}
+
+void *tree_worker(void *arg) {
+    tree_worker_t *worker = arg;
+    tree_t *tree = worker->tree;
+
+    while(atomic_load(&tree->pending) > 0) {
+        tree_task_t task;
+        if(tree_pop(worker, &task) || tree_steal(worker, &task)) {
+            if(!atomic_load(&tree->failed)) {
+                tree_scan(worker, &task);
+            }
+            free(task.path);
+            atomic_fetch_sub(&tree->pending, 1);
+        } else {
+            // Others are still scanning and may find more directories
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+void tree_release(tree_t *tree) {
+    for(unsigned int i = 0; i < tree->worker_count; i++) {
+        tree_worker_t *worker = &tree->workers[i];
+        for(size_t j = worker->head; j < worker->tail; j++) {
+            free(worker->tasks[j].path);
+        }
+        for(size_t j = 0; j < worker->entry_count; j++) {
+            free(worker->entries[j].path);
+        }
+        free(worker->tasks);
+        free(worker->entries);
+        free(worker->blocks);
+        free(worker->block);
+        pthread_mutex_destroy(&worker->lock);
+    }
+    free(tree->workers);
+    free(tree->queued);
+}
+
+// Walks the directory starting at block_number with mfs->threads threads. The results stay in the workers until
+// tree_release().
+int tree_walk(mfs_t *mfs, tree_t *tree, tree_mode_t mode, const char *pattern, uint16_t block_number, const char *path) {
+    tree->mfs = mfs;
+    tree->mode = mode;
+    tree->pattern = pattern;
+    tree->worker_count = mfs->threads;
+    atomic_init(&tree->pending, 0);
+    atomic_init(&tree->failed, false);
+
+    tree->workers = calloc(tree->worker_count, sizeof(*tree->workers));
+    tree->queued = calloc(mfs->block_count, sizeof(*tree->queued));
+    if(tree->workers == NULL || tree->queued == NULL) {
+        perror("Memory allocation failed");
+        free(tree->workers);
+        free(tree->queued);
+        return -1;
+    }
+
+    for(unsigned int i = 0; i < tree->worker_count; i++) {
+        tree_worker_t *worker = &tree->workers[i];
+        worker->tree = tree;
+        worker->index = i;
+        pthread_mutex_init(&worker->lock, NULL);
+        worker->block = malloc(sizeof(*worker->block) * mfs->block_size);
+        if(worker->block == NULL) {
+            perror("Memory allocation failed");
+            tree->worker_count = i + 1;
+            tree_release(tree);
+            return -1;
+        }
+    }
+
+    // The threads read the image behind the FILE's back
+    if(fflush(mfs->f)) {
+        perror("Flush failed");
+        tree_release(tree);
+        return -1;
+    }
+
+    char *root_path = NULL;
+    if(mode != TREE_FREE) {
+        root_path = strdup(path);
+        if(root_path == NULL) {
+            perror("Memory allocation failed");
+            tree_release(tree);
+            return -1;
+        }
+    }
+    if(tree_push(&tree->workers[0], block_number, root_path)) {
+        tree_release(tree);
+        return -1;
+    }
+
+    // Alloc table pages are loaded under a lock while the threads run
+    alloc_table_share(mfs, true);
+
+    unsigned int started = 0;
+    for(; started < tree->worker_count; started++) {
+        if(pthread_create(&tree->workers[started].thread, NULL, tree_worker, &tree->workers[started])) {
+            fprintf(stderr, "Failed to start thread\n");
+            break;
+        }
+    }
+    for(unsigned int i = 0; i < started; i++) {
+        pthread_join(tree->workers[i].thread, NULL);
+    }
+
+    alloc_table_share(mfs, false);
+
+    if(started == 0) {
+        tree_release(tree);
+        return -1;
+    }
+
+    if(atomic_load(&tree->failed)) {
+        tree_release(tree);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Resolves a directory and walks it, with the path cut down to how results name it
+int tree_walk_path(mfs_t *mfs, tree_t *tree, tree_mode_t mode, const char *pattern, const char *path) {
+    uint16_t block_number = 0;
+    if(mfs_block_for_directory_path(mfs, path, &block_number)) {
+        fprintf(stderr, "Directory %s not found\n", path);
+        return -1;
+    }
+
+    size_t len = strlen(path);
+    while(len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    char *dir = strndup(path, len);
+    if(dir == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    int ret = tree_walk(mfs, tree, mode, pattern, block_number, dir);
+    free(dir);
+
+    return ret;
+}
+
+int compare_tree_entries(const void *a, const void *b) {
+    return strcmp(((const tree_entry_t *) a)->path, ((const tree_entry_t *) b)->path);
+}
+
+// Prints the entries all threads found, sorted by path
+int tree_print(tree_t *tree, bool details) {
+    size_t count = 0;
+    for(unsigned int i = 0; i < tree->worker_count; i++) {
+        count += tree->workers[i].entry_count;
+    }
+
+    tree_entry_t *entries = malloc(sizeof(*entries) * (count ? count : 1));
+    if(entries == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    size_t n = 0;
+    for(unsigned int i = 0; i < tree->worker_count; i++) {
+        // Workers that found nothing have no array
+        if(tree->workers[i].entry_count == 0) {
+            continue;
+        }
+        memcpy(entries + n, tree->workers[i].entries, sizeof(*entries) * tree->workers[i].entry_count);
+        n += tree->workers[i].entry_count;
+    }
+
+    qsort(entries, count, sizeof(*entries), compare_tree_entries);
+
+    for(size_t i = 0; i < count; i++) {
+        if(details) {
+            uint16_t type = ENTRY_TYPE(entries[i].type);
+            printf("%-4s 0x%04x %6u %s\n", type == MFS_TYPE_DIRECTORY ? "dir" : type == MFS_TYPE_FILE ? "file" : "unkn", entries[i].block_number, entries[i].blocks, entries[i].path);
+        } else {
+            printf("%s\n", entries[i].path);
+        }
+    }
+
+    free(entries);
+
+    return 0;
+}
+
+// Lists the paths below a directory whose names match a glob pattern, or all of them
+int find_path(mfs_t *mfs, const char *path, const char *pattern) {
+    tree_t tree;
+    if(tree_walk_path(mfs, &tree, TREE_FIND, pattern, path)) {
+        return -1;
+    }
+
+    int ret = tree_print(&tree, false);
+    tree_release(&tree);
+
+    return ret;
+}
+
+// Lists everything below a directory with its type, first block and length in blocks
+int list_tree(mfs_t *mfs, const char *path) {
+    tree_t tree;
+    if(tree_walk_path(mfs, &tree, TREE_LIST, NULL, path)) {
+        return -1;
+    }
+
+    int ret = tree_print(&tree, true);
+    tree_release(&tree);
+
+    return ret;
+}
+
+// Sums up the blocks used by a directory and everything below it
+int du_path(mfs_t *mfs, const char *path) {
+    tree_t tree;
+    if(tree_walk_path(mfs, &tree, TREE_DU, NULL, path)) {
+        return -1;
+    }
+
+    uint64_t blocks = 0;
+    uint32_t files = 0;
+    uint32_t directories = 0;
+    for(unsigned int i = 0; i < tree.worker_count; i++) {
+        blocks += tree.workers[i].chain_blocks;
+        files += tree.workers[i].files;
+        directories += tree.workers[i].directories;
+    }
+
+    tree_release(&tree);
+
+    // The directory's own blocks
+    uint16_t block_number = 0;
+    mfs_block_for_directory_path(mfs, path, &block_number);
+    for(uint32_t n = 0; block_number != BLOCK_EOF && tree_block_used(mfs, block_number) && n < mfs->block_count; n++) {
+        blocks++;
+        block_number = get_block_next(mfs, block_number);
+    }
+
+    printf("%llu blocks (%llu bytes) in %u files and %u directories\n", (unsigned long long) blocks, (unsigned long long) blocks * mfs->block_size, files, directories);
+
+    return 0;
+}
+
+int mfs_find(mfs_t *mfs, const char *path, const char *pattern) {
+    uint64_t start = trace_clock(mfs);
+    int ret = find_path(mfs, path, pattern);
+    trace_record(mfs, TRACE_FIND, start, ret, path, pattern, 0);
+    return ret;
+}
+
+int mfs_tree(mfs_t *mfs, const char *path) {
+    uint64_t start = trace_clock(mfs);
+    int ret = list_tree(mfs, path);
+    trace_record(mfs, TRACE_TREE, start, ret, path, NULL, 0);
+    return ret;
+}
+
+int mfs_du(mfs_t *mfs, const char *path) {
+    uint64_t start = trace_clock(mfs);
+    int ret = du_path(mfs, path);
+    trace_record(mfs, TRACE_DU, start, ret, path, NULL, 0);
+    return ret;
+}
+
+// Frees a directory with everything below it. All blocks are collected first and then freed in one batch.
+int tree_free(mfs_t *mfs, uint16_t block_number) {
+    tree_t tree;
+    if(tree_walk(mfs, &tree, TREE_FREE, NULL, block_number, NULL)) {
+        return -1;
+    }
+
+    size_t count = 0;
+    for(unsigned int i = 0; i < tree.worker_count; i++) {
+        count += tree.workers[i].block_count;
+    }
+
+    uint16_t *blocks = malloc(sizeof(*blocks) * (count ? count : 1));
+    if(blocks == NULL) {
+        perror("Memory allocation failed");
+        tree_release(&tree);
+        return -1;
+    }
+
+    size_t n = 0;
+    for(unsigned int i = 0; i < tree.worker_count; i++) {
+        if(tree.workers[i].block_count == 0) {
+            continue;
+        }
+        memcpy(blocks + n, tree.workers[i].blocks, sizeof(*blocks) * tree.workers[i].block_count);
+        n += tree.workers[i].block_count;
+    }
+
+    int ret = release_blocks(mfs, blocks, count);
+    free(blocks);
+
+    for(unsigned int i = 0; i < tree.worker_count && ret == 0; i++) {
+        for(size_t j = 0; j < tree.workers[i].entry_count && ret == 0; j++) {
+            ret = share_release(mfs, tree.workers[i].entries[j].block_number);
+        }
+    }
+
+    tree_release(&tree);
+
+    return ret;
+}
+
+int mfs_rm_recursive(mfs_t *mfs, const char *path) {
+    uint64_t start = trace_clock(mfs);
+    if(begin_operation(mfs)) {
+        return -1;
+    }
+    int ret = remove_path(mfs, path, true);
+    complete_operation(mfs, ret);
+    trace_record(mfs, TRACE_RM_RECURSIVE, start, ret, path, NULL, 0);
+    return ret;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "mfs.h"
+
+int tree_free(mfs_t *mfs, uint16_t block_number);
+
+int mfs_find(mfs_t *mfs, const char *path, const char *pattern);
+int mfs_du(mfs_t *mfs, const char *path);
+int mfs_tree(mfs_t *mfs, const char *path);
+int mfs_rm_recursive(mfs_t *mfs, const char *path);
@@ -1,4 +1,33 @@
-
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define strequals(a, b) (strcmp((a), (b)) == 0)
+
+static inline void write16(uint8_t *buf, size_t index, uint16_t data) {
+    buf[index] = data & 0xFF;
+    buf[index + 1] = (data >> 8) & 0xFF;
+}
+
+static inline uint16_t read16(const uint8_t *buf, size_t index) {
+    return buf[index + 1] << 8 | buf[index];
+}
+
+static inline void write32(uint8_t *buf, size_t index, uint32_t data) {
+    write16(buf, index, data & 0xFFFF);
+    write16(buf, index + 2, (data >> 16) & 0xFFFF);
+}
+
+static inline uint32_t read32(const uint8_t *buf, size_t index) {
+    return (uint32_t) read16(buf, index + 2) << 16 | read16(buf, index);
+}
+
+static inline void write64(uint8_t *buf, size_t index, uint64_t data) {
+    write32(buf, index, data & 0xFFFFFFFFu);
+    write32(buf, index + 4, (data >> 32) & 0xFFFFFFFFu);
+}
+
+static inline uint64_t read64(const uint8_t *buf, size_t index) {
+    return (uint64_t) read32(buf, index + 4) << 32 | read32(buf, index);
+}
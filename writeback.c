@@ -0,0 +1,552 @@
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "blocks.h"
+#include "stripe.h"
+#include "writeback.h"
+
+// With writeback enabled, writes to the image are copied into a buffer of aligned pages and return. A background thread
+// takes all buffered pages at once, sorts them by offset, merges neighbouring pages into single pwritev() calls and
+// writes them while new writes fill the buffer again. Reads of buffered ranges see the buffer. Once the buffer holds the
+// limit, writers wait for the thread; durability points (sync, journal checkpoints, closing) wait until it is empty.
+
+#define WRITEBACK_PAGE_SIZE 4096
+// Longest time a write stays in the buffer when nothing else makes the thread write it
+#define WRITEBACK_INTERVAL_MS 100
+#define WRITEBACK_MAX_IOV 64
+
+typedef struct writeback_page {
+    size_t index;
+    // Range of the page holding buffered data
+    uint16_t start;
+    uint16_t end;
+    struct writeback_page *next;
+    uint8_t data[WRITEBACK_PAGE_SIZE];
+} writeback_page_t;
+
+struct writeback {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // Signalled when the thread has work, and when it finished a batch
+    pthread_cond_t work;
+    pthread_cond_t done;
+    // Pages being filled, by page index
+    writeback_page_t **buckets;
+    size_t bucket_mask;
+    size_t dirty_count;
+    // Pages the thread is writing, sorted by index
+    writeback_page_t **flushing;
+    size_t flushing_count;
+    // Pages that can be reused
+    writeback_page_t *spare;
+    size_t page_count;
+    size_t page_limit;
+    // Writers waiting for room or for the buffer to empty
+    unsigned int waiting;
+    bool failed;
+    bool stop;
+};
+
+static inline size_t writeback_bucket(const writeback_t *wb, size_t index) {
+    return (index * 0x9E3779B97F4A7C15u >> 17) & wb->bucket_mask;
+}
+
+writeback_page_t *writeback_find_dirty(writeback_t *wb, size_t index) {
+    for(writeback_page_t *page = wb->buckets[writeback_bucket(wb, index)]; page; page = page->next) {
+        if(page->index == index) {
+            return page;
+        }
+    }
+    return NULL;
+}
+
+writeback_page_t *writeback_find_flushing(writeback_t *wb, size_t index) {
+    size_t low = 0;
+    size_t high = wb->flushing_count;
+    while(low < high) {
+        size_t mid = low + (high - low) / 2;
+        if(wb->flushing[mid]->index < index) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low < wb->flushing_count && wb->flushing[low]->index == index ? wb->flushing[low] : NULL;
+}
+
+// Where a range of the image is stored: the image file, or a member file for the data region of a striped image.
+// Returns how much of the range is contiguous there.
+size_t writeback_target(mfs_t *mfs, size_t offset, size_t len, int *fd_out, off_t *target_offset_out) {
+    size_t data_end = mfs->blocks_base + block_bytes(mfs, mfs->data_block_count);
+
+    if(mfs->stripe && offset >= mfs->blocks_base && offset < data_end) {
+        uint16_t member;
+        size_t chunk = stripe_locate(mfs, offset, len, &member, target_offset_out);
+        *fd_out = stripe_member_fd(mfs, member);
+        return chunk;
+    }
+
+    *fd_out = fileno(mfs->f);
+    *target_offset_out = (off_t) offset;
+    if(mfs->stripe && offset < mfs->blocks_base && len > mfs->blocks_base - offset) {
+        return mfs->blocks_base - offset;
+    }
+    return len;
+}
+
+// Reads from the image itself, without the buffer
+int writeback_pread(mfs_t *mfs, size_t offset, uint8_t *buf, size_t len) {
+    while(len > 0) {
+        int fd;
+        off_t target;
+        size_t chunk = writeback_target(mfs, offset, len, &fd, &target);
+        ssize_t got = pread(fd, buf, chunk, target);
+        if(got < 0 && errno == EINTR) {
+            continue;
+        }
+        if(got < 0) {
+            perror("File read error");
+            return -1;
+        }
+        if(got == 0) {
+            fprintf(stderr, "File to short\n");
+            return -1;
+        }
+        offset += (size_t) got;
+        buf += got;
+        len -= (size_t) got;
+    }
+
+    return 0;
+}
+
+// Copies buffered data over a range read from the image, pages being written first as they are older
+void writeback_apply(writeback_t *wb, size_t offset, uint8_t *buf, size_t len) {
+    size_t first = offset / WRITEBACK_PAGE_SIZE;
+    size_t last = (offset + len - 1) / WRITEBACK_PAGE_SIZE;
+
+    for(int pass = 0; pass < 2; pass++) {
+        if(pass == 0 ? wb->flushing_count == 0 : wb->dirty_count == 0) {
+            continue;
+        }
+        for(size_t index = first; index <= last; index++) {
+            writeback_page_t *page = pass == 0 ? writeback_find_flushing(wb, index) : writeback_find_dirty(wb, index);
+            if(page == NULL) {
+                continue;
+            }
+
+            size_t page_offset = index * WRITEBACK_PAGE_SIZE;
+            size_t start = page_offset + page->start > offset ? page_offset + page->start : offset;
+            size_t end = page_offset + page->end < offset + len ? page_offset + page->end : offset + len;
+            if(start < end) {
+                memcpy(buf + (start - offset), page->data + (start - page_offset), end - start);
+            }
+        }
+    }
+}
+
+// Writes a run of pages following each other in the image with as few calls as possible
+int writeback_write_run(mfs_t *mfs, writeback_page_t **pages, size_t count) {
+    struct iovec iov[WRITEBACK_MAX_IOV];
+
+    size_t offset = pages[0]->index * WRITEBACK_PAGE_SIZE + pages[0]->start;
+    size_t next = 0;
+    size_t skip = 0;
+    while(next < count) {
+        // Gather the pages into as many vectors as fit
+        int iov_count = 0;
+        size_t len = 0;
+        for(size_t i = next; i < count && iov_count < WRITEBACK_MAX_IOV; i++) {
+            writeback_page_t *page = pages[i];
+            size_t start = page->start + (i == next ? skip : 0);
+            iov[iov_count].iov_base = page->data + start;
+            iov[iov_count].iov_len = page->end - start;
+            len += iov[iov_count].iov_len;
+            iov_count++;
+        }
+
+        int fd;
+        off_t target;
+        size_t chunk = writeback_target(mfs, offset, len, &fd, &target);
+
+        // Writes that only go to part of the vectors, because the stripe unit ends, stop there
+        int used = 0;
+        size_t covered = 0;
+        while(covered < chunk) {
+            if(covered + iov[used].iov_len > chunk) {
+                iov[used].iov_len = chunk - covered;
+            }
+            covered += iov[used].iov_len;
+            used++;
+        }
+
+        ssize_t written = pwritev(fd, iov, used, target);
+        if(written < 0 && errno == EINTR) {
+            continue;
+        }
+        if(written <= 0) {
+            perror("Background write failed");
+            return -1;
+        }
+
+        // Move on by what was written
+        offset += (size_t) written;
+        size_t left = (size_t) written;
+        while(left > 0) {
+            writeback_page_t *page = pages[next];
+            size_t rest = page->end - page->start - skip;
+            if(left < rest) {
+                skip += left;
+                break;
+            }
+            left -= rest;
+            next++;
+            skip = 0;
+        }
+    }
+
+    return 0;
+}
+
+int writeback_compare_pages(const void *a, const void *b) {
+    const writeback_page_t *page_a = *(writeback_page_t * const *) a;
+    const writeback_page_t *page_b = *(writeback_page_t * const *) b;
+    return page_a->index < page_b->index ? -1 : page_a->index > page_b->index;
+}
+
+// Takes every buffered page for writing. Called with the lock held.
+void writeback_take_dirty(writeback_t *wb) {
+    size_t count = 0;
+    for(size_t i = 0; i <= wb->bucket_mask; i++) {
+        for(writeback_page_t *page = wb->buckets[i]; page; page = page->next) {
+            wb->flushing[count++] = page;
+        }
+        wb->buckets[i] = NULL;
+    }
+
+    qsort(wb->flushing, count, sizeof(*wb->flushing), writeback_compare_pages);
+    wb->flushing_count = count;
+    wb->dirty_count = 0;
+}
+
+void *writeback_thread(void *arg) {
+    mfs_t *mfs = arg;
+    writeback_t *wb = mfs->writeback;
+
+    pthread_mutex_lock(&wb->lock);
+    while(1) {
+        // Write when the buffer is half full, when someone waits, or when the oldest data has waited long enough
+        if(wb->dirty_count == 0 || (wb->dirty_count * 2 < wb->page_limit && wb->waiting == 0 && !wb->stop)) {
+            if(wb->stop && wb->dirty_count == 0) {
+                break;
+            }
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += WRITEBACK_INTERVAL_MS * 1000000L;
+            if(deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            if(pthread_cond_timedwait(&wb->work, &wb->lock, &deadline) != ETIMEDOUT || wb->dirty_count == 0) {
+                continue;
+            }
+        }
+
+        writeback_take_dirty(wb);
+        pthread_mutex_unlock(&wb->lock);
+
+        int ret = 0;
+        size_t run = 0;
+        for(size_t i = 1; i <= wb->flushing_count && ret == 0; i++) {
+            writeback_page_t *previous = wb->flushing[i - 1];
+            if(i < wb->flushing_count) {
+                writeback_page_t *page = wb->flushing[i];
+                if(page->index == previous->index + 1 && previous->end == WRITEBACK_PAGE_SIZE && page->start == 0) {
+                    continue;
+                }
+            }
+            ret = writeback_write_run(mfs, wb->flushing + run, i - run);
+            run = i;
+        }
+
+        pthread_mutex_lock(&wb->lock);
+        if(ret) {
+            wb->failed = true;
+        }
+        for(size_t i = 0; i < wb->flushing_count; i++) {
+            wb->flushing[i]->next = wb->spare;
+            wb->spare = wb->flushing[i];
+        }
+        wb->flushing_count = 0;
+        pthread_cond_broadcast(&wb->done);
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    return NULL;
+}
+
+int writeback_open(mfs_t *mfs, unsigned int limit_kb) {
+    writeback_t *wb = calloc(1, sizeof(*wb));
+    if(wb == NULL) {
+        perror("Memory allocation failed");
+        return -1;
+    }
+
+    wb->page_limit = ((size_t) limit_kb * 1024u + WRITEBACK_PAGE_SIZE - 1) / WRITEBACK_PAGE_SIZE;
+    size_t buckets = 16;
+    while(buckets < wb->page_limit) {
+        buckets *= 2;
+    }
+    wb->bucket_mask = buckets - 1;
+    wb->buckets = calloc(buckets, sizeof(*wb->buckets));
+    wb->flushing = malloc(sizeof(*wb->flushing) * wb->page_limit);
+    if(wb->buckets == NULL || wb->flushing == NULL) {
+        perror("Memory allocation failed");
+        free(wb->buckets);
+        free(wb->flushing);
+        free(wb);
+        return -1;
+    }
+
+    // The thread writes behind the FILE's back, reads through it must not come from its buffer
+    if(fflush(mfs->f) || setvbuf(mfs->f, NULL, _IONBF, 0)) {
+        perror("Failed to set up the image file");
+        free(wb->buckets);
+        free(wb->flushing);
+        free(wb);
+        return -1;
+    }
+
+    pthread_mutex_init(&wb->lock, NULL);
+    pthread_cond_init(&wb->work, NULL);
+    pthread_cond_init(&wb->done, NULL);
+
+    mfs->writeback = wb;
+
+    if(pthread_create(&wb->thread, NULL, writeback_thread, mfs)) {
+        fprintf(stderr, "Failed to start the writeback thread\n");
+        pthread_cond_destroy(&wb->done);
+        pthread_cond_destroy(&wb->work);
+        pthread_mutex_destroy(&wb->lock);
+        free(wb->buckets);
+        free(wb->flushing);
+        free(wb);
+        mfs->writeback = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Writes everything still buffered and stops the thread
+void writeback_free(mfs_t *mfs) {
+    writeback_t *wb = mfs->writeback;
+    if(wb == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&wb->lock);
+    wb->stop = true;
+    pthread_cond_signal(&wb->work);
+    pthread_mutex_unlock(&wb->lock);
+    pthread_join(wb->thread, NULL);
+
+    if(wb->failed) {
+        fprintf(stderr, "Some buffered writes could not be written\n");
+    }
+
+    while(wb->spare) {
+        writeback_page_t *page = wb->spare;
+        wb->spare = page->next;
+        free(page);
+    }
+    pthread_cond_destroy(&wb->done);
+    pthread_cond_destroy(&wb->work);
+    pthread_mutex_destroy(&wb->lock);
+    free(wb->buckets);
+    free(wb->flushing);
+    free(wb);
+    mfs->writeback = NULL;
+}
+
+// Returns a page for the given index in the buffer, waiting for the thread if the buffer is full. Called with the lock
+// held.
+writeback_page_t *writeback_claim(mfs_t *mfs, size_t index) {
+    writeback_t *wb = mfs->writeback;
+
+    writeback_page_t *page = writeback_find_dirty(wb, index);
+    if(page) {
+        return page;
+    }
+
+    // Back-pressure: the writer waits until the thread made room
+    while(wb->dirty_count >= wb->page_limit || (wb->spare == NULL && wb->page_count >= wb->page_limit)) {
+        wb->waiting++;
+        pthread_cond_signal(&wb->work);
+        pthread_cond_wait(&wb->done, &wb->lock);
+        wb->waiting--;
+    }
+
+    if(wb->spare) {
+        page = wb->spare;
+        wb->spare = page->next;
+    } else {
+        page = malloc(sizeof(*page));
+        if(page == NULL) {
+            perror("Memory allocation failed");
+            return NULL;
+        }
+        wb->page_count++;
+    }
+
+    page->index = index;
+    page->start = 0;
+    page->end = 0;
+
+    size_t bucket = writeback_bucket(wb, index);
+    page->next = wb->buckets[bucket];
+    wb->buckets[bucket] = page;
+    wb->dirty_count++;
+
+    return page;
+}
+
+// Buffers a write. The caller may reuse buf as soon as this returns.
+int writeback_write(mfs_t *mfs, size_t offset, const uint8_t *buf, size_t len) {
+    writeback_t *wb = mfs->writeback;
+
+    pthread_mutex_lock(&wb->lock);
+    if(wb->failed) {
+        pthread_mutex_unlock(&wb->lock);
+        fprintf(stderr, "Background writes failed earlier\n");
+        return -1;
+    }
+
+    while(len > 0) {
+        size_t index = offset / WRITEBACK_PAGE_SIZE;
+        uint16_t start = (uint16_t) (offset % WRITEBACK_PAGE_SIZE);
+        uint16_t n = (uint16_t) (len < (size_t) (WRITEBACK_PAGE_SIZE - start) ? len : (size_t) (WRITEBACK_PAGE_SIZE - start));
+        uint16_t end = start + n;
+
+        writeback_page_t *page = writeback_claim(mfs, index);
+        if(page == NULL) {
+            pthread_mutex_unlock(&wb->lock);
+            return -1;
+        }
+
+        // A page only holds one range. Gaps between it and the new write are filled in from the image.
+        if(page->end > page->start && (end < page->start || start > page->end)) {
+            size_t page_offset = index * WRITEBACK_PAGE_SIZE;
+            uint16_t gap_start = end < page->start ? end : page->end;
+            uint16_t gap_end = end < page->start ? page->start : start;
+            if(writeback_pread(mfs, page_offset + gap_start, page->data + gap_start, gap_end - gap_start)) {
+                pthread_mutex_unlock(&wb->lock);
+                return -1;
+            }
+            writeback_page_t *older = writeback_find_flushing(wb, index);
+            if(older) {
+                uint16_t from = older->start > gap_start ? older->start : gap_start;
+                uint16_t to = older->end < gap_end ? older->end : gap_end;
+                if(from < to) {
+                    memcpy(page->data + from, older->data + from, to - from);
+                }
+            }
+        }
+
+        memcpy(page->data + start, buf, n);
+        if(page->end == page->start) {
+            page->start = start;
+            page->end = end;
+        } else {
+            if(start < page->start) page->start = start;
+            if(end > page->end) page->end = end;
+        }
+
+        offset += n;
+        buf += n;
+        len -= n;
+    }
+
+    pthread_mutex_unlock(&wb->lock);
+    return 0;
+}
+
+// Whether part of a range is still buffered
+bool writeback_overlaps(mfs_t *mfs, size_t offset, size_t len) {
+    writeback_t *wb = mfs->writeback;
+    if(len == 0) {
+        return false;
+    }
+
+    size_t first = offset / WRITEBACK_PAGE_SIZE;
+    size_t last = (offset + len - 1) / WRITEBACK_PAGE_SIZE;
+
+    pthread_mutex_lock(&wb->lock);
+    bool overlaps = false;
+    for(size_t index = first; index <= last && !overlaps && (wb->dirty_count || wb->flushing_count); index++) {
+        overlaps = writeback_find_dirty(wb, index) || writeback_find_flushing(wb, index);
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    return overlaps;
+}
+
+// Reads a range of the image as it will be once the buffer is written. The lock is held throughout, so the thread
+// can't finish writing a page between reading the image and looking at the buffer.
+int writeback_read(mfs_t *mfs, size_t offset, uint8_t *buf, size_t len) {
+    writeback_t *wb = mfs->writeback;
+
+    pthread_mutex_lock(&wb->lock);
+    int ret = writeback_pread(mfs, offset, buf, len);
+    if(ret == 0 && len > 0) {
+        writeback_apply(wb, offset, buf, len);
+    }
+    pthread_mutex_unlock(&wb->lock);
+
+    return ret;
+}
+
+// Waits until everything buffered so far is in the image
+int writeback_drain(mfs_t *mfs) {
+    writeback_t *wb = mfs->writeback;
+    if(wb == NULL) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&wb->lock);
+    wb->waiting++;
+    while(wb->dirty_count > 0 || wb->flushing_count > 0) {
+        pthread_cond_signal(&wb->work);
+        pthread_cond_wait(&wb->done, &wb->lock);
+    }
+    wb->waiting--;
+    bool failed = wb->failed;
+    pthread_mutex_unlock(&wb->lock);
+
+    if(failed) {
+        fprintf(stderr, "Background writes failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// Drains the buffer if it holds part of a range, before the range is accessed around it
+int writeback_drain_range(mfs_t *mfs, size_t offset, size_t len) {
+    if(mfs->writeback == NULL || !writeback_overlaps(mfs, offset, len)) {
+        return 0;
+    }
+
+    return writeback_drain(mfs);
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mfs.h"
+
+int writeback_open(mfs_t *mfs, unsigned int limit_kb);
+void writeback_free(mfs_t *mfs);
+
+int writeback_write(mfs_t *mfs, size_t offset, const uint8_t *buf, size_t len);
+bool writeback_overlaps(mfs_t *mfs, size_t offset, size_t len);
+int writeback_read(mfs_t *mfs, size_t offset, uint8_t *buf, size_t len);
+
+int writeback_drain(mfs_t *mfs);
+int writeback_drain_range(mfs_t *mfs, size_t offset, size_t len);